@@ -69,38 +69,48 @@ void NTPClient::begin(int port) {
   this->_udpSetup = true;
 }
 
-void NTPClient::forceUpdate(NTPClient::UpdateState &state) {
+void NTPClient::forceUpdate() {
   #ifdef DEBUG_NTPClient
     Serial.println("Update from NTP Server");
   #endif
 
+  if (!this->_udpSetup) this->begin();  // setup the UDP client if needed
+
+  // a reply to the previous query that came too late is dropped here
+  while (this->_udp->parsePacket() > 0)
+    this->_udp->read(this->_packetBuffer, NTP_PACKET_SIZE);
+
+  this->_requestMS   = millis();
+  this->_waiting     = true;
+  this->_failed      = false;
   this->sendNTPPacket();
+}
+
+void NTPClient::poll(NTPClient::UpdateState &state) {
+  int cb = this->_udp->parsePacket();
+  unsigned long ms = millis();
 
-  // Wait till data is there or timeout...
-  byte timeout = 0;
-  int cb = 0;
-  do {
-    delay ( 10 );
-    cb = this->_udp->parsePacket();
-    if (timeout > 100) {
-        state.updated = false;
-        state.error = true;
-        return;  // timeout after 1000 ms
+  if (cb <= 0) {
+    if (ms - this->_requestMS >= NTP_REPLY_TIMEOUT) {
+      this->_waiting = false;
+      this->_failed  = true;
+      state.error    = true;
     }
-    timeout++;
-  } while (cb == 0);
+    return;
+  }
 
-  unsigned long prev_millis = getMillis();
-  unsigned long prev_epoch = getEpochTime();
+  this->_udp->read(this->_packetBuffer, NTP_PACKET_SIZE);
 
-  // no prev update means we will do a full one
-  bool fullUpdate = (_lastUpdate == 0);
+  // the originate timestamp echoes our transmit timestamp. Anything else is
+  // not a reply to the query in flight
+  unsigned long cookie = word(this->_packetBuffer[28], this->_packetBuffer[29]) << 16
+                       | word(this->_packetBuffer[30], this->_packetBuffer[31]);
+  if (cb < NTP_PACKET_SIZE || cookie != this->_requestMS) return;
 
-  // Account for delay in reading the time
-  unsigned long ms = millis();
-  unsigned long updateMillis = ms - (10 * (timeout + 1));
+  this->_waiting = false;
 
-  this->_udp->read(this->_packetBuffer, NTP_PACKET_SIZE);
+  // the server's timestamp is taken about half way through the round trip
+  unsigned long updateMillis = this->_requestMS + (ms - this->_requestMS) / 2;
 
   unsigned long highWord = word(this->_packetBuffer[40], this->_packetBuffer[41]);
   unsigned long lowWord = word(this->_packetBuffer[42], this->_packetBuffer[43]);
@@ -116,53 +126,95 @@ void NTPClient::forceUpdate(NTPClient::UpdateState &state) {
   // fractional part to milisecs
   uint16_t mssec = ((frac >> 7) * 125 + (1UL << 24)) >> 25;
 
-  // so... the NTP server informs us that _lastUpdate in fact means secsSince1900
-  // but it also tells us it's already mssec past that time in seconds
-  // so we have to subtract that mssec time from the _lastUpdate var
-  // so we get to next second sooner (millis() - _lastUpdate gets to next second sooner)
-  unsigned long cur_millis = getMillis();
-  unsigned long cur_epoch = getEpochTime();
+  unsigned long epoch = secsSince1900 - SEVENZYYEARS;
+
+  // no prev update (or one hopelessly off) means we will do a full one
+  long secDiff = (long)(this->_currentEpoc - epoch);
+  bool fullUpdate = (_lastUpdate == 0) || secDiff > 86400L || secDiff < -86400L;
+
+  if (fullUpdate) {
+      this->_epocMS      = updateMillis - mssec;
+      this->_currentEpoc = epoch;
+      this->_driftMS     = 0;
+      this->_ratePPM     = 0;
+      this->_rateAcc     = 0;
+      this->_lastRate    = ms;
+      this->_lastUpdate  = ms;
+      state.drift        = 0;
+      state.updated      = true;
+      return;
+  }
+
+  this->applyRate();
 
+  // our time at updateMillis minus the server's one,
   // negative values mean we're behind schedule
-  long drift_ms = ((cur_epoch - prev_epoch) * 1000 + cur_millis - prev_millis) - mssec;
+  long drift_ms = secDiff * 1000 + (long)(updateMillis - this->_epocMS) - mssec;
+
+  // what is left of the previous drift was known, the rest came since the last
+  // update. Half of that goes into the rate estimate, to not chase the jitter
+  unsigned long elapsed = ms - this->_lastUpdate;
+  if (elapsed >= 10000) {
+      long ppm = this->_ratePPM
+               + (long)((long long)(drift_ms - this->_driftMS) * 1000000LL / (long long)elapsed / 2);
+      if (ppm >  NTP_MAX_RATE_PPM) ppm =  NTP_MAX_RATE_PPM;
+      if (ppm < -NTP_MAX_RATE_PPM) ppm = -NTP_MAX_RATE_PPM;
+      this->_ratePPM = ppm;
+  }
 
   this->_lastUpdate = ms;
 
-  if (fullUpdate) {
-      this->_epocMS = updateMillis;
-      this->_epocMS -= mssec;
-      this->_currentEpoc = secsSince1900 - SEVENZYYEARS;
-      this->_driftMS = 0;
-      state.drift    = 0;
-  } else {
-      // HACK: we can pre-correct anything rounded to 1 minute intevals, as it does not break our code
-      // this will help us if we get totally lost in time
-      long min_drift  = drift_ms % 60000;
-      this->_epocMS  += drift_ms - min_drift;
-      this->_driftMS  = min_drift;
-      state.drift     = drift_ms;
-  }
+  // HACK: we can pre-correct anything rounded to 1 minute intevals, as it does not break our code
+  // this will help us if we get totally lost in time
+  long min_drift  = drift_ms % 60000;
+  this->_epocMS  += drift_ms - min_drift;
+  this->_driftMS  = min_drift;
+  state.drift     = drift_ms;
 
   // TODO: Large drift values should maybe cause time skips.
   state.updated = true;
-  state.error   = false;
 }
 
-void NTPClient::update(NTPClient::UpdateState &state) {
+void NTPClient::update(NTPClient::UpdateState &state, bool can_send) {
   state.updated = false; state.error = false; state.drift = 0;
 
-  if ((millis() - this->_lastUpdate >= this->_updateInterval)  // Update after _updateInterval
+  if (this->_waiting) {
+      this->poll(state);
+      return;
+  }
+
+  if (!can_send) return;
+
+  unsigned long ms = millis();
+
+  // failed query is not repeated right away, it'd just fail again
+  if (this->_failed && ms - this->_requestMS < NTP_RETRY_INTERVAL)
+      return;
+
+  if ((ms - this->_lastUpdate >= this->_updateInterval)  // Update after _updateInterval
       || this->_lastUpdate == 0)  // Update if there was no update yet.
   {
-      if (!this->_udpSetup) this->begin();  // setup the UDP client if needed
-      this->forceUpdate(state);
+      this->forceUpdate();
   }
 }
 
+void NTPClient::applyRate() {
+    // moves the whole milliseconds of the rate correction into _epocMS
+    unsigned long ms = millis();
+    this->_rateAcc  += this->_ratePPM * (long)(ms - this->_lastRate);
+    this->_lastRate  = ms;
+
+    long whole = this->_rateAcc / 1000000L;
+    this->_epocMS  += whole;
+    this->_rateAcc -= whole * 1000000L;
+}
+
 long NTPClient::slew() {
     // no slew when no sync was done....
     if (_lastUpdate == 0) return 0;
 
+    applyRate();
+
     unsigned long ms = millis();
     if (ms - _lastSlew >= 60000) {
         // correct the time resolution by shifting _lastUpdate a bit
@@ -175,10 +227,17 @@ long NTPClient::slew() {
     return _driftMS;
 }
 
+unsigned long NTPClient::elapsedMS() {
+  unsigned long ms = millis();
+  // rate correction not yet moved to _epocMS by applyRate()
+  long pending = (this->_rateAcc + this->_ratePPM * (long)(ms - this->_lastRate)) / 1000000L;
+  return ms - this->_epocMS - pending;
+}
+
 unsigned long NTPClient::getEpochTime() {
   return this->_timeOffset + // User offset
          this->_currentEpoc + // Epoc returned by the NTP server
-         ((millis() - this->_epocMS) / 1000); // Time since last update
+         (elapsedMS() / 1000); // Time since last update
 }
 
 int NTPClient::getDay() {
@@ -198,7 +257,7 @@ int NTPClient::getSeconds() {
 }
 
 int NTPClient::getMillis() {
-  return ((millis() - this->_epocMS) % 1000);
+  return (elapsedMS() % 1000);
 }
 
 String NTPClient::getFormattedTime() {
@@ -243,6 +302,12 @@ void NTPClient::sendNTPPacket() {
   this->_packetBuffer[13]  = 0x4E;
   this->_packetBuffer[14]  = 49;
   this->_packetBuffer[15]  = 52;
+  // transmit timestamp - the server echoes it in the originate timestamp of
+  // the reply. We put the request time in, to recognize the reply by it
+  this->_packetBuffer[44]  = this->_requestMS >> 24;
+  this->_packetBuffer[45]  = this->_requestMS >> 16;
+  this->_packetBuffer[46]  = this->_requestMS >> 8;
+  this->_packetBuffer[47]  = this->_requestMS;
 
   // all NTP fields have been given values, now
   // you can send a packet requesting a timestamp:
@@ -7,8 +7,18 @@
 #define SEVENZYYEARS 2208988800UL
 #define NTP_PACKET_SIZE 48
 #define NTP_DEFAULT_LOCAL_PORT 1337
+#define NTP_REPLY_TIMEOUT 1000  // In ms - a reply not here by then is lost
+#define NTP_RETRY_INTERVAL 10000 // In ms - wait after a failed query
+#define NTP_MAX_RATE_PPM 500    // clamp of the clock rate estimate
 
 class NTPClient {
+  public:
+    struct UpdateState {
+        bool updated; // did it update?
+        bool error;   // if it tried to update and failed, this will be true
+        long drift;   // current difference in miliseconds between server reported time and our time
+    };
+
   private:
     UDP*          _udp;
     bool          _udpSetup       = false;
@@ -27,9 +37,24 @@ class NTPClient {
     long _driftMS                 = 0;
     unsigned long _lastSlew       = 0;      // In ms - millis() when we last did slew() update
 
+    // rate of our clock v.s. NTP, in ppm. positive means we run fast. The
+    // correction accumulates in _rateAcc (ms * 1e-6) and moves _epocMS
+    long          _ratePPM        = 0;
+    long          _rateAcc        = 0;
+    unsigned long _lastRate       = 0;      // In ms - millis() of the last rate correction
+
+    // query in flight. Sent at _requestMS, _requestMS is in the request's
+    // transmit timestamp too, so a late reply to an older query is not taken
+    bool          _waiting        = false;
+    bool          _failed         = false;  // the last query got no reply
+    unsigned long _requestMS      = 0;
+
     byte          _packetBuffer[NTP_PACKET_SIZE];
 
     void          sendNTPPacket();
+    void          poll(UpdateState &state);
+    void          applyRate();
+    unsigned long elapsedMS();              // In ms - since _epocMS, rate corrected
 
   public:
     NTPClient(UDP& udp);
@@ -49,17 +74,13 @@ class NTPClient {
     void begin(int port);
 
 
-    struct UpdateState {
-        bool updated; // did it update?
-        bool error;   // if it tried to update and failed, this will be true
-        long drift;   // current difference in miliseconds between server reported time and our time
-    };
-
     /**
-     * This should be called in the main loop of your application. By default an update from the NTP Server is only
-     * made every 60 seconds. This can be configured in the NTPClient constructor.
+     * This should be called in the main loop of your application, as often as possible - the time the reply is
+     * picked up at is the time it is assumed to have arrived. By default an update from the NTP Server is only
+     * made every 60 seconds. This can be configured in the NTPClient constructor. Never blocks, the request is
+     * sent and the reply is picked up by the later calls.
      *
-     * @return true on success, false on failure
+     * @return true when a reply was processed
      */
     bool update()
     {
@@ -81,20 +102,28 @@ class NTPClient {
     /**
      * Full implementation of the update call - with more thorough update info.
      * implements slew as a part of the process to divert from abrupt time skips
+     * @param can_send false keeps the new request for later, replies are picked up regardless
      */
-    void update(UpdateState& state);
+    void update(UpdateState& state, bool can_send = true);
 
     /**
-     * This will force the update from the NTP Server.
-     *
-     * @return true on success, false on failure
+     * Sends a request to the NTP Server now, regardless of the update interval. The reply is picked up by update()
      */
-    void forceUpdate(UpdateState &state);
+    void forceUpdate();
+
+    /**
+     * @return the estimated rate of our clock v.s. the NTP server, in ppm. Positive means we run fast
+     */
+    long getRatePPM() { return _ratePPM; }
 
     int getDay();
     int getHours();
     int getMinutes();
     int getSeconds();
+
+    /**
+     * @return milliseconds into the current second, corrected by the estimated rate of our clock
+     */
     int getMillis();
 
     /**
@@ -0,0 +1,215 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+/* Benchmarks of the radio stack on the simulated network. Reports, for each
+ * client count:
+ *
+ *  - time to full sync from a cold start (every timer read),
+ *  - time to push a write burst (setpoint, a day of timers and an eeprom
+ *    cell on every client) and get it confirmed,
+ *  - exchanges (our answers carrying commands) per minute while syncing,
+ *  - send queue utilisation,
+ *  - share of the time the static 500-900ms window and the activity model
+ *    (timing.h) declare idle [%], and valve frames starting in those,
+ *
+ * and the host cpu cycles the crypto spends per packet.
+ *
+ * Usage: sim [-n 1,4,8,16,29] [-m max_minutes] [-v]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "network.h"
+
+using namespace hr20;
+using namespace hr20::sim;
+
+// crypto iterations per measured packet size
+static constexpr const unsigned CRYPTO_ROUNDS = 20000;
+
+struct PhaseResult {
+    uint64_t took_us = 0; // 0 means timeout
+    Network::Counters c;
+};
+
+static void print_phase(const char *name, uint8_t n, const PhaseResult &r,
+                        uint64_t limit_us)
+{
+    const auto &c = r.c;
+    uint64_t us   = r.took_us ? r.took_us : limit_us;
+    double   mins = us / 60e6;
+
+    char took[16];
+    if (r.took_us)
+        snprintf(took, sizeof(took), "%.1f", r.took_us / 1e6);
+    else
+        snprintf(took, sizeof(took), "timeout");
+
+    printf("%-6s %3u %9s %8.1f %7.1f %6.2f %4u %5u %5u %5u %5u %6.1f %6.1f "
+           "%5u %5u\n",
+           name, n, took,
+           c.exchanges / mins,
+           c.exchanges ? (double)c.cmd_bytes / c.exchanges : 0.0,
+           c.queue_samples ? (double)c.queue_used_sum / c.queue_samples : 0.0,
+           c.queue_used_max, c.pending_max,
+           c.collisions, c.unanswered, c.valve_bad_cmac,
+           100.0 * c.idle_static * STEP_US / us,
+           100.0 * c.idle_model * STEP_US / us,
+           c.hits_static, c.hits_model);
+}
+
+template<typename Pred>
+static PhaseResult phase(Network &net, Pred pred, uint64_t limit_us) {
+    PhaseResult r;
+    net.counters = Network::Counters();
+    r.took_us = net.run_until(pred, limit_us);
+    r.c = net.counters;
+    return r;
+}
+
+static void run_network(uint8_t n, uint64_t limit_us) {
+    auto *net = new Network(n);
+    net->begin();
+
+    // cold start - everything gets read
+    auto cold = phase(*net, [&] { return net->all_synced(); }, limit_us);
+    print_phase("cold", n, cold, limit_us);
+
+    // write burst on every client
+    for (uint8_t a = 1; a <= n; ++a) {
+        HR20 *hr = net->model[a];
+        if (!hr) continue;
+
+        hr->temp_wanted.set_requested(net->valves[a]->temp_wanted + 2);
+
+        for (uint8_t s = 0; s < TIMER_SLOTS_PER_DAY; ++s) {
+            Timer t;
+            t.set(6 + s * 2, 15 * (s % 4), s % 4);
+            hr->request_timer(1, s, t);
+        }
+
+        hr->request_eeprom_write(0x10 + a, a);
+    }
+
+    auto burst = phase(*net,
+                       [&] { return net->all_synced() && !net->mismatches(); },
+                       limit_us);
+    print_phase("burst", n, burst, limit_us);
+
+    // what's left stays out of sync
+    if (!burst.took_us)
+        printf("       %u values differ from the valves\n", net->mismatches());
+
+    delete net;
+}
+
+static void crypto_bench() {
+    ntptime::NTPTime time;
+    crypto::Crypto c(time);
+    uint8_t pass[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    c.begin(pass);
+    c.update(vclock.unix_time());
+
+    printf("\ncrypto, host cycles per packet\n");
+    printf("%8s %10s %10s %10s\n", "payload", "seal", "seal(pf)", "verify");
+
+    for (uint8_t size = 0; size <= SENT_PACKET_MAX; size += 8) {
+        uint8_t data[SENT_PACKET_MAX + 8] = {};
+        ShortQ<crypto::CMAC::CMAC_SIZE> mac;
+
+        // encrypt + cmac of an outgoing packet, keystream computed on the
+        // fly and served from the prefetched cache
+        uint64_t seal[2] = {0, 0};
+        for (int pf = 0; pf < 2; ++pf) {
+            c.ks_ready = 0;
+            if (pf) c.prefetch();
+
+            uint64_t start = cycles();
+            for (unsigned r = 0; r < CRYPTO_ROUNDS; ++r) {
+                c.rtc.pkt_cnt = 0;
+                if (!pf) c.ks_ready = 0;
+                c.encrypt_decrypt(data, size);
+                mac.clear();
+                c.cmac_fill_addr(data, size, 0, mac);
+            }
+            seal[pf] = (cycles() - start) / CRYPTO_ROUNDS;
+        }
+
+        // incremental verify + decrypt of a received packet with the same
+        // layout, keystream prefetched like in the idle radio time
+        Frame f;
+        f.size = size + 2 + crypto::CMAC::CMAC_SIZE;
+        f.data[0] = f.size;
+        f.data[1] = 1;
+        for (uint8_t i = 0; i < crypto::CMAC::CMAC_SIZE; ++i)
+            f.data[2 + size + i] = mac.pop();
+
+        crypto::RxStream rx(c);
+        uint64_t start = cycles();
+        for (unsigned r = 0; r < CRYPTO_ROUNDS; ++r) {
+            rx.begin(f.data[0]);
+            for (uint8_t i = 1; i < f.size; ++i) rx.feed(f.data[i]);
+        }
+        uint64_t verify = (cycles() - start) / CRYPTO_ROUNDS;
+
+        printf("%8u %10llu %10llu %10llu\n", size,
+               (unsigned long long)seal[0], (unsigned long long)seal[1],
+               (unsigned long long)verify);
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *counts = "1,4,8,16,29";
+    unsigned max_minutes = 30;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            counts = argv[++i];
+        } else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+            max_minutes = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-v")) {
+            Serial.enabled = true;
+        } else {
+            fprintf(stderr, "usage: %s [-n 1,4,8,16,29] [-m max_minutes] [-v]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    uint64_t limit_us = max_minutes * 60ull * 1000000ull;
+
+    printf("%-6s %3s %9s %8s %7s %6s %4s %5s %5s %5s %5s %6s %6s %5s %5s\n",
+           "phase", "n", "took[s]", "xchg/min", "B/xchg", "q_avg", "q_max",
+           "pend", "coll", "unans", "vbad", "idle_s", "idle_m", "hit_s",
+           "hit_m");
+
+    for (const char *p = counts; *p;) {
+        int n = atoi(p);
+        if (n > 0) run_network(n, limit_us);
+
+        p = strchr(p, ',');
+        if (!p) break;
+        ++p;
+    }
+
+    crypto_bench();
+    return 0;
+}
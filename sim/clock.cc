@@ -0,0 +1,101 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+#include <Arduino.h>
+#include <TimeLib.h>
+#include <WiFiUdp.h>
+
+#include <chrono>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "clock.h"
+
+HardwareSerial Serial;
+EspClass ESP;
+
+namespace hr20 {
+namespace sim {
+
+Clock vclock;
+
+uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    // no cycle counter, use ns instead
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+} // namespace sim
+} // namespace hr20
+
+using hr20::sim::vclock;
+
+unsigned long millis() { return vclock.ms(); }
+unsigned long micros() { return vclock.us(); }
+void delay(unsigned long ms) { vclock.advance_us(ms * 1000ull); }
+
+uint32_t EspClass::getCycleCount() {
+    return static_cast<uint32_t>(hr20::sim::cycles());
+}
+
+static struct tm split(time_t t) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    return tm;
+}
+
+int year(time_t t)      { return split(t).tm_year + 1900; }
+int month(time_t t)     { return split(t).tm_mon + 1; }
+int day(time_t t)       { return split(t).tm_mday; }
+int hour(time_t t)      { return split(t).tm_hour; }
+int minute(time_t t)    { return split(t).tm_min; }
+int second(time_t t)    { return split(t).tm_sec; }
+int dayOfWeek(time_t t) { return split(t).tm_wday + 1; }
+
+time_t now() { return vclock.unix_time(); }
+
+// the clock is the reference, nothing to set
+void setTime(int, int, int, int, int, int) {}
+
+int WiFiUDP::read(unsigned char *buf, size_t len) {
+    // seconds since 1900 and 32 bit fraction in the transmit timestamp
+    constexpr const uint32_t SEVENTY_YEARS = 2208988800UL;
+
+    uint64_t us    = vclock.us();
+    uint32_t secs  = vclock.unix_time() + SEVENTY_YEARS;
+    uint32_t frac  = ((us % 1000000) << 32) / 1000000;
+
+    memset(buf, 0, len);
+    if (len < 48) return 0;
+
+    memcpy(buf + 24, origin, sizeof(origin));
+    for (int i = 0; i < 4; ++i) {
+        buf[40 + i] = secs >> (24 - 8 * i);
+        buf[44 + i] = frac >> (24 - 8 * i);
+    }
+
+    requested = false;
+    return 48;
+}
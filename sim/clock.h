@@ -0,0 +1,54 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+
+namespace hr20 {
+namespace sim {
+
+/** Virtual clock of the simulation. Everything that asks for time - millis(),
+ * micros(), now() and the NTP stub - is served from here, so a simulated
+ * hour takes as long as the code under test needs to process it.
+ */
+struct Clock {
+    // 2020-12-12 00:00:00 UTC. Arbitrary, but has to be past 2000
+    static constexpr const time_t EPOCH = 1607731200;
+
+    void advance_us(uint64_t us) { now_us += us; }
+
+    // advances to the given absolute time, never back
+    void advance_to(uint64_t us) { if (us > now_us) now_us = us; }
+
+    uint64_t us() const { return now_us; }
+    uint64_t ms() const { return now_us / 1000; }
+    time_t unix_time() const { return EPOCH + now_us / 1000000; }
+
+    uint64_t now_us = 0;
+};
+
+extern Clock vclock;
+
+// host cpu cycle counter, for the crypto benchmarks
+uint64_t cycles();
+
+} // namespace sim
+} // namespace hr20
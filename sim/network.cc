@@ -0,0 +1,415 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+#include "network.h"
+
+namespace hr20 {
+namespace sim {
+
+// binary form of the default rfm password (see Config::rfm_pass_hex)
+static const uint8_t RFM_PASS[8] = {0x01, 0x23, 0x45, 0x67,
+                                    0x89, 0x01, 0x23, 0x45};
+
+// valves give up waiting for our answer after this many ms
+static constexpr const uint16_t VALVE_LISTEN_MS = RESPONSE_WINDOW_MS + 50;
+
+Network::Network(uint8_t clients)
+    : time(),
+      crypto{time},
+      queue{crypto, activity, PACKET_DISCARD_AGE},
+      proto{model, time, crypto, queue, activity},
+      rx{crypto},
+      valve_count(clients < MAX_HR_COUNT ? clients : MAX_HR_COUNT)
+{
+    for (uint8_t a = 1; a <= valve_count; ++a)
+        valves[a] = new Valve(a, time, RFM_PASS);
+}
+
+Network::~Network() {
+    for (auto *v : valves) delete v;
+}
+
+void Network::begin() {
+    crypto.begin(RFM_PASS);
+    time.begin();
+
+    // the valves start talking once we have the time, they would not
+    // understand us before
+    while (!time.isSynced()) {
+        vclock.advance_us(STEP_US);
+        bool changed;
+        time.update(true, changed);
+    }
+
+    last_sec = time.unixTime();
+}
+
+void Network::step() {
+    vclock.advance_us(STEP_US);
+    uint64_t now_us = vclock.us();
+
+    // same order of things as in HR20Master::update
+    bool idle = !master_tx && !air_cnt;
+    auto sec  = second(time.localTime());
+
+    // HR20Master::is_idle, with the static window it replaced for reference
+    int ms = time.getMillis();
+    static_idle = idle && ms >= 500 && ms < 900;
+    model_idle  = idle && !activity.busy(sec, ms, model.present,
+                                         proto.forced());
+    counters.idle_static += static_idle;
+    counters.idle_model  += model_idle;
+
+    bool changed = false;
+    time_t now = time.update(model_idle, changed);
+    eventLog.update(now);
+
+    schedule_valves(now);
+
+    if (crypto.update(now)) {
+        proto.update(time.localTime(), time.isSynced(), changed,
+                     time.cur_slew);
+        expire_due = true;
+    }
+
+    // frames that finished
+    for (uint8_t i = 0; i < air_cnt;) {
+        if (air[i].end > now_us) {
+            ++i;
+            continue;
+        }
+
+        Air a = air[i];
+        air[i] = air[--air_cnt];
+        deliver(a);
+    }
+
+    // valve packets that are due
+    for (uint8_t i = 0; i < planned_cnt;) {
+        if (planned[i].at > now_us) {
+            ++i;
+            continue;
+        }
+
+        Planned p = planned[i];
+        planned[i] = planned[--planned_cnt];
+
+        Valve *v = valves[p.addr];
+        if (p.size) {
+            valve_send(*v, p.payload, p.size, now_us);
+        } else {
+            uint8_t buf[Frame::MAX_LEN];
+            valve_send(*v, buf, v->status(buf), now_us);
+        }
+    }
+
+    master_send();
+
+    // exchanges end with the radio going idle
+    bool radio_now = !master_tx && !air_cnt;
+    if (radio_now && !radio_idle) activity.on_idle(time.getMillis());
+    radio_idle = radio_now;
+
+    if (!master_tx && !air_cnt) {
+        crypto.prefetch();
+
+        if (expire_due || queue.expire_wanted) {
+            queue.expire(time.unixTime());
+            expire_due = false;
+        }
+    }
+
+    // valves listening in vain
+    for (auto *v : valves) {
+        if (!v || !v->waiting) continue;
+        if (now_us > v->waiting_since + VALVE_LISTEN_MS * 1000ull) {
+            v->waiting = false;
+            ++counters.unanswered;
+        }
+    }
+
+    uint8_t used = PACKET_QUEUE_LEN - queue.free_cnt;
+    ++counters.queue_samples;
+    counters.queue_used_sum += used;
+    if (used > counters.queue_used_max) counters.queue_used_max = used;
+    if (queue.pending_cnt > counters.pending_max)
+        counters.pending_max = queue.pending_cnt;
+}
+
+bool Network::all_synced() {
+    for (uint8_t a = 1; a <= valve_count; ++a) {
+        HR20 *hr = model[a];
+        if (!hr || !hr->synced) return false;
+    }
+
+    return true;
+}
+
+unsigned Network::mismatches() {
+    unsigned cnt = 0;
+
+    for (uint8_t a = 1; a <= valve_count; ++a) {
+        HR20 *hr = model[a];
+        Valve &v = *valves[a];
+
+        if (!hr) {
+            ++cnt;
+            continue;
+        }
+
+        if (hr->temp_wanted.get_remote() != v.temp_wanted) ++cnt;
+        if (hr->auto_mode.get_remote() != v.auto_mode) ++cnt;
+        if (hr->menu_locked.get_remote() != v.locked) ++cnt;
+        if (hr->temp_wanted.is_requested_set()) ++cnt;
+        if (hr->auto_mode.is_requested_set()) ++cnt;
+        if (hr->menu_locked.is_requested_set()) ++cnt;
+
+        for (uint8_t d = 0; d < TIMER_DAYS; ++d) {
+            for (uint8_t s = 0; s < TIMER_SLOTS_PER_DAY; ++s) {
+                auto &t = hr->timers[d][s];
+                if (t.get_remote().raw() != v.timers[d][s]) ++cnt;
+                if (t.is_requested_set()) ++cnt;
+            }
+        }
+
+        hr->eeprom.for_each([&](uint8_t ee, SyncedValue<uint8_t> &cell) {
+            if (cell.remote_valid() && cell.get_remote() != v.eeprom[ee])
+                ++cnt;
+            if (cell.is_requested_set()) ++cnt;
+        });
+    }
+
+    return cnt;
+}
+
+const Network::Air *Network::transmit(const Frame &f, int8_t from,
+                                      uint64_t at)
+{
+    if (air_cnt >= MAX_AIR) {
+        ++counters.collisions;
+        return nullptr;
+    }
+
+    // the master sees the first byte come in
+    if (from >= 0) {
+        activity.on_rx_start(time.getMillis());
+        counters.hits_static += static_idle;
+        counters.hits_model  += model_idle;
+    }
+
+    Air &a = air[air_cnt++];
+    a.frame = f;
+    a.from  = from;
+    a.start = at;
+    a.end   = at + (PREAMBLE_BYTES + f.size) * BYTE_US;
+    a.lost  = false;
+
+    // single channel - anything overlapping is garbage for everyone
+    for (uint8_t i = 0; i + 1 < air_cnt; ++i) {
+        Air &o = air[i];
+        if (o.end <= a.start || o.start >= a.end) continue;
+        if (!o.lost) ++counters.collisions;
+        if (!a.lost) ++counters.collisions;
+        o.lost = a.lost = true;
+    }
+
+    return &a;
+}
+
+void Network::deliver(const Air &a) {
+    if (a.from < 0) master_tx = false;
+    if (a.lost) return;
+
+    // our answer goes to the valve that waits the longest
+    Valve *target = nullptr;
+    if (a.from < 0 && !a.frame.sync()) {
+        for (auto *v : valves) {
+            if (!v || !v->waiting) continue;
+            if (!target || v->waiting_since < target->waiting_since)
+                target = v;
+        }
+    }
+
+    if (a.from >= 0) master_receive(a);
+
+    for (auto *v : valves) {
+        if (!v || v->addr == a.from) continue;
+
+        valve_receive(*v, a);
+
+        if (v == target) {
+            // decrypted payload of the answer, behind len and addr
+            const uint8_t *cmds = last_payload;
+            v->waiting = false;
+
+            if (!last_payload_size) continue;
+
+            if (planned_cnt >= MAX_PLANNED) continue;
+            Planned &p = planned[planned_cnt];
+            p.size = v->execute(cmds, last_payload_size, p.payload);
+            if (!p.size) continue;
+
+            p.addr = v->addr;
+            p.at   = vclock.us() + VALVE_TURNAROUND_MS * 1000ull;
+            ++planned_cnt;
+        }
+    }
+}
+
+void Network::master_receive(const Air &a) {
+    const Frame &f = a.frame;
+
+    packet.clear();
+    rx.begin(f.data[0]);
+    linkStats.on_rx_start(a.start / 1000);
+    packet.push(f.data[0]);
+
+    for (uint8_t i = 1; i < f.size; ++i) packet.push(rx.feed(f.data[i]));
+
+    ++counters.received;
+    proto.receive(packet, rx);
+}
+
+void Network::master_send() {
+    if (master_tx) return;
+
+    queue.prepare_pending();
+    if (queue.peek() < 0) return;
+
+    uint8_t raw[PREAMBLE_BYTES + Frame::MAX_LEN];
+    uint8_t n = 0;
+
+    while (n < sizeof(raw)) {
+        int b = queue.peek();
+        if (b < 0) break;
+        raw[n++] = b;
+        if (!queue.pop()) break;
+    }
+
+    Frame f;
+    f.size = n - PREAMBLE_BYTES;
+    memcpy(f.data, raw + PREAMBLE_BYTES, f.size);
+
+    if (f.sync()) {
+        ++counters.syncs;
+    } else {
+        // len, addr and cmac
+        uint8_t cmds = f.size - 2 - crypto::CMAC::CMAC_SIZE;
+        if (cmds) ++counters.exchanges; else ++counters.acks;
+        counters.cmd_bytes += cmds;
+    }
+
+    master_tx = transmit(f, -1, vclock.us()) != nullptr;
+}
+
+void Network::valve_receive(Valve &v, const Air &a) {
+    const Frame &f = a.frame;
+    uint8_t buf[Frame::MAX_LEN];
+
+    last_payload_size = 0;
+
+    if (f.size > v.max_frame) {
+        if (a.from < 0 && v.waiting) ++counters.valve_bad_cmac;
+        return;
+    }
+
+    v.rx.begin(f.data[0]);
+    buf[0] = f.data[0];
+    for (uint8_t i = 1; i < f.size; ++i) buf[i] = v.rx.feed(f.data[i]);
+
+    if (!v.rx.verified()) {
+        if (a.from < 0 && v.waiting) ++counters.valve_bad_cmac;
+        return;
+    }
+
+    if (!f.sync()) {
+        v.rx.commit();
+
+        uint8_t size = f.size - 2 - crypto::CMAC::CMAC_SIZE;
+        memcpy(last_payload, buf + 2, size);
+        last_payload_size = size;
+        return;
+    }
+
+    // sync: 4 bytes of time, then 2 force addrs or 4 bytes of force flags
+    uint8_t flags = f.size - 1 - 4 - crypto::CMAC::CMAC_SIZE;
+    const uint8_t *ff = buf + 5;
+
+    if (flags == 2) {
+        v.forced = ff[0] == v.addr || ff[1] == v.addr;
+    } else if (flags == 4) {
+        uint32_t big = ff[0] | ff[1] << 8 | ff[2] << 16 | (uint32_t)ff[3] << 24;
+        v.forced = big & (1ul << v.addr);
+    } else {
+        v.forced = false;
+    }
+}
+
+void Network::valve_send(Valve &v, const uint8_t *payload, uint8_t size,
+                         uint64_t at)
+{
+    Frame f;
+    f.size    = size + 2 + crypto::CMAC::CMAC_SIZE;
+    f.data[0] = f.size;
+    f.data[1] = v.addr;
+    memcpy(f.data + 2, payload, size);
+
+    // same order as on the master's side - encrypt, then cmac
+    v.crypto.encrypt_decrypt(f.data + 2, size);
+
+    ShortQ<crypto::CMAC::CMAC_SIZE> mac;
+    v.crypto.cmac_fill_addr(f.data + 2, size, v.addr, mac);
+    for (uint8_t i = 0; i < crypto::CMAC::CMAC_SIZE; ++i)
+        f.data[2 + size + i] = mac.pop();
+
+    ++counters.client_packets;
+    const Air *a = transmit(f, v.addr, at);
+
+    // status packets expect an answer
+    if (a && payload[0] == ('D' | 0x80)) {
+        v.waiting = true;
+        v.waiting_since = a->end;
+    }
+}
+
+void Network::schedule_valves(time_t now) {
+    // the clock may step back on NTP correction, don't repeat the second
+    if (now <= last_sec) return;
+    last_sec = now;
+
+    uint8_t sec = second(now);
+    uint64_t sec_start = vclock.us() - time.getMillis() * 1000ull;
+
+    for (auto *v : valves) {
+        if (!v) continue;
+
+        // valves are synchronized to our sync packets
+        v->crypto.update(now);
+
+        if (!v->talks_in(sec) || planned_cnt >= MAX_PLANNED) continue;
+
+        Planned &p = planned[planned_cnt++];
+        p.addr = v->addr;
+        p.size = 0; // status packet, built when sent
+        p.at   = sec_start + v->talk_offset() * 1000ull;
+    }
+}
+
+} // namespace sim
+} // namespace hr20
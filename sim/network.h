@@ -0,0 +1,171 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "config.h"
+#include "crypto.h"
+#include "model.h"
+#include "ntptime.h"
+#include "packetqueue.h"
+#include "protocol.h"
+
+#include "clock.h"
+#include "valve.h"
+
+namespace hr20 {
+namespace sim {
+
+// air time of one byte at 9600 bps, in us
+constexpr const uint32_t BYTE_US = 8 * 1000000 / 9600;
+// bytes sent ahead of the frame - 0xAA 0xAA preamble and 2 byte sync word
+constexpr const uint8_t PREAMBLE_BYTES = 4;
+// time a valve needs from our answer to its response packet, in ms
+constexpr const uint16_t VALVE_TURNAROUND_MS = 5;
+// simulated time step
+constexpr const uint32_t STEP_US = 1000;
+
+/** Simulated radio network - the master's radio stack (Protocol, PacketQ,
+ * Crypto, Model) driven the way RadioNet drives it, and N simulated
+ * valves, all running on the virtual clock. The radio is a single shared
+ * channel, overlapping frames are all lost.
+ */
+struct Network {
+    static constexpr const uint8_t MAX_AIR = 8;
+
+    struct Counters {
+        uint32_t client_packets = 0; // valve packets put on air
+        uint32_t received       = 0; // valve packets master processed
+        uint32_t exchanges      = 0; // our answers carrying commands
+        uint32_t acks           = 0; // our empty answers
+        uint32_t syncs          = 0;
+        uint32_t collisions     = 0; // frames lost to overlaps
+        uint32_t unanswered     = 0; // valves that gave up waiting
+        uint32_t valve_bad_cmac = 0; // frames valves could not verify
+
+        // command bytes and command carrying answers, for the averages
+        uint32_t cmd_bytes      = 0;
+
+        // queue utilisation
+        uint64_t queue_samples  = 0;
+        uint64_t queue_used_sum = 0;
+        uint8_t  queue_used_max = 0;
+        uint8_t  pending_max    = 0;
+
+        // steps the static 500-900ms window and the activity model declared
+        // idle, and valve frames that started in such a step
+        uint32_t idle_static    = 0;
+        uint32_t idle_model     = 0;
+        uint32_t hits_static    = 0;
+        uint32_t hits_model     = 0;
+    };
+
+    Network(uint8_t clients);
+    ~Network();
+
+    void begin();
+
+    // advances the simulation by one step
+    void step();
+
+    // runs until pred returns true or the limit (us of simulated time)
+    // passes. Returns simulated time it took, or 0 on timeout
+    template<typename Pred>
+    uint64_t run_until(Pred pred, uint64_t limit_us) {
+        uint64_t start = vclock.us();
+        while (vclock.us() - start < limit_us) {
+            step();
+            if (pred()) return vclock.us() - start;
+        }
+        return 0;
+    }
+
+    void run_for(uint64_t us) {
+        run_until([] { return false; }, us);
+    }
+
+    // all valves are known to the master and nothing is pending for them
+    bool all_synced();
+
+    // count of values in master's model differing from the valves
+    unsigned mismatches();
+
+    ntptime::NTPTime time;
+    crypto::Crypto crypto;
+    ActivityModel activity;
+    PacketQ queue;
+    Model model;
+    Protocol proto;
+    crypto::RxStream rx;
+    RcvPacket packet;
+
+    Valve *valves[MAX_HR_ADDR] = {};
+    uint8_t valve_count;
+
+    Counters counters;
+
+protected:
+    struct Air {
+        Frame frame;
+        uint64_t start = 0, end = 0; // us
+        int8_t from = -1;            // valve address, -1 for master
+        bool lost = false;
+    };
+
+    // puts a frame on air, returns nullptr if it did not even start
+    const Air *transmit(const Frame &f, int8_t from, uint64_t at);
+    void deliver(const Air &a);
+    void master_receive(const Air &a);
+    void master_send();
+    void valve_receive(Valve &v, const Air &a);
+    void valve_send(Valve &v, const uint8_t *payload, uint8_t size,
+                    uint64_t at);
+    void schedule_valves(time_t now);
+
+    Air air[MAX_AIR];
+    uint8_t air_cnt = 0;
+    bool master_tx = false;         // the master's frame is on air
+    bool radio_idle = false;        // as of the last step, for on_idle
+    // idle declarations of this step, see Counters
+    bool static_idle = false;
+    bool model_idle = false;
+    bool expire_due = false;
+    time_t last_sec = 0;
+
+    // decrypted payload of the master frame the last valve_receive verified
+    uint8_t last_payload[Frame::MAX_LEN];
+    uint8_t last_payload_size = 0;
+
+    // valve packets scheduled into the future
+    struct Planned {
+        uint64_t at;
+        uint8_t addr;
+        uint8_t size;
+        uint8_t payload[Frame::MAX_LEN];
+    };
+
+    static constexpr const uint8_t MAX_PLANNED = MAX_HR_ADDR * 2;
+    Planned planned[MAX_PLANNED];
+    uint8_t planned_cnt = 0;
+};
+
+} // namespace sim
+} // namespace hr20
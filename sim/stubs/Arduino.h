@@ -0,0 +1,115 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+/* Minimal host replacement of the Arduino core, just enough for the radio
+ * stack to compile natively. millis()/micros()/delay() run on the virtual
+ * clock of the simulation (see sim/clock.h).
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdarg>
+#include <cmath>
+#include <ctime>
+#include <functional>
+#include <string>
+
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RAM_ATTR
+#define IRAM_ATTR
+#define PROGMEM
+#define F(x) (x)
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+inline void yield() {}
+
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+inline uint16_t word(uint8_t h, uint8_t l) { return (h << 8) | l; }
+
+class String : public std::string {
+public:
+    String() {}
+    String(const char *c) : std::string(c ? c : "") {}
+    String(const std::string &s) : std::string(s) {}
+    String(unsigned long v) : std::string(std::to_string(v)) {}
+
+    bool concat(const char *c, unsigned len) { append(c, len); return true; }
+    long toInt() const { return atol(c_str()); }
+};
+
+inline String operator+(const char *a, const String &b) {
+    return String(std::string(a) + b);
+}
+
+inline String operator+(const String &a, const String &b) {
+    std::string rv(a);
+    return String(rv.append(b));
+}
+
+inline String operator+(const String &a, const char *b) {
+    std::string rv(a);
+    return String(rv.append(b));
+}
+
+// serial output goes to stdout, but only when enabled (-v of the sim)
+struct HardwareSerial {
+    void begin(long) {}
+
+    size_t write(const char *s) { return enabled ? fputs(s, stdout) : 0; }
+
+    void print(const char *s) { write(s); }
+    void print(long v) { printf("%ld", v); }
+    void print(int v) { printf("%d", v); }
+    void print(unsigned v) { printf("%u", v); }
+    void println(const char *s = "") { write(s); write("\n"); }
+
+    int printf(const char *fmt, ...) __attribute__((format(printf, 2, 3))) {
+        if (!enabled) return 0;
+        va_list ap;
+        va_start(ap, fmt);
+        int rv = vprintf(fmt, ap);
+        va_end(ap);
+        return rv;
+    }
+
+    bool enabled = false;
+};
+
+extern HardwareSerial Serial;
+
+struct EspClass {
+    void restart() { exit(0); }
+    void wdtFeed() {}
+    uint32_t getCycleCount();
+};
+
+extern EspClass ESP;
+
+struct IPAddress {};
@@ -0,0 +1,36 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+/* TimeLib subset. Works in UTC on the virtual clock of the simulation */
+
+#pragma once
+
+#include <ctime>
+#include <cstdint>
+
+int year(time_t t);
+int month(time_t t);
+int day(time_t t);
+int hour(time_t t);
+int minute(time_t t);
+int second(time_t t);
+int dayOfWeek(time_t t); // sunday is 1
+
+time_t now();
+void setTime(int hr, int min, int sec, int day, int month, int yr);
@@ -0,0 +1,39 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+/* Timezone stub - the simulation runs in UTC, so local time equals utc */
+
+#pragma once
+
+#include <Time.h>
+
+enum week_t { Last, First, Second, Third, Fourth };
+enum dow_t { Sun = 1, Mon, Tue, Wed, Thu, Fri, Sat };
+enum month_t { Jan = 1, Feb, Mar, Apr, May, Jun, Jul, Aug, Sep, Oct, Nov, Dec };
+
+struct TimeChangeRule {
+    char abbrev[6];
+    uint8_t week, dow, month, hour;
+    int offset;
+};
+
+struct Timezone {
+    Timezone(TimeChangeRule, TimeChangeRule) {}
+    time_t toLocal(time_t utc, TimeChangeRule **) { return utc; }
+};
@@ -0,0 +1,44 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+/* UDP stub serving as an ideal NTP server - every request gets answered
+ * with the exact time of the virtual clock.
+ */
+
+#pragma once
+
+#include <Udp.h>
+
+struct WiFiUDP : public UDP {
+    uint8_t begin(uint16_t) override { return 1; }
+    void stop() override {}
+    int beginPacket(const char *, uint16_t) override { return 1; }
+    int endPacket() override { return 1; }
+    size_t write(const uint8_t *buf, size_t size) override {
+        requested = true;
+        // the transmit timestamp gets echoed as the originate one
+        if (size >= 48) memcpy(origin, buf + 40, sizeof(origin));
+        return size;
+    }
+    int parsePacket() override { return requested ? 48 : 0; }
+    int read(unsigned char *buf, size_t len) override;
+
+    bool requested = false;
+    uint8_t origin[8] = {};
+};
@@ -0,0 +1,218 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "config.h"
+#include "crypto.h"
+#include "ntptime.h"
+#include "queue.h"
+
+namespace hr20 {
+namespace sim {
+
+// radio frame as it goes over the air: [len][addr][payload][cmac x 4]
+// (sync frames have no addr). The preamble and the sync word are not stored
+struct Frame {
+    static constexpr const uint8_t MAX_LEN = 80;
+
+    uint8_t data[MAX_LEN];
+    uint8_t size = 0;
+
+    bool sync() const { return data[0] & 0x80; }
+};
+
+/** Simulated HR20 client. Keeps the state the master syncs (setpoint, mode,
+ * lock, timers, eeprom) and answers the master's commands the way the
+ * rfmsrc firmware does. It has its own copy of the crypto state, so the
+ * packet counter only stays in step with the master when both saw the
+ * same packets.
+ */
+struct Valve {
+    Valve(uint8_t addr, ntptime::NTPTime &time, const uint8_t *rfm_pass)
+        : addr(addr), jitter(addr),
+          // every third valve struggles with longer frames
+          max_frame(addr % 3 ? Frame::MAX_LEN : 40),
+          crypto(time), rx(crypto)
+    {
+        crypto.begin(rfm_pass);
+
+        // some per-client variety, deterministic for repeatable runs
+        temp_wanted = c2temp(17) + addr % 8;
+        temp_avg    = 1900 + addr * 10;
+        bat_avg     = 2900 - addr;
+        valve_wtd   = 30 + addr;
+
+        for (uint8_t d = 0; d < TIMER_DAYS; ++d)
+            for (uint8_t s = 0; s < TIMER_SLOTS_PER_DAY; ++s)
+                timers[d][s] = (s % 4) << 12 | ((s * 3 + d + addr) * 20 % 1440);
+
+        for (unsigned a = 0; a < EEPROM_SIZE; ++a)
+            eeprom[a] = a ^ addr;
+    }
+
+    // calendar checksum, as the client reports it in the long debug response
+    uint8_t checksum() const {
+        uint8_t sum = 0;
+        for (uint8_t d = 0; d < TIMER_DAYS; ++d)
+            for (uint8_t s = 0; s < TIMER_SLOTS_PER_DAY; ++s)
+                sum += (timers[d][s] & 0xFF) + (timers[d][s] >> 8);
+        return sum;
+    }
+
+    // decides if the client talks in the given second of a minute. Every
+    // client talks in its own second of each half minute, clients named
+    // in the force flags of the last sync talk every second till the next one
+    bool talks_in(uint8_t sec) const {
+        if (sec == 0 || sec == 30) return false;
+        return forced || (sec % 30) == addr % 30;
+    }
+
+    // offset (ms) of the client packet inside its second. Pseudo-random,
+    // but repeatable, so clients that collided once don't collide forever
+    uint16_t talk_offset() {
+        jitter = jitter * 1103515245 + 12345;
+        return 100 + (jitter >> 16) % 700;
+    }
+
+    // status packet payload (long debug response with the checksum)
+    uint8_t status(uint8_t *buf) const {
+        buf[0] = 'D' | 0x80;
+        debug_data(buf + 1);
+        buf[10] = checksum();
+        return 11;
+    }
+
+    // executes the master's commands, fills the responses into buf. Returns
+    // the size of the responses
+    uint8_t execute(const uint8_t *cmd, uint8_t size, uint8_t *buf) {
+        uint8_t pos = 0, i = 0;
+        bool trailing_debug = false;
+
+        while (i < size) {
+            uint8_t c = cmd[i++];
+            uint8_t n = arg_len(c);
+
+            if (n == 0xFF || i + n > size) {
+                ++bad_commands;
+                break;
+            }
+
+            const uint8_t *a = cmd + i;
+            i += n;
+
+            buf[pos++] = c | 0x80;
+            trailing_debug = false;
+
+            switch (c) {
+            case 'A':
+            case 'M':
+                if (c == 'A') temp_wanted = a[0];
+                else          auto_mode   = a[0] != 0;
+                debug_data(buf + pos);
+                pos += 9;
+                trailing_debug = true;
+                break;
+            case 'L':
+                locked = a[0] != 0;
+                buf[pos++] = locked;
+                break;
+            case 'W':
+            case 'R': {
+                uint8_t d = a[0] >> 4, s = a[0] & 0xF;
+                if (d >= TIMER_DAYS || s >= TIMER_SLOTS_PER_DAY) {
+                    ++bad_commands;
+                    return pos - 1;
+                }
+                if (c == 'W') timers[d][s] = a[1] << 8 | a[2];
+                buf[pos++] = a[0];
+                buf[pos++] = timers[d][s] >> 8;
+                buf[pos++] = timers[d][s] & 0xFF;
+                break;
+            }
+            case 'S':
+                eeprom[a[0]] = a[1];
+                // fall through
+            case 'G':
+                buf[pos++] = a[0];
+                buf[pos++] = eeprom[a[0]];
+                break;
+            }
+        }
+
+        // the checksum only makes it when the debug response is the last one
+        if (trailing_debug) buf[pos++] = checksum();
+
+        return pos;
+    }
+
+    uint8_t addr;
+
+    // synced state
+    uint8_t  temp_wanted;
+    bool     auto_mode = true;
+    bool     locked    = false;
+    uint16_t timers[TIMER_DAYS][TIMER_SLOTS_PER_DAY];
+    uint8_t  eeprom[EEPROM_SIZE];
+
+    // measured values
+    uint16_t temp_avg;
+    uint16_t bat_avg;
+    uint8_t  valve_wtd;
+
+    // comm state
+    bool forced = false;             // named in the last sync's force flags
+    bool waiting = false;            // sent status, listens for the answer
+    uint64_t waiting_since = 0;      // us
+    uint16_t bad_commands = 0;       // commands we could not understand
+    uint32_t jitter;                 // talk_offset generator state
+    uint8_t max_frame;               // longer frames never get received
+
+    crypto::Crypto crypto;
+    crypto::RxStream rx;
+
+protected:
+    // argument byte count of a master command, 0xFF for unknown commands
+    static uint8_t arg_len(uint8_t c) {
+        switch (c) {
+        case 'A': case 'M': case 'L': case 'R': case 'G': return 1;
+        case 'S': return 2;
+        case 'W': return 3;
+        default:  return 0xFF;
+        }
+    }
+
+    // the 9 bytes of the debug response
+    void debug_data(uint8_t *buf) const {
+        buf[0] = auto_mode ? 0x80 : 0;
+        buf[1] = locked ? 0x80 : 0;
+        buf[2] = 0;
+        buf[3] = temp_avg >> 8;
+        buf[4] = temp_avg & 0xFF;
+        buf[5] = bat_avg >> 8;
+        buf[6] = bat_avg & 0xFF;
+        buf[7] = temp_wanted;
+        buf[8] = valve_wtd;
+    }
+};
+
+} // namespace sim
+} // namespace hr20
@@ -0,0 +1,100 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+#include "bench.h"
+
+#ifdef BENCH
+
+#include "crypto.h"
+#include "debug.h"
+#include "packetqueue.h"
+
+namespace hr20 {
+
+// iterations per synthetic measurement
+static constexpr const uint8_t BENCH_ROUNDS = 64;
+
+Bench bench;
+
+void ICACHE_RAM_ATTR CycleStat::add(uint32_t cycles) {
+    ++count;
+    total += cycles;
+    if (cycles < min) min = cycles;
+    if (cycles > max) max = cycles;
+}
+
+void ICACHE_FLASH_ATTR Bench::run_crypto(crypto::Crypto &c) {
+    crypto::RTC saved = c.rtc;
+    uint8_t data[SENT_PACKET_LEN] = {0};
+    ShortQ<crypto::CMAC::CMAC_SIZE> mac;
+
+    for (uint8_t r = 0; r < BENCH_ROUNDS; ++r) {
+        c.ks_ready    = 0;
+        c.rtc.pkt_cnt = 0;
+        {
+            CycleScope s(pkt_encrypt);
+            c.encrypt_decrypt(data, sizeof(data));
+        }
+
+        c.prefetch();
+        c.rtc.pkt_cnt = 0;
+        {
+            CycleScope s(pkt_encrypt_pf);
+            c.encrypt_decrypt(data, sizeof(data));
+        }
+
+        mac.clear();
+        {
+            CycleScope s(pkt_cmac);
+            c.cmac_fill_addr(data, sizeof(data), 0, mac);
+        }
+
+        ESP.wdtFeed();
+    }
+
+    c.rtc      = saved;
+    c.ks_ready = 0;
+
+    // the live stats should only show the real traffic
+    xtea            = CycleStat();
+    cmac_finish     = CycleStat();
+    encrypt_decrypt = CycleStat();
+}
+
+void ICACHE_FLASH_ATTR Bench::dump() const {
+    auto line = [](const char *name, const CycleStat &s) {
+        DBG("(BENCH %s n %u avg %u min %u max %u)", name,
+            (unsigned)s.count, (unsigned)s.avg(),
+            (unsigned)(s.count ? s.min : 0), (unsigned)s.max);
+    };
+
+    DBG("(BENCH cpu %u MHz)", (unsigned)ESP.getCpuFreqMHz());
+    line("isr", isr);
+    line("spi16", spi16);
+    line("xtea", xtea);
+    line("cmac_finish", cmac_finish);
+    line("encrypt_decrypt", encrypt_decrypt);
+    line("pkt_encrypt", pkt_encrypt);
+    line("pkt_encrypt_pf", pkt_encrypt_pf);
+    line("pkt_cmac", pkt_cmac);
+}
+
+} // namespace hr20
+
+#endif
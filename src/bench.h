@@ -0,0 +1,92 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#include "config.h"
+
+namespace hr20 {
+
+namespace crypto {
+struct Crypto;
+} // namespace crypto
+
+#ifdef BENCH
+
+// cycle count statistics of one measured code path
+struct CycleStat {
+    // called from the ISR too, lives in IRAM
+    void add(uint32_t cycles);
+
+    uint32_t avg() const { return count ? total / count : 0; }
+
+    uint32_t count = 0;
+    uint32_t min   = ~0u;
+    uint32_t max   = 0;
+    uint64_t total = 0;
+};
+
+/** Cycle counts of the radio and crypto hot paths, taken with
+ * ESP.getCycleCount(). Live ones are measured in place, the packet ones
+ * are a synthetic run over a SENT_PACKET_LEN packet done at boot.
+ */
+struct Bench {
+    // live
+    CycleStat isr;             // RFM12B::on_interrupt, entry to exit
+    CycleStat spi16;           // one select of the radio, command or status+FIFO
+    CycleStat xtea;            // XTEA::encrypt of one block
+    CycleStat cmac_finish;     // CMAC::finish
+    CycleStat encrypt_decrypt; // Crypto::encrypt_decrypt, any size
+
+    // boot time, SENT_PACKET_LEN bytes
+    CycleStat pkt_encrypt;     // keystream computed on the fly
+    CycleStat pkt_encrypt_pf;  // keystream served from prefetch
+    CycleStat pkt_cmac;        // cmac_fill_addr
+
+    // runs the synthetic packet measurements. Leaves the crypto's rtc as it
+    // was and drops its keystream cache
+    void ICACHE_FLASH_ATTR run_crypto(crypto::Crypto &c);
+
+    // prints the results over serial
+    void ICACHE_FLASH_ATTR dump() const;
+};
+
+// measures the cycles spent in its scope
+struct CycleScope {
+    inline CycleScope(CycleStat &s) : s(s), start(ESP.getCycleCount()) {}
+    inline ~CycleScope() { s.add(ESP.getCycleCount() - start); }
+
+    CycleStat &s;
+    uint32_t start;
+};
+
+// global benchmark results instance
+extern Bench bench;
+
+#define BENCH_SCOPE(STAT) hr20::CycleScope bench_scope_(hr20::bench.STAT)
+
+#else
+
+#define BENCH_SCOPE(STAT) do { } while (0)
+
+#endif
+
+} // namespace hr20
@@ -0,0 +1,150 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#include "config.h"
+#include "crypto.h"
+
+namespace hr20 {
+
+#ifdef CAPTURE
+
+/** Ring of the raw radio frames, as they went over the air - the frames
+ * we sent (with the 0xAA 0xAA 0x2D 0xD4 preamble/sync) and the ones we
+ * received (from the length byte, still encrypted). Each gets the micros()
+ * of its first and last byte and the crypto RTC as it was when the frame
+ * started. The bytes are stored as they are handed over to/from the radio in
+ * the main loop, so the cost is a store per byte. Downloaded as a pcap file,
+ * see /capture and the README.
+ */
+struct Capture {
+    enum Flags : uint8_t {
+        TX        = 1, // sent by us
+        VERIFIED  = 2, // received, cmac verified
+        ABORTED   = 4, // reception ended early, or a TX cut the RX short
+        TRUNCATED = 8  // longer than CAPTURE_FRAME_LEN
+    };
+
+    struct Record {
+        uint64_t us;     // first byte
+        uint32_t dur_us; // first to last byte
+        uint8_t net;
+        uint8_t flags;
+        uint8_t len;     // stored bytes
+        crypto::RTC rtc;
+        uint8_t data[CAPTURE_FRAME_LEN];
+    };
+
+    // starts a new frame of the network. An unfinished previous one ends
+    // ABORTED
+    ICACHE_FLASH_ATTR void begin(uint8_t net, uint8_t flags,
+                                 const crypto::RTC &rtc)
+    {
+        end(net, ABORTED);
+
+        uint32_t now = micros();
+        if (now < last_us) ++wraps;
+        last_us = now;
+
+        Record &r = ring[seq % CAPTURE_SLOTS];
+        r.us     = ((uint64_t)wraps << 32) | now;
+        r.dur_us = 0;
+        r.net    = net;
+        r.flags  = flags;
+        r.len    = 0;
+        r.rtc    = rtc;
+
+        open[net] = &r;
+        ++seq;
+    }
+
+    // true if the network has a frame in progress that was sent by us
+    bool sending(uint8_t net) const {
+        return open[net] && (open[net]->flags & TX);
+    }
+
+    inline void push(uint8_t net, uint8_t b) {
+        Record *r = open[net];
+        if (!r) return;
+
+        if (r->len < CAPTURE_FRAME_LEN)
+            r->data[r->len++] = b;
+        else
+            r->flags |= TRUNCATED;
+    }
+
+    // finishes the frame in progress, if any, with the given flags added
+    ICACHE_FLASH_ATTR void end(uint8_t net, uint8_t flags = 0) {
+        Record *r = open[net];
+        if (!r) return;
+
+        r->dur_us = micros() - (uint32_t)r->us;
+        r->flags |= flags;
+        open[net] = nullptr;
+    }
+
+    // calls cb with every finished record, oldest first
+    template<typename CbT>
+    ICACHE_FLASH_ATTR void walk(CbT cb) const {
+        uint32_t first = seq > CAPTURE_SLOTS ? seq - CAPTURE_SLOTS : 0;
+        for (uint32_t s = first; s < seq; ++s) {
+            const Record &r = ring[s % CAPTURE_SLOTS];
+            if (is_open(r)) continue;
+            cb(r);
+        }
+    }
+
+    // count of frames captured since boot, overwritten ones included
+    uint32_t count() const { return seq; }
+
+protected:
+    bool is_open(const Record &r) const {
+        for (auto *o : open)
+            if (o == &r) return true;
+        return false;
+    }
+
+    Record ring[CAPTURE_SLOTS];
+    Record *open[RFM_RADIO_COUNT] = {};
+    uint32_t seq     = 0;
+    uint32_t last_us = 0;
+    uint32_t wraps   = 0;
+};
+
+// global capture ring
+extern Capture capture;
+
+#define CAPTURE_BEGIN(NET, FLAGS, RTC) hr20::capture.begin(NET, FLAGS, RTC)
+#define CAPTURE_BYTE(NET, B) hr20::capture.push(NET, B)
+#define CAPTURE_END(NET, FLAGS) hr20::capture.end(NET, FLAGS)
+#define CAPTURE_SENDING(NET) hr20::capture.sending(NET)
+
+#else
+
+#define CAPTURE_BEGIN(NET, FLAGS, RTC) do { } while (0)
+#define CAPTURE_BYTE(NET, B) do { } while (0)
+#define CAPTURE_END(NET, FLAGS) do { } while (0)
+#define CAPTURE_SENDING(NET) true
+
+#endif
+
+} // namespace hr20
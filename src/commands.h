@@ -0,0 +1,145 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace hr20 {
+namespace cmd {
+
+/** Wire format of a client command. We send the code letter followed by
+ * req argument bytes, the client answers with the code | 0x80 followed by
+ * resp bytes, optionally trailed by opt more. Multi-byte fields are big
+ * endian.
+ *
+ * TABLE is the single source of these lengths - the planner packs the
+ * packets by them, encode/decode check the bounds once per command.
+ */
+struct Desc {
+    char    code;
+    uint8_t req;  // argument bytes of our command
+    uint8_t resp; // fixed part of the response
+    uint8_t opt;  // bytes that may trail the fixed part
+};
+
+constexpr const Desc TABLE[] = {
+    // [A][temp /0.5C] -> debug response
+    {'A', 1, 9, 1},
+    // [B][0x13][0x24] -> [0x13][0x24]
+    {'B', 2, 2, 0},
+    // [D] -> [ctl][sec][err][temp avg:2][bat avg:2][temp wtd][valve wtd]
+    // then the calendar checksum, in the long variant
+    {'D', 0, 9, 1},
+    // [G][ee addr] -> [ee addr][value]
+    {'G', 1, 2, 0},
+    // [L][locked] -> [locked]
+    {'L', 1, 1, 0},
+    // [M][auto] -> debug response
+    {'M', 1, 9, 1},
+    // [R][dow << 4 | slot] -> [dow << 4 | slot][timer:2]
+    {'R', 1, 3, 0},
+    // [S][ee addr][value] -> [ee addr][value]
+    {'S', 2, 2, 0},
+    // [T][idx] -> [idx][value:2]
+    {'T', 1, 3, 0},
+    // [V] -> version text up to '\n', variable length
+    {'V', 0, 0, 0},
+    // [W][dow << 4 | slot][timer:2] -> [dow << 4 | slot][timer:2]
+    {'W', 3, 3, 0},
+};
+
+constexpr const uint8_t COUNT = sizeof(TABLE) / sizeof(TABLE[0]);
+constexpr const Desc UNKNOWN = {0, 0xFF, 0xFF, 0};
+
+constexpr const Desc &find(char code, uint8_t i = 0) {
+    return i >= COUNT ? UNKNOWN
+                      : TABLE[i].code == code ? TABLE[i] : find(code, i + 1);
+}
+
+constexpr bool known(char code) { return find(code).req != 0xFF; }
+
+// size of the command in our packet
+constexpr uint8_t cmd_len(char code) { return 1 + find(code).req; }
+
+// size of the response the client sends back for the command, at most
+constexpr uint8_t resp_len(char code) {
+    return 1 + find(code).resp + find(code).opt;
+}
+
+// byte width of the encoded argument list
+template<typename... Args> struct Width;
+
+template<> struct Width<> {
+    static constexpr const uint8_t value = 0;
+};
+
+template<typename T, typename... Rest> struct Width<T, Rest...> {
+    static constexpr const uint8_t value = sizeof(T) + Width<Rest...>::value;
+};
+
+inline uint8_t *put(uint8_t *b, uint8_t v) {
+    *b = v;
+    return b + 1;
+}
+
+inline uint8_t *put(uint8_t *b, uint16_t v) {
+    b[0] = v >> 8;
+    b[1] = v & 0xFF;
+    return b + 2;
+}
+
+/** appends command C with its arguments to the packet. The arguments
+ * have to be uint8_t/uint16_t fields filling exactly the req bytes of the
+ * table. Returns false if the command did not fit
+ */
+template<char C, typename Q, typename... Args>
+bool encode(Q &q, Args... args) {
+    static_assert(known(C), "command is not in the table");
+    static_assert(Width<Args...>::value == find(C).req,
+                  "arguments do not match the command table");
+
+    uint8_t buf[1 + find(C).req];
+    uint8_t *b = put(buf, static_cast<uint8_t>(C));
+    int fields[] = {0, ((b = put(b, args)), 0)...};
+    (void)fields;
+
+    return q.push(buf, sizeof(buf));
+}
+
+/// fixed part of the response to command C, taken from the packet at once
+template<char C>
+struct Response {
+    static_assert(known(C), "command is not in the table");
+    static constexpr const uint8_t LEN = find(C).resp;
+
+    uint8_t operator[](uint8_t i) const { return b[i]; }
+    uint16_t u16(uint8_t i) const { return b[i] << 8 | b[i + 1]; }
+
+    uint8_t b[LEN ? LEN : 1];
+};
+
+// takes the fixed part of the response. false if the packet is too short
+template<char C, typename Q>
+bool decode(Q &q, Response<C> &r) {
+    return q.take(r.b, Response<C>::LEN);
+}
+
+} // namespace cmd
+} // namespace hr20
@@ -38,8 +38,64 @@ static bool ICACHE_FLASH_ATTR jsoneq(const char *json,
   return false;
 }
 
+#ifdef MQTT
+// parses the zone definition at p - NAME:ID,ID... up to a ';' or the end,
+// and moves p past it. false if it is malformed
+static bool ICACHE_FLASH_ATTR parse_zone(const char *&p, const char *&name,
+                                         uint8_t &len, uint64_t &ids)
+{
+    name = p;
+    while (*p && *p != ':' && *p != ';') ++p;
+    if (*p != ':' || p == name) return false;
+    len = p - name;
+    ++p;
+
+    ids = 0;
+    do {
+        int id = 0;
+        const char *start = p;
+        for (; *p >= '0' && *p <= '9'; ++p) id = id * 10 + (*p - '0');
+        if (p == start || p - start > 2) return false;
+        if (id <= 0 || id >= MAX_CLIENT_ID) return false;
+        ids |= 1ull << id;
+    } while (*p == ',' && *++p);
+
+    if (*p == ';') {
+        ++p;
+        return true;
+    }
+
+    return *p == 0;
+}
+#endif
+
 } // namespace
 
+#ifdef MQTT
+bool ICACHE_FLASH_ATTR Config::zone_members(const char *name, uint8_t len,
+                                            uint64_t &ids) const
+{
+    const char *p = mqtt_zones;
+    while (*p) {
+        const char *zname;
+        uint8_t zlen;
+        if (!parse_zone(p, zname, zlen, ids)) return false;
+        if (zlen == len && strncmp(zname, name, len) == 0) return true;
+    }
+    return false;
+}
+
+bool ICACHE_FLASH_ATTR Config::zones_valid(const char *zones) {
+    const char *name;
+    uint8_t len;
+    uint64_t ids;
+    while (*zones) {
+        if (!parse_zone(zones, name, len, ids)) return false;
+    }
+    return true;
+}
+#endif
+
 bool ICACHE_FLASH_ATTR Config::rfm_pass_to_binary(unsigned char *target) {
     for (int j = 0; j < 8; ++j)
     {
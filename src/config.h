@@ -41,11 +41,27 @@ struct Config
     char mqtt_user[21] = "";
     char mqtt_pass[21] = "";
     char mqtt_topic_prefix[41] = "hr20";
+    // valve groups for the set/zone/NAME/... topics, NAME:ID,ID;NAME:ID...
+    // i.e. "ground:1,2,3;first:4,5,33"
+    char mqtt_zones[121] = "";
+#endif
+
+#ifdef SYSLOG
+    char syslog_server[41] = "";
 #endif
 
     // converts hexadecimal config form of rfm password to binary into 8 byte buffer
     bool ICACHE_FLASH_ATTR rfm_pass_to_binary(unsigned char *rfm_pass);
 
+#ifdef MQTT
+    // bitmap of client ids of the named zone. false if there's no such zone
+    bool ICACHE_FLASH_ATTR zone_members(const char *name, uint8_t len,
+                                        uint64_t &ids) const;
+
+    // true if the zone definitions are well formed
+    static bool ICACHE_FLASH_ATTR zones_valid(const char *zones);
+#endif
+
 private:
 #ifdef MQTT
     const char *mqtt_client_id_prefix = "OpenHR20_";
@@ -61,18 +77,79 @@ constexpr const int8_t REREAD_CYCLES = 2;
 // Don't try setting value every time. Skip a few packets in-between
 constexpr const int8_t RESEND_CYCLES = 2;
 
-// Max. number of timers queued per one packet exchange
-constexpr const int8_t MAX_QUEUE_TIMERS = 8;
-// Max. count of eeprom accesses queued per one client roundtrip
-constexpr const int8_t MAX_QUEUE_EEPROM = 8;
+// Packet size limit (our payload is at most one byte less) each client starts
+// with. 25 is empirical - the clients struggle with longer packets, some more
+// than others, so larger sizes are probed per client (see PacketLimit)
+constexpr const uint8_t SENT_PACKET_LEN = 25;
+// Largest limit probed - [len][addr] + 74 bytes of payload + cmac fill the
+// 80 byte RFM_FRAME_MAX
+constexpr const uint8_t SENT_PACKET_MAX = 75;
+// Packet limit probing step, in bytes
+constexpr const uint8_t PACKET_LIMIT_STEP = 8;
+// Answered exchanges close to the limit before the next step up probe. It
+// doubles with every lost probe, up to PACKET_LIMIT_MAX_BACKOFF times
+constexpr const uint8_t PACKET_LIMIT_PROBE_AFTER = 4;
+constexpr const uint8_t PACKET_LIMIT_MAX_BACKOFF = 4;
+// A client packet coming in this soon (ms) after ours is its response to it.
+// Otherwise it's a status packet of the next wakeup - ours got lost
+constexpr const unsigned long PACKET_REPLY_MS = 300;
+
+// Count of exchanges with a client planned ahead (packets queued per client)
+constexpr const uint8_t PLAN_EXCHANGES = 2;
+// Max. bytes of client responses our commands of one exchange may trigger.
+// Empirical, like SENT_PACKET_LEN - clients struggle with longer responses.
+// Grows along with the client's learned packet limit
+constexpr const uint8_t PLAN_RESPONSE_BUDGET = 24;
+
+// Backlog (in exchanges) that starts a bulk session with a client. The client
+// then gets forced in every sync, not just the :30 one, until it's synced
+constexpr const uint8_t BULK_MIN_EXCHANGES = 4;
+// Failed packets or forced half minutes without contact that end the session
+constexpr const uint8_t BULK_MAX_ERRORS = 3;
+// Max. clients in bulk session at once - forced clients all talk every second
+// and more of them collide more than they gain
+constexpr const uint8_t BULK_MAX_SESSIONS = 4;
+// Syncs a client waits after a failed bulk session before the next one
+constexpr const uint8_t BULK_COOLDOWN_SYNCS = 10;
+
+// Max. count of responses waiting for the radio while another one is sent
+constexpr const uint8_t MAX_PENDING_RESPONSES = 4;
+// Time in ms a client keeps listening for our response after it sent its
+// packet. Responses deferred past this are dropped
+constexpr const unsigned long RESPONSE_WINDOW_MS = 150;
+
+// Count of client changes queued for publishing before they get coarser
+constexpr const uint8_t CHANGE_JOURNAL_LEN = 32;
 
 // Max. count of HR clients
-constexpr const uint8_t MAX_HR_COUNT = 8;
+constexpr const uint8_t MAX_HR_COUNT = 29;
 // Max. address (first invalid address, to be precise)
 constexpr const uint8_t MAX_HR_ADDR  = 30;
 
-// size of eeprom image, cached
+// Count of RFM12B radios. Each drives a network of its own (clients, sync
+// seconds, channel) in parallel with the others. Outside of the radio stack,
+// clients go by the id of net * MAX_HR_ADDR + addr - just the address with
+// one radio. The pins are set in rfm12b.h
+constexpr const uint8_t RFM_RADIO_COUNT = 1;
+// Count of client ids over all the networks
+constexpr const uint8_t MAX_CLIENT_ID = RFM_RADIO_COUNT * MAX_HR_ADDR;
+static_assert(MAX_CLIENT_ID <= 64, "client id bitmaps are 64 bit");
+
+// Count of 8 byte keystream blocks precomputed for every second. Covers
+// pkt_cnt of a typical client packet plus our response
+constexpr const uint8_t KEYSTREAM_BLOCKS = 16;
+
+// Passive timer sync - timers are only re-read from clients when the
+// reported calendar checksum differs from the one of our cached timer table
+constexpr const bool TIMERS_PASSIVE_SYNC = true;
+
+// Min. time in seconds between model snapshot writes to flash
+constexpr const time_t PERSIST_INTERVAL = 60;
+
+// size of client's eeprom image
 constexpr const uint16_t EEPROM_SIZE = 256;
+// count of eeprom cells cached per client (only read/written cells are kept)
+constexpr const uint8_t EEPROM_CACHE_SLOTS = 32;
 
 // Max. count of HR clients (and a max addr)
 #define c2temp(c) (c*2)
@@ -94,6 +171,88 @@ constexpr const bool MQTT_RETAIN = true;
 // Reconnect attempt every N seconds
 constexpr const time_t MQTT_RECONNECT_TIME = 10;
 
+// Outgoing MQTT messages are collected up to this size and sent at once
+constexpr const size_t MQTT_TX_BUFFER_SIZE = 512;
+// A change is published at most N messages per update call - about what fits
+// the TX buffer. The rest goes out in the next ones
+constexpr const uint8_t MQTT_PUBLISH_BATCH = 8;
+
+// Events are exported (MQTT/syslog) in batches this often [s]
+constexpr const time_t EXPORT_INTERVAL = 10;
+// Max. events per batch, keeps the batch within the MQTT buffer
+constexpr const uint8_t EXPORT_BATCH_EVENTS = 12;
+// Each event code (type and code) gets at most EXPORT_CODE_LIMIT events per
+// EXPORT_WINDOW seconds exported. EXPORT_CODE_SLOTS counters track them
+constexpr const time_t EXPORT_WINDOW = 60;
+constexpr const uint8_t EXPORT_CODE_LIMIT = 6;
+constexpr const uint8_t EXPORT_CODE_SLOTS = 64;
+
+// Syslog server port, and max. size of the datagrams sent to it
+constexpr const uint16_t SYSLOG_PORT = 514;
+constexpr const size_t SYSLOG_DATAGRAM_LEN = 512;
+// Max. size of one event line in the datagram
+constexpr const size_t SYSLOG_LINE_LEN = 64;
+
+// Radio activity model (timing.h). Exchange envelopes shrink by DECAY per
+// exchange and get GUARD added around them. Slots never seen use the static
+// idle window of IDLE_FROM - IDLE_TO ms into the second
+constexpr const int TIMING_DECAY_MS = 2;
+constexpr const int TIMING_GUARD_MS = 60;
+constexpr const int TIMING_IDLE_FROM = 500;
+constexpr const int TIMING_IDLE_TO = 900;
+
+// Max. count of change observers of a Protocol (the mqtt journal and the
+// master's relay) and of HR20Master (web live feed and others)
+constexpr const uint8_t MAX_CHANGE_CALLBACKS = 2;
+
+// Max. count of simultaneously connected /live (server-sent events) clients
+constexpr const uint8_t LIVE_MAX_CLIENTS = 2;
+// Keepalive comment interval of /live streams, drops dead connections too
+constexpr const unsigned long LIVE_KEEPALIVE_MS = 15000;
+// Room needed in the tcp send buffer before a /live frame is composed
+constexpr const size_t LIVE_FRAME_MAX = 256;
+
+// Bucket count of the radio latency histograms
+constexpr const uint8_t STATS_BUCKETS = 16;
+// Bucket width (ms) of the sync to client reply histogram (offset in second)
+constexpr const uint16_t STATS_SYNC_BUCKET_MS = 64;
+// Bucket width (ms) of the client reply to our answer histogram
+constexpr const uint16_t STATS_ANSWER_BUCKET_MS = 4;
+
+// Link statistics get published every N seconds
+constexpr const time_t STATS_PUBLISH_INTERVAL = 5 * 60;
+
+// BENCH builds print the cycle counts over serial every N ms
+constexpr const uint32_t BENCH_DUMP_INTERVAL = 60000;
+
+// MEMSTATS builds sample the heap (free, largest block, fragmentation) every N ms
+constexpr const uint32_t MEMSTATS_SAMPLE_MS = 1000;
+
+// CAPTURE builds keep the last N radio frames for download at /capture
+constexpr const uint8_t CAPTURE_SLOTS = 24;
+// Bytes stored of a captured frame - the 80 byte RFM frame and our preamble
+constexpr const uint8_t CAPTURE_FRAME_LEN = 84;
+
+// Max. count of main loop tasks
+constexpr const uint8_t SCHED_MAX_TASKS = 8;
+// Time budget of one main loop pass in us. The TX ring holds ~50 ms of
+// radio data at 9600 bps, so this leaves plenty of headroom
+constexpr const uint32_t SCHED_SLICE_US = 10000;
+// A task late by this many us runs even if it does not fit the budget
+constexpr const uint32_t SCHED_STARVE_US = 1000000;
+
+// I2C address of the SSD1306 panel (HR20_DISPLAY builds)
+constexpr const uint8_t DISPLAY_I2C_ADDR = 0x3c;
+// The display text gets recomposed from the model every N ms
+constexpr const uint32_t DISPLAY_COMPOSE_MS = 1000;
+// Changed character cells sent to the panel in one go. 8 cells are 48 bytes,
+// about 1.2 ms of I2C traffic at 400 kHz
+constexpr const uint8_t DISPLAY_CHUNK_CELLS = 8;
+// With more valves than fit the panel, pages rotate every N seconds
+constexpr const time_t DISPLAY_PAGE_SECS = 5;
+// Valves not heard of for N seconds are shown as stale
+constexpr const time_t DISPLAY_STALE_SECS = 10 * 60;
+
 // Length of a log ring buffer (last N events)
 constexpr const uint16_t EVENT_LOG_LEN = 64;
 
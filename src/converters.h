@@ -29,47 +29,52 @@ namespace cvt {
 // should be enough for all the values we use here (long int is ~20 chars)
 using ValueBuffer = BufferHolder<32>;
 
+/** Converters expose two ways of conversion. to_str(StrMaker &, value)
+ * appends the value right where it goes (a json document, a topic value).
+ * to_str(Buffer, value) composes it into the given buffer, returning the
+ * string - that's for the APIs wanting the value alone.
+ */
+
 // Simple integer converter
 struct Simple {
-    ICACHE_FLASH_ATTR static Str to_str(Buffer buf, uint8_t val) {
-        StrMaker sm{buf};
-        sm += val;
-        return sm.str();
+    ICACHE_FLASH_ATTR static void to_str(StrMaker &sm, uint8_t val) {
+        sm.append_uint(val);
     }
 
-    ICACHE_FLASH_ATTR static Str to_str(Buffer buf, bool val) {
-        const char * rvbuf = val ? "true" : "false";
-        // construct an immutable string directly from flash mem.
-        return {rvbuf, strlen(rvbuf)};
+    ICACHE_FLASH_ATTR static void to_str(StrMaker &sm, bool val) {
+        sm += val ? "true" : "false";
     }
 
-    ICACHE_FLASH_ATTR static Str to_str(Buffer buf, uint16_t val) {
-        StrMaker sm{buf};
-        sm += val;
-        return sm.str();
+    ICACHE_FLASH_ATTR static void to_str(StrMaker &sm, uint16_t val) {
+        sm.append_uint(val);
     }
 
-    ICACHE_FLASH_ATTR static Str to_str(Buffer buf, int val) {
-        StrMaker sm{buf};
+    ICACHE_FLASH_ATTR static void to_str(StrMaker &sm, int val) {
         sm += val;
-        return sm.str();
     }
 
-    ICACHE_FLASH_ATTR static Str to_str(Buffer buf, unsigned val) {
-        StrMaker sm{buf};
-        sm += (int)val;
-        return sm.str();
+    ICACHE_FLASH_ATTR static void to_str(StrMaker &sm, unsigned val) {
+        sm.append_uint(val);
     }
 
-    ICACHE_FLASH_ATTR static Str to_str(Buffer buf, time_t val) {
-        StrMaker sm{buf};
-        sm += (int)val;
-        return sm.str();
+    ICACHE_FLASH_ATTR static void to_str(StrMaker &sm, time_t val) {
+        sm += (long)val;
+    }
+
+    ICACHE_FLASH_ATTR static void to_str(StrMaker &sm, const EEPROMReq &val) {
+        sm.append_uint(val.value);
     }
 
-    ICACHE_FLASH_ATTR static Str to_str(Buffer buf, const EEPROMReq &val) {
+    ICACHE_FLASH_ATTR static Str to_str(Buffer buf, bool val) {
+        const char * rvbuf = val ? "true" : "false";
+        // construct an immutable string directly from flash mem.
+        return {rvbuf, strlen(rvbuf)};
+    }
+
+    template<typename T>
+    ICACHE_FLASH_ATTR static Str to_str(Buffer buf, const T &val) {
         StrMaker sm{buf};
-        sm += (int)val.value;
+        to_str(sm, val);
         return sm.str();
     }
 
@@ -113,9 +118,13 @@ struct Simple {
  *  Format: [X].H - H being 0 or 5, X between 5 and 30
  */
 struct TempHalfC {
+    ICACHE_FLASH_ATTR static void to_str(StrMaker &sm, uint8_t temp) {
+        sm.append_fixed(temp * 5, 1);
+    }
+
     ICACHE_FLASH_ATTR static Str to_str(Buffer buf, uint8_t temp) {
         StrMaker sm{buf};
-        sm.append(float(temp) / 2, 1);
+        to_str(sm, temp);
         return sm.str();
     }
 
@@ -133,9 +142,13 @@ struct TempHalfC {
  *  Format: X.XX
  */
 struct Temp001C {
+    ICACHE_FLASH_ATTR static void to_str(StrMaker &sm, uint16_t temp) {
+        sm.append_fixed(temp, 2);
+    }
+
     ICACHE_FLASH_ATTR static Str to_str(Buffer buf, uint16_t temp) {
         StrMaker sm{buf};
-        sm.append(float(temp) / 100, 2);
+        to_str(sm, temp);
         return sm.str();
     }
 };
@@ -144,9 +157,13 @@ struct Temp001C {
  *  Format: X.XXX
  */
 struct Voltage0001V {
+    ICACHE_FLASH_ATTR static void to_str(StrMaker &sm, uint16_t volt) {
+        sm.append_fixed(volt, 3);
+    }
+
     ICACHE_FLASH_ATTR static Str to_str(Buffer buf, uint16_t volt) {
         StrMaker sm{buf};
-        sm.append(float(volt) / 1000, 3);
+        to_str(sm, volt);
         return sm.str();
     }
 };
@@ -154,17 +171,15 @@ struct Voltage0001V {
 /** converts to/from string in HH:MM format
  */
 struct TimeHHMM {
-    ICACHE_FLASH_ATTR static Str to_str(Buffer buf, uint16_t time) {
-        StrMaker sm{buf};
-
-        sm += time / 60;
+    ICACHE_FLASH_ATTR static void to_str(StrMaker &sm, uint16_t time) {
+        sm.append_uint(time / 60);
         sm += ':';
-        uint8_t min = time % 60;
-
-        if (min < 10)
-            sm += '0';
+        sm.append_2digits(time % 60);
+    }
 
-        sm += min;
+    ICACHE_FLASH_ATTR static Str to_str(Buffer buf, uint16_t time) {
+        StrMaker sm{buf};
+        to_str(sm, time);
         return sm.str();
     }
 
@@ -92,23 +92,55 @@ bool ICACHE_FLASH_ATTR Crypto::update(time_t now) {
         rtc.ss = second(now);
         rtc.DOW = (dayOfWeek(now) + 5) % 7 + 1; // dayOfWeek has sunday=1, we need monday=1
         rtc.pkt_cnt = 0;
+        // the keystream is only valid for the second it was computed in
+        ks_ready = 0;
         return true;
     }
 
     return false;
 }
 
-void ICACHE_FLASH_ATTR Crypto::encrypt_decrypt(uint8_t *data, unsigned size) {
+void ICACHE_FLASH_ATTR Crypto::prefetch() {
+    if (ks_ready >= KEYSTREAM_BLOCKS) return;
+
+    XTEA xenc(Kenc);
+    RTC block = rtc;
+
+    for (; ks_ready < KEYSTREAM_BLOCKS; ++ks_ready) {
+        block.pkt_cnt = ks_ready;
+        xenc.encrypt(reinterpret_cast<uint8_t*>(&block), keystream[ks_ready]);
+    }
+}
+
+const uint8_t * ICACHE_FLASH_ATTR Crypto::keystream_block(uint8_t pkt_cnt,
+                                                          uint8_t *buf)
+{
+    if (pkt_cnt < ks_ready) return keystream[pkt_cnt];
+
     XTEA xenc(Kenc);
+    RTC block = rtc;
+    block.pkt_cnt = pkt_cnt;
+
+    // next block in line? store it, it's computed anyway
+    if (pkt_cnt == ks_ready && ks_ready < KEYSTREAM_BLOCKS) {
+        xenc.encrypt(reinterpret_cast<uint8_t*>(&block), keystream[ks_ready]);
+        return keystream[ks_ready++];
+    }
 
+    xenc.encrypt(reinterpret_cast<uint8_t*>(&block), buf);
+    return buf;
+}
+
+void ICACHE_FLASH_ATTR Crypto::encrypt_decrypt(uint8_t *data, unsigned size) {
+    BENCH_SCOPE(encrypt_decrypt);
     uint8_t i = 0;
     uint8_t buf[8];
 
     while(i < size) {
-        xenc.encrypt(reinterpret_cast<uint8_t*>(&rtc), buf);
+        const uint8_t *ks = keystream_block(rtc.pkt_cnt, buf);
         rtc.pkt_cnt++;
         do {
-            data[i] ^= buf[i&7];
+            data[i] ^= ks[i&7];
             i++;
             if (i >= size) return; //done
         } while ((i & 7) != 0);
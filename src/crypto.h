@@ -22,6 +22,8 @@
 #include <cstdint>
 #include <Time.h>
 
+#include "bench.h"
+#include "config.h"
 #include "queue.h"
 
 namespace hr20 {
@@ -43,6 +45,7 @@ struct XTEA {
     void encrypt(const uint8_t *src,
                  uint8_t *dst)
     {
+        BENCH_SCOPE(xtea);
         const uint32_t* s = reinterpret_cast<const uint32_t*>(src);
         uint32_t sum = 0;
         uint32_t* d = reinterpret_cast<uint32_t*>(dst);
@@ -125,6 +128,7 @@ struct CMAC {
     }
 
     uint8_t *finish() {
+        BENCH_SCOPE(cmac_finish);
         // any excess data that didn't get processed?
         const uint8_t *kx = ((pos == 8) ? k1 : k2);
 
@@ -191,6 +195,12 @@ struct Crypto {
     time_t lastTime;
     RTC rtc;
 
+    // keystream cache - Kenc encrypted rtc for first KEYSTREAM_BLOCKS values
+    // of pkt_cnt in the current second. Invalidated on every rollover,
+    // refilled by prefetch()
+    uint8_t keystream[KEYSTREAM_BLOCKS][XTEA::XTEA_BLOCK_SIZE];
+    uint8_t ks_ready = 0; // count of valid blocks in keystream
+
     // constructor. begin() has to be called before this class is usable!
     Crypto(ntptime::NTPTime &time);
 
@@ -200,13 +210,27 @@ struct Crypto {
     // updates the rtc if needed. Returns true if second passed
     bool update(time_t now);
 
+    // precomputes the keystream blocks for the current second. Call in idle
+    // time, so the packet encryption turns into simple XOR
+    void prefetch();
+
+    // returns keystream block for given pkt_cnt. Served from cache if
+    // possible, otherwise computed into buf
+    const uint8_t *keystream_block(uint8_t pkt_cnt, uint8_t *buf);
+
     // packet payload encrypt/decrypt function
     void encrypt_decrypt(uint8_t *data, unsigned size);
 
+    // verifies the cmac of the packet. cnt_offset is added to the pkt_cnt
+    // for the cmac prefix (not applicable for sync)
     bool ICACHE_FLASH_ATTR cmac_verify(const uint8_t *data, size_t size,
-                                       bool isSync)
+                                       bool isSync, uint8_t cnt_offset = 0)
     {
-        CMAC cmac(K1, K2, Kmac, isSync ? nullptr : rtc_bytes());
+        RTC prefix = rtc;
+        prefix.pkt_cnt += cnt_offset;
+
+        CMAC cmac(K1, K2, Kmac,
+                  isSync ? nullptr : reinterpret_cast<const uint8_t *>(&prefix));
 
         cmac.append(data, size);
         const uint8_t *buf = cmac.finish();
@@ -254,5 +278,101 @@ struct Crypto {
     }
 };
 
+/** Incremental receive path. Authenticates and decrypts the packet bytes
+ * one by one as they are popped from the radio, so the verification result
+ * is ready as soon as the last MAC byte lands.
+ *
+ * Packet layout: [len][addr][payload...][cmac x 4]. cmac is computed over
+ * all bytes but len, payload is encrypted for non-sync packets.
+ */
+struct RxStream {
+    RxStream(Crypto &crypto)
+        : crypto(crypto), cmac(crypto.K1, crypto.K2, crypto.Kmac)
+    {}
+
+    // starts a new packet with the given length byte (which is not fed)
+    void ICACHE_FLASH_ATTR begin(uint8_t lenbyte) {
+        length  = lenbyte & 0x7F;
+        sync    = (lenbyte & 0x80) != 0;
+        pos     = 1;
+        mac     = nullptr;
+        mac_ok  = length > CMAC::CMAC_SIZE + 1;
+        mac_pos = mac_ok ? length - CMAC::CMAC_SIZE : length;
+        base    = crypto.rtc.pkt_cnt;
+
+        if (sync) {
+            cmac = CMAC(crypto.K1, crypto.K2, crypto.Kmac);
+        } else {
+            // pkt_cnt was increased by sender's encrypt_decrypt before it
+            // computed the cmac
+            RTC prefix = crypto.rtc;
+            prefix.pkt_cnt += (length + 1) / 8;
+            cmac = CMAC(crypto.K1, crypto.K2, crypto.Kmac,
+                        reinterpret_cast<const uint8_t *>(&prefix));
+        }
+    }
+
+    // feeds next byte of the packet. returns the byte to be stored -
+    // decrypted if it is a part of the encrypted payload
+    uint8_t ICACHE_FLASH_ATTR feed(uint8_t b) {
+        if (pos >= length) return b;
+
+        uint8_t i = pos++;
+
+        if (i < mac_pos) {
+            // cmac goes over the encrypted data
+            cmac.append(&b, 1);
+
+            // payload starts after the address
+            if (!sync && i >= 2) {
+                uint8_t j = i - 2;
+                if ((j & 7) == 0) ks = crypto.keystream_block(base + (j >> 3),
+                                                              ks_buf);
+                b ^= ks[j & 7];
+            }
+
+            return b;
+        }
+
+        // first mac byte closes the cmac
+        if (!mac) mac = cmac.finish();
+
+        if (mac[i - mac_pos] != b) mac_ok = false;
+
+        return b;
+    }
+
+    // true after all the bytes of the packet were fed
+    bool done() const { return pos >= length; }
+
+    bool verified() const { return done() && mac_ok; }
+
+    // count of blocks the payload was encrypted with
+    uint8_t blocks() const {
+        return (mac_pos > 2) ? (mac_pos - 2 + 7) / 8 : 0;
+    }
+
+    // advances the rtc packet counter after a verified non-sync packet
+    // was accepted, the way the sender did with its copy
+    void ICACHE_FLASH_ATTR commit() {
+        if (sync) return;
+        crypto.rtc.pkt_cnt = base + blocks() + 1;
+    }
+
+protected:
+    Crypto &crypto;
+    CMAC cmac;
+    const uint8_t *mac = nullptr; // finished cmac, set at first mac byte
+    const uint8_t *ks  = nullptr; // current keystream block
+    uint8_t ks_buf[XTEA::XTEA_BLOCK_SIZE];
+
+    uint8_t length  = 0; // whole packet length, including length byte
+    uint8_t pos     = 0; // index of the next fed byte
+    uint8_t mac_pos = 0; // index of the first mac byte
+    uint8_t base    = 0; // pkt_cnt at the start of the packet
+    bool sync       = false;
+    bool mac_ok     = false;
+};
+
 } // namespace crypto
 } // namespace hr20
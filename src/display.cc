@@ -0,0 +1,288 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+#ifdef HR20_DISPLAY
+
+#include "display.h"
+#include "master.h"
+#include "str.h"
+
+namespace hr20 {
+
+// SSD1306 control bytes and addressing commands
+static constexpr const uint8_t SSD_CMD_STREAM  = 0x00;
+static constexpr const uint8_t SSD_DATA_STREAM = 0x40;
+static constexpr const uint8_t SSD_COLUMN_ADDR = 0x21;
+static constexpr const uint8_t SSD_PAGE_ADDR   = 0x22;
+
+// cells equal to what's shown that a run may still bridge - cheaper than
+// starting another transfer
+static constexpr const uint8_t RUN_GAP = 2;
+
+// 5x7 glyphs of ASCII 0x20-0x7E, column by column, LSB on top
+static const uint8_t FONT_5X7[][5] PROGMEM = {
+    {0x00,0x00,0x00,0x00,0x00}, {0x00,0x00,0x5F,0x00,0x00}, // ' ' !
+    {0x00,0x07,0x00,0x07,0x00}, {0x14,0x7F,0x14,0x7F,0x14}, // " #
+    {0x24,0x2A,0x7F,0x2A,0x12}, {0x23,0x13,0x08,0x64,0x62}, // $ %
+    {0x36,0x49,0x55,0x22,0x50}, {0x00,0x05,0x03,0x00,0x00}, // & '
+    {0x00,0x1C,0x22,0x41,0x00}, {0x00,0x41,0x22,0x1C,0x00}, // ( )
+    {0x14,0x08,0x3E,0x08,0x14}, {0x08,0x08,0x3E,0x08,0x08}, // * +
+    {0x00,0x50,0x30,0x00,0x00}, {0x08,0x08,0x08,0x08,0x08}, // , -
+    {0x00,0x60,0x60,0x00,0x00}, {0x20,0x10,0x08,0x04,0x02}, // . /
+    {0x3E,0x51,0x49,0x45,0x3E}, {0x00,0x42,0x7F,0x40,0x00}, // 0 1
+    {0x42,0x61,0x51,0x49,0x46}, {0x21,0x41,0x45,0x4B,0x31}, // 2 3
+    {0x18,0x14,0x12,0x7F,0x10}, {0x27,0x45,0x45,0x45,0x39}, // 4 5
+    {0x3C,0x4A,0x49,0x49,0x30}, {0x01,0x71,0x09,0x05,0x03}, // 6 7
+    {0x36,0x49,0x49,0x49,0x36}, {0x06,0x49,0x49,0x29,0x1E}, // 8 9
+    {0x00,0x36,0x36,0x00,0x00}, {0x00,0x56,0x36,0x00,0x00}, // : ;
+    {0x08,0x14,0x22,0x41,0x00}, {0x14,0x14,0x14,0x14,0x14}, // < =
+    {0x00,0x41,0x22,0x14,0x08}, {0x02,0x01,0x51,0x09,0x06}, // > ?
+    {0x32,0x49,0x79,0x41,0x3E}, {0x7E,0x11,0x11,0x11,0x7E}, // @ A
+    {0x7F,0x49,0x49,0x49,0x36}, {0x3E,0x41,0x41,0x41,0x22}, // B C
+    {0x7F,0x41,0x41,0x22,0x1C}, {0x7F,0x49,0x49,0x49,0x41}, // D E
+    {0x7F,0x09,0x09,0x09,0x01}, {0x3E,0x41,0x49,0x49,0x7A}, // F G
+    {0x7F,0x08,0x08,0x08,0x7F}, {0x00,0x41,0x7F,0x41,0x00}, // H I
+    {0x20,0x40,0x41,0x3F,0x01}, {0x7F,0x08,0x14,0x22,0x41}, // J K
+    {0x7F,0x40,0x40,0x40,0x40}, {0x7F,0x02,0x0C,0x02,0x7F}, // L M
+    {0x7F,0x04,0x08,0x10,0x7F}, {0x3E,0x41,0x41,0x41,0x3E}, // N O
+    {0x7F,0x09,0x09,0x09,0x06}, {0x3E,0x41,0x51,0x21,0x5E}, // P Q
+    {0x7F,0x09,0x19,0x29,0x46}, {0x46,0x49,0x49,0x49,0x31}, // R S
+    {0x01,0x01,0x7F,0x01,0x01}, {0x3F,0x40,0x40,0x40,0x3F}, // T U
+    {0x1F,0x20,0x40,0x20,0x1F}, {0x3F,0x40,0x38,0x40,0x3F}, // V W
+    {0x63,0x14,0x08,0x14,0x63}, {0x07,0x08,0x70,0x08,0x07}, // X Y
+    {0x61,0x51,0x49,0x45,0x43}, {0x00,0x7F,0x41,0x41,0x00}, // Z [
+    {0x02,0x04,0x08,0x10,0x20}, {0x00,0x41,0x41,0x7F,0x00}, // \ ]
+    {0x04,0x02,0x01,0x02,0x04}, {0x40,0x40,0x40,0x40,0x40}, // ^ _
+    {0x00,0x01,0x02,0x04,0x00}, {0x20,0x54,0x54,0x54,0x78}, // ` a
+    {0x7F,0x48,0x44,0x44,0x38}, {0x38,0x44,0x44,0x44,0x20}, // b c
+    {0x38,0x44,0x44,0x48,0x7F}, {0x38,0x54,0x54,0x54,0x18}, // d e
+    {0x08,0x7E,0x09,0x01,0x02}, {0x0C,0x52,0x52,0x52,0x3E}, // f g
+    {0x7F,0x08,0x04,0x04,0x78}, {0x00,0x44,0x7D,0x40,0x00}, // h i
+    {0x20,0x40,0x44,0x3D,0x00}, {0x7F,0x10,0x28,0x44,0x00}, // j k
+    {0x00,0x41,0x7F,0x40,0x00}, {0x7C,0x04,0x18,0x04,0x78}, // l m
+    {0x7C,0x08,0x04,0x04,0x78}, {0x38,0x44,0x44,0x44,0x38}, // n o
+    {0x7C,0x14,0x14,0x14,0x08}, {0x08,0x14,0x14,0x18,0x7C}, // p q
+    {0x7C,0x08,0x04,0x04,0x08}, {0x48,0x54,0x54,0x54,0x20}, // r s
+    {0x04,0x3F,0x44,0x40,0x20}, {0x3C,0x40,0x40,0x20,0x7C}, // t u
+    {0x1C,0x20,0x40,0x20,0x1C}, {0x3C,0x40,0x30,0x40,0x3C}, // v w
+    {0x44,0x28,0x10,0x28,0x44}, {0x0C,0x50,0x50,0x50,0x3C}, // x y
+    {0x44,0x64,0x54,0x4C,0x44}, {0x00,0x08,0x36,0x41,0x00}, // z {
+    {0x00,0x00,0x7F,0x00,0x00}, {0x00,0x41,0x36,0x08,0x00}, // | }
+    {0x02,0x01,0x02,0x04,0x02}                              // ~
+};
+
+static constexpr const char FONT_FIRST = ' ';
+static constexpr const char FONT_LAST  = '~';
+
+static_assert(sizeof(FONT_5X7) / sizeof(FONT_5X7[0]) ==
+                  FONT_LAST - FONT_FIRST + 1,
+              "display font has to cover printable ASCII");
+
+// writes the text composed in sm into the row, right aligned to column end
+static ICACHE_FLASH_ATTR void put_right(char *row, uint8_t end, StrMaker &sm) {
+    unsigned len = sm.size();
+    if (len > end) len = end;
+    memcpy(row + end - len, sm.data() + sm.size() - len, len);
+}
+
+void ICACHE_FLASH_ATTR Display::begin() {
+    display.init();
+    // the only full frame ever sent - the panel RAM is random after power up
+    display.clear();
+    display.display();
+
+    memset(shown, ' ', sizeof(shown));
+    memset(wanted, ' ', sizeof(wanted));
+}
+
+void ICACHE_FLASH_ATTR Display::update() {
+    uint32_t ms = millis();
+    if (!composed || ms - composed_ms >= DISPLAY_COMPOSE_MS) {
+        composed    = true;
+        composed_ms = ms;
+        compose();
+        return;
+    }
+
+    push();
+}
+
+void ICACHE_FLASH_ATTR Display::compose() {
+    memset(wanted, ' ', sizeof(wanted));
+
+    bool synced_time = time.isSynced();
+    time_t now   = synced_time ? time.unixTime() : 0;
+    time_t local = synced_time ? time.localTime() : 0;
+
+    // ids of the known clients, in order
+    uint8_t ids[MAX_CLIENT_ID];
+    uint8_t known = 0, synced = 0;
+    for (uint8_t id = 0; id < MAX_CLIENT_ID; ++id) {
+        HR20 *hr = master.client(id);
+        if (!hr) continue;
+        ids[known++] = id;
+        if (hr->synced) ++synced;
+    }
+
+    constexpr const uint8_t PER_PAGE = ROWS - 1;
+    uint8_t pages = known ? (known + PER_PAGE - 1) / PER_PAGE : 1;
+    uint8_t page  = (millis() / 1000 / DISPLAY_PAGE_SECS) % pages;
+
+    BufferHolder<COLS + 1> buf;
+    char *hdr = wanted[0];
+
+    if (synced_time) {
+        StrMaker sm{buf};
+        sm.append_2digits((local / 3600) % 24);
+        sm += ':';
+        sm.append_2digits((local / 60) % 60);
+        put_right(hdr, 5, sm);
+    } else {
+        memcpy(hdr, "--:--", 5);
+    }
+
+    {
+        StrMaker sm{buf};
+        sm += (unsigned)synced;
+        sm += '/';
+        sm += (unsigned)known;
+        put_right(hdr, 12, sm);
+    }
+
+    if (pages > 1) {
+        StrMaker sm{buf};
+        sm += (unsigned)(page + 1);
+        sm += '/';
+        sm += (unsigned)pages;
+        put_right(hdr, COLS, sm);
+    }
+
+    for (uint8_t r = 1; r < ROWS; ++r) {
+        uint8_t i = page * PER_PAGE + r - 1;
+        if (i >= known) break;
+        compose_client(wanted[r], ids[i], *master.client(ids[i]), now);
+    }
+}
+
+// "03 21.1 22.0 3.01 *" - id, temp, setpoint, battery, state
+void ICACHE_FLASH_ATTR Display::compose_client(char *row, uint8_t id,
+                                               const HR20 &hr, time_t now)
+{
+    BufferHolder<COLS + 1> buf;
+
+    {
+        StrMaker sm{buf};
+        sm.append_2digits(id % 100);
+        put_right(row, 2, sm);
+    }
+
+    if (hr.temp_avg.remote_valid()) {
+        StrMaker sm{buf};
+        sm.append_fixed((hr.temp_avg.get_remote() + 5) / 10, 1);
+        put_right(row, 7, sm);
+    } else {
+        memcpy(row + 5, "--", 2);
+    }
+
+    if (hr.temp_wanted.remote_valid()) {
+        StrMaker sm{buf};
+        hr.temp_wanted.to_str(sm);
+        put_right(row, 12, sm);
+    } else {
+        memcpy(row + 10, "--", 2);
+    }
+
+    if (hr.bat_avg.remote_valid()) {
+        StrMaker sm{buf};
+        sm.append_fixed((hr.bat_avg.get_remote() + 5) / 10, 2);
+        put_right(row, 17, sm);
+    } else {
+        memcpy(row + 15, "--", 2);
+    }
+
+    char state;
+    if (!hr.last_contact)
+        state = '?';
+    else if (now && hr.last_contact + DISPLAY_STALE_SECS < now)
+        state = '!';
+    else if (hr.in_bulk())
+        state = 'B';
+    else if (hr.synced)
+        state = '*';
+    else
+        state = '~';
+    row[COLS - 2] = state;
+}
+
+bool ICACHE_FLASH_ATTR Display::push() {
+    for (uint8_t row = 0; row < ROWS; ++row) {
+        const char *w = wanted[row];
+        const char *s = shown[row];
+
+        uint8_t first = 0;
+        while (first < COLS && w[first] == s[first]) ++first;
+        if (first == COLS) continue;
+
+        // extend the run over changed cells and short gaps of equal ones
+        uint8_t last = first;
+        for (uint8_t c = first + 1;
+             c < COLS && c < first + DISPLAY_CHUNK_CELLS; ++c)
+        {
+            if (w[c] != s[c])
+                last = c;
+            else if (c - last > RUN_GAP)
+                break;
+        }
+
+        send(row, first, last + 1);
+        return true;
+    }
+
+    return false;
+}
+
+void ICACHE_FLASH_ATTR Display::send(uint8_t row, uint8_t first, uint8_t end) {
+    Wire.beginTransmission(DISPLAY_I2C_ADDR);
+    Wire.write(SSD_CMD_STREAM);
+    Wire.write(SSD_COLUMN_ADDR);
+    Wire.write(first * CELL_W);
+    Wire.write(end * CELL_W - 1);
+    Wire.write(SSD_PAGE_ADDR);
+    Wire.write(row);
+    Wire.write(row);
+    Wire.endTransmission();
+
+    Wire.beginTransmission(DISPLAY_I2C_ADDR);
+    Wire.write(SSD_DATA_STREAM);
+    for (uint8_t c = first; c < end; ++c) {
+        char ch = wanted[row][c];
+        shown[row][c] = ch;
+        if (ch < FONT_FIRST || ch > FONT_LAST) ch = '?';
+
+        const uint8_t *glyph = FONT_5X7[ch - FONT_FIRST];
+        for (uint8_t x = 0; x < CELL_W - 1; ++x)
+            Wire.write(pgm_read_byte(glyph + x));
+        Wire.write(0); // spacing column
+    }
+    Wire.endTransmission();
+}
+
+} // namespace hr20
+
+#endif
@@ -22,33 +22,58 @@
 #include <Wire.h>
 #include <SSD1306Wire.h>
 
+#include "config.h"
+#include "ntptime.h"
+
 namespace hr20 {
 
 // FWD
 struct HR20Master;
+struct HR20;
 
+/** Text mode SSD1306 renderer. The screen is a grid of 6x8 pixel character
+ * cells, one panel page per text row. update() composes the text wanted from
+ * the model and sends only the cells that differ from what the panel shows,
+ * a short run at a time, so a single call never holds the loop for long.
+ *
+ * Row 0 is a header (time, synced/known valves, page), the rest lists the
+ * valves - id, temperature, setpoint, battery and sync state:
+ * '*' synced, '~' syncing, 'B' bulk transfer, '!' stale, '?' nothing read yet
+ */
 struct Display {
-    Display(const HR20Master &master)
+    static constexpr const uint8_t CELL_W = 6;
+    static constexpr const uint8_t COLS   = 128 / CELL_W;
+    static constexpr const uint8_t ROWS   = 8;
+
+    Display(HR20Master &master, ntptime::NTPTime &time)
         : master(master)
-        , display(0x3c, /*SDA*/D2, /*SCL*/D1)
+        , time(time)
+        , display(DISPLAY_I2C_ADDR, /*SDA*/D2, /*SCL*/D1)
     {}
 
-    void begin() {
-        display.init();
-        display.setFont(ArialMT_Plain_10);
-    }
-
+    void begin();
 
-    void update() {
-        display.setTextAlignment(TEXT_ALIGN_LEFT);
-        display.setFont(ArialMT_Plain_10);
-        display.drawString(0, 0, "HR20 Master");
-    }
+    /// recomposes the text every DISPLAY_COMPOSE_MS, otherwise sends one
+    /// chunk of changed cells
+    void update();
 
 protected:
-    const HR20Master &master;
+    void compose();
+    void compose_client(char *row, uint8_t id, const HR20 &hr, time_t now);
+    // sends one run of changed cells. false if the panel is up to date
+    bool push();
+    void send(uint8_t row, uint8_t first, uint8_t end);
+
+    HR20Master &master;
+    ntptime::NTPTime &time;
     SSD1306Wire display;
+    uint32_t composed_ms = 0; // millis() of the last compose
+    bool composed = false;
+    char wanted[ROWS][COLS]; // text we want on the panel
+    char shown[ROWS][COLS];  // text the panel shows
 };
 
+static_assert(DISPLAY_CHUNK_CELLS * Display::CELL_W < 128,
+              "display chunk has to fit the Wire buffer");
 
 } // namespace hr20
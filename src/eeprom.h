@@ -0,0 +1,139 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+#pragma once
+
+#include <new>
+
+#include "config.h"
+#include "error.h"
+#include "value.h"
+
+namespace hr20 {
+
+/** Sparse cache of the client's EEPROM.
+ *
+ * Only the cells that were requested to be read or written, or were loaded
+ * from the client, occupy one of the EEPROM_CACHE_SLOTS slots. A bitset per
+ * address tells which cells are tracked, a bitmap of used slots makes it
+ * possible to visit only the tracked cells.
+ */
+struct EepromCache {
+    using Cell = SyncedValue<uint8_t>;
+
+    static_assert(EEPROM_CACHE_SLOTS <= 32, "slot bitmap is 32 bits wide");
+
+    // tracked cell of the address, nullptr if it is not in the cache
+    Cell * ICACHE_FLASH_ATTR find(uint8_t addr) {
+        int8_t s = slot_of(addr);
+        return s < 0 ? nullptr : &cells[s];
+    }
+
+    const Cell * ICACHE_FLASH_ATTR find(uint8_t addr) const {
+        int8_t s = slot_of(addr);
+        return s < 0 ? nullptr : &cells[s];
+    }
+
+    // cell for the address, allocated if needed. New cells start masked
+    // (not to be read). Returns nullptr if the cache is full
+    Cell * ICACHE_FLASH_ATTR get(uint8_t addr) {
+        int8_t s = slot_of(addr);
+        if (s >= 0) return &cells[s];
+
+        s = free_slot();
+        if (s < 0) {
+            ERR_ARG(PROTO_EEPROM_CACHE_FULL, addr);
+            return nullptr;
+        }
+
+        new (&cells[s]) Cell();
+        cells[s].masked() = true;
+        addrs[s] = addr;
+        used    |= 1ul << s;
+        present[addr >> 5] |= 1ul << (addr & 31);
+
+        return &cells[s];
+    }
+
+    // calls f(addr, cell) for every tracked cell
+    template<typename F>
+    void ICACHE_FLASH_ATTR for_each(F f) {
+        for (uint32_t m = used; m; m &= m - 1) {
+            uint8_t s = __builtin_ctz(m);
+            f(addrs[s], cells[s]);
+        }
+    }
+
+    template<typename F>
+    void ICACHE_FLASH_ATTR for_each(F f) const {
+        for (uint32_t m = used; m; m &= m - 1) {
+            uint8_t s = __builtin_ctz(m);
+            f(addrs[s], cells[s]);
+        }
+    }
+
+    // slot level access for incremental walks (see MQTTPublisher)
+    bool ICACHE_FLASH_ATTR slot_used(uint8_t s) const {
+        return s < EEPROM_CACHE_SLOTS && (used & (1ul << s));
+    }
+
+    uint8_t ICACHE_FLASH_ATTR slot_addr(uint8_t s) const { return addrs[s]; }
+    uint8_t ICACHE_FLASH_ATTR slot_index(const Cell *c) const { return c - cells; }
+    Cell & ICACHE_FLASH_ATTR slot_cell(uint8_t s) { return cells[s]; }
+
+protected:
+    int8_t ICACHE_FLASH_ATTR slot_of(uint8_t addr) const {
+        if (!(present[addr >> 5] & (1ul << (addr & 31)))) return -1;
+
+        for (uint32_t m = used; m; m &= m - 1) {
+            uint8_t s = __builtin_ctz(m);
+            if (addrs[s] == addr) return s;
+        }
+
+        return -1;
+    }
+
+    // a free slot, or one of a cell that holds nothing we'd miss - nothing
+    // pending and the value, if any, already published
+    int8_t ICACHE_FLASH_ATTR free_slot() {
+        uint32_t free = ~used & ((1ull << EEPROM_CACHE_SLOTS) - 1);
+        if (free) return __builtin_ctz(free);
+
+        for (uint32_t m = used; m; m &= m - 1) {
+            uint8_t s = __builtin_ctz(m);
+            Cell &c = cells[s];
+
+            if (c.is_requested_set()) continue;
+            if (c.remote_valid() ? !c.published() : !c.masked()) continue;
+
+            uint8_t a = addrs[s];
+            present[a >> 5] &= ~(1ul << (a & 31));
+            used &= ~(1ul << s);
+            return s;
+        }
+
+        return -1;
+    }
+
+    Cell    cells[EEPROM_CACHE_SLOTS];
+    uint8_t addrs[EEPROM_CACHE_SLOTS];
+    uint32_t used = 0; // bitmap of used slots
+    uint32_t present[EEPROM_SIZE / 32] = {}; // bitset of tracked addresses
+};
+
+} // namespace hr20
@@ -29,6 +29,7 @@ ICACHE_FLASH_ATTR const char * err_to_str(ErrorCode err) {
     switch (err) {
         HANDLE(QUEUE_FULL);
         HANDLE(QUEUE_PREPARE_WHILE_SEND);
+        HANDLE(QUEUE_RESPONSE_EXPIRED);
 
         HANDLE(WIFI_CANNOT_CONNECT);
 
@@ -45,6 +46,7 @@ ICACHE_FLASH_ATTR const char * err_to_str(ErrorCode err) {
         HANDLE(PROTO_PACKET_TOO_LONG);
         HANDLE(PROTO_EMPTY_PACKET);
         HANDLE(PROTO_TOO_MANY_CLIENTS);
+        HANDLE(PROTO_EEPROM_CACHE_FULL);
 
         HANDLE(RFM_ALREADY_INITIALIZED);
         HANDLE(RFM_TX_UNDERRUN);
@@ -64,9 +66,15 @@ ICACHE_FLASH_ATTR const char * err_to_str(ErrorCode err) {
         HANDLE(MQTT_CALLBACK_BAD_ADDR);
         HANDLE(MQTT_CANT_PUBLISH);
         HANDLE(MQTT_INVALID_TOPIC_VALUE);
+        HANDLE(MQTT_INVALID_TIMER_TABLE);
+        HANDLE(MQTT_INVALID_ZONE);
 
         HANDLE(NTP_CANNOT_SYNC);
 
+        HANDLE(PERSIST_CANNOT_OPEN);
+        HANDLE(PERSIST_BAD_FORMAT);
+        HANDLE(PERSIST_CANNOT_WRITE);
+
     default:
         return "INVALID_ERROR_CODE";
     }
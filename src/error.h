@@ -32,6 +32,8 @@ enum ErrorCode {
     QUEUE_FULL = 1,
     // Can't prepare packet to be sent while another is being sent already
     QUEUE_PREPARE_WHILE_SEND,
+    // Deferred response missed the client's receive window, arg is addr
+    QUEUE_RESPONSE_EXPIRED,
 
     // ========== WIFI ==========
     // Bad wifi settings, starting config interface
@@ -59,6 +61,8 @@ enum ErrorCode {
     PROTO_PACKET_TOO_LONG,
     PROTO_EMPTY_PACKET,
     PROTO_TOO_MANY_CLIENTS,
+    // no room for another cached eeprom cell, arg is eeprom address
+    PROTO_EEPROM_CACHE_FULL,
 
     // ========== RFM ==========
     // RFM12B::begin called more than once!?
@@ -85,10 +89,20 @@ enum ErrorCode {
     MQTT_CALLBACK_BAD_ADDR,
     MQTT_CANT_PUBLISH,
     MQTT_INVALID_TOPIC_VALUE,
+    // Malformed bulk timer table upload, arg is the failing offset
+    MQTT_INVALID_TIMER_TABLE,
+    // set/zone/NAME/... names a zone not in the configuration
+    MQTT_INVALID_ZONE,
 
     // ========== NTP ==========
     // NTP errors
-    NTP_CANNOT_SYNC = 70
+    NTP_CANNOT_SYNC = 70,
+
+    // ========== PERSIST ==========
+    // Model snapshot errors
+    PERSIST_CANNOT_OPEN = 80,
+    PERSIST_BAD_FORMAT,
+    PERSIST_CANNOT_WRITE
 };
 
 const char *err_to_str(ErrorCode err);
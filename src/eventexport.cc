@@ -0,0 +1,63 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+#include "eventexport.h"
+
+namespace hr20 {
+
+void EventExporter::start(time_t now) {
+    // the ring went past the cursor
+    uint32_t first = eventLog.first_seq();
+    if (cursor < first) {
+        lost  += first - cursor;
+        cursor = first;
+    }
+
+    pos = cursor;
+    batch_dropped = 0;
+    memset(batch_counts, 0, sizeof(batch_counts));
+
+    if (now - window >= EXPORT_WINDOW) {
+        window = now;
+        memset(counts, 0, sizeof(counts));
+    }
+}
+
+bool EventExporter::next(Event &ev) {
+    for (; pos <= eventLog.last_seq(); ++pos) {
+        const Event *e = eventLog.find(pos);
+        if (!e) continue;
+
+        auto s = slot(*e);
+
+        if (counts[s] + batch_counts[s] >= EXPORT_CODE_LIMIT) {
+            ++batch_dropped;
+            continue;
+        }
+
+        ++batch_counts[s];
+        ev = *e;
+        ++pos;
+        return true;
+    }
+
+    return false;
+}
+
+} // namespace hr20
@@ -0,0 +1,84 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#include "config.h"
+#include "eventlog.h"
+
+namespace hr20 {
+
+/** Drains the event log in batches, for shipping it off the device (MQTT,
+ * syslog). Keeps its own cursor in the log, so nothing is missed between
+ * batches unless the ring wrapped over it in the meantime - such events are
+ * counted as lost. Each event code is limited to EXPORT_CODE_LIMIT events per
+ * EXPORT_WINDOW, the rest is counted as dropped.
+ *
+ * Usage: start(), next() until false or the batch is full, then commit() once
+ * the batch was shipped. Without commit() the next batch starts over. The
+ * rate limit and drop counts of a batch are only kept on commit(), so a
+ * batch that failed to ship does not charge them twice.
+ */
+struct EventExporter {
+    ICACHE_FLASH_ATTR void start(time_t now);
+
+    // next event of the batch to be shipped. false if there is none
+    ICACHE_FLASH_ATTR bool next(Event &ev);
+
+    // puts back the event the last next() gave, it did not fit the batch
+    ICACHE_FLASH_ATTR void unget(const Event &ev) {
+        pos = ev.seq;
+        --batch_counts[slot(ev)];
+    }
+
+    // the batch was shipped, continue after it
+    ICACHE_FLASH_ATTR void commit() {
+        for (uint8_t i = 0; i < EXPORT_CODE_SLOTS; ++i)
+            counts[i] += batch_counts[i];
+
+        cursor  = pos;
+        lost    = 0;
+        // drops seen while building the batch go with the next one
+        dropped = batch_dropped;
+        batch_dropped = 0;
+        memset(batch_counts, 0, sizeof(batch_counts));
+    }
+
+    // counts to report with the batch
+    uint32_t lost    = 0; // overwritten in the log before being exported
+    uint32_t dropped = 0; // over the rate limit
+
+protected:
+    uint32_t cursor = 1; // seq of the first event not shipped yet
+    uint32_t pos    = 1; // seq of the next event of the current batch
+    time_t window = 0;   // start of the current rate limit window
+    // events per code in the current window, codes share slots by hash
+    uint8_t counts[EXPORT_CODE_SLOTS] = {};
+    // the same (and the drops) of the batch being built
+    uint8_t batch_counts[EXPORT_CODE_SLOTS] = {};
+    uint32_t batch_dropped = 0;
+
+    static uint8_t slot(const Event &e) {
+        return (e.code * 2 + static_cast<uint8_t>(e.type)) % EXPORT_CODE_SLOTS;
+    }
+};
+
+} // namespace hr20
@@ -30,6 +30,9 @@ ICACHE_FLASH_ATTR const char *event_to_str(EventCode err) {
         HANDLE(PROTO_PACKET_SENDING)
         HANDLE(PROTO_PACKET_SYNC)
         HANDLE(PROTO_HANDLED_OPS)
+        HANDLE(PROTO_BULK_START)
+        HANDLE(PROTO_BULK_DONE)
+        HANDLE(PROTO_BULK_ABORT)
         HANDLE(MQTT_PUBLISH)
         HANDLE(MQTT_CALLBACK)
         HANDLE(MQTT_CONN)
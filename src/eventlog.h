@@ -39,6 +39,9 @@ enum class EventCode {
     PROTO_PACKET_SENDING  = 2, // packet was queued for sending, arg is addr
     PROTO_PACKET_SYNC     = 3, // sync is being sent
     PROTO_HANDLED_OPS     = 4, // handled bitmap of operations on incoming packet
+    PROTO_BULK_START      = 5, // bulk session started, arg is addr
+    PROTO_BULK_DONE       = 6, // bulk session finished, arg is addr
+    PROTO_BULK_ABORT      = 7, // bulk session failed, arg is addr
 
     // mqtt. publishes/subscription callbacks
     MQTT_PUBLISH          = 50, // a publish was done
@@ -69,6 +72,19 @@ struct Event {
     uint8_t  code  = 0; // code is severity dependent, either EventCode or ErrorCode
     uint16_t value = 0;
     time_t   time  = 0;
+    uint32_t seq   = 0; // sequence number, 1 for the first event since boot
+};
+
+// selects events by type and/or code
+struct EventFilter {
+    uint8_t type = 0;  // EventType, 0 for any
+    int16_t code = -1; // -1 for any
+
+    bool matches(const Event &ev) const {
+        if (type && static_cast<uint8_t>(ev.type) != type) return false;
+        if (code >= 0 && ev.code != code) return false;
+        return true;
+    }
 };
 
 // Singleton event log ring buffer
@@ -84,10 +100,46 @@ struct EventLog {
         slot.code  = code;
         slot.value = val;
         slot.time  = now;
+        slot.seq   = seq++;
 
         pos = (pos + 1) % EVENT_LOG_LEN;
     }
 
+    // sequence numbers of the oldest and newest events still held. The log
+    // is empty if first > last. Event seq is at (seq - 1) % EVENT_LOG_LEN
+    uint32_t first_seq() const {
+        return seq > EVENT_LOG_LEN ? seq - EVENT_LOG_LEN : 1;
+    }
+    uint32_t last_seq() const { return seq - 1; }
+
+    // the event of the given sequence number, nullptr if not held any more
+    const Event *find(uint32_t s) const {
+        if (s < first_seq() || s > last_seq()) return nullptr;
+        return &events[(s - 1) % EVENT_LOG_LEN];
+    }
+
+    /** calls fn(event) for up to count events matching the filter, starting
+     * with the event of sequence number from, towards the newer events if up
+     * is true and the older ones otherwise. First skip matches are skipped
+     */
+    template<typename F>
+    ICACHE_FLASH_ATTR void walk(uint32_t from, bool up, const EventFilter &f,
+                                unsigned skip, unsigned count, F fn) const
+    {
+        for (uint32_t s = from; count && find(s); up ? ++s : --s) {
+            const auto &ev = *find(s);
+            if (!f.matches(ev)) continue;
+
+            if (skip) {
+                --skip;
+                continue;
+            }
+
+            fn(ev);
+            --count;
+        }
+    }
+
     struct const_iterator {
         const_iterator(const EventLog &owner, uint16_t pos)
             : owner(owner), pos(pos)
@@ -132,6 +184,7 @@ struct EventLog {
 protected:
     Event events[EVENT_LOG_LEN];
     uint16_t pos = 0;
+    uint32_t seq = 1; // of the next event
     time_t now;
 };
 
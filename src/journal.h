@@ -0,0 +1,114 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "config.h"
+#include "util.h"
+
+namespace hr20 {
+
+/** Queue of client changes, as reported by the Protocol's change callback.
+ * Consumers drain it instead of scanning every client for changes.
+ *
+ * Entries are deduplicated. When the journal overflows, the changes are
+ * folded into per-address category masks without detail, so nothing gets
+ * lost, just coarser.
+ */
+struct ChangeJournal {
+    struct Entry {
+        uint8_t  addr;
+        uint8_t  detail; // timer slot (day*8+slot), eeprom addr or ALL
+        uint16_t cat;    // ChangeCategory bits
+    };
+
+    ChangeJournal() : overflow() {}
+
+    void ICACHE_FLASH_ATTR push(uint8_t addr, uint16_t cat, uint8_t detail) {
+        if (addr >= MAX_HR_ADDR || !cat) return;
+
+        // already overflown changes of the category cover this one
+        if ((overflow[addr] & cat) == cat) return;
+
+        for (uint8_t i = 0; i < count; ++i) {
+            Entry &e = entries[(head + i) % CHANGE_JOURNAL_LEN];
+            if (e.addr != addr) continue;
+
+            // covered by already queued change?
+            if ((e.cat & cat) == cat &&
+                (e.detail == detail || e.detail == CHANGE_DETAIL_ALL))
+                return;
+
+            // detail-less changes merge into a single entry
+            if (detail == CHANGE_DETAIL_ALL && e.detail == CHANGE_DETAIL_ALL) {
+                e.cat |= cat;
+                return;
+            }
+        }
+
+        if (count >= CHANGE_JOURNAL_LEN) {
+            overflow[addr] |= cat;
+            overflow_addrs |= 1ul << addr;
+            return;
+        }
+
+        Entry &e = entries[(head + count) % CHANGE_JOURNAL_LEN];
+        e.addr   = addr;
+        e.cat    = cat;
+        e.detail = detail;
+        ++count;
+    }
+
+    // takes the oldest change. returns false if there's none
+    bool ICACHE_FLASH_ATTR pop(Entry &e) {
+        if (count) {
+            e    = entries[head];
+            head = (head + 1) % CHANGE_JOURNAL_LEN;
+            --count;
+            return true;
+        }
+
+        if (!overflow_addrs) return false;
+
+        // overflown changes go out as whole categories
+        uint8_t addr = __builtin_ctz(overflow_addrs);
+        e.addr   = addr;
+        e.cat    = overflow[addr];
+        e.detail = CHANGE_DETAIL_ALL;
+
+        overflow[addr]  = 0;
+        overflow_addrs &= ~(1ul << addr);
+        return true;
+    }
+
+    bool empty() const { return !count && !overflow_addrs; }
+
+protected:
+    Entry entries[CHANGE_JOURNAL_LEN];
+    uint8_t head  = 0;
+    uint8_t count = 0;
+
+    // fallback when the journal is full
+    uint16_t overflow[MAX_HR_ADDR];
+    uint32_t overflow_addrs = 0;
+};
+
+} // namespace hr20
@@ -22,6 +22,10 @@
 #include "model.h"
 #include "error.h"
 #include "eventlog.h"
+#include "stats.h"
+#include "bench.h"
+#include "memstats.h"
+#include "scheduler.h"
 #include "json.h"
 #include "mqtt.h"
 #include "converters.h"
@@ -41,6 +45,7 @@ static const char *S_ERROR     PROGMEM = "error";
 
 static const char *S_LAST_SEEN  PROGMEM = "last_seen";
 static const char *S_STATE      PROGMEM = "st";
+static const char *S_EXCHANGES  PROGMEM = "xchg";
 
 void append_client_attr(StrMaker &str,
                         const HR20 &client)
@@ -49,34 +54,30 @@ void append_client_attr(StrMaker &str,
     // for PubSubClient to be able to handle us
     json::Object obj(str);
 
-    // attributes follow.
-    cvt::ValueBuffer vb;
-    json::kv_raw(obj, S_AUTO, client.auto_mode.to_str(vb));
-    json::kv_raw(obj, S_LOCK, client.menu_locked.to_str(vb));
-    json::kv_raw(obj, S_WINDOW, client.mode_window.to_str(vb));
-    json::kv_raw(obj, S_TEMP, client.temp_avg.to_str(vb));
-    json::kv_raw(obj, S_BAT, client.bat_avg.to_str(vb));
-    json::kv_raw(obj, S_TEMP_WTD, client.temp_wanted.to_str(vb));
-    json::kv_raw(obj, S_TEMP_WSET, client.temp_wanted.req_to_str(vb));
-    json::kv_raw(obj, S_VALVE_WTD, client.cur_valve_wtd.to_str(vb));
-    json::kv_raw(obj, S_ERROR, client.ctl_err.to_str(vb));
+    // attributes follow, converted right into the document
+    json::kv_value(obj, S_AUTO, client.auto_mode);
+    json::kv_value(obj, S_LOCK, client.menu_locked);
+    json::kv_value(obj, S_WINDOW, client.mode_window);
+    json::kv_value(obj, S_TEMP, client.temp_avg);
+    json::kv_value(obj, S_BAT, client.bat_avg);
+    json::kv_value(obj, S_TEMP_WTD, client.temp_wanted);
+    obj.key(S_TEMP_WSET);
+    client.temp_wanted.req_to_str(str);
+    json::kv_value(obj, S_VALVE_WTD, client.cur_valve_wtd);
+    json::kv_value(obj, S_ERROR, client.ctl_err);
 
     // just for the info
-    StrMaker sm{vb};
-    sm += client.last_contact;
-    json::kv_raw(obj, S_LAST_SEEN, sm.str());
+    json::kv_raw(obj, S_LAST_SEEN, (long)client.last_contact);
 
     // trying to compress in a bit more extra info
     // bit 1 - needs basic values set on client (requested over mqtt)
     // bit 2 - needs to read more data from the client to be synced
     int state = (client.needs_basic_value_sync() ? 1 : 0)
                 | (client.synced ? 0 : 2);
+    json::kv_raw(obj, S_STATE, state);
 
-    {
-        StrMaker sm1{vb};
-        sm1 += state;
-        json::kv_raw(obj, S_STATE, sm1.str());
-    }
+    // exchanges left until synced
+    json::kv_raw(obj, S_EXCHANGES, (unsigned)client.exchanges_left);
 }
 
 void append_timer_day(StrMaker &str,
@@ -99,11 +100,14 @@ void append_timer_day(StrMaker &str,
         json::Object slot(day_obj);
 
 
-        cvt::ValueBuffer vb;
         slot.key(timer_topic_str(mqtt::TIMER_TIME));
-        json::str(str, cvt::TimeHHMM::to_str(vb, remote.time()));
+        str += '"';
+        cvt::TimeHHMM::to_str(str, remote.time());
+        str += '"';
         slot.key(timer_topic_str(mqtt::TIMER_MODE));
-        json::str(str, cvt::Simple::to_str(vb, remote.mode()));
+        str += '"';
+        cvt::Simple::to_str(str, remote.mode());
+        str += '"';
     }
 }
 
@@ -111,8 +115,7 @@ void append_event(StrMaker &str, const Event &ev) {
     json::Object obj(str);
 
     // attributes follow.
-    cvt::ValueBuffer vb;
-    json::kv_raw(obj, "type",  cvt::Simple::to_str(vb, (uint8_t)ev.type));
+    json::kv_raw(obj, "type",  (unsigned)ev.type);
     switch (ev.type) {
     case EventType::EVENT:
         json::kv_str(
@@ -124,10 +127,136 @@ void append_event(StrMaker &str, const Event &ev) {
     default:
         break;
     }
-    json::kv_raw(obj, "value", cvt::Simple::to_str(vb, ev.value));
-    json::kv_raw(obj, "time",  cvt::Simple::to_str(vb, ev.time));
+    json::kv_raw(obj, "value", (unsigned)ev.value);
+    json::kv_raw(obj, "time",  (long)ev.time);
+    json::kv_raw(obj, "seq",   (unsigned)ev.seq);
+}
+
+static void append_histogram(Object &obj, const char *name,
+                             const LatencyHistogram &h)
+{
+    obj.key(name);
+    json::Object ho(obj);
+    json::kv_raw(ho, "ms", h.width);
+    ho.key("h");
+
+    json::Array arr(ho);
+    for (uint8_t b = 0; b < STATS_BUCKETS; ++b) {
+        arr.element();
+        arr.s += h.buckets[b];
+    }
 }
 
+#ifdef BENCH
+// [count, avg, min, max] cycles
+static void append_cycles(Object &obj, const char *name, const CycleStat &c) {
+    obj.key(name);
+    json::Array arr(obj);
+    arr.element();
+    arr.s += (unsigned)c.count;
+    arr.element();
+    arr.s += (unsigned)c.avg();
+    arr.element();
+    arr.s += (unsigned)(c.count ? c.min : 0);
+    arr.element();
+    arr.s += (unsigned)c.max;
+}
+
+static void append_bench(Object &obj, const Bench &b) {
+    obj.key("bench");
+    json::Object bo(obj);
+    json::kv_raw(bo, "mhz", (unsigned)ESP.getCpuFreqMHz());
+    append_cycles(bo, "isr",             b.isr);
+    append_cycles(bo, "spi16",           b.spi16);
+    append_cycles(bo, "xtea",            b.xtea);
+    append_cycles(bo, "cmac_finish",     b.cmac_finish);
+    append_cycles(bo, "encrypt_decrypt", b.encrypt_decrypt);
+    append_cycles(bo, "pkt_encrypt",     b.pkt_encrypt);
+    append_cycles(bo, "pkt_encrypt_pf",  b.pkt_encrypt_pf);
+    append_cycles(bo, "pkt_cmac",        b.pkt_cmac);
+}
+#endif
+
+#ifdef MEMSTATS
+static void append_mem(Object &obj, const MemStats &m) {
+    obj.key("mem");
+    json::Object mo(obj);
+    json::kv_raw(mo, "heap",       (unsigned)m.heap_free);
+    json::kv_raw(mo, "heap_min",   (unsigned)m.heap_min);
+    json::kv_raw(mo, "block",      (unsigned)m.block_max);
+    json::kv_raw(mo, "block_min",  (unsigned)m.block_min);
+    json::kv_raw(mo, "frag",       (unsigned)m.frag);
+    json::kv_raw(mo, "frag_max",   (unsigned)m.frag_max);
+    json::kv_raw(mo, "stack_free", (unsigned)m.stack_free);
+}
+#endif
+
+void append_link_stats(StrMaker &str, const LinkStats &st,
+                       const Bench *bench, const MemStats *mem)
+{
+    json::Object obj(str);
+
+    json::kv_raw(obj, "syncs",      st.syncs);
+    json::kv_raw(obj, "answers",    st.answers);
+    json::kv_raw(obj, "underruns",  st.tx_underruns);
+    json::kv_raw(obj, "rx_dropped", st.rx_dropped);
+    json::kv_raw(obj, "queue_full", st.queue_full);
+
+    append_histogram(obj, "sync_reply",   st.sync_to_reply);
+    append_histogram(obj, "reply_answer", st.reply_to_answer);
+
+    // [rx, bad cmac] of every client we heard from
+    {
+        obj.key("clients");
+        json::Object co(obj);
+        for (uint8_t addr = 0; addr < MAX_HR_ADDR; ++addr) {
+            const auto &c = st.clients[addr];
+            if (!c.rx && !c.bad_cmac) continue;
+
+            co.key(addr);
+            json::Array arr(co);
+            arr.element();
+            arr.s += c.rx;
+            arr.element();
+            arr.s += c.bad_cmac;
+        }
+    }
+
+#ifdef BENCH
+    if (bench) append_bench(obj, *bench);
+#endif
+#ifdef MEMSTATS
+    if (mem) append_mem(obj, *mem);
+#endif
+}
+
+void append_tasks(StrMaker &str, const Scheduler &sched) {
+    json::Object obj(str);
+
+    json::kv_raw(obj, "slice_us", (unsigned)SCHED_SLICE_US);
+
+    for (uint8_t i = 0; i < sched.count; ++i) {
+        const auto &t = sched.tasks[i];
+
+        obj.key(t.name);
+        json::Object to(obj);
+        json::kv_raw(to, "prio",     t.prio);
+        json::kv_raw(to, "runs",     (unsigned)t.runs);
+        json::kv_raw(to, "last_us",  (unsigned)t.last_us);
+        json::kv_raw(to, "worst_us", (unsigned)t.worst_us);
+        json::kv_raw(to, "overruns", t.overruns);
+#ifdef MEMSTATS
+        // tasks that did not run yet have nothing to report
+        const auto &m = memStats.tasks[i];
+        if (m.heap_min != ~0u) {
+            json::kv_raw(to, "heap_min",  (unsigned)m.heap_min);
+            json::kv_raw(to, "heap_drop", (unsigned)m.heap_drop);
+        }
+        if (m.stack_min != ~0u)
+            json::kv_raw(to, "stack_min", (unsigned)m.stack_min);
+#endif
+    }
+}
 
 } // namespace json
 } // namespace hr20
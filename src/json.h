@@ -28,6 +28,10 @@ namespace hr20 {
 
 struct HR20;
 struct Event;
+struct LinkStats;
+struct Bench;
+struct MemStats;
+struct Scheduler;
 
 namespace json {
 
@@ -101,9 +105,22 @@ inline void kv_raw(Object &o, const T &name, const V &val) {
     o.s += val;
 }
 
+// key and a cached/synced value, converted straight into the document
+template<typename T, typename V>
+inline void kv_value(Object &o, const T &name, const V &val) {
+    o.key(name);
+    val.to_str(o.s);
+}
+
 void append_client_attr(StrMaker &str, const HR20 &client);
 void append_timer_day(StrMaker &str, const HR20 &m, uint8_t day);
 void append_event(StrMaker &s, const Event &ev);
+// bench and memory results are only included in BENCH/MEMSTATS builds, and
+// only if given
+void append_link_stats(StrMaker &str, const LinkStats &st,
+                       const Bench *bench = nullptr,
+                       const MemStats *mem = nullptr);
+void append_tasks(StrMaker &str, const Scheduler &sched);
 
 } // namespace json
 } // namespace hr20
@@ -27,6 +27,8 @@
 #include "eventlog.h"
 #include "button.h"
 #include "webserver.h"
+#include "scheduler.h"
+#include "bench.h"
 
 #ifdef HR20_DISPLAY
 #include "display.h"
@@ -36,10 +38,16 @@
 #include "mqtt.h"
 #endif
 
+#ifdef SYSLOG
+#include "syslog.h"
+#endif
+
 hr20::Config config;
 hr20::ntptime::NTPTime ntptime;
 hr20::HR20Master master{config, ntptime};
 int last_int = 1;
+// set by the ntp task, consumed by the radio task
+bool time_changed = false;
 
 // webserver is mandatory for the configuration of the device
 hr20::Web webserver(config, master);
@@ -49,7 +57,11 @@ hr20::mqtt::MQTTPublisher publisher(config, master);
 #endif
 
 #ifdef HR20_DISPLAY
-hr20::Display display(master);
+hr20::Display display(master, ntptime);
+#endif
+
+#ifdef SYSLOG
+hr20::SyslogExporter syslogger(config);
 #endif
 
 void setup(void) {
@@ -81,55 +93,93 @@ void setup(void) {
 #ifdef HR20_DISPLAY
     display.begin();
 #endif
-}
-
-void loop(void) {
-    // handle OTA updates as appropriate
-    ArduinoOTA.handle();
-
-    // feed the watchdog...
-    ESP.wdtFeed();
 
+    using hr20::Scheduler;
 
-    // don't try to repeat ntp time updates more than once a second!
-    bool changed_time = false;
+    // radio and protocol. guaranteed service on every pass
+    hr20::scheduler.add("radio", Scheduler::PRIO_RADIO, 0, [](void *) {
+        // feed the watchdog...
+        ESP.wdtFeed();
 
-    // TODO: Only try to update ntp if we're connected (info by iotwebconf)
-    // TODO: Only update time every N seconds, not every 1 second
-    auto sec = second(ntptime.localTime());
-    // only NTP ~ update every minute
-    time_t now = ntptime.update(sec == 55, changed_time);
+        if (!ntptime.isSynced()) return;
 
-    if (ntptime.isSynced()) {
-        hr20::eventLog.update(now);
+        hr20::eventLog.update(ntptime.unixTime());
 
         bool __attribute__((unused))
-            sec_pass = master.update(changed_time, ntptime.localTime());
+            sec_pass = master.update(time_changed, ntptime.localTime());
+        time_changed = false;
+    });
 
-        // sec_pass = second passed (once every second)
+    // often - the reply is timed by when it gets picked up
+    hr20::scheduler.add("ntp", Scheduler::PRIO_HIGH, 10, [](void *) {
+        bool changed = false;
+
+        // TODO: Only try to update ntp if we're connected (info by iotwebconf)
+        // new queries only go out while the radio is expected to be quiet
+        ntptime.update(master.is_idle(), changed);
+        time_changed |= changed;
+    });
 
 #ifdef MQTT
     // only update mqtt if we have a time to do so, as controlled by master
-    if (master.is_idle()) publisher.update(now);
+    hr20::scheduler.add("mqtt", Scheduler::PRIO_HIGH, 0,
+        [](void *) { publisher.update(ntptime.unixTime()); },
+        nullptr,
+        [](void *) { return ntptime.isSynced() && master.is_idle(); });
 #endif
-    }
 
-#ifdef HR20_DISPLAY
-    // TODO: Eats a lot of time. display.update();
+    hr20::scheduler.add("web", Scheduler::PRIO_LOW, 0,
+        [](void *) {
+            static int last_status = -1;
+            int status = WiFi.status();
+            if (status != last_status) {
+                last_status = status;
+                DBG("(WIFI %d)", status);
+            }
+
+            webserver.update();
+        },
+        nullptr,
+#ifdef RFM_POLL_MODE
+        // only update web when radio's not talking
+        [](void *) { return master.is_idle(); }
+#else
+        nullptr
+#endif
+    );
+
+#ifdef SYSLOG
+    // event log batches, in the radio's quiet times
+    hr20::scheduler.add("syslog", Scheduler::PRIO_LOW,
+        hr20::EXPORT_INTERVAL * 1000,
+        [](void *) { syslogger.update(ntptime.unixTime()); },
+        nullptr,
+        [](void *) {
+            return ntptime.isSynced() && master.is_idle()
+                   && WiFi.status() == WL_CONNECTED;
+        });
 #endif
 
-    static int last_status = -1;
-    int status = WiFi.status();
-    if (status != last_status) {
-        last_status = status;
-        DBG("(WIFI %d)", status);
-    }
+    // handle OTA updates as appropriate
+    hr20::scheduler.add("ota", Scheduler::PRIO_LOW, 100,
+                        [](void *) { ArduinoOTA.handle(); });
 
-#ifdef RFM_POLL_MODE
-    // only update web when radio's not talking
-    if (master.is_idle())
-        webserver.update();
-#else
-    webserver.update();
+#ifdef BENCH
+    // cycle counts of the hot paths, see bench.h
+    hr20::scheduler.add("bench", Scheduler::PRIO_LOW, hr20::BENCH_DUMP_INTERVAL,
+                        [](void *) { hr20::bench.dump(); });
 #endif
+
+#ifdef HR20_DISPLAY
+    // sends a small chunk of changed cells per run, kept out of the
+    // client radio exchanges
+    hr20::scheduler.add("display", Scheduler::PRIO_LOW, 20,
+        [](void *) { display.update(); },
+        nullptr,
+        [](void *) { return master.is_idle(); });
+#endif
+}
+
+void loop(void) {
+    hr20::scheduler.run();
 }
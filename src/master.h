@@ -19,156 +19,127 @@
 
 #pragma once
 
+#include <utility>
+
+#include "config.h"
 #include "debug.h"
 #include "ntptime.h"
-#include "protocol.h"
-#include "rfm12b.h"
-#include "crypto.h"
-#include "packetqueue.h"
+#include "radionet.h"
 
 namespace hr20 {
 
-/// Implements the state machine for packet sending/retrieval and radio control.
+/** Drives the radio networks, RFM_RADIO_COUNT of them. Outside of the radio
+ * stack the clients go by id (net * MAX_HR_ADDR + addr), see client().
+ */
 struct HR20Master {
     ICACHE_FLASH_ATTR HR20Master(Config &config, ntptime::NTPTime &tm)
-        : config(config),
-          time(tm),
-          crypto{time},
-          queue{crypto, PACKET_DISCARD_AGE},
-          proto{model, time, crypto, queue}
+        : HR20Master(config, tm, std::make_index_sequence<RFM_RADIO_COUNT>{})
     {}
 
     // has to be called after config.begin()!
     void ICACHE_FLASH_ATTR begin() {
         uint8_t rfm_pass[8];
         config.rfm_pass_to_binary((unsigned char*)rfm_pass);
-        crypto.begin(rfm_pass);
-        radio.begin();
+        for (auto &n : nets) n.begin(rfm_pass);
+#ifdef BENCH
+        bench.run_crypto(nets[0].crypto);
+        bench.dump();
+#endif
     }
 
     bool ICACHE_FLASH_ATTR update(bool changed_time, time_t now) {
-        radio.update();
+        bool sec_pass = false;
+        for (auto &n : nets) sec_pass |= n.update(changed_time, now);
 
-        // Note: could use [[maybe_unused]] in C++17
-        // update the crypto rtc if needed
-        bool __attribute__((unused)) sec_pass = crypto.update(now);
-
-        // TODO: if it's 00 or 30, we send sync
-        if (sec_pass) {
-            DBGI("[:%d]\n", crypto.rtc.ss);
-            time_t curtime = time.localTime();
-            proto.update(curtime, time.isSynced(), changed_time, time.cur_slew);
-        }
+#ifdef MODEL_STORE
+        // flash writes block for a while, only do them outside comms
+        if (is_idle())
+            for (auto &n : nets) n.store.update(now);
+#endif
 
-        // send data/receive data as appropriate
-        send();
-        receive();
         return sec_pass;
     }
 
-    void ICACHE_FLASH_ATTR receive() {
-        int b = radio.recv();
-
-        // no data on input means we just ignore
-        if (b < 0) return;
-
-        if (!packet.push(b)) {
-            ERR(PROTO_PACKET_TOO_LONG);
-            wait_for_sync();
-        }
-
-        if (length == 0) {
-            length = b & ~0x80;
-            if (length == 0) {
-                ERR(PROTO_EMPTY_PACKET);
-                wait_for_sync();
-                return;
-            } else {
-#ifdef VERBOSE
-                DBG(" * Start rcv. of %d bytes", length);
-#endif
-            }
-        }
-
-        --length;
+    /** indicates master has no time-sensitive work
+     * going on, so we can do some time consuming updates that could break
+     * radio comms. None of the networks may have any.
+     */
+    bool ICACHE_FLASH_ATTR is_idle() {
+        for (auto &n : nets)
+            if (!n.is_idle()) return false;
+        return true;
+    }
 
-        if (!length) {
-            DBG("(RCV %u)", packet.size());
-            // TODO: Close the RX sooner here
-            proto.receive(packet);
-            wait_for_sync();
-        }
+    // client of the given id, nullptr if there is none
+    ICACHE_FLASH_ATTR HR20 *client(unsigned id) {
+        if (id >= MAX_CLIENT_ID) return nullptr;
+        return nets[id / MAX_HR_ADDR].model[id % MAX_HR_ADDR];
     }
 
-    bool ICACHE_FLASH_ATTR send() {
-        while (true) {
-            int b = queue.peek();
-
-            if (b >= 0) {
-                // when sending, we are sure to discard any prior received data
-                length = 0;
-                packet.clear();
-
-                if (radio.send(b)) {
-                    queue.pop();
-                } else {
-                    // come back after the radio gets free
-                    return true;
-                }
-            } else {
-                // no more data...
-                return false;
-            }
-        }
+    static constexpr uint8_t client_id(uint8_t net, uint8_t addr) {
+        return net * MAX_HR_ADDR + addr;
     }
 
-    void ICACHE_FLASH_ATTR wait_for_sync() {
-        length = 0;
-        packet.clear();
-        radio.wait_for_sync();
+    // the client gets named in the next sync of its network
+    ICACHE_FLASH_ATTR void force_next(unsigned id) {
+        if (id >= MAX_CLIENT_ID) return;
+        nets[id / MAX_HR_ADDR].proto.force_next(id % MAX_HR_ADDR);
     }
 
-    /** indicates master has no time-sensitive work
-     * going on, so we can do some time consuming updates that could break
-     * radio comms.
+    /** registers the change observer of all networks, addr is the client id.
+     * The networks get one relay observer each, that is registered with the
+     * first observer here
      */
-    bool ICACHE_FLASH_ATTR is_idle() {
-        // every second if we have realtime
-#ifndef NO_REALTIME
-        auto millis = time.getMillis();
-        // every second half of every second (not last 100 ms though, sending
-        // can take time), but only if radio is idle
-        return (millis >= 500) && (millis < 900) && radio.is_idle();
-#endif
-        auto sec = second(time.localTime());
-        return (sec >= 50) && (sec <= 58) && radio.is_idle();
-    }
+    ICACHE_FLASH_ATTR bool add_callback(OnChangeFn fn, void *ctx) {
+        if (observers.empty()) {
+            for (uint8_t i = 0; i < RFM_RADIO_COUNT; ++i) {
+                relays[i] = {this, nets[i].net};
+                if (!nets[i].proto.add_callback(relay, &relays[i]))
+                    return false;
+            }
+        }
 
-    bool ICACHE_FLASH_ATTR can_update_ntp() {
-        auto sec = second(time.localTime());
-        // we sacrifice the last of the 2 seconds in a minute for time sync
-        // so it is beneficial to not use the last 2 addresses
-        return radio.is_idle() && (((sec == 31) && proto.no_forces()) || (sec == 58));
+        return observers.add(fn, ctx);
     }
 
     // called when webserver updates the configuration
     void ICACHE_FLASH_ATTR config_updated() {
+#ifdef MODEL_STORE
+        // don't lose the changes since the last snapshot
+        for (auto &n : nets) n.store.flush();
+#endif
         // restart the ESP to get the settings loaded...
         ESP.restart();
     }
 
-    // RTC with NTP synchronization
     Config &config;
     ntptime::NTPTime &time;
-    crypto::Crypto crypto;
-    RFM12B radio;
-    PacketQ queue;
-    Model model;
-    Protocol proto;
-
-    // received packet
-    RcvPacket packet;
-    int length = 0;
+    RadioNet nets[RFM_RADIO_COUNT];
+
+protected:
+    template<size_t... NET>
+    ICACHE_FLASH_ATTR HR20Master(Config &config, ntptime::NTPTime &tm,
+                                 std::index_sequence<NET...>)
+        : config(config),
+          time(tm),
+          nets{{tm, NET}...}
+    {}
+
+    // the network a change gets relayed from, see add_callback
+    struct Relay {
+        HR20Master *master;
+        uint8_t net;
+    };
+
+    static ICACHE_FLASH_ATTR void relay(void *ctx, uint8_t addr,
+                                        ChangeCategory cat, uint8_t detail)
+    {
+        auto *r = static_cast<Relay *>(ctx);
+        r->master->observers.notify(client_id(r->net, addr), cat, detail);
+    }
+
+    Relay relays[RFM_RADIO_COUNT];
+    ChangeObservers observers;
 };
 
 } // namespace hr20
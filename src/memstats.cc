@@ -0,0 +1,74 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+#include "memstats.h"
+
+#ifdef MEMSTATS
+
+namespace hr20 {
+
+MemStats memStats;
+
+MemStats::Mark MemStats::before_task() {
+    // whatever used the stack since the last task is the radio's doing
+    if (radio_task < SCHED_MAX_TASKS) stack_mark(tasks[radio_task]);
+    ESP.resetFreeContStack();
+    return {ESP.getFreeHeap()};
+}
+
+void MemStats::after_task(uint8_t idx, const Mark &m) {
+    TaskMarks &tm = tasks[idx];
+
+    uint32_t heap = ESP.getFreeHeap();
+    if (heap < tm.heap_min) tm.heap_min = heap;
+    if (heap < m.heap && m.heap - heap > tm.heap_drop)
+        tm.heap_drop = m.heap - heap;
+
+    stack_mark(tm);
+
+    unsigned long now = millis();
+    if (!sampled || now - last_sample >= MEMSTATS_SAMPLE_MS) {
+        sampled     = true;
+        last_sample = now;
+        sample();
+    }
+
+    // repaint, so the radio mark only sees what ran after this task
+    ESP.resetFreeContStack();
+}
+
+void MemStats::sample() {
+    heap_free = ESP.getFreeHeap();
+    block_max = ESP.getMaxFreeBlockSize();
+    frag      = ESP.getHeapFragmentation();
+
+    if (heap_free < heap_min) heap_min = heap_free;
+    if (block_max < block_min) block_min = block_max;
+    if (frag > frag_max) frag_max = frag;
+}
+
+void MemStats::stack_mark(TaskMarks &tm) {
+    uint32_t free = ESP.getFreeContStack();
+    if (free < tm.stack_min) tm.stack_min = free;
+    if (free < stack_free) stack_free = free;
+}
+
+} // namespace hr20
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#include "config.h"
+
+namespace hr20 {
+
+#ifdef MEMSTATS
+
+/** Heap and stack watermarks. The heap numbers (free heap, largest free
+ * block, fragmentation) are sampled every MEMSTATS_SAMPLE_MS, the lowest
+ * (highest for fragmentation) kept since boot. The scheduler brackets every
+ * task run but the radio ones, so each task gets the free heap after its
+ * runs, the largest heap decrease over a single run (allocations the task
+ * kept) and its stack high-water mark. The unused stack gets repainted
+ * before and after the task (ESP.resetFreeContStack) and scanned for the
+ * untouched part after it, so what the radio task used in between shows
+ * alone at the next task. Costs a few tens of us per task run, hence the
+ * build flag.
+ */
+struct MemStats {
+    struct TaskMarks {
+        uint32_t heap_min  = ~0u; // free heap after a run
+        uint32_t heap_drop = 0;   // largest heap decrease over one run
+        uint32_t stack_min = ~0u; // least free stack during a run
+    };
+
+    // state at the start of a task run
+    struct Mark {
+        uint32_t heap;
+    };
+
+    ICACHE_FLASH_ATTR Mark before_task();
+    ICACHE_FLASH_ATTR void after_task(uint8_t idx, const Mark &m);
+
+    // takes the heap sample, called by after_task when due
+    ICACHE_FLASH_ATTR void sample();
+
+    uint32_t heap_free  = 0;    // as of the last sample
+    uint32_t heap_min   = ~0u;
+    uint32_t block_max  = 0;    // largest free block, last sample
+    uint32_t block_min  = ~0u;
+    uint8_t  frag       = 0;    // fragmentation in percent, last sample
+    uint8_t  frag_max   = 0;
+    uint32_t stack_free = ~0u;  // least free stack of all the tasks
+
+    TaskMarks tasks[SCHED_MAX_TASKS];
+    // index of the radio task, set by the scheduler
+    uint8_t radio_task = SCHED_MAX_TASKS;
+
+protected:
+    // accounts the free stack left untouched since the last repaint
+    void ICACHE_FLASH_ATTR stack_mark(TaskMarks &tm);
+
+    unsigned long last_sample = 0;
+    bool sampled = false;
+};
+
+// global memory statistics
+extern MemStats memStats;
+
+#endif
+
+} // namespace hr20
@@ -20,6 +20,7 @@
 #pragma once
 
 #include "value.h"
+#include "eeprom.h"
 #include "timer.h"
 #include "str.h"
 
@@ -27,13 +28,17 @@ namespace hr20 {
 
 using TimerSlot = SyncedValue<Timer>;
 
+// state of the bulk transfer session with a client, see Protocol::update_bulk
+enum BulkState : uint8_t {
+    BULK_NONE = 0, // no session since boot
+    BULK_ACTIVE,
+    BULK_DONE,
+    BULK_ABORTED
+};
+
 // models a single HR20 client
 struct HR20 {
-    HR20() {
-        // we don't want to read eeprom by default. only when requested
-        for (unsigned a = 0; a < EEPROM_SIZE; ++a)
-            eeprom[a].masked() = true;
-    }
+    HR20() {}
 
     HR20(const HR20 &) = delete; // not copyable
     const HR20 &operator = (const HR20 &) = delete;
@@ -45,6 +50,31 @@ struct HR20 {
      * frequent comms with the client.
      */
     bool need_fat_comms = false;
+    // estimate of packet exchanges left until the client is synced
+    uint8_t exchanges_left = 0;
+    // size of our packets the client copes with
+    PacketLimit packet_limit;
+
+    // bulk session - the client is forced in every sync while it has a large
+    // backlog. bulk_total is the backlog the session started with
+    BulkState bulk_state  = BULK_NONE;
+    uint8_t bulk_total    = 0;
+    uint8_t bulk_errors   = 0;
+    uint8_t bulk_cooldown = 0; // syncs until another session may start
+
+    bool in_bulk() const { return bulk_state == BULK_ACTIVE; }
+
+    // percentage of the session's backlog done
+    ICACHE_FLASH_ATTR uint8_t bulk_progress() const {
+        if (bulk_state != BULK_ACTIVE || !bulk_total) return 100;
+        if (exchanges_left >= bulk_total) return 0;
+        return 100 - (uint16_t)exchanges_left * 100 / bulk_total;
+    }
+
+    // generations of what /list and /timer report of this client, bumped on
+    // every change. The web server derives ETags of them
+    uint16_t gen = 0;
+    uint16_t timers_gen = 0;
 
     // == Controllable values ==
     // these are mirrored values - we sync them to HR20 when a change is requested
@@ -56,8 +86,65 @@ struct HR20 {
     SyncedValue<bool>     auto_mode;
     // false unlocked, true locked - L[01]/L[00]
     SyncedValue<bool>     menu_locked;
-    // whole-eeprom image with lazy loading
-    SyncedValue<uint8_t> eeprom[EEPROM_SIZE];
+    // eeprom cells we were asked about, lazily loaded. We don't want to read
+    // eeprom by default, only when requested
+    EepromCache eeprom;
+
+    // == Pending work ==
+    // bitmaps of entries that may have a read or write pending. Set by the
+    // mutators below, bits of entries found with nothing to do get cleared
+    // by Protocol::queue_updates_for. Timer bit is dow * 8 + slot, eeprom
+    // bit is the EepromCache slot
+    uint64_t timers_rd = ~0ull; // nothing is read yet
+    uint64_t timers_wr = 0;
+    uint32_t eeprom_rd = 0;
+    uint32_t eeprom_wr = 0;
+
+    static constexpr uint64_t timer_bit(uint8_t dow, uint8_t slot) {
+        return 1ull << (dow * TIMER_SLOTS_PER_DAY + slot);
+    }
+
+    // true if nothing at all can be pending
+    bool ICACHE_FLASH_ATTR nothing_pending() const {
+        return !(timers_rd | timers_wr) && !(eeprom_rd | eeprom_wr) &&
+               !needs_basic_value_sync();
+    }
+
+    ICACHE_FLASH_ATTR void request_timer(uint8_t dow, uint8_t slot, Timer t) {
+        timers[dow][slot].set_requested(t);
+        timers_wr |= timer_bit(dow, slot);
+    }
+
+    // drops our copy of the whole timer table, to get it re-read
+    ICACHE_FLASH_ATTR void invalidate_timers() {
+        for (auto &day : timers)
+            for (auto &slot : day)
+                slot.remote_valid() = false;
+
+        timers_rd = ~0ull;
+        ++timers_gen;
+    }
+
+    ICACHE_FLASH_ATTR bool request_eeprom_write(uint8_t ee_addr, uint8_t val) {
+        auto *cell = eeprom.get(ee_addr);
+        if (!cell) return false;
+
+        cell->set_requested(val);
+        eeprom_wr |= 1ul << eeprom.slot_index(cell);
+        return true;
+    }
+
+    // re-read request. unmasks the cell in case it was not seen since
+    // reboot and also invalidates remote in case it was already read
+    ICACHE_FLASH_ATTR bool request_eeprom_read(uint8_t ee_addr) {
+        auto *cell = eeprom.get(ee_addr);
+        if (!cell) return false;
+
+        cell->masked()       = false;
+        cell->remote_valid() = false;
+        eeprom_rd |= 1ul << eeprom.slot_index(cell);
+        return true;
+    }
 
     // true if one or more of the synced values up here need to be written to client
     bool needs_basic_value_sync() const {
@@ -77,6 +164,53 @@ struct HR20 {
     // (M being the highest 4 bits of the 16bit value, 12 lowest bits are time)
     TimerSlot timers[TIMER_DAYS][TIMER_SLOTS_PER_DAY];
 
+    // calendar checksum as last reported by the client (long debug response)
+    uint8_t timers_crc = 0;
+    bool timers_crc_valid = false;
+    // the cached timer table holds values of unknown freshness (i.e.
+    // restored after reboot). These get verified by the checksum instead of
+    // being re-read slot by slot
+    bool timers_unverified = false;
+    // the timer table was re-read because of a checksum mismatch
+    bool timers_fresh = false;
+    // checksum mismatched even after a fresh re-read - not to be trusted
+    bool timers_crc_ignored = false;
+
+    // computes the calendar checksum the client reports, over our cached
+    // copy of the timer table. The client sums the bytes of the timer table
+    // as stored in its eeprom - 16bit little endian values, day by day
+    ICACHE_FLASH_ATTR uint8_t timers_checksum() const {
+        uint8_t sum = 0;
+        for (uint8_t dow = 0; dow < TIMER_DAYS; ++dow) {
+            for (uint8_t slot = 0; slot < TIMER_SLOTS_PER_DAY; ++slot) {
+                uint16_t raw = timers[dow][slot].get_remote().raw();
+                sum += raw & 0xFF;
+                sum += raw >> 8;
+            }
+        }
+        return sum;
+    }
+
+    // true if every slot of the timer table was read from client
+    ICACHE_FLASH_ATTR bool timers_complete() const {
+        for (uint8_t dow = 0; dow < TIMER_DAYS; ++dow) {
+            for (uint8_t slot = 0; slot < TIMER_SLOTS_PER_DAY; ++slot) {
+                if (!timers[dow][slot].remote_valid()) return false;
+            }
+        }
+        return true;
+    }
+
+    // true if any slot waits to be written to client
+    ICACHE_FLASH_ATTR bool timers_write_pending() const {
+        for (uint8_t dow = 0; dow < TIMER_DAYS; ++dow) {
+            for (uint8_t slot = 0; slot < TIMER_SLOTS_PER_DAY; ++slot) {
+                if (timers[dow][slot].is_requested_set()) return true;
+            }
+        }
+        return false;
+    }
+
     // == Just read from HR20 - not controllable ==
     // true means auto mode with temperature equal to requested
     CachedValue<bool>     test_auto;
@@ -101,7 +235,9 @@ struct HR20 {
         uint8_t cvtd;
 
         if (cvt::Simple::from_str(val, cvtd)) {
-            timers[day][slot].get_requested().set_mode(cvtd & 0x0F);
+            Timer t = pending_timer(day, slot);
+            t.set_mode(cvtd & 0x0F);
+            request_timer(day, slot, t);
             return true;
         }
 
@@ -117,12 +253,21 @@ struct HR20 {
 
         uint16_t cvtd;
         if (cvt::TimeHHMM::from_str(val, cvtd)) {
-            timers[day][slot].get_requested().set_time(cvtd);
+            Timer t = pending_timer(day, slot);
+            t.set_time(cvtd);
+            request_timer(day, slot, t);
             return true;
         }
 
         return false;
     }
+
+    // the value a timer slot change applies to - the one already requested
+    // if there is one, the client's otherwise
+    ICACHE_FLASH_ATTR Timer pending_timer(uint8_t day, uint8_t slot) const {
+        const auto &t = timers[day][slot];
+        return t.is_requested_set() ? t.get_requested() : t.get_remote();
+    }
 };
 
 // Holds all clients in one array
@@ -163,11 +308,24 @@ struct Model {
 
             slot        = ++cidx;
             index[addr] = slot;
+            present    |= 1ul << addr;
+            // new client has to be persisted
+            mark_dirty(addr);
         }
 
         return &clients[slot - 1];
     }
 
+    // marks the client to be written out by ModelStore
+    void mark_dirty(uint8_t addr) {
+        if (addr < MAX_HR_ADDR) dirty |= 1ul << addr;
+    }
+
+    // bitmap of client addresses with changes not yet persisted
+    uint32_t dirty = 0;
+    // bitmap of client addresses we have a slot for
+    uint32_t present = 0;
+
 protected:
     Model(const Model &) = delete;
 
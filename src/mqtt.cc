@@ -17,12 +17,14 @@
  *
  */
 
-#include "mqtt.h"
+#include "mqtt_path.h"
 
 namespace hr20 {
 namespace mqtt {
 
 const char *Path::prefix = "hr20";
+const char *Path::match_prefix = "hr20";
+uint8_t Path::match_prefix_len = 4;
 
 } // namespace mqtt
 } // namespace hr20
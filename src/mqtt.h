@@ -25,534 +25,87 @@
 #include "config.h"
 #include "debug.h"
 #include "error.h"
+#include "eventexport.h"
 #include "master.h"
+#include "memstats.h"
 #include "util.h"
 #include "json.h"
+#include "journal.h"
+#include "mqtt_path.h"
+#include "schedule.h"
+#include "stats.h"
 #include "str.h"
 
+#if defined(MQTT_STATE_ONLY) && !defined(MQTT_JSON)
+#error "MQTT_STATE_ONLY needs MQTT_JSON"
+#endif
+
 namespace hr20 {
 namespace mqtt {
 
-// topic enum. Each has different initial letter for simple parsing
-enum Topic {
-    AVG_TMP = 1,
-    BAT     = 2,
-    ERR     = 3,
-    LOCK    = 4,
-    AUTO    = 5,
-    REQ_TMP = 6,
-    VALVE_WTD = 7,
-    WND       = 8,
-    LAST_SEEN = 9,
-    TIMER     = 10,
-    STATE     = 11,
-    EEPROM    = 12,
-    MODE      = 13,
-    INVALID_TOPIC = 255
-};
-
-enum TimerTopic {
-    TIMER_NONE = 0,
-    TIMER_TIME,
-    TIMER_MODE,
-    INVALID_TIMER_TOPIC = 255
-};
-
-enum EEPROMAccess {
-    EA_READ  = 0,
-    EA_WRITE = 1,
-    INVALID_EEPROM_TOPIC = 255
-};
-
-enum Mode {
-    MODE_OFF = 0,
-    MODE_AUTO,
-    MODE_MANUAL,
-    MODE_OPEN,
-    INVALID_MODE_TYPE = 255
-};
-
-static const char *S_AVG_TMP   = "average_temp";
-static const char *S_BAT       = "battery";
-static const char *S_ERR       = "error";
-static const char *S_EEPROM     = "eeprom";
-static unsigned    S_EEPROM_LEN = 6;
-static const char *S_LOCK      = "lock";
-static const char *S_MODE      = "mode"; // this is a OFF/MANUAL/AUTO mode info topic
-static const char *S_AUTO      = "auto";
-static const char *S_REQ_TMP   = "requested_temp"; // 14
-static const char *S_VALVE_WTD = "valve_wanted";
-static const char *S_WND       = "window";
-static const char *S_LAST_SEEN = "last_seen";
-static const char *S_STATE     = "state";
-
-static const char *S_TIMER     = "timer";
-static unsigned    S_TIMER_LEN = 5;
-
-// timer subtopics
-static const char *S_TIMER_MODE = "mode";
-static const char *S_TIMER_TIME = "time";
-
-// set topic branch mid-prefix
-static const char *S_SET_MODE   = "set";
-
-// eeprom access strs
-static const char *S_EA_READ  = "read";
-static const char *S_EA_WRITE = "write";
-
-// valve modes
-static const char *S_MODE_OFF    = "off";
-static const char *S_MODE_AUTO   = "auto";
-static const char *S_MODE_MANUAL = "manual";
-static const char *S_MODE_OPEN   = "open";
-
-constexpr const uint8_t MAX_MQTT_PATH_LENGTH = 128;
-using PathBuffer = BufferHolder<MAX_MQTT_PATH_LENGTH>;
-
-ICACHE_FLASH_ATTR static const char *topic_str(Topic topic) {
-    switch (topic) {
-    case AVG_TMP:   return S_AVG_TMP;
-    case BAT:       return S_BAT;
-    case ERR:       return S_ERR;
-    case EEPROM:    return S_EEPROM;
-    case LOCK:      return S_LOCK;
-    case AUTO:      return S_AUTO;
-    case MODE:      return S_MODE;
-    case REQ_TMP:   return S_REQ_TMP;
-    case VALVE_WTD: return S_VALVE_WTD;
-    case WND:       return S_WND;
-    case LAST_SEEN: return S_LAST_SEEN;
-    case STATE:     return S_STATE;
-    case TIMER:     return S_TIMER;
-    default:
-        return nullptr;
-    }
-}
-
-ICACHE_FLASH_ATTR static const char *eeprom_access_str(EEPROMAccess ea) {
-    switch (ea) {
-    case EA_READ:   return S_EA_READ;
-    case EA_WRITE:  return S_EA_WRITE;
-    default:
-        return nullptr;
-    }
-}
-
-ICACHE_FLASH_ATTR static const char *timer_topic_str(TimerTopic sub) {
-    switch (sub) {
-    case TIMER_TIME: return S_TIMER_TIME;
-    case TIMER_MODE: return S_TIMER_MODE;
-    default:
-        return nullptr;
-    }
-}
-
-ICACHE_FLASH_ATTR static Topic parse_topic(const char *top) {
-    switch (*top) {
-    case 'a':
-        if (strcmp(top, S_AVG_TMP) == 0) return AVG_TMP;
-        if (strcmp(top, S_AUTO) == 0) return AUTO;
-        return INVALID_TOPIC;
-    case 'b':
-        if (strcmp(top, S_BAT) == 0) return BAT;
-        return INVALID_TOPIC;
-    case 'e':
-        if (strcmp(top, S_ERR) == 0) return ERR;
-        if (strncmp(top, S_EEPROM, S_EEPROM_LEN) == 0) return EEPROM;
-        return INVALID_TOPIC;
-    case 'l':
-        if (strcmp(top, S_LOCK) == 0) return LOCK;
-        if (strcmp(top, S_LAST_SEEN) == 0) return LAST_SEEN;
-        return INVALID_TOPIC;
-    case 'm':
-        if (strcmp(top, S_MODE) == 0) return MODE;
-    case 'r':
-        if (strcmp(top, S_REQ_TMP) == 0) return REQ_TMP;
-        return INVALID_TOPIC;
-    case 's':
-        if (strcmp(top, S_STATE) == 0) return STATE;
-        return INVALID_TOPIC;
-    case 't':
-        if (strncmp(top, S_TIMER, S_TIMER_LEN) == 0) return TIMER;
-        return INVALID_TOPIC;
-    case 'v':
-        if (strcmp(top, S_VALVE_WTD) == 0) return VALVE_WTD;
-        return INVALID_TOPIC;
-    case 'w':
-        if (strcmp(top, S_WND) == 0) return WND;
-        return INVALID_TOPIC;
-    default:
-        return INVALID_TOPIC;
-    }
-}
-
-ICACHE_FLASH_ATTR static TimerTopic parse_timer_topic(const char *top) {
-    if (!top) return INVALID_TIMER_TOPIC;
-
-    if (top[0] == 't') {
-        if (strcmp(top, S_TIMER_TIME) == 0) return TIMER_TIME;
-        return INVALID_TIMER_TOPIC;
-    }
-
-    if (top[0] == 'm') {
-        if (strcmp(top, S_TIMER_MODE) == 0) return TIMER_MODE;
-        return INVALID_TIMER_TOPIC;
-    }
-
-    return INVALID_TIMER_TOPIC;
-}
-
-ICACHE_FLASH_ATTR static EEPROMAccess parse_eeprom_access(const char *top) {
-    if (!top) return INVALID_EEPROM_TOPIC;
-
-    if (top[0] == 'r') {
-        if (strcmp(top, S_EA_READ) == 0) return EA_READ;
-        return INVALID_EEPROM_TOPIC;
-    }
-
-    if (top[0] == 'w') {
-        if (strcmp(top, S_EA_WRITE) == 0) return EA_WRITE;
-        return INVALID_EEPROM_TOPIC;
-    }
-
-    return INVALID_EEPROM_TOPIC;
-}
-
-ICACHE_FLASH_ATTR static Mode parse_mode(const char *top) {
-    if (!top) return INVALID_MODE_TYPE;
-
-    if (top[0] == 'o') {
-        if (strcmp(top, S_MODE_OFF)  == 0) return MODE_OFF;
-        if (strcmp(top, S_MODE_OPEN) == 0) return MODE_OPEN;
-    }
-
-    if (top[0] == 'a') {
-        if (strcmp(top, S_MODE_AUTO) == 0) return MODE_AUTO;
-    }
-
-    if (top[0] == 'm') {
-        if (strcmp(top, S_MODE_MANUAL) == 0) return MODE_MANUAL;
-    }
-
-    return INVALID_MODE_TYPE;
-}
-
-// mqtt path parser/composer
-struct Path {
-    static const char SEPARATOR = '/';
-    static const char WILDCARD  = '#';
-    static const char *prefix;
-
-    // static method that overrides prefix
-    ICACHE_FLASH_ATTR static void begin(const char *pfx) {
-        prefix = pfx;
-    }
-
-    ICACHE_FLASH_ATTR Path() {}
-
-    // constructor for normal or timer topics
-    ICACHE_FLASH_ATTR Path(uint8_t addr,
-                           Topic t,
-                           bool set_mode = false,
-                           TimerTopic st = TIMER_NONE,
-                           uint8_t day   = 0,
-                           uint8_t slot  = 0)
-        : addr(addr),
-          day(day),
-          slot(slot),
-          topic(t),
-          timer_topic(st),
-          set_mode(set_mode)
-    {}
-
-    // this constructs eeprom access topics
-    ICACHE_FLASH_ATTR Path(uint8_t addr,
-                           bool set_mode,
-                           EEPROMAccess ea,
-                           uint8_t ee_address)
-        : addr(addr),
-          day(0),
-          slot(0),
-          topic(EEPROM),
-          timer_topic(TIMER_NONE),
-          set_mode(set_mode),
-          eeprom_access(ea),
-          eeprom_address(ee_address)
-    {}
-
-    ICACHE_FLASH_ATTR static Str compose_set_prefix_wildcard(Buffer b) {
-        StrMaker rv(b);
-
-        rv += prefix;
-        rv += SEPARATOR;
-        rv += S_SET_MODE;
-        rv += SEPARATOR;
-        rv += WILDCARD;
+/** Client wrapper that collects the outgoing data, so a burst of small
+ * messages leaves in one TCP write. Anything that waits on the peer (reads,
+ * available) pushes the collected data out first, so request/response
+ * exchanges like CONNECT/CONNACK keep working.
+ */
+struct BufferedClient : public Client {
+    BufferedClient(Client &client) : client(client) {}
 
-        return rv.str();
+    int connect(IPAddress ip, uint16_t port) override {
+        pos = 0;
+        return client.connect(ip, port);
     }
 
-
-    ICACHE_FLASH_ATTR Str compose(Buffer b) const {
-        StrMaker rv(b);
-
-        rv += prefix;
-        rv += SEPARATOR;
-
-        if (set_mode) {
-            rv += S_SET_MODE;
-            rv += SEPARATOR;
-        }
-
-        rv += addr;
-        rv += SEPARATOR;
-        rv += topic_str(topic);
-
-        if (topic == EEPROM) {
-            rv += SEPARATOR;
-            rv += eeprom_address;
-
-            // In set mode we include read/write op. specifier
-            if (set_mode) {
-                rv += SEPARATOR;
-                rv += eeprom_access_str(eeprom_access);
-            }
-        } else if (topic == TIMER) {
-            rv += SEPARATOR;
-            rv += day;
-            rv += SEPARATOR;
-            rv += slot;
-            rv += SEPARATOR;
-            rv += timer_topic_str(timer_topic);
-        }
-
-        return rv.str();
+    int connect(const char *host, uint16_t port) override {
+        pos = 0;
+        return client.connect(host, port);
     }
 
-    ICACHE_FLASH_ATTR static Path parse(const char *p) {
-        // compare prefix first
-        const char *pos = p;
-        bool set_mode = false;
-
-        // skips the prefix path and compares if it equals
-        // also skips leading separators
-        // skip the prefix (1..n tokens)
-        pos = skip_prefix(pos, prefix);
-
-        // prefix does not match!
-        if (!pos) return {};
-
-        // premature end (just the prefix)
-        if (!*pos) return {};
-
-        // tokenize the address
-        auto addr = token(pos);
-
-        static const Token S_SET_TOK{S_SET_MODE, strlen(S_SET_MODE)};
-
-        // is it by chance a set sub_branch?
-        if (cmp_tokens(addr, S_SET_TOK)) {
-            pos = skip_token(addr);
-            set_mode = true;
-
-            if (!pos) return {};
-
-            // re-read the token for address
-            addr = token(pos);
-        }
-
-        // convert to number
-        uint8_t address = to_num(&pos, addr.second);
+    size_t write(uint8_t b) override { return write(&b, 1); }
 
-        // is the next char a separator? if not then it wasn't a valid path
-        if (*pos != Path::SEPARATOR) return {};
+    size_t write(const uint8_t *data, size_t size) override {
+        if (pos + size > MQTT_TX_BUFFER_SIZE && !send()) return 0;
 
-        ++pos;
+        // does not fit at all, goes out directly
+        if (size > MQTT_TX_BUFFER_SIZE) return client.write(data, size);
 
-        // now follows the ending element. Parse via parse_topic
-        Topic top = parse_topic(pos);
-
-        if (top == INVALID_TOPIC) return {};
-
-        if (top == EEPROM) {
-            // eeprom is a sub-tree
-            // here we see these
-            // set/.../eeprom/addr/read  - read request to an address (value sent is ignored)
-            // set/.../eeprom/addr/write - write request with value for addr written to this topic
-            // .../eeprom/addr - value as gathered from client with specified topic
-
-            // skip the token 'eeprom'
-            auto ee_topic_t = token(pos);
-            pos = ee_topic_t.first + ee_topic_t.second;
-            if (*pos != Path::SEPARATOR) return {};
-            ++pos;
-
-            // unless read mode is set, we expect an address as a continuation
-            auto addr_t = token(pos);
-            uint8_t ee_addr = to_num(&pos, addr_t.second);
-
-            // in set mode we expect either read/write tokens next
-            EEPROMAccess ea = EA_READ;
-            if (set_mode) {
-                // is the next char a separator? if not then it wasn't a valid path
-                if (*pos != Path::SEPARATOR) return {};
-                ++pos;
-
-                ea = parse_eeprom_access(pos);
-
-                if (ea == INVALID_EEPROM_TOPIC) return {};
-            }
-
-            return {address, set_mode, ea, ee_addr};
-        } else if (top == TIMER) {
-            // timer subtree... .../timer/day/slot/[mode/time]
-            // skip the 'timer' token
-            auto tt_topic_t = token(pos);
-            pos = tt_topic_t.first + tt_topic_t.second;
-
-            if (*pos != Path::SEPARATOR) return {};
-            ++pos;
-
-            // day
-            auto d_t = token(pos);
-            uint8_t d = to_num(&pos, d_t.second);
-
-            // is the next char a separator? if not then it wasn't a valid path
-            if (*pos != Path::SEPARATOR) return {};
-            ++pos;
-
-            auto s_t = token(pos);
-            uint8_t s = to_num(&pos, s_t.second);
-
-            // is the next char a separator? if not then it wasn't a valid path
-            if (*pos != Path::SEPARATOR) return {};
-            ++pos;
-
-            // now timer topic
-            auto tt = parse_timer_topic(pos);
-
-            if (tt == INVALID_TIMER_TOPIC) return {};
-
-            // whole timer specification is okay
-            return {address, top, set_mode, tt, d, s};
-        }
-
-        return {address, top, set_mode};
-    }
-
-    ICACHE_FLASH_ATTR static uint8_t to_num(const char **p, uint8_t cnt) {
-        uint8_t res = 0;
-        for (;cnt--;++(*p)) {
-            if (**p == 0) return res;
-
-            switch (**p) {
-                case '0':
-                case '1':
-                case '2':
-                case '3':
-                case '4':
-                case '5':
-                case '6':
-                case '7':
-                case '8':
-                case '9':
-                    res *= 10;
-                    res += static_cast<uint8_t>(**p - '0');
-                    continue;
-            default:
-                return res;
-            }
-        }
-        return res;
+        memcpy(buf + pos, data, size);
+        pos += size;
+        return size;
     }
 
-    using Token = std::pair<const char*, uint8_t>;
-
-    ICACHE_FLASH_ATTR static const char *skip_token(const Token &t) {
-        // skips the token chars plus optionally a separator
-        const char *end = t.first + t.second;
-        return skip_separator(end);
-    }
-
-    // skips a separator, and if there is nothing past it, it returns a nullptr
-    // returns `other` if the separator is missing (defaults to nullptr)
-    ICACHE_FLASH_ATTR static const char *skip_separator(
-        const char *p, const char *other = nullptr)
-    {
-        // skip initial SEPARATOR if present
-        if (!p) return nullptr;
-        // this might not be obvious, but it includes a trailing '\0'
-        if (*p != SEPARATOR) return other;
-        ++p;
-        if (*p == 0) return nullptr;
-        return p;
+    int available() override { send(); return client.available(); }
+    int read() override { send(); return client.read(); }
+    int read(uint8_t *data, size_t size) override {
+        send();
+        return client.read(data, size);
     }
+    int peek() override { send(); return client.peek(); }
 
+    // only pushes the collected data, does not wait for the peer's ack
+    void flush() override { send(); }
 
-    ICACHE_FLASH_ATTR static const char *skip_prefix(const char *p, const char *pfx) {
-        // also skip any initial separators in prefix path
-        // the second arg is there to ignore if the separator is missing
-        p   = skip_separator(p, p);
-        pfx = skip_separator(pfx, pfx);
-
-        // do we still have something to process?
-        while (p != nullptr && pfx != nullptr) {
-            auto p_t    = token(p);
-            auto pfx_t  = token(pfx);
-
-            // is the first token same as prefix?
-            p = cmp_tokens(p_t, pfx_t);
-
-            // differing tokens?
-            if (!p) return nullptr;
-
-            // and onto the next part of the path
-            p   = skip_token(p_t);
-            pfx = skip_token(pfx_t);
-        }
-
-        // still some prefix left? if so we didn't eat all tokens of it and have
-        // to bail
-        if (pfx) return nullptr;
-
-        return p;
-    }
-
-    ICACHE_FLASH_ATTR static const char *cmp_tokens(const Token &a, const Token &b) {
-        if (a.second != b.second) return nullptr;
-        return (strncmp(a.first, b.first, a.second) == 0) ? a.first + a.second : nullptr;
+    void stop() override {
+        pos = 0;
+        client.stop();
     }
 
-    // returns separator pos (or zero byte) and number of bytes that it took to
-    // get there
-    ICACHE_FLASH_ATTR static Token token(const char *p) {
-        const char *pos = p;
-        for(;*p;++p) {
-            if (*p == Path::SEPARATOR) {
-                break;
-            }
-        }
-
-        return {pos, p - pos};
-    }
+    uint8_t connected() override { return client.connected(); }
+    operator bool() override { return client; }
 
-    ICACHE_FLASH_ATTR bool valid() { return addr != 0; }
+    // writes out the collected data. false if the write failed
+    bool send() {
+        if (!pos) return true;
 
-    // compressed topic code for debugging (addr 5 bits, topic 4 bits, timer topic 2 bits)
-    ICACHE_FLASH_ATTR uint16_t as_uint() const {
-        return addr | ((uint16_t)topic << 5) | ((uint16_t)timer_topic << 9);
+        size_t len = pos;
+        pos = 0;
+        return client.write(buf, len) == len;
     }
 
-    // client ID. 0 means invalid path!
-    uint8_t addr = 0;
-    uint8_t day  = 0;
-    uint8_t slot = 0;
-    Topic topic            = INVALID_TOPIC;
-    TimerTopic timer_topic = TIMER_NONE;
-    bool    set_mode = false; // true in the S_SET_MODE sub-branch
-
-    EEPROMAccess eeprom_access = EA_READ;
-    uint8_t eeprom_address = 0; // eeprom address in case topic is EEPROM
+protected:
+    Client &client;
+    uint8_t buf[MQTT_TX_BUFFER_SIZE];
+    size_t pos = 0;
 };
 
 /// Publishes/receives topics in mqtt
@@ -563,10 +116,9 @@ struct MQTTPublisher {
         : config(config),
           master(master),
           wifiClient(),
-          client(wifiClient)
-    {
-        for (uint8_t i = 0; i < MAX_HR_ADDR; ++i) states[i] = 0;
-    }
+          buffered(wifiClient),
+          client(buffered)
+    {}
 
     ICACHE_FLASH_ATTR void begin() {
         client.setServer(config.mqtt_server, atoi(config.mqtt_port));
@@ -574,10 +126,14 @@ struct MQTTPublisher {
                            {
                                callback(topic, payload, length);
                            });
-        // every change gets a bitmask info here
-        master.proto.set_callback([&](uint8_t addr, uint32_t mask) {
-                                      states[addr] |= mask;
-                                  });
+        // every change gets queued into the journal of its network
+        for (auto &n : master.nets) {
+            n.proto.add_callback(
+                [](void *ctx, uint8_t addr, ChangeCategory cat, uint8_t detail) {
+                    static_cast<ChangeJournal *>(ctx)->push(addr, cat, detail);
+                },
+                &journal[n.net]);
+        }
     }
 
     ICACHE_FLASH_ATTR bool reconnect(time_t now) {
@@ -615,10 +171,11 @@ struct MQTTPublisher {
     }
 
     enum StateMajor {
-        STM_FREQ        = 0,
-        STM_TIMER       = 1,
-        STM_EEPROM      = 2,
-        STM_NEXT_CLIENT = 3
+        STM_FREQ   = 0,
+        STM_TIMER  = 1,
+        STM_EEPROM = 2,
+        STM_BULK   = 3,
+        STM_DONE   = 4
     };
 
     ICACHE_FLASH_ATTR void update(time_t now) {
@@ -628,51 +185,177 @@ struct MQTTPublisher {
 
         client.loop();
 
-        if (!states[addr]) {
-            // no changes for this client
-            // switch to next one and check here next loop
-            next_client();
+        if (now - last_stats >= STATS_PUBLISH_INTERVAL) {
+            last_stats = now;
+            publish_stats();
+        }
+
+        if (now - last_events >= EXPORT_INTERVAL) {
+            last_events = now;
+            publish_events(now);
+        }
+
+        // current change is done, take the next one from the journals,
+        // round robin over the networks
+        if (state_maj >= STM_DONE) {
+            uint8_t i = 0;
+            for (; i < RFM_RADIO_COUNT; ++i) {
+                net = (net + 1) % RFM_RADIO_COUNT;
+                if (journal[net].pop(change)) break;
+            }
+            if (i == RFM_RADIO_COUNT) return;
+
+            addr      = change.addr;
+            state_maj = STM_FREQ;
+            state_min = 0;
+        }
+
+        // the values of the change go out in batches, not to hold the
+        // radio up for a whole timer table
+        published = 0;
+        while (state_maj < STM_DONE && published < MQTT_PUBLISH_BATCH) {
+            switch (state_maj) {
+            case STM_FREQ:
+                publish_frequent();
+                break;
+            case STM_TIMER:
+                publish_timers();
+                break;
+            case STM_EEPROM:
+                publish_eeprom();
+                break;
+            case STM_BULK:
+                publish_bulk();
+                break;
+            default:
+                state_maj = STM_DONE;
+            }
+        }
+
+        // the batch in one TCP write
+        if (!buffered.send()) ERR_ARG(MQTT_CANT_PUBLISH, id());
+    }
+
+    // client id of the change being published
+    uint8_t id() const { return HR20Master::client_id(net, addr); }
+
+    // client of the change being published
+    ICACHE_FLASH_ATTR HR20 *current() { return master.nets[net].model[addr]; }
+
+    // composes the topic path for publishing. The "prefix/addr/" part is
+    // kept in the buffer for as long as the same client is published
+    ICACHE_FLASH_ATTR Str path_for(const Path &p) {
+        Buffer b = path_buf;
+
+        if (!path_prefix_len || path_addr != p.addr) {
+            StrMaker pm(b);
+            p.compose_prefix(pm);
+            path_prefix_len = pm.invalid() ? 0 : pm.size();
+            path_addr = p.addr;
+        }
+
+        StrMaker rv(Buffer{b.ptr + path_prefix_len, b.len - path_prefix_len});
+        p.compose_topic(rv);
+        Str topic = rv.str();
+
+        if (!path_prefix_len || rv.invalid()) return {};
+
+        return Str{b.ptr, path_prefix_len + topic.length()};
+    }
+
+    // {"lost":N,"drop":N,"ev":[[seq,time,type,code,value],...]}
+    ICACHE_FLASH_ATTR void publish_events(time_t now) {
+        exporter.start(now);
+
+        BufferHolder<MQTT_TX_BUFFER_SIZE - MAX_MQTT_PATH_LENGTH> buf;
+        StrMaker sm{buf};
+        uint8_t count = 0;
+        {
+            json::Object obj(sm);
+            json::kv_raw(obj, "lost", (unsigned)exporter.lost);
+            json::kv_raw(obj, "drop", (unsigned)exporter.dropped);
+            obj.key("ev");
+            json::Array arr(obj);
+
+            Event ev;
+            while (count < EXPORT_BATCH_EVENTS && exporter.next(ev)) {
+                ++count;
+                arr.element();
+                json::Array e(arr);
+                sm += (unsigned)ev.seq;
+                sm += ',';
+                sm += (long)ev.time;
+                sm += ',';
+                sm += (unsigned)ev.type;
+                sm += ',';
+                sm += (unsigned)ev.code;
+                sm += ',';
+                sm += (unsigned)ev.value;
+            }
+        }
+
+        // nothing to report
+        if (!count && !exporter.lost && !exporter.dropped) return;
+
+        PathBuffer pb;
+        auto path = Path::compose_global(pb, S_EVENTS);
+        auto val  = sm.str();
+
+        // not committed - the same events get another try next time
+        if (val.length() == 0 || path.length() == 0 ||
+            !client.publish(path.c_str(),
+                            reinterpret_cast<const uint8_t *>(val.c_str()),
+                            val.length(), false))
+        {
+            ERR(MQTT_CANT_PUBLISH);
             return;
         }
 
-        switch (state_maj) {
-        case STM_FREQ:
-            publish_frequent();
-            break;
-        case STM_TIMER:
-            publish_timers();
-            break;
-        case STM_EEPROM:
-            publish_eeprom();
-            break;
-        default:
-            next_client();
+        // goes out right away, not with the next change
+        if (!buffered.send()) {
+            ERR(MQTT_CANT_PUBLISH);
+            return;
         }
+
+        exporter.commit();
     }
 
-    ICACHE_FLASH_ATTR void next_client() {
-        // process one client per loop call (i.e. per second)
-        ++addr;
+    ICACHE_FLASH_ATTR void publish_stats() {
+        PathBuffer pb;
+        auto path = Path::compose_global(pb, S_STATS);
+
+        BufferHolder<MQTT_TX_BUFFER_SIZE - MAX_MQTT_PATH_LENGTH> buf;
+        StrMaker sm{buf};
+#ifdef MEMSTATS
+        json::append_link_stats(sm, linkStats, nullptr, &memStats);
+#else
+        json::append_link_stats(sm, linkStats);
+#endif
 
-        // wraparound
-        if (addr >= MAX_HR_ADDR) addr = 0;
+        auto val = sm.str();
+        if (val.length() == 0 || path.length() == 0 ||
+            !client.publish(path.c_str(),
+                            reinterpret_cast<const uint8_t *>(val.c_str()),
+                            val.length(), false))
+        {
+            ERR(MQTT_CANT_PUBLISH);
+            return;
+        }
 
-        // reset the major/minor state indicators
-        state_maj = STM_FREQ;
-        state_min = 0;
+        // goes out right away, not with the next change
+        if (!buffered.send()) ERR(MQTT_CANT_PUBLISH);
     }
 
     ICACHE_FLASH_ATTR void next_major() {
         state_min = 0;
         ++state_maj;
-        if (state_maj >= STM_NEXT_CLIENT) next_client();
     }
 
     template <typename T, typename CvT>
     ICACHE_FLASH_ATTR void publish(const Str &path,
                                    CachedValue<T, CvT> &val,
                                    uint16_t hint,
-                                   bool retain = MQTT_RETAIN) const
+                                   bool retain = MQTT_RETAIN)
     {
         if (val.published() || !val.remote_valid())
             return;
@@ -680,6 +363,7 @@ struct MQTTPublisher {
         cvt::ValueBuffer vb;
         auto vstr = val.to_str(vb);
 
+        ++published;
         if (client.publish(path.c_str(),
                            reinterpret_cast<const uint8_t *>(vstr.c_str()),
                            vstr.length(),
@@ -696,20 +380,19 @@ struct MQTTPublisher {
 
     template <typename T, typename CvT>
     ICACHE_FLASH_ATTR void publish(const Path &p,
-                                   CachedValue<T, CvT> &val) const
+                                   CachedValue<T, CvT> &val)
     {
-        PathBuffer pb;
-        auto path = p.compose(pb);
+        auto path = path_for(p);
         publish(path.c_str(), val, p.as_uint());
     }
 
     ICACHE_FLASH_ATTR void publish(const Path &p,
                                    const Str &val,
-                                   bool retain = MQTT_RETAIN) const
+                                   bool retain = MQTT_RETAIN)
     {
-        PathBuffer pb;
-        auto path = p.compose(pb);
+        auto path = path_for(p);
 
+        ++published;
         if (client.publish(path.c_str(),
                            reinterpret_cast<const uint8_t *>(val.c_str()),
                            val.length(),
@@ -723,18 +406,16 @@ struct MQTTPublisher {
 
     template <typename T, typename CvT>
     ICACHE_FLASH_ATTR void publish_synced(const Path &p,
-                                          SyncedValue<T, CvT> &val) const
+                                          SyncedValue<T, CvT> &val)
     {
-        PathBuffer pb;
-        auto path = p.compose(pb);
+        auto path = path_for(p);
 
         publish(path.c_str(), val, p.as_uint());
     }
 
-    ICACHE_FLASH_ATTR void publish_timer_slot(const Path &p, TimerSlot &val) const
+    // returns true if the slot was published
+    ICACHE_FLASH_ATTR bool publish_timer_slot(const Path &p, TimerSlot &val)
     {
-        PathBuffer pb;
-
         // clone paths and set the two possile endings for them
         Path mode_path{p};
         Path time_path{p};
@@ -744,18 +425,19 @@ struct MQTTPublisher {
 
         if (!val.published() && val.remote_valid()) {
             const auto &remote = val.get_remote();
+            published += 2;
 
             // holds the converted value between to_str and publish
             cvt::ValueBuffer vb;
             auto mode = cvt::Simple::to_str(vb, remote.mode());
-            auto path = mode_path.compose(pb);
+            auto path = path_for(mode_path);
             bool err =
                 client.publish(path.c_str(),
                                reinterpret_cast<const uint8_t *>(mode.c_str()),
                                mode.length(),
                                /*retained*/ MQTT_RETAIN);
 
-            path = time_path.compose(pb);
+            path = path_for(time_path);
             // overwrites the old vb content!
             auto time = cvt::TimeHHMM::to_str(vb, remote.time());
             bool err1 =
@@ -772,11 +454,14 @@ struct MQTTPublisher {
             }
 
             val.published() = true;
+            return true;
         }
+
+        return false;
     }
 
     ICACHE_FLASH_ATTR void publish_eeprom() {
-        if ((states[addr] & CHANGE_EEPROM) == 0) {
+        if ((change.cat & CHANGE_EEPROM) == 0) {
             // no changes. advance...
             next_major();
             return;
@@ -786,35 +471,44 @@ struct MQTTPublisher {
         // TOO VERBOSE
         DBG("(ME %u)", addr);
 #endif
-        auto *hr = master.model[addr];
+        auto *hr = current();
         if (!hr) {
             ERR(MQTT_INVALID_CLIENT);
+            state_maj = STM_DONE;
+            return;
+        }
+
+        // single cell change
+        if (change.detail != CHANGE_DETAIL_ALL) {
+            Path p{id(), false, mqtt::EA_READ, change.detail};
+            auto *cell = hr->eeprom.find(change.detail);
+            if (cell) publish(p, *cell);
+            next_major();
             return;
         }
 
-        // playloads of 16 addresses
-        for (unsigned cnt = 0; cnt < 16; ++cnt) {
-            if (state_min >= EEPROM_SIZE) {
+        // cached cells, up to the batch limit
+        for (; published < MQTT_PUBLISH_BATCH; ++state_min) {
+            if (state_min >= EEPROM_CACHE_SLOTS) {
                 DBG("(PUB E)");
                 // whatever happens, we transition to next state
-                states[addr] &= ~CHANGE_EEPROM;
                 next_major(); // moves to next major state
                 break;
             }
 
-            Path p{addr, false, mqtt::EA_READ, state_min};
+            if (!hr->eeprom.slot_used(state_min)) continue;
 
-            auto &rec = hr->eeprom[state_min];
+            Path p{id(), false, mqtt::EA_READ,
+                   hr->eeprom.slot_addr(state_min)};
 
             // only publish remote-valid values
-            publish(p, rec);
-            ++state_min;
+            publish(p, hr->eeprom.slot_cell(state_min));
         }
     }
 
 
     ICACHE_FLASH_ATTR void publish_frequent() {
-        if ((states[addr] & CHANGE_FREQUENT) == 0) {
+        if ((change.cat & CHANGE_FREQUENT) == 0) {
             // no changes. advance...
             next_major();
             return;
@@ -825,13 +519,19 @@ struct MQTTPublisher {
         DBG("(MF %u)", addr);
 #endif
 
-        auto *hr = master.model[addr];
+        auto *hr = current();
         if (!hr) {
             ERR(MQTT_INVALID_CLIENT);
+            state_maj = STM_DONE;
             return;
         }
 
-        Path p{addr, mqtt::INVALID_TOPIC};
+        Path p{id(), mqtt::INVALID_TOPIC};
+
+#ifdef MQTT_STATE_ONLY
+        // only the json state topic carries the frequent values
+        if (state_min < 10) state_min = 10;
+#endif
 
 #define STATE(ST) case ST
 #define NEXT_MIN_STATE ++state_min; break;
@@ -903,7 +603,7 @@ struct MQTTPublisher {
 #ifdef MQTT_JSON
         STATE(10): {
             p.topic = mqtt::STATE;
-            BufferHolder<160> buf;
+            BufferHolder<192> buf;
             StrMaker sm{buf};
             json::append_client_attr(sm, *hr);
             publish(p, sm.str());
@@ -913,8 +613,6 @@ struct MQTTPublisher {
 
         default:
             DBG("(PUB F)");
-            // clear out the change bit
-            states[addr] &= ~CHANGE_FREQUENT;
             next_major(); // moves to next major state
             break;
         }
@@ -923,50 +621,82 @@ struct MQTTPublisher {
     }
 
     ICACHE_FLASH_ATTR void publish_timers() {
-        auto *hr = master.model[addr];
+        auto *hr = current();
         if (!hr) {
             ERR(MQTT_INVALID_CLIENT);
+            state_maj = STM_DONE;
             return;
         }
 
-        if ((states[addr] & CHANGE_TIMER_MASK) == 0) {
+        if ((change.cat & CHANGE_TIMER_MASK) == 0) {
             next_major();
             return;
         }
 
-        // the minor state encodes day/slot
-        uint8_t day  = state_min >> 3;
-        uint8_t slot = state_min  & 0x7;
-        ++state_min;
+        // single slot change
+        if (change.detail != CHANGE_DETAIL_ALL) {
+            uint8_t day  = change.detail / TIMER_SLOTS_PER_DAY;
+            uint8_t slot = change.detail % TIMER_SLOTS_PER_DAY;
 
-        uint8_t mask = change_get_timer_mask(states[addr]);
+            if (day < TIMER_DAYS) {
+                Path p{id(), mqtt::TIMER, false, mqtt::TIMER_NONE, day, slot};
+                publish_timer_slot(p, hr->timers[day][slot]);
+            }
 
-        // if we overshot the day counter, we switch to next
-        // major slot (or client in this case)
-        if (day >= 8) {
-            DBG("(PUB T)");
             next_major();
             return;
         }
 
-        // the current day/slot is not changed?
-        // visit the next day/slot next time
-        if (!((1 << day) & mask)) {
-            return;
-        }
+        uint8_t mask = change_get_timer_mask(change.cat);
+
+        // the minor state encodes day/slot. Unchanged days and already
+        // published slots are skipped, one slot gets published per call
+        while (state_min < TIMER_DAYS * TIMER_SLOTS_PER_DAY) {
+            uint8_t day  = state_min / TIMER_SLOTS_PER_DAY;
+            uint8_t slot = state_min % TIMER_SLOTS_PER_DAY;
+
+            if (!((1 << day) & mask)) {
+                state_min = (day + 1) * TIMER_SLOTS_PER_DAY;
+                continue;
+            }
 
-        // clear out the mask bit for the particular day if the last slot is hit
-        if (slot == TIMER_SLOTS_PER_DAY - 1) states[addr] &= ~timer_day_2_change[day];
+            ++state_min;
 
 #ifdef VERBOSE
-        // TOO VERBOSE
-        DBG("(MT %u %u %u)", addr, day, slot);
+            // TOO VERBOSE
+            DBG("(MT %u %u %u)", addr, day, slot);
 #endif
-        // only publish timers that have bit set in mask
-        Path p{addr, mqtt::TIMER, false, mqtt::TIMER_NONE, day, slot};
+            Path p{id(), mqtt::TIMER, false, mqtt::TIMER_NONE, day, slot};
+
+            // TODO: Rework this to implicit conversion system
+            if (publish_timer_slot(p, hr->timers[day][slot])) return;
+        }
+
+        DBG("(PUB T)");
+        next_major();
+    }
+
+    ICACHE_FLASH_ATTR void publish_bulk() {
+        next_major();
+
+        if ((change.cat & CHANGE_BULK) == 0) return;
+
+        auto *hr = current();
+        if (!hr) {
+            ERR(MQTT_INVALID_CLIENT);
+            return;
+        }
+
+        Path p{id(), mqtt::BULK};
+        cvt::ValueBuffer vb;
+        StrMaker sm{vb};
 
-        // TODO: Rework this to implicit conversion system
-        publish_timer_slot(p, hr->timers[day][slot]);
+        if (hr->bulk_state == BULK_ABORTED)
+            sm += S_BULK_FAILED;
+        else
+            sm += (int)hr->bulk_progress();
+
+        publish(p, sm.str());
     }
 
     ICACHE_FLASH_ATTR void callback(char *topic, byte *payload,
@@ -985,48 +715,120 @@ struct MQTTPublisher {
             return;
         }
 
-        auto *hr = master.model[p.addr];
+        // Arduino string does NOT have char*+len concat/ctor...
+        Str val{(const char *)payload, length};
+
+        if (p.is_zone()) {
+            set_zone(p, val);
+            return;
+        }
+
+        auto *hr = master.client(p.addr);
         if (!hr) {
             ERR(MQTT_CALLBACK_BAD_ADDR);
             return;
         }
 
-        bool ok = true; // false indicates an invalid value was encountered
-        // Arduino string does NOT have char*+len concat/ctor...
-        Str val{(const char *)payload, length};
+        // false indicates an invalid value was encountered
+        bool ok = apply(*hr, p, val);
+
+        if (ok) requested(*hr, p.addr);
+
+        EVENT_ARG(MQTT_CALLBACK, p.as_uint());
+        DBG("(MQTT %d %d %d)", p.addr, p.as_uint(), ok ? 1 : 0);
+
+        // conversion went sideways
+        if (!ok) {
+            ERR_ARG(MQTT_INVALID_TOPIC_VALUE, p.as_uint());
+#ifdef VERBOSE
+            DBG("(MQ ERR %d %d %s)", p.addr, p.topic, val.c_str());
+#endif
+        }
+
+#ifdef VERBOSE
+        DBG("(MQC %d %d)", p.addr, p.topic);
+#endif
+    }
+
+    // fans the request out to every valve of the zone
+    ICACHE_FLASH_ATTR void set_zone(const Path &p, const Str &val) {
+        uint64_t ids;
+        if (!config.zone_members(p.zone.data(), p.zone.length(), ids)) {
+            ERR(MQTT_INVALID_ZONE);
+            return;
+        }
+
+        uint8_t count = 0;
+        bool ok = true;
+
+        for (; ids; ids &= ids - 1) {
+            uint8_t id = __builtin_ctzll(ids);
+            auto *hr = master.client(id);
+            if (!hr) continue;
+
+            // the value is the same for all, so is its validity
+            if (!apply(*hr, p, val)) {
+                ok = false;
+                break;
+            }
+
+            requested(*hr, id);
+            ++count;
+        }
+
+        EVENT_ARG(MQTT_CALLBACK, p.as_uint());
+        DBG("(MQTT ZONE %d %d %d)", p.as_uint(), count, ok ? 1 : 0);
+
+        if (!ok) ERR_ARG(MQTT_INVALID_TOPIC_VALUE, p.as_uint());
+    }
+
+    // change happened on the client model, sync is lost. The client gets
+    // forced in the next sync to pick it up
+    ICACHE_FLASH_ATTR void requested(HR20 &hr, uint8_t id) {
+        hr.synced = false;
+        ++hr.gen;
+        master.force_next(id);
+    }
+
+    // applies the set request to the client. false if the value was invalid
+    ICACHE_FLASH_ATTR bool apply(HR20 &hr, const Path &p, const Str &val) {
+        bool ok = true;
+        const char *payload = val.data();
+        unsigned length     = val.length();
 
         switch (p.topic) {
-        case mqtt::REQ_TMP: ok = hr->temp_wanted.set_requested_from_str(val); break;
-        case mqtt::AUTO: ok = hr->auto_mode.set_requested_from_str(val); break;
+        case mqtt::REQ_TMP: ok = hr.temp_wanted.set_requested_from_str(val); break;
+        case mqtt::AUTO: ok = hr.auto_mode.set_requested_from_str(val); break;
         case mqtt::MODE: {
             // off will set temp to TEMP_OFF
             auto mode = parse_mode(val.c_str());
 
             switch (mode) {
             case MODE_OFF: // off sets manual and 4.5 degrees
-                hr->auto_mode.set_requested(false);
-                hr->temp_wanted.set_requested(TEMP_OFF);
+                hr.auto_mode.set_requested(false);
+                hr.temp_wanted.set_requested(TEMP_OFF);
                 ok = true;
                 break;
             case MODE_OPEN: // open sets over 30C and manual
-                hr->auto_mode.set_requested(false);
-                hr->temp_wanted.set_requested(TEMP_OPEN);
+                hr.auto_mode.set_requested(false);
+                hr.temp_wanted.set_requested(TEMP_OPEN);
                 ok = true;
                 break;
             case MODE_AUTO:
                 ok = true;
-                hr->auto_mode.set_requested(true); break;
+                hr.auto_mode.set_requested(true); break;
             case MODE_MANUAL:
                 ok = true;
-                hr->auto_mode.set_requested(false); break;
+                hr.auto_mode.set_requested(false); break;
             default:
                 ERR(MQTT_INVALID_TOPIC_VALUE);
                 ok = false;
             }
+            break;
         }
-        case mqtt::LOCK: ok = hr->menu_locked.set_requested_from_str(val); break;
+        case mqtt::LOCK: ok = hr.menu_locked.set_requested_from_str(val); break;
         case mqtt::EEPROM: {
-            //            ok = hr->eeprom;
+            //            ok = hr.eeprom;
             // we're in set mode here. for reads we invalidate the remote and let it be read again
             if (p.eeprom_access == EA_WRITE) {
                 int ival = 0;
@@ -1035,13 +837,10 @@ struct MQTTPublisher {
                     ok = false;
                     break;
                 }
-                hr->eeprom[p.eeprom_address].set_requested(ival);
+                ok = hr.request_eeprom_write(p.eeprom_address, ival);
             } else if (p.eeprom_access == EA_READ) {
                 // we got a re-read request, we do it without questioning
-                // we unmask the value in case it was not seen since reboot
-                // and also invalidate remote in case it was already read...
-                hr->eeprom[p.eeprom_address].masked() = false;
-                hr->eeprom[p.eeprom_address].remote_valid() = false;
+                ok = hr.request_eeprom_read(p.eeprom_address);
             } else {
                 ERR(MQTT_INVALID_TOPIC);
                 ok = false;
@@ -1063,46 +862,52 @@ struct MQTTPublisher {
 
             // subswitch based on the timer topic
             switch (p.timer_topic) {
-            case mqtt::TIMER_MODE: ok = hr->set_timer_mode(p.day, p.slot, val); break;
-            case mqtt::TIMER_TIME: ok = hr->set_timer_time(p.day, p.slot, val); break;
+            case mqtt::TIMER_MODE: ok = hr.set_timer_mode(p.day, p.slot, val); break;
+            case mqtt::TIMER_TIME: ok = hr.set_timer_time(p.day, p.slot, val); break;
             default: ERR(MQTT_INVALID_TIMER_TOPIC);
             }
             break;
         }
-        default: ERR(MQTT_INVALID_TOPIC); return;
-        }
-
-        // not an error. change happened on the client model, sync is lost
-        if (ok) hr->synced = false;
-
-        EVENT_ARG(MQTT_CALLBACK, p.as_uint());
-        DBG("(MQTT %d %d %d)", p.addr, p.as_uint(), ok ? 1 : 0);
-
-        // conversion went sideways
-        if (!ok) {
-            ERR_ARG(MQTT_INVALID_TOPIC_VALUE, p.as_uint());
-#ifdef VERBOSE
-            DBG("(MQ ERR %d %d %s)", p.addr, p.topic, val.c_str());
-#endif
+        case mqtt::TIMERS:
+            ok = apply_timer_table(hr, payload, length,
+                                   p.timer_topic == mqtt::TIMER_BINARY
+                                       ? TIMER_TABLE_BINARY
+                                       : TIMER_TABLE_JSON) >= 0;
+            break;
+        default:
+            ERR(MQTT_INVALID_TOPIC);
+            ok = false;
         }
 
-#ifdef VERBOSE
-        DBG("(MQC %d %d)", p.addr, p.topic);
-#endif
+        return ok;
     }
 
     Config &config;
     HR20Master &master;
     WiFiClient wifiClient;
+    BufferedClient buffered;
     /// seriously, const correctness anyone? PubSubClient does not have single const method...
     mutable PubSubClient client;
-    uint32_t states[MAX_HR_ADDR];
+    // reusable topic path, see path_for
+    PathBuffer path_buf;
+    unsigned path_prefix_len = 0;
+    uint8_t  path_addr = 0;
+
+    // changes waiting to be published, per radio network
+    ChangeJournal journal[RFM_RADIO_COUNT];
 
-    // Publisher state machine
+    // Publisher state machine - processes one change at a time
+    ChangeJournal::Entry change;
+    uint8_t net  = 0; // network and the client address in it
     uint8_t addr = 0;
-    uint8_t  state_maj = 0; // state category (FREQUENT, CALENDAR)
+    uint8_t  state_maj = STM_DONE; // state category (FREQUENT, CALENDAR)
     uint16_t state_min = 0; // state detail (depends on major state)
+    uint8_t published = 0; // messages sent in this update call
     time_t   last_conn = 0; // last connection attempt
+    time_t   last_stats = 0; // last link statistics publish
+    time_t   last_events = 0; // last event batch publish
+    // event log position of the events topic
+    EventExporter exporter;
 };
 
 } // namespace mqtt
@@ -0,0 +1,554 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#include "config.h"
+#include "str.h"
+
+namespace hr20 {
+namespace mqtt {
+
+// topic enum. Each has different initial letter for simple parsing
+enum Topic {
+    AVG_TMP = 1,
+    BAT     = 2,
+    ERR     = 3,
+    LOCK    = 4,
+    AUTO    = 5,
+    REQ_TMP = 6,
+    VALVE_WTD = 7,
+    WND       = 8,
+    LAST_SEEN = 9,
+    TIMER     = 10,
+    STATE     = 11,
+    EEPROM    = 12,
+    MODE      = 13,
+    TIMERS    = 14, // whole timer table, set only
+    BULK      = 15, // bulk session progress, publish only
+    INVALID_TOPIC = 255
+};
+
+enum TimerTopic {
+    TIMER_NONE = 0,
+    TIMER_TIME,
+    TIMER_MODE,
+    TIMER_BINARY, // set/.../timers/bin - the table is binary, not json
+    INVALID_TIMER_TOPIC = 255
+};
+
+enum EEPROMAccess {
+    EA_READ  = 0,
+    EA_WRITE = 1,
+    INVALID_EEPROM_TOPIC = 255
+};
+
+enum Mode {
+    MODE_OFF = 0,
+    MODE_AUTO,
+    MODE_MANUAL,
+    MODE_OPEN,
+    INVALID_MODE_TYPE = 255
+};
+
+static constexpr const char S_AVG_TMP[]   = "average_temp";
+static constexpr const char S_BAT[]       = "battery";
+static constexpr const char S_ERR[]       = "error";
+static constexpr const char S_EEPROM[]    = "eeprom";
+static constexpr const char S_LOCK[]      = "lock";
+static constexpr const char S_MODE[]      = "mode"; // this is a OFF/MANUAL/AUTO mode info topic
+static constexpr const char S_AUTO[]      = "auto";
+static constexpr const char S_REQ_TMP[]   = "requested_temp"; // 14
+static constexpr const char S_VALVE_WTD[] = "valve_wanted";
+static constexpr const char S_WND[]       = "window";
+static constexpr const char S_LAST_SEEN[] = "last_seen";
+static constexpr const char S_STATE[]     = "state";
+// percentage of the bulk session done, "failed" if it was aborted
+static constexpr const char S_BULK[]      = "bulk";
+static constexpr const char S_BULK_FAILED[] = "failed";
+// global (not per-client) topic with the link statistics
+static constexpr const char S_STATS[]     = "stats";
+// global topic the event log is exported to, in batches
+static constexpr const char S_EVENTS[]    = "events";
+
+static constexpr const char S_TIMER[]     = "timer";
+// accepted in set topics as an alias, on its own it is the whole table
+static constexpr const char S_TIMERS[]    = "timers";
+
+// timer subtopics
+static constexpr const char S_TIMER_MODE[] = "mode";
+static constexpr const char S_TIMER_TIME[] = "time";
+// binary whole table upload, after timers
+static constexpr const char S_TIMER_BINARY[] = "bin";
+
+// set topic branch mid-prefix
+static constexpr const char S_SET_MODE[]   = "set";
+// set/zone/NAME/... fans the value out to the valves of the zone
+static constexpr const char S_ZONE[]       = "zone";
+
+// eeprom access strs
+static constexpr const char S_EA_READ[]  = "read";
+static constexpr const char S_EA_WRITE[] = "write";
+
+// valve modes
+static const char *S_MODE_OFF    = "off";
+static const char *S_MODE_AUTO   = "auto";
+static const char *S_MODE_MANUAL = "manual";
+static const char *S_MODE_OPEN   = "open";
+
+// FNV-1a hash of a topic token. constexpr so the dispatch tables get
+// generated at compile time - colliding vocabulary would not compile, since
+// it would produce duplicate case labels
+constexpr uint32_t token_hash(const char *s, size_t len,
+                              uint32_t h = 2166136261u)
+{
+    return len ? token_hash(s + 1, len - 1,
+                            (h ^ static_cast<uint8_t>(*s)) * 16777619u)
+               : h;
+}
+
+template<size_t N>
+constexpr uint32_t token_hash(const char (&s)[N]) {
+    return token_hash(s, N - 1);
+}
+
+/// one element of a topic path, as split by Tokens
+struct Token {
+    const char *ptr = nullptr;
+    uint8_t len     = 0;
+    int16_t num     = -1; // numeric value, -1 if not a number (0-255)
+
+    template<size_t N>
+    bool operator==(const char (&s)[N]) const {
+        return len == N - 1 && memcmp(ptr, s, len) == 0;
+    }
+
+    uint32_t hash() const { return token_hash(ptr, len); }
+};
+
+/// single pass path tokenizer - splits the rest of the topic path by
+/// separators, converting numeric tokens on the way
+struct Tokens {
+    static constexpr const uint8_t MAX_TOKENS = 8;
+
+    ICACHE_FLASH_ATTR Tokens(const char *p) {
+        Token *t = tok;
+        t->ptr = p;
+        t->num = 0;
+
+        for (;; ++p) {
+            char c = *p;
+
+            if (c == '/' || c == 0) {
+                t->len = p - t->ptr;
+                if (!t->len) t->num = -1;
+
+                ++count;
+                if (c == 0) break;
+
+                if (count >= MAX_TOKENS) {
+                    overflow = true;
+                    break;
+                }
+
+                ++t;
+                t->ptr = p + 1;
+                t->num = 0;
+                continue;
+            }
+
+            if (t->num < 0) continue;
+
+            if (c >= '0' && c <= '9') {
+                t->num = t->num * 10 + (c - '0');
+                if (t->num > 255) t->num = -1;
+            } else {
+                t->num = -1;
+            }
+        }
+    }
+
+    const Token &operator[](uint8_t i) const { return tok[i]; }
+
+    Token tok[MAX_TOKENS];
+    uint8_t count = 0;
+    bool overflow = false;
+};
+
+constexpr const uint8_t MAX_MQTT_PATH_LENGTH = 128;
+using PathBuffer = BufferHolder<MAX_MQTT_PATH_LENGTH>;
+
+ICACHE_FLASH_ATTR inline const char *topic_str(Topic topic) {
+    switch (topic) {
+    case AVG_TMP:   return S_AVG_TMP;
+    case BAT:       return S_BAT;
+    case ERR:       return S_ERR;
+    case EEPROM:    return S_EEPROM;
+    case LOCK:      return S_LOCK;
+    case AUTO:      return S_AUTO;
+    case MODE:      return S_MODE;
+    case REQ_TMP:   return S_REQ_TMP;
+    case VALVE_WTD: return S_VALVE_WTD;
+    case WND:       return S_WND;
+    case LAST_SEEN: return S_LAST_SEEN;
+    case STATE:     return S_STATE;
+    case TIMER:     return S_TIMER;
+    case TIMERS:    return S_TIMERS;
+    case BULK:      return S_BULK;
+    default:
+        return nullptr;
+    }
+}
+
+ICACHE_FLASH_ATTR inline const char *eeprom_access_str(EEPROMAccess ea) {
+    switch (ea) {
+    case EA_READ:   return S_EA_READ;
+    case EA_WRITE:  return S_EA_WRITE;
+    default:
+        return nullptr;
+    }
+}
+
+ICACHE_FLASH_ATTR inline const char *timer_topic_str(TimerTopic sub) {
+    switch (sub) {
+    case TIMER_TIME: return S_TIMER_TIME;
+    case TIMER_MODE: return S_TIMER_MODE;
+    case TIMER_BINARY: return S_TIMER_BINARY;
+    default:
+        return nullptr;
+    }
+}
+
+#define TOKEN_CASE(STR, VAL) case token_hash(STR): return (t == STR) ? VAL
+ICACHE_FLASH_ATTR inline Topic parse_topic(const Token &t) {
+    switch (t.hash()) {
+    TOKEN_CASE(S_AVG_TMP,   AVG_TMP)   : INVALID_TOPIC;
+    TOKEN_CASE(S_AUTO,      AUTO)      : INVALID_TOPIC;
+    TOKEN_CASE(S_BAT,       BAT)       : INVALID_TOPIC;
+    TOKEN_CASE(S_ERR,       ERR)       : INVALID_TOPIC;
+    TOKEN_CASE(S_EEPROM,    EEPROM)    : INVALID_TOPIC;
+    TOKEN_CASE(S_LOCK,      LOCK)      : INVALID_TOPIC;
+    TOKEN_CASE(S_LAST_SEEN, LAST_SEEN) : INVALID_TOPIC;
+    TOKEN_CASE(S_MODE,      MODE)      : INVALID_TOPIC;
+    TOKEN_CASE(S_REQ_TMP,   REQ_TMP)   : INVALID_TOPIC;
+    TOKEN_CASE(S_STATE,     STATE)     : INVALID_TOPIC;
+    TOKEN_CASE(S_TIMER,     TIMER)     : INVALID_TOPIC;
+    TOKEN_CASE(S_TIMERS,    TIMER)     : INVALID_TOPIC;
+    TOKEN_CASE(S_VALVE_WTD, VALVE_WTD) : INVALID_TOPIC;
+    TOKEN_CASE(S_WND,       WND)       : INVALID_TOPIC;
+    default:
+        return INVALID_TOPIC;
+    }
+}
+
+ICACHE_FLASH_ATTR inline TimerTopic parse_timer_topic(const Token &t) {
+    switch (t.hash()) {
+    TOKEN_CASE(S_TIMER_TIME, TIMER_TIME) : INVALID_TIMER_TOPIC;
+    TOKEN_CASE(S_TIMER_MODE, TIMER_MODE) : INVALID_TIMER_TOPIC;
+    default:
+        return INVALID_TIMER_TOPIC;
+    }
+}
+
+ICACHE_FLASH_ATTR inline EEPROMAccess parse_eeprom_access(const Token &t) {
+    switch (t.hash()) {
+    TOKEN_CASE(S_EA_READ,  EA_READ)  : INVALID_EEPROM_TOPIC;
+    TOKEN_CASE(S_EA_WRITE, EA_WRITE) : INVALID_EEPROM_TOPIC;
+    default:
+        return INVALID_EEPROM_TOPIC;
+    }
+}
+#undef TOKEN_CASE
+
+ICACHE_FLASH_ATTR inline Mode parse_mode(const char *top) {
+    if (!top) return INVALID_MODE_TYPE;
+
+    if (top[0] == 'o') {
+        if (strcmp(top, S_MODE_OFF)  == 0) return MODE_OFF;
+        if (strcmp(top, S_MODE_OPEN) == 0) return MODE_OPEN;
+    }
+
+    if (top[0] == 'a') {
+        if (strcmp(top, S_MODE_AUTO) == 0) return MODE_AUTO;
+    }
+
+    if (top[0] == 'm') {
+        if (strcmp(top, S_MODE_MANUAL) == 0) return MODE_MANUAL;
+    }
+
+    return INVALID_MODE_TYPE;
+}
+
+// mqtt path parser/composer
+struct Path {
+    static const char SEPARATOR = '/';
+    static const char WILDCARD  = '#';
+    static const char *prefix;
+    // prefix as matched in parse - without leading/trailing separators
+    static const char *match_prefix;
+    static uint8_t match_prefix_len;
+
+    // static method that overrides prefix
+    ICACHE_FLASH_ATTR static void begin(const char *pfx) {
+        prefix = pfx;
+
+        while (*pfx == SEPARATOR) ++pfx;
+        size_t len = strlen(pfx);
+        while (len && pfx[len - 1] == SEPARATOR) --len;
+
+        match_prefix     = pfx;
+        match_prefix_len = len;
+    }
+
+    ICACHE_FLASH_ATTR Path() {}
+
+    // constructor for normal or timer topics
+    ICACHE_FLASH_ATTR Path(uint8_t addr,
+                           Topic t,
+                           bool set_mode = false,
+                           TimerTopic st = TIMER_NONE,
+                           uint8_t day   = 0,
+                           uint8_t slot  = 0)
+        : addr(addr),
+          day(day),
+          slot(slot),
+          topic(t),
+          timer_topic(st),
+          set_mode(set_mode)
+    {}
+
+    // this constructs eeprom access topics
+    ICACHE_FLASH_ATTR Path(uint8_t addr,
+                           bool set_mode,
+                           EEPROMAccess ea,
+                           uint8_t ee_address)
+        : addr(addr),
+          day(0),
+          slot(0),
+          topic(EEPROM),
+          timer_topic(TIMER_NONE),
+          set_mode(set_mode),
+          eeprom_access(ea),
+          eeprom_address(ee_address)
+    {}
+
+    ICACHE_FLASH_ATTR static Str compose_set_prefix_wildcard(Buffer b) {
+        StrMaker rv(b);
+
+        rv += prefix;
+        rv += SEPARATOR;
+        rv += S_SET_MODE;
+        rv += SEPARATOR;
+        rv += WILDCARD;
+
+        return rv.str();
+    }
+
+    // composes a topic directly under the prefix
+    ICACHE_FLASH_ATTR static Str compose_global(Buffer b, const char *topic) {
+        StrMaker rv(b);
+
+        rv += prefix;
+        rv += SEPARATOR;
+        rv += topic;
+
+        return rv.str();
+    }
+
+    ICACHE_FLASH_ATTR Str compose(Buffer b) const {
+        StrMaker rv(b);
+        compose_prefix(rv);
+        compose_topic(rv);
+        return rv.str();
+    }
+
+    // composes the path up to and including the client address
+    ICACHE_FLASH_ATTR void compose_prefix(StrMaker &rv) const {
+        rv += prefix;
+        rv += SEPARATOR;
+
+        if (set_mode) {
+            rv += S_SET_MODE;
+            rv += SEPARATOR;
+        }
+
+        rv += addr;
+        rv += SEPARATOR;
+    }
+
+    // composes the rest of the path after the client address
+    ICACHE_FLASH_ATTR void compose_topic(StrMaker &rv) const {
+        rv += topic_str(topic);
+
+        if (topic == EEPROM) {
+            rv += SEPARATOR;
+            rv += eeprom_address;
+
+            // In set mode we include read/write op. specifier
+            if (set_mode) {
+                rv += SEPARATOR;
+                rv += eeprom_access_str(eeprom_access);
+            }
+        } else if (topic == TIMER) {
+            rv += SEPARATOR;
+            rv += day;
+            rv += SEPARATOR;
+            rv += slot;
+            rv += SEPARATOR;
+            rv += timer_topic_str(timer_topic);
+        } else if (topic == TIMERS && timer_topic == TIMER_BINARY) {
+            rv += SEPARATOR;
+            rv += S_TIMER_BINARY;
+        }
+    }
+
+    ICACHE_FLASH_ATTR static Path parse(const char *p) {
+        // skip the leading separator and the prefix
+        if (*p == SEPARATOR) ++p;
+
+        if (strncmp(p, match_prefix, match_prefix_len) != 0) return {};
+        p += match_prefix_len;
+
+        // premature end (just the prefix), or only a partial match
+        if (*p != SEPARATOR) return {};
+        ++p;
+
+        Tokens t(p);
+        if (t.overflow) return {};
+
+        uint8_t i = 0;
+        bool set_mode = false;
+
+        // is it by chance a set sub_branch?
+        if (t[i] == S_SET_MODE) {
+            set_mode = true;
+            ++i;
+        }
+
+        // zone requests - set/zone/NAME/topic, plain value topics only
+        if (set_mode && i < t.count && t[i] == S_ZONE) {
+            if (i + 3 != t.count || !t[i + 1].len) return {};
+
+            const Token &name = t[i + 1];
+            Topic top = parse_topic(t[i + 2]);
+
+            switch (top) {
+            case REQ_TMP:
+            case AUTO:
+            case MODE:
+            case LOCK: {
+                Path p{0, top, true};
+                p.zone = Str{name.ptr, name.len};
+                return p;
+            }
+            default:
+                return {};
+            }
+        }
+
+        // address, topic and whatever the topic needs
+        if (i + 2 > t.count) return {};
+
+        int16_t address = t[i++].num;
+        if (address <= 0) return {};
+
+        Topic top = parse_topic(t[i++]);
+
+        switch (top) {
+        case INVALID_TOPIC:
+            return {};
+        case EEPROM: {
+            // eeprom is a sub-tree
+            // here we see these
+            // set/.../eeprom/addr/read  - read request to an address (value sent is ignored)
+            // set/.../eeprom/addr/write - write request with value for addr written to this topic
+            // .../eeprom/addr - value as gathered from client with specified topic
+            if (i + (set_mode ? 2 : 1) != t.count) return {};
+
+            int16_t ee_addr = t[i++].num;
+            if (ee_addr < 0) return {};
+
+            // in set mode we expect either read/write tokens next
+            EEPROMAccess ea = EA_READ;
+            if (set_mode) {
+                ea = parse_eeprom_access(t[i]);
+                if (ea == INVALID_EEPROM_TOPIC) return {};
+            }
+
+            return {static_cast<uint8_t>(address), set_mode, ea,
+                    static_cast<uint8_t>(ee_addr)};
+        }
+        case TIMER: {
+            // set/.../timers - whole timer table upload
+            if (set_mode && i == t.count)
+                return {static_cast<uint8_t>(address), TIMERS, set_mode};
+            // set/.../timers/bin - the same, binary
+            if (set_mode && i + 1 == t.count && t[i] == S_TIMER_BINARY)
+                return {static_cast<uint8_t>(address), TIMERS, set_mode,
+                        TIMER_BINARY};
+
+            // timer subtree... .../timer/day/slot/[mode/time]
+            if (i + 3 != t.count) return {};
+
+            int16_t d = t[i++].num;
+            int16_t s = t[i++].num;
+            if (d < 0 || s < 0) return {};
+
+            auto tt = parse_timer_topic(t[i]);
+            if (tt == INVALID_TIMER_TOPIC) return {};
+
+            // whole timer specification is okay
+            return {static_cast<uint8_t>(address), top, set_mode, tt,
+                    static_cast<uint8_t>(d), static_cast<uint8_t>(s)};
+        }
+        default:
+            if (i != t.count) return {};
+            return {static_cast<uint8_t>(address), top, set_mode};
+        }
+    }
+
+    ICACHE_FLASH_ATTR bool valid() { return addr != 0 || is_zone(); }
+
+    ICACHE_FLASH_ATTR bool is_zone() const { return zone.data() != nullptr; }
+
+    // compressed topic code for debugging (client id 6 bits, topic 4 bits, timer topic 2 bits)
+    ICACHE_FLASH_ATTR uint16_t as_uint() const {
+        return addr | ((uint16_t)topic << 6) | ((uint16_t)timer_topic << 10);
+    }
+
+    // client ID (net * MAX_HR_ADDR + addr). 0 means invalid path!
+    uint8_t addr = 0;
+    uint8_t day  = 0;
+    uint8_t slot = 0;
+    Topic topic            = INVALID_TOPIC;
+    TimerTopic timer_topic = TIMER_NONE;
+    bool    set_mode = false; // true in the S_SET_MODE sub-branch
+
+    EEPROMAccess eeprom_access = EA_READ;
+    uint8_t eeprom_address = 0; // eeprom address in case topic is EEPROM
+
+    // zone name of the set/zone/NAME/... requests, addr is 0 then. Points
+    // into the parsed topic
+    Str zone;
+};
+
+} // namespace mqtt
+} // namespace hr20
@@ -65,7 +65,7 @@ struct NTPTime {
     void begin() {
 #ifdef NTP_CLIENT
         timeClient.begin();
-        // initial update
+        // initial query, picked up by the later updates
         bool b;
         update(true, b);
 #endif
@@ -80,32 +80,30 @@ struct NTPTime {
 #endif
     }
 
-    time_t update(bool can_update, bool &changed_time) {
+    /** never blocks - call it often, a reply is timed by when it gets
+     * picked up. can_send false holds back sending a new query (DNS lookup
+     * and a WiFi transmission), a query in flight is polled regardless
+     */
+    time_t update(bool can_send, bool &changed_time) {
 #ifdef NTP_CLIENT
         static time_t last_time = 0;
-        time_t now = unixTime();
         changed_time = false;
 
-        if ((now != last_time)) {
-            // only work on these updates once every second, not more
-            last_time = now;
-
-            if (can_update) {
-                NTPClient::UpdateState us;
-                timeClient.update(us);
-
-                if (us.error) ERR(NTP_CANNOT_SYNC);
-                if (us.updated) {
-                    EVENT(NTP_SYNCHRONIZED);
-                    DBG("(NTP %ld)", us.drift);
-                    changed_time = true;
-                }
+        NTPClient::UpdateState us;
+        timeClient.update(us, can_send);
 
-                // that needs ntpclient
-                return now;
-            }
+        if (us.error) ERR(NTP_CANNOT_SYNC);
+        if (us.updated) {
+            EVENT(NTP_SYNCHRONIZED);
+            DBG("(NTP %ld %ldppm)", us.drift, timeClient.getRatePPM());
+            changed_time = true;
+        }
 
-            cur_slew = timeClient.slew();
+        time_t now = unixTime();
+        if (now != last_time) {
+            // slew once every second, not more
+            last_time = now;
+            cur_slew  = timeClient.slew();
         }
 
         return now;
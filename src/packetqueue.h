@@ -21,37 +21,87 @@
 
 #include <cstdint>
 
+#include "config.h"
 #include "crypto.h"
 #include "queue.h"
 #include "debug.h"
 #include "error.h"
 #include "eventlog.h"
+#include "stats.h"
+#include "timing.h"
 
 namespace hr20 {
 
 constexpr const uint8_t PACKET_QUEUE_LEN = 32;
-// constexpr const uint8_t SENT_PACKET_LEN = 76;
-// 19 is empirical - maybe 24 could work, but we should analyze why the clients
-// struggle to send more than that - it would benefit the comm speed greatly.
-constexpr const uint8_t SENT_PACKET_LEN = 25;
+// slots holding packets up to SENT_PACKET_MAX, for the clients that learned
+// a larger limit. The rest only hold SENT_PACKET_LEN
+constexpr const uint8_t PACKET_QUEUE_LARGE = 8;
+// free slots only sync packets may take
+constexpr const uint8_t PACKET_RESERVE_SYNC = 2;
+// free slots only sync and interactive packets may take (sync ones included)
+constexpr const uint8_t PACKET_RESERVE_INTERACTIVE = 8;
 
 // implements a packet queue
 struct PacketQ {
-    using Packet = ShortQ<SENT_PACKET_LEN>;
+    using Packet = SlotQ;
+
+    // payload size and start (millis) of the last packet with commands sent
+    // to a client. Kept until the client's next packet tells if it got there
+    struct Sent {
+        uint8_t len = 0;
+        unsigned long at = 0;
+    };
 
     enum SpecialAddrs : uint8_t {
         MASTER_ADDR = 0x00,
         SYNC_ADDR = 0x21 // MAX ADDR IS 0x20, we're fine here
     };
 
-    ICACHE_FLASH_ATTR PacketQ(crypto::Crypto &crypto, time_t packet_max_age)
-        : crypto(crypto), que(), packet_max_age(packet_max_age)
-    {}
+    // count of addresses the queue keeps index for (clients and sync)
+    static constexpr const uint8_t ADDR_SLOTS = SYNC_ADDR + 1;
+
+    /** priority classes of the queued packets. The background class can't
+     * take the slots reserved for the others, so a long read backlog never
+     * keeps a user's setpoint out of the queue. Interactive packets also go
+     * out before the background ones queued for the same client.
+     */
+    enum Prio : uint8_t {
+        PRIO_SYNC = 0,    // sync packets
+        PRIO_INTERACTIVE, // user visible setpoints (temperature, mode, lock)
+        PRIO_BACKGROUND   // timer/eeprom reads and writes, acks
+    };
+
+    // free slots the class has to leave alone
+    static constexpr uint8_t reserved_for(Prio prio) {
+        return prio == PRIO_SYNC          ? 0
+             : prio == PRIO_INTERACTIVE   ? PACKET_RESERVE_SYNC
+                                          : PACKET_RESERVE_INTERACTIVE;
+    }
+
+    ICACHE_FLASH_ATTR PacketQ(crypto::Crypto &crypto, ActivityModel &activity,
+                              time_t packet_max_age)
+        : crypto(crypto), activity(activity), que(), packet_max_age(packet_max_age)
+    {
+        for (uint8_t i = 0; i < PACKET_QUEUE_LEN; ++i) {
+            if (is_large(i))
+                que[i].packet.attach(large_buf[i], SENT_PACKET_MAX);
+            else
+                que[i].packet.attach(small_buf[i - PACKET_QUEUE_LARGE],
+                                     SENT_PACKET_LEN);
+        }
+
+        clear();
+    }
+
+    // slot i holds packets up to SENT_PACKET_MAX
+    static constexpr bool is_large(uint8_t i) { return i < PACKET_QUEUE_LARGE; }
 
     struct Item {
         void clear() {
             addr = -1;
             time  = 0;
+            next  = -1;
+            prio  = PRIO_BACKGROUND;
             packet.clear();
         }
 
@@ -61,141 +111,370 @@ struct PacketQ {
 
 
         int8_t addr = -1;
-        Packet packet;
+        int8_t next = -1; // next queued item for the same address
+        Prio prio = PRIO_BACKGROUND;
         time_t time = 0;
+        Packet packet;
     };
 
     //
     void clear() {
         for (int i = 0; i < PACKET_QUEUE_LEN; ++i) {
             que[i].clear();
+            // lowest slots get used first
+            free_slots[i] = PACKET_QUEUE_LEN - 1 - i;
+        }
+
+        free_cnt = PACKET_QUEUE_LEN;
+
+        for (int i = 0; i < ADDR_SLOTS; ++i) {
+            head[i]  = -1;
+            count[i] = 0;
         }
 
         // let's hope someone wasn't sending something...
         sending = nullptr;
+        sealed  = false;
+        pending_cnt = 0;
         prologue.clear();
         cmac.clear();
     }
 
-    uint8_t ICACHE_FLASH_ATTR get_update_count(uint8_t addr) {
-        uint8_t cntr = 0;
-        for (int i = 0; i < PACKET_QUEUE_LEN; ++i) {
-            cntr += (que[i].addr == addr) ? 1 : 0;
-        }
-        return cntr;
+    uint8_t ICACHE_FLASH_ATTR get_update_count(uint8_t addr) const {
+        if (addr >= ADDR_SLOTS) return 0;
+        return count[addr];
+    }
+
+    // count of the packets of the class queued for addr
+    uint8_t ICACHE_FLASH_ATTR get_update_count(uint8_t addr, Prio prio) const {
+        if (addr >= ADDR_SLOTS) return 0;
+
+        uint8_t n = 0;
+        for (int8_t i = head[addr]; i >= 0; i = que[i].next)
+            if (que[i].prio == prio) ++n;
+        return n;
+    }
+
+    // takes the record of the last packet sent to addr. false if there's none
+    bool ICACHE_FLASH_ATTR take_sent(uint8_t addr, Sent &s) {
+        if (addr >= MAX_HR_ADDR || !sent[addr].len) return false;
+        s = sent[addr];
+        sent[addr].len = 0;
+        return true;
     }
 
     /// insert into queue or return nullptr if full
-    /// returns packet structure to be filled with data
-    Packet * ICACHE_FLASH_ATTR want_to_send_for(uint8_t addr, uint8_t bytes, time_t curtime) {
+    /// returns packet structure to be filled with data. With fresh set, the
+    /// data never gets appended to an already queued packet. Appended
+    /// packets stay below limit (the client's learned PacketLimit).
+    /// Packets for SYNC_ADDR are always PRIO_SYNC and replace the sync
+    /// packet that did not get out
+    Packet * ICACHE_FLASH_ATTR want_to_send_for(uint8_t addr, uint8_t bytes,
+                                                time_t curtime,
+                                                bool fresh = false,
+                                                uint8_t limit = SENT_PACKET_LEN,
+                                                Prio prio = PRIO_BACKGROUND)
+    {
 #ifdef VERBOSE
         DBG(" * Q APP %p", this);
 #endif
-        for (int i = 0; i < PACKET_QUEUE_LEN; ++i) {
-            // reverse index - we queue top first, send bottom first
-            // to have fair queueing
-            int ri = PACKET_QUEUE_LEN - 1 - i;
-            Item &it = que[ri];
+        if (addr >= ADDR_SLOTS) {
+            ERR(PROTO_BAD_CLIENT_ADDR);
+            return nullptr;
+        }
+
+        if (addr == SYNC_ADDR) {
+            drop(SYNC_ADDR);
+            prio = PRIO_SYNC;
+        }
 
-            if (addr != SYNC_ADDR && (it.addr == addr)) {
-                if (it.packet.free_size() > bytes) {
+        // append to the last packet of the class (or a higher one) queued
+        // for the address if it fits
+        int8_t t = last_upto(addr, prio);
+        if (!fresh && addr != SYNC_ADDR && t >= 0 &&
+            que[t].packet.size() + bytes < limit &&
+            que[t].packet.free_size() >= bytes)
+        {
 #ifdef VERBOSE
-                    DBG(" * Q APPEND [%d] %d", ri, addr);
+            DBG(" * Q APPEND [%d] %d", t, addr);
 #endif
-                    return &it.packet;
-                }
-            }
+            return &que[t].packet;
+        }
+
+        // no free spot? the expiry sweep is not run here, we may be in the
+        // middle of an exchange. It runs as soon as the radio gets idle
+        if (free_cnt <= reserved_for(prio)) {
+            expire_wanted = true;
+            ++linkStats.queue_full;
+            // background work just waits for the next exchange
+            if (prio != PRIO_BACKGROUND) ERR(QUEUE_FULL);
+            return nullptr;
+        }
+
+        int8_t i = take_slot(limit > SENT_PACKET_LEN);
+        Item &it = que[i];
 
-            // free spot or too old packet
-            if ((it.addr == -1) || (it.time + packet_max_age < curtime)) {
 #ifdef VERBOSE
-                DBG(" * Q NEW [%d] %d", ri, addr);
+        DBG(" * Q NEW [%d] %d", i, addr);
 #endif
-                it.addr = addr;
-                it.time = curtime;
-                it.packet.clear();
-                return &it.packet;
-            }
+        it.clear();
+        it.addr = addr;
+        it.time = curtime;
+        it.prio = prio;
+
+        // link behind the packets of the same or higher class
+        if (t >= 0) {
+            it.next = que[t].next;
+            que[t].next = i;
+        } else {
+            it.next = head[addr];
+            head[addr] = i;
         }
 
-        // full
-        ERR(QUEUE_FULL);
-        return nullptr;
+        ++count[addr];
+
+        return &it.packet;
+    }
+
+    // drops client packets older than packet_max_age and sync packets
+    // of the past seconds. Walks the whole queue, so it is meant to be
+    // called while the radio is idle
+    void ICACHE_FLASH_ATTR expire(time_t curtime) {
+        expire_wanted = false;
+
+        for (uint8_t a = 0; a < ADDR_SLOTS; ++a) {
+            int8_t prev = -1;
+            int8_t i    = head[a];
+
+            while (i >= 0) {
+                Item &it = que[i];
+                int8_t next = it.next;
+
+                time_t age = it.prio == PRIO_SYNC ? 0 : packet_max_age;
+                if (it.time + age < curtime) {
+#ifdef VERBOSE
+                    DBG(" * Q EXPIRE [%d] %d", i, a);
+#endif
+                    if (prev >= 0)
+                        que[prev].next = next;
+                    else
+                        head[a] = next;
+
+                    --count[a];
+                    release(i);
+                } else {
+                    prev = i;
+                }
+
+                i = next;
+            }
+        }
     }
 
     // prepares queue to send data for address addr, if there's a
-    // prepared packet present
+    // prepared packet present. Only the prologue is composed here, the
+    // payload is encrypted and signed in seal() once the prologue is handed
+    // over to the radio, so the TX can start right away.
+    // If another packet is being sent, the response is deferred until
+    // the radio gets free (see prepare_pending).
     bool ICACHE_FLASH_ATTR prepare_to_send_to(uint8_t addr) {
-        if (sending) {
-            ERR(QUEUE_PREPARE_WHILE_SEND);
+        Item *it = find(addr);
+
+        if (!it) {
+#ifdef VERBOSE
+            DBG("(NOTHING FOR %d)", addr);
+#endif
             return false;
         }
 
-        for (unsigned i = 0; i < PACKET_QUEUE_LEN; ++i) {
-            Item &it = que[i];
-            if (it.addr == addr) {
+        if (sending) return defer(addr);
+
+        start(*it);
+        return true;
+    }
+
+    // starts the next deferred response once the radio is free. Responses
+    // that missed the client's receive window are dropped.
+    bool ICACHE_FLASH_ATTR prepare_pending() {
+        if (sending || !pending_cnt) return false;
+
+        unsigned long now = millis();
+
+        while (pending_cnt) {
+            Pending p = pending[0];
+
+            --pending_cnt;
+            for (uint8_t i = 0; i < pending_cnt; ++i)
+                pending[i] = pending[i + 1];
+
+            if (static_cast<long>(now - p.deadline) > 0) {
+                ERR_ARG(QUEUE_RESPONSE_EXPIRED, p.addr);
+                continue;
+            }
+
+            Item *it = find(p.addr);
+            if (!it) continue;
+
+#ifdef VERBOSE
+            DBG("(PEND SND %d)", p.addr);
+#endif
+            start(*it);
+            return true;
+        }
+
+        return false;
+    }
+
+    // encrypts the payload of the packet being sent and computes its cmac.
+    // called lazily when the first payload byte is needed
+    void ICACHE_FLASH_ATTR seal() {
+        cmac.clear();
+
+        // non-sync packets have to be encrypted as well
+        if (!sending_sync) {
+            crypto.encrypt_decrypt(sending->packet.data(),
+                                   sending->packet.size());
+
+            // non-sync packets include address in the cmac checksum
+            crypto.cmac_fill_addr(sending->packet.data(),
+                                  sending->packet.size(),
+                                  MASTER_ADDR, cmac);
+        } else {
+            crypto.cmac_fill_sync(sending->packet.data(),
+                                  sending->packet.size(),
+                                  cmac);
+        }
+
+        sealed = true;
+
 #ifdef VERBOSE
-                DBG("(PREP SND %d)", i);
+        hex_dump(" DTA", sending->packet.data(), sending->packet.size());
+        hex_dump("CMAC", cmac.data(), cmac.size());
 #endif
-                sending = &it;
-                bool isSync = (it.addr == SYNC_ADDR);
-                // just something to not get handled while we're sending this
-                it.addr = -2;
+    }
 
-                prepare_prologue();
+    // last item queued for addr with the class prio or a higher one, -1
+    // if there's none. The address chains are kept sorted by class
+    int8_t ICACHE_FLASH_ATTR last_upto(uint8_t addr, Prio prio) const {
+        int8_t last = -1;
+        for (int8_t i = head[addr]; i >= 0 && que[i].prio <= prio;
+             i = que[i].next)
+            last = i;
+        return last;
+    }
 
-                // 1 is the length itself
-                // length, highest byte indicates sync word
-                // non-sync packet includes an address (see branch below)
-                uint8_t lenbyte = 1 + it.packet.size() + crypto::CMAC::CMAC_SIZE;
+    // drops everything queued for addr
+    void ICACHE_FLASH_ATTR drop(uint8_t addr) {
+        for (int8_t i = head[addr]; i >= 0;) {
+            int8_t next = que[i].next;
+            release(i);
+            i = next;
+        }
 
-                cmac.clear();
+        head[addr]  = -1;
+        count[addr] = 0;
+    }
 
-                // non-sync packets have to be encrypted as well
-                if (!isSync) {
-                    ++lenbyte; // we're pushing address so we extend length
-                    prologue.push(lenbyte);
-                    prologue.push(MASTER_ADDR);
+    // first (oldest) packet queued for addr
+    Item * ICACHE_FLASH_ATTR find(uint8_t addr) {
+        if (addr >= ADDR_SLOTS || head[addr] < 0) return nullptr;
+        return &que[head[addr]];
+    }
 
-                    crypto.encrypt_decrypt(it.packet.data(), it.packet.size());
+    // returns the slot to the free stack
+    void release(int8_t i) {
+        que[i].clear();
+        free_slots[free_cnt++] = i;
+    }
 
-                    // non-sync packets include address in the cmac checksum
-                    crypto.cmac_fill_addr(it.packet.data(),
-                                          it.packet.size(),
-                                          MASTER_ADDR, cmac);
-                } else {
-                    prologue.push(lenbyte | 0x80); // 0x80 indicates sync
-                    crypto.cmac_fill_sync(it.packet.data(),
-                                          it.packet.size(),
-                                          cmac);
-                }
+    // takes a free slot of the wanted size class if there is one, of the
+    // other one otherwise. The caller checks free_cnt
+    int8_t ICACHE_FLASH_ATTR take_slot(bool large) {
+        uint8_t k = free_cnt - 1;
+        for (uint8_t j = free_cnt; j-- > 0;) {
+            if (is_large(free_slots[j]) == large) {
+                k = j;
+                break;
+            }
+        }
 
+        int8_t i = free_slots[k];
+        free_slots[k] = free_slots[--free_cnt];
+        return i;
+    }
 
-                // dummy bytes, this gives the radio time to process the 16 bit
-                // tx queue in time - we don't care if these get sent whole.
-                cmac.push(0xAA); cmac.push(0xAA);
+    // remembers addr to be responded to after the current packet is sent
+    bool ICACHE_FLASH_ATTR defer(uint8_t addr) {
+        for (uint8_t i = 0; i < pending_cnt; ++i)
+            if (pending[i].addr == addr) return true;
+
+        if (pending_cnt >= MAX_PENDING_RESPONSES) {
+            ERR(QUEUE_PREPARE_WHILE_SEND);
+            return false;
+        }
 
 #ifdef VERBOSE
-                hex_dump("PRLG", prologue.data(), prologue.size());
-                hex_dump(" DTA", it.packet.data(), it.packet.size());
-                hex_dump("CMAC", cmac.data(), cmac.size());
+        DBG("(DEFER %d)", addr);
 #endif
-                if (addr == SYNC_ADDR) {
+        pending[pending_cnt].addr     = addr;
+        pending[pending_cnt].deadline = millis() + RESPONSE_WINDOW_MS;
+        ++pending_cnt;
+        return true;
+    }
+
+    // composes the prologue and marks the item as the packet being sent.
+    // it has to be the head of its address chain (see find)
+    void ICACHE_FLASH_ATTR start(Item &it) {
+        // unlink from the address chain, the slot returns to the free stack
+        // after it was sent
+        head[it.addr] = it.next;
+        --count[it.addr];
+        it.next = -1;
+
+        sending = &it;
+        sending_sync = (it.addr == SYNC_ADDR);
+        sealed = false;
+
+        if (sending_sync) {
+            linkStats.on_sync(millis());
+            activity.on_sync();
+        }
+        else
+            linkStats.on_answer(it.addr, millis());
+
+        if (!sending_sync && it.addr < MAX_HR_ADDR && it.packet.size())
+            sent[it.addr] = {it.packet.size(), millis()};
+
+        if (sending_sync) {
 #ifdef DEBUG
-                    // only log sync packets in debug mode
-                    EVENT(PROTO_PACKET_SYNC);
+            // only log sync packets in debug mode
+            EVENT(PROTO_PACKET_SYNC);
 #endif
-                } else {
-                    EVENT_ARG(PROTO_PACKET_SENDING, addr);
-                }
-                return true;
-            }
+        } else {
+            EVENT_ARG(PROTO_PACKET_SENDING, it.addr);
+        }
+
+        // just something to not get handled while we're sending this
+        it.addr = -2;
+
+        prepare_prologue();
+
+        // 1 is the length itself
+        // length, highest byte indicates sync word
+        // non-sync packet includes an address (see branch below)
+        uint8_t lenbyte = 1 + it.packet.size() + crypto::CMAC::CMAC_SIZE;
+
+        if (!sending_sync) {
+            ++lenbyte; // we're pushing address so we extend length
+            prologue.push(lenbyte);
+            prologue.push(MASTER_ADDR);
+        } else {
+            prologue.push(lenbyte | 0x80); // 0x80 indicates sync
         }
 
 #ifdef VERBOSE
-        DBG("(NOTHING FOR %d)", addr);
+        hex_dump("PRLG", prologue.data(), prologue.size());
 #endif
-        return false;
     }
 
     void prepare_prologue() {
@@ -214,6 +493,8 @@ struct PacketQ {
         if (!prologue.empty())
             return prologue.peek();
 
+        if (!sealed) seal();
+
         if (!sending->packet.empty())
             return sending->packet.peek();
 
@@ -223,6 +504,11 @@ struct PacketQ {
         return -1;
     }
 
+    // true if the packet being sent already went past the prologue
+    bool in_payload() const {
+        return sending && prologue.empty();
+    }
+
     // pops a char from queue after it sent well. returns if more data are present
     bool ICACHE_FLASH_ATTR pop() {
         if (!sending) return false;
@@ -244,7 +530,7 @@ struct PacketQ {
         // empty after all this?
         if (cmac.empty()) {
             prologue.clear();
-            sending->clear();
+            release(sending - que);
             cmac.clear();
             sending = nullptr;
             return false;
@@ -254,11 +540,42 @@ struct PacketQ {
     }
 
     crypto::Crypto &crypto;
+    // radio timing of the network, learns the sync times
+    ActivityModel &activity;
     Item que[PACKET_QUEUE_LEN];
+    // packet storage of the slots, see is_large
+    uint8_t large_buf[PACKET_QUEUE_LARGE][SENT_PACKET_MAX];
+    uint8_t small_buf[PACKET_QUEUE_LEN - PACKET_QUEUE_LARGE][SENT_PACKET_LEN];
     Item *sending = nullptr;
+
+    // per-address FIFO chains of queued items (-1 terminated) and counts
+    int8_t head[ADDR_SLOTS];
+    uint8_t count[ADDR_SLOTS];
+
+    // stack of unused item slots
+    int8_t free_slots[PACKET_QUEUE_LEN];
+    uint8_t free_cnt = 0;
+    // an allocation was refused, the expiry sweep should not wait for the
+    // next second
+    bool expire_wanted = false;
+
+    bool sending_sync = false; // sending packet is a sync packet
+    bool sealed = false;       // sending packet was encrypted and signed
     ShortQ<6> prologue; // stores sync-word, size and optionally an address
-    ShortQ<6> cmac; // stores cmac for sent packet, and 2 dummy bytes
+    ShortQ<crypto::CMAC::CMAC_SIZE> cmac; // stores cmac for sent packet
     const time_t packet_max_age;
+
+    // a client that answered while we were busy sending to another one
+    struct Pending {
+        uint8_t addr;
+        unsigned long deadline; // millis() the client stops listening at
+    };
+
+    Pending pending[MAX_PENDING_RESPONSES];
+    uint8_t pending_cnt = 0;
+
+    // not cleared with the queue, the answers still come
+    Sent sent[MAX_HR_ADDR];
 };
 
 } // namespace hr20
@@ -0,0 +1,234 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+#include <FS.h>
+
+#include "persist.h"
+#include "debug.h"
+
+namespace hr20 {
+namespace {
+// the first network keeps the file name of the single radio builds
+const char *MODEL_FILES[] = {"/model.bin", "/model1.bin", "/model2.bin", "/model3.bin"};
+static_assert(RFM_RADIO_COUNT <= sizeof(MODEL_FILES) / sizeof(MODEL_FILES[0]),
+              "MODEL_FILES has to list a file for every radio network");
+} // namespace
+
+const char *ICACHE_FLASH_ATTR ModelStore::file() const {
+    return MODEL_FILES[net];
+}
+
+void ICACHE_FLASH_ATTR ModelStore::begin() {
+    // webserver might have done this already, no harm doing it again
+    SPIFFS.begin();
+
+    File f = SPIFFS.open(file(), "r");
+
+    Header hdr;
+    if (!f || f.read(reinterpret_cast<uint8_t *>(&hdr), sizeof(hdr)) != sizeof(hdr) ||
+        hdr.magic != MAGIC || hdr.version != VERSION ||
+        hdr.addr_count != MAX_HR_ADDR || hdr.record_size != sizeof(Record))
+    {
+        if (f) {
+            ERR(PERSIST_BAD_FORMAT);
+            f.close();
+        }
+
+        ready = create();
+        return;
+    }
+
+    Record rec;
+    uint8_t restored = 0;
+
+    for (uint8_t addr = 0; addr < MAX_HR_ADDR; ++addr) {
+        if (f.read(reinterpret_cast<uint8_t *>(&rec), sizeof(rec)) != sizeof(rec)) {
+            ERR(PERSIST_BAD_FORMAT);
+            break;
+        }
+
+        if (rec.flags & REC_PRESENT) {
+            restore(addr, rec);
+            ++restored;
+        }
+    }
+
+    f.close();
+
+    DBG("(MODEL RESTORED %d)", restored);
+
+    // restoring marked everything dirty, but the file already has it all
+    model.dirty = 0;
+    ready = true;
+}
+
+void ICACHE_FLASH_ATTR ModelStore::update(time_t now) {
+    if (!ready || !model.dirty) return;
+    if (now - last_write < PERSIST_INTERVAL) return;
+
+    last_write = now;
+    flush();
+}
+
+void ICACHE_FLASH_ATTR ModelStore::flush() {
+    if (!ready || !model.dirty) return;
+
+    File f = SPIFFS.open(file(), "r+");
+    if (!f) {
+        ERR(PERSIST_CANNOT_OPEN);
+        return;
+    }
+
+    Record rec;
+
+    for (uint8_t addr = 0; addr < MAX_HR_ADDR; ++addr) {
+        if (!(model.dirty & (1ul << addr))) continue;
+
+        HR20 *hr = model[addr];
+        if (!hr) {
+            model.dirty &= ~(1ul << addr);
+            continue;
+        }
+
+        save(addr, *hr, rec);
+
+        // the dirty bits stay set on failure, the next flush retries them
+        if (!f.seek(record_offset(addr), SeekSet) ||
+            f.write(reinterpret_cast<const uint8_t *>(&rec), sizeof(rec)) != sizeof(rec))
+        {
+            ERR_ARG(PERSIST_CANNOT_WRITE, addr);
+            break;
+        }
+
+        model.dirty &= ~(1ul << addr);
+
+#ifdef VERBOSE
+        DBG(" * MODEL SAVED %d", addr);
+#endif
+    }
+
+    f.close();
+}
+
+bool ICACHE_FLASH_ATTR ModelStore::create() {
+    File f = SPIFFS.open(file(), "w");
+    if (!f) {
+        ERR(PERSIST_CANNOT_OPEN);
+        return false;
+    }
+
+    Header hdr;
+    hdr.magic       = MAGIC;
+    hdr.version     = VERSION;
+    hdr.addr_count  = MAX_HR_ADDR;
+    hdr.record_size = sizeof(Record);
+
+    bool ok = f.write(reinterpret_cast<const uint8_t *>(&hdr), sizeof(hdr)) == sizeof(hdr);
+
+    // zeroed records are records of absent clients
+    uint8_t zero[32] = {};
+    size_t rest = MAX_HR_ADDR * sizeof(Record);
+
+    while (ok && rest) {
+        size_t chunk = rest < sizeof(zero) ? rest : sizeof(zero);
+        ok = f.write(zero, chunk) == chunk;
+        rest -= chunk;
+    }
+
+    f.close();
+
+    if (!ok) {
+        ERR(PERSIST_CANNOT_WRITE);
+        SPIFFS.remove(file());
+    }
+
+    return ok;
+}
+
+void ICACHE_FLASH_ATTR ModelStore::save(uint8_t addr, const HR20 &hr, Record &rec) {
+    memset(&rec, 0, sizeof(rec));
+
+    rec.flags        = REC_PRESENT;
+    rec.last_contact = hr.last_contact;
+
+    if (hr.temp_wanted.remote_valid()) {
+        rec.flags |= REC_TEMP;
+        rec.temp_wanted = hr.temp_wanted.get_remote();
+    }
+
+    if (hr.auto_mode.remote_valid()) {
+        rec.flags |= REC_AUTO;
+        if (hr.auto_mode.get_remote()) rec.flags |= REC_AUTO_VAL;
+    }
+
+    if (hr.menu_locked.remote_valid()) {
+        rec.flags |= REC_LOCK;
+        if (hr.menu_locked.get_remote()) rec.flags |= REC_LOCK_VAL;
+    }
+
+    // partial timer tables are not worth it, they can't be verified
+    if (hr.timers_unverified || hr.timers_complete()) {
+        rec.flags |= REC_TIMERS;
+        for (uint8_t dow = 0; dow < TIMER_DAYS; ++dow)
+            for (uint8_t slot = 0; slot < TIMER_SLOTS_PER_DAY; ++slot)
+                rec.timers[dow][slot] = hr.timers[dow][slot].get_remote().raw();
+    }
+
+    hr.eeprom.for_each([&](uint8_t ee, const EepromCache::Cell &cell) {
+        if (!cell.remote_valid()) return;
+        rec.eeprom_valid[ee >> 3] |= 1 << (ee & 7);
+        rec.eeprom[ee] = cell.get_remote();
+    });
+}
+
+void ICACHE_FLASH_ATTR ModelStore::restore(uint8_t addr, const Record &rec) {
+    HR20 *hr = model.prepare_client(addr);
+    if (!hr) return;
+
+    hr->last_contact = rec.last_contact;
+
+    if (rec.flags & REC_TEMP)
+        hr->temp_wanted.set_remote(rec.temp_wanted);
+
+    if (rec.flags & REC_AUTO)
+        hr->auto_mode.set_remote(rec.flags & REC_AUTO_VAL);
+
+    if (rec.flags & REC_LOCK)
+        hr->menu_locked.set_remote(rec.flags & REC_LOCK_VAL);
+
+    // timers are only taken as valid after the client's calendar checksum
+    // confirms them
+    if (rec.flags & REC_TIMERS) {
+        for (uint8_t dow = 0; dow < TIMER_DAYS; ++dow)
+            for (uint8_t slot = 0; slot < TIMER_SLOTS_PER_DAY; ++slot)
+                hr->timers[dow][slot].restore_remote(rec.timers[dow][slot]);
+
+        hr->timers_unverified = true;
+    }
+
+    // eeprom cells only change on our request, we trust them as they are
+    for (unsigned ee = 0; ee < EEPROM_SIZE; ++ee) {
+        if (!(rec.eeprom_valid[ee >> 3] & (1 << (ee & 7)))) continue;
+
+        auto *cell = hr->eeprom.get(ee);
+        if (cell) cell->set_remote(rec.eeprom[ee]);
+    }
+}
+
+} // namespace hr20
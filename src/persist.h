@@ -0,0 +1,98 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#include "config.h"
+#include "error.h"
+#include "model.h"
+
+namespace hr20 {
+
+/** Persists the remote state of the Model into a binary file on SPIFFS, so
+ * a restart does not mean re-reading everything over the radio.
+ *
+ * The file holds a header and one fixed size record per client address,
+ * so a change of a single client only rewrites its own record in place.
+ */
+struct ModelStore {
+    // net is the radio network of the model, each has a file of its own
+    ModelStore(Model &model, uint8_t net = 0) : model(model), net(net) {}
+
+    // restores the model from flash. call before the radio starts
+    void ICACHE_FLASH_ATTR begin();
+
+    // writes out changed clients, rate limited to one pass per
+    // PERSIST_INTERVAL. Call when there's time for it (flash writes block)
+    void ICACHE_FLASH_ATTR update(time_t now);
+
+    // writes out all changed clients right away (i.e. before restart)
+    void ICACHE_FLASH_ATTR flush();
+
+protected:
+    // on-flash layout. Packed, versioned by the header
+    struct __attribute__((packed)) Header {
+        uint32_t magic;
+        uint8_t  version;
+        uint8_t  addr_count;
+        uint16_t record_size;
+    };
+
+    enum RecordFlags : uint8_t {
+        REC_PRESENT     = 1,  // client was seen on this address
+        REC_TEMP        = 2,  // temp_wanted is valid
+        REC_AUTO        = 4,  // auto_mode is valid
+        REC_LOCK        = 8,  // menu_locked is valid
+        REC_TIMERS      = 16, // the complete timer table is stored
+        REC_AUTO_VAL    = 32, // auto_mode value
+        REC_LOCK_VAL    = 64  // menu_locked value
+    };
+
+    struct __attribute__((packed)) Record {
+        uint8_t  flags;
+        uint8_t  temp_wanted;
+        uint32_t last_contact;
+        uint16_t timers[TIMER_DAYS][TIMER_SLOTS_PER_DAY];
+        uint8_t  eeprom_valid[EEPROM_SIZE / 8]; // bit per eeprom cell
+        uint8_t  eeprom[EEPROM_SIZE];
+    };
+
+    static constexpr const uint32_t MAGIC   = 0x4D303248; // "H20M"
+    static constexpr const uint8_t  VERSION = 1;
+
+    static size_t record_offset(uint8_t addr) {
+        return sizeof(Header) + addr * sizeof(Record);
+    }
+
+    bool ICACHE_FLASH_ATTR create();
+    void ICACHE_FLASH_ATTR save(uint8_t addr, const HR20 &hr, Record &rec);
+    void ICACHE_FLASH_ATTR restore(uint8_t addr, const Record &rec);
+
+    // file of the network
+    const char *ICACHE_FLASH_ATTR file() const;
+
+    Model &model;
+    const uint8_t net;
+    time_t last_write = 0;
+    bool ready = false;
+};
+
+} // namespace hr20
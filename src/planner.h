@@ -0,0 +1,114 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+#pragma once
+
+#include <cstdint>
+
+#include "config.h"
+#include "commands.h"
+#include "packetqueue.h"
+#include "util.h"
+
+namespace hr20 {
+
+/** Plans the commands sent to a client in the next few exchanges.
+ *
+ * Commands are added in the order of their priority and get first-fit
+ * packed into the packets of the planned exchanges, so that neither the
+ * command bytes nor the bytes of the expected client response exceed the
+ * per-exchange budget. Commands that don't fit are only accounted for, to
+ * estimate how many exchanges remain until the client is synced.
+ */
+struct ExchangePlanner {
+    static constexpr const uint8_t NO_BIN = 0xFF;
+    // every command we plan has an argument, so it's at least 2 bytes long
+    static constexpr const uint8_t MAX_CMDS =
+        PLAN_EXCHANGES * SENT_PACKET_MAX / 2;
+
+    struct Cmd {
+        uint8_t code; // command letter
+        uint8_t arg;  // eeprom address or dow << 4 | slot for timers
+        uint8_t bin;  // index of the exchange the command was packed into
+    };
+
+    // starts a new plan with the given count of exchanges to fill, packets
+    // and responses limited as the client learned
+    void ICACHE_FLASH_ATTR clear(uint8_t exchanges, const PacketLimit &lim) {
+        bins = exchanges > PLAN_EXCHANGES ? PLAN_EXCHANGES : exchanges;
+        tx_limit = lim.limit;
+        rx_limit = lim.response_budget();
+        count = 0;
+        backlog_len  = 0;
+        backlog_resp = 0;
+
+        for (uint8_t b = 0; b < PLAN_EXCHANGES; ++b) {
+            tx[b] = 0;
+            rx[b] = 0;
+        }
+    }
+
+    // packs the command into the first exchange with enough budget left.
+    // returns false if it did not fit any
+    bool ICACHE_FLASH_ATTR add(uint8_t code, uint8_t arg = 0) {
+        uint8_t len  = cmd::cmd_len(code);
+        uint8_t resp = cmd::resp_len(code);
+
+        backlog_len  += len;
+        backlog_resp += resp;
+
+        if (count >= MAX_CMDS) return false;
+
+        for (uint8_t b = 0; b < bins; ++b) {
+            // PacketQ only appends if there's a byte to spare
+            if (tx[b] + len >= tx_limit) continue;
+            if (rx[b] + resp > rx_limit) continue;
+
+            tx[b] += len;
+            rx[b] += resp;
+            cmds[count++] = {code, arg, b};
+            return true;
+        }
+
+        return false;
+    }
+
+    bool ICACHE_FLASH_ATTR empty() const { return backlog_len == 0; }
+
+    // estimate of exchanges needed to send everything that was added
+    uint8_t ICACHE_FLASH_ATTR exchanges_left() const {
+        uint16_t by_tx = (backlog_len + tx_limit - 2) / (tx_limit - 1);
+        uint16_t by_rx = (backlog_resp + rx_limit - 1) / rx_limit;
+        uint16_t rv    = by_tx > by_rx ? by_tx : by_rx;
+        return rv > 0xFF ? 0xFF : rv;
+    }
+
+    Cmd cmds[MAX_CMDS];
+    uint8_t count = 0;
+    uint8_t bins  = 0;
+
+private:
+    uint8_t tx[PLAN_EXCHANGES];
+    uint8_t rx[PLAN_EXCHANGES];
+    uint16_t backlog_len  = 0;
+    uint16_t backlog_resp = 0;
+    uint8_t tx_limit = SENT_PACKET_LEN;
+    uint8_t rx_limit = PLAN_RESPONSE_BUDGET;
+};
+
+} // namespace hr20
@@ -20,10 +20,14 @@
 #pragma once
 
 #include "config.h"
+#include "commands.h"
 #include "util.h"
 #include "ntptime.h"
 #include "packetqueue.h"
 #include "model.h"
+#include "planner.h"
+#include "stats.h"
+#include "timing.h"
 
 namespace hr20 {
 
@@ -37,12 +41,11 @@ using RcvPacket = ShortQ<80>;
 // sent packet is shorter, as we hold cmac in an isolated place
 using SndPacket = PacketQ::Packet;
 
-typedef std::function<void(uint8_t addr, ChangeCategory cat)> OnChangeCb;
-
 // implements send/receive of the OpenHR20 protocol
 struct Protocol {
-    Protocol(Model &m, ntptime::NTPTime &time, crypto::Crypto &crypto, PacketQ &sndQ)
-        : model(m), time(time), crypto(crypto), sndQ(sndQ)
+    Protocol(Model &m, ntptime::NTPTime &time, crypto::Crypto &crypto,
+             PacketQ &sndQ, ActivityModel &activity)
+        : model(m), time(time), crypto(crypto), sndQ(sndQ), activity(activity)
     {}
 
     // bitfield
@@ -52,17 +55,35 @@ struct Protocol {
         ERR_MODEL = 2
     };
 
-    void ICACHE_FLASH_ATTR set_callback(const OnChangeCb &cb) {
-        on_change_cb = cb;
+    // registers a change observer. All of them get called, in the order
+    // they were added. False if there is no free slot
+    bool ICACHE_FLASH_ATTR add_callback(OnChangeFn fn, void *ctx) {
+        return observers.add(fn, ctx);
     }
 
-    /// verifies incoming packet, processes it accordingly
-    void ICACHE_FLASH_ATTR receive(RcvPacket &packet) {
+    // reports a change of client's values to the model and the callback
+    void ICACHE_FLASH_ATTR notify(uint8_t addr, ChangeCategory cat,
+                                  uint8_t detail = CHANGE_DETAIL_ALL)
+    {
+        // frequent values are not worth the flash writes
+        if (cat & (CHANGE_TIMER_MASK | CHANGE_EEPROM))
+            model.mark_dirty(addr);
+
+        if (auto *hr = model[addr]) {
+            ++hr->gen;
+            if (cat & CHANGE_TIMER_MASK) ++hr->timers_gen;
+        }
+
+        observers.notify(addr, cat, detail);
+    }
+
+    /// processes incoming packet. The packet was already authenticated
+    /// and decrypted on the fly by the rx stream while being received
+    void ICACHE_FLASH_ATTR receive(RcvPacket &packet, crypto::RxStream &rx) {
         rd_time = time.unixTime();
 
 #ifdef VERBOSE
-        DBG("== Will verify_decode packet of %d bytes ==", packet.size());
-        hex_dump("PKT", packet.data(), packet.size());
+        DBG("== Will process packet of %d bytes ==", packet.size());
 #endif
         // length byte in packet contains the length byte itself (thus -1)
         size_t data_size = (packet[0] & 0x7f) - 1;
@@ -79,17 +100,7 @@ struct Protocol {
             return;
         }
 
-        // pkt_cnt gets increased the number of times it was
-        // increased in encrypt_decrypt by sender (not applicable for sync)
-        uint8_t cnt_offset = isSync ? 0 : (packet.size() + 1) / 8;
-        crypto.rtc.pkt_cnt += cnt_offset;
-
-        bool ver = crypto.cmac_verify(
-            reinterpret_cast<const uint8_t *>(packet.data() + 1),
-            data_size - crypto::CMAC::CMAC_SIZE, isSync);
-
-        // restore the pkt_cnt
-        crypto.rtc.pkt_cnt -= cnt_offset;
+        bool ver = rx.verified();
 
 #ifdef VERBOSE
         DBG(" %s%s PACKET VERIFICATION %s",
@@ -100,7 +111,10 @@ struct Protocol {
         // verification failed? return
         if (!ver) {
             // bad packet might get special handling later on...
+            linkStats.on_bad_cmac(packet[1]);
             ERR_ARG(PROTO_BAD_CMAC, packet[1]);
+            if (packet[1] < MAX_HR_ADDR)
+                packet_feedback(packet[1], model[packet[1]], false, 0);
             on_failed_verify();
             return;
         }
@@ -115,12 +129,12 @@ struct Protocol {
                 ERR(PROTO_PACKET_TOO_SHORT);
                 return;
             }
-            // not a sync packet. we have to decode it
-            crypto.encrypt_decrypt(
-                    reinterpret_cast<uint8_t *>(packet.data()) + 2,
-                    packet.size() - 6);
 
-            crypto.rtc.pkt_cnt++;
+            // the packet counter moves past the decrypted payload
+            rx.commit();
+
+            linkStats.on_reply(packet[1], millis());
+            activity.on_reply(packet[1]);
 
 #ifdef VERBOSE
             hex_dump(" * Decoded packet data", packet.data(), packet.size());
@@ -137,14 +151,10 @@ struct Protocol {
                                   bool changed_time,
                                   long slew)
     {
-        // reset last_addr every second. this way we limit comms to 1 exchange
-        // per second
-        last_addr = 0xFF;
-
-        // clear
-        if (crypto.rtc.ss == 0) {
-            sndQ.clear(); // everything old is lost by design.
-        }
+        // every client gets at most one exchange per second. The responses
+        // to clients that answer within the same second are pipelined by
+        // the send queue
+        serviced = 0;
 
         if ((crypto.rtc.ss == 0 ||
              crypto.rtc.ss == 30))
@@ -176,6 +186,17 @@ struct Protocol {
         return last_force_count == 0;
     }
 
+    // bitmap of the client addresses forced by the last sync
+    uint32_t ICACHE_FLASH_ATTR forced() const {
+        return last_forced;
+    }
+
+    // names the client in the force flags of the next sync, :00 or :30,
+    // if it has anything to sync by then
+    void ICACHE_FLASH_ATTR force_next(uint8_t addr) {
+        if (addr < MAX_HR_ADDR) force_next_mask |= 1ul << addr;
+    }
+
 protected:
     bool ICACHE_FLASH_ATTR process_sync_packet(RcvPacket &packet) {
         if (packet.rest_size() < 1+4+4) {
@@ -220,6 +241,11 @@ protected:
         if (!hr) return false;
 
         hr->last_contact = rd_time;
+        // anything handled below is covered by this too
+        ++hr->gen;
+
+        // the payload behind len and addr, without the cmac
+        packet_feedback(addr, hr, true, packet.rest_size() - 4);
 
         // eat up the MAC, it's already verified
         packet.trim(4);
@@ -277,11 +303,13 @@ protected:
             default:
                 ERR(PROTO_UNKNOWN_SEQUENCE);
                 DBG(" !)");
+                bulk_error(addr, *hr);
                 return false;
             }
 
             if (err != OK) {
                 DBG(" ~)");
+                bulk_error(addr, *hr);
                 return false;
             }
         }
@@ -291,14 +319,15 @@ protected:
         EVENT_ARG(PROTO_HANDLED_OPS, bitmap);
 
         // inform send queue that we can send data for addr if we have any
-        // we limit to one packet to each client every minute by this logic
-        if (last_addr != addr) {
+        // we limit to one packet to each client every second by this logic
+        if (!(serviced & (1ul << addr))) {
             // prepare for immediate response if possible - shortens discovery
             // time by 1 minute.
             queue_updates_for(addr, *hr);
 
             // how many packets are queued for the client?
-            hr->need_fat_comms = (sndQ.get_update_count(addr) > 1);
+            hr->need_fat_comms = hr->in_bulk() ||
+                                 (sndQ.get_update_count(addr) > 1);
 
             // if there's anything for the current address, we prepare to
             // send right away.
@@ -308,7 +337,7 @@ protected:
 #else
             sndQ.prepare_to_send_to(addr);
 #endif
-            last_addr = addr;
+            serviced |= 1ul << addr;
         }
 
         return err == OK;
@@ -324,10 +353,7 @@ protected:
         // sequence of bytes terminated by \n
         while (1) {
             // packet too short or newline missing?
-            if (p.empty()) {
-                ERR(PROTO_RESPONSE_TOO_SHORT);
-                return ERR_PROTO;
-            }
+            if (p.empty()) return too_short();
 
             auto c = p.pop();
 
@@ -344,24 +370,28 @@ protected:
         return OK;
     }
 
+    // the response did not fit the rest of the packet
+    static Error ICACHE_FLASH_ATTR too_short() {
+        ERR(PROTO_RESPONSE_TOO_SHORT);
+        return ERR_PROTO;
+    }
+
     Error ICACHE_FLASH_ATTR on_temperature(uint8_t addr, RcvPacket &p) {
-        if (p.rest_size() < 9) {
-            ERR(PROTO_RESPONSE_TOO_SHORT);
+        if (p.rest_size() < cmd::Response<'A'>::LEN) {
             // reset the temp request status on the HR20 that reported this problem
             HR20 *hr = model[addr];
             if (!hr) return ERR_MODEL;
             hr->temp_wanted.reset_requested();
-            return ERR_PROTO; // can't continue after this...
+            return too_short(); // can't continue after this...
         }
 
         return on_debug(addr, p);
     }
 
     Error ICACHE_FLASH_ATTR on_debug(uint8_t addr, RcvPacket &p) {
-        if (p.rest_size() < 9) {
-            ERR(PROTO_RESPONSE_TOO_SHORT);
-            return ERR_PROTO;
-        }
+        // A and M answer with the same debug response
+        cmd::Response<'D'> r;
+        if (!cmd::decode(p, r)) return too_short();
 
         // TODO: Can't just store the value here, the client seems to accumulate
         // the debug packet responses.
@@ -370,36 +400,39 @@ protected:
         // If it IS a normal behavior, we need to handle the value carefully
 
         // minutes. 0x80 is CTL_mode_auto(0 manual, 1 auto), 0x40 is CTL_test_auto
-        uint8_t min_ctl   = p.pop();
+        uint8_t min_ctl   = r[0];
         // seconds. 0x80 is menu_locked, 0x40 is mode_window(0 closed, 1 open)
-        uint8_t sec_mm    = p.pop();
-        uint8_t ctl_err   = p.pop();
+        uint8_t sec_mm    = r[1];
+        uint8_t ctl_err   = r[2];
         // 16 bit temp average
-        uint8_t tmp_avg_h = p.pop();
-        uint8_t tmp_avg_l = p.pop();
+        uint16_t tmp_avg  = r.u16(3);
         // 16 bit batery measurement?
-        uint8_t bat_avg_h = p.pop();
-        uint8_t bat_avg_l = p.pop();
+        uint16_t bat_avg  = r.u16(5);
         // current wanted temperature (may be sourced from timer)
-        uint8_t tmp_wtd   = p.pop();
+        uint8_t tmp_wtd   = r[7];
         // wanted valve position
-        uint8_t valve_wtd = p.pop();
-
-        // TODO: implement calendar checksum handling here
-        // * if the packet is longer it contains calendar checksum
-        // * we then can introduce a passive mode that only refreshes
-        // * calendar when the checksum differs.
+        uint8_t valve_wtd = r[8];
 
         // fetch client from model
         HR20 *hr = model[addr];
         if (!hr) return ERR_MODEL;
 
+        // the longer variant of the response carries a calendar checksum.
+        // a byte trailing the response can't be a start of another one, as
+        // any response has at least one byte of data
+        if (p.rest_size() == 1) {
+            on_timers_checksum(addr, *hr, p.pop());
+        } else if (hr->timers_unverified) {
+            // client does not report the checksum, read timers normally
+            hr->timers_unverified = false;
+        }
+
         hr->auto_mode.set_remote(min_ctl & 0x80);
         hr->test_auto.set_remote(min_ctl & 0x40);
         hr->menu_locked.set_remote(sec_mm & 0x80);
         hr->mode_window.set_remote(sec_mm & 0x40);
-        hr->temp_avg.set_remote(tmp_avg_h << 8 | tmp_avg_l);
-        hr->bat_avg.set_remote(bat_avg_h << 8 | bat_avg_l);
+        hr->temp_avg.set_remote(tmp_avg);
+        hr->bat_avg.set_remote(bat_avg);
         hr->temp_wanted.set_remote(tmp_wtd);
         hr->cur_valve_wtd.set_remote(valve_wtd);
         hr->ctl_err.set_remote(ctl_err);
@@ -409,37 +442,83 @@ protected:
 #endif
 
         // inform callback we had a change
-        if (on_change_cb) on_change_cb(addr, CHANGE_FREQUENT);
+        notify(addr, CHANGE_FREQUENT);
 
         return OK;
     }
 
-    Error ICACHE_FLASH_ATTR on_watch(uint8_t addr, RcvPacket &p) {
-        if (p.rest_size() < 3) {
-            ERR(PROTO_RESPONSE_TOO_SHORT);
-            return ERR_PROTO;
+    // passive timer sync. Compares the client's calendar checksum with the
+    // one of our cached timer table, and either confirms the cached table
+    // or invalidates it to get it re-read
+    void ICACHE_FLASH_ATTR on_timers_checksum(uint8_t addr, HR20 &hr,
+                                              uint8_t crc)
+    {
+        hr.timers_crc       = crc;
+        hr.timers_crc_valid = true;
+
+        if (!TIMERS_PASSIVE_SYNC || hr.timers_crc_ignored) {
+            hr.timers_unverified = false;
+            return;
+        }
+
+        // the remote table is in flux, can't compare yet
+        if (hr.timers_write_pending()) return;
+
+        bool verify   = hr.timers_unverified;
+        bool complete = !verify && hr.timers_complete();
+
+        // not a full table to compare to - timers get read the regular way
+        if (!verify && !complete) return;
+
+        hr.timers_unverified = false;
+
+        if (hr.timers_checksum() == crc) {
+            hr.timers_fresh = false;
+            if (!verify) return;
+
+#ifdef VERBOSE
+            DBG(" * TMR CRC OK %02x", crc);
+#endif
+            // cached table is what client has, no need to re-read it
+            for (auto &day : hr.timers)
+                for (auto &slot : day)
+                    slot.set_remote(slot.get_remote());
+
+            notify(addr, CHANGE_TIMER_MASK);
+            return;
         }
 
-/*        uint8_t idx  = p.pop();
-        uint16_t val = p.pop() << 8;
-        val |= p.pop();*/
+        DBG("(TMR CRC %02x %02x)", crc, hr.timers_checksum());
 
+        // a freshly read table that does not match means we compute the
+        // checksum differently than the client. Stop relying on it
+        if (complete && hr.timers_fresh) {
+            hr.timers_crc_ignored = true;
+            return;
+        }
+
+        // calendar was changed on the client, or our copy is stale
+        hr.invalidate_timers();
+
+        hr.timers_fresh = true;
+    }
+
+    Error ICACHE_FLASH_ATTR on_watch(uint8_t addr, RcvPacket &p) {
         // IGNORED, 8 bit slot, 16 bit value
-        p.pop(); p.pop(); p.pop();
+        cmd::Response<'T'> r;
+        if (!cmd::decode(p, r)) return too_short();
 
         return OK;
     }
 
 
     Error ICACHE_FLASH_ATTR on_timers(uint8_t addr, RcvPacket &p) {
-        if (p.rest_size() < 3) {
-            ERR(PROTO_RESPONSE_TOO_SHORT);
-            return ERR_PROTO;
-        }
+        // R and W answer the same
+        cmd::Response<'R'> r;
+        if (!cmd::decode(p, r)) return too_short();
 
-        uint8_t idx  = p.pop();
-        uint16_t val = p.pop() << 8;
-        val |= p.pop();
+        uint8_t idx  = r[0];
+        uint16_t val = r.u16(1);
 
         // val: time | (mode << 12). Stored packed here
         HR20 *hr = model[addr];
@@ -460,39 +539,38 @@ protected:
 
         hr->timers[day][slot].set_remote(val);
 
-        if (on_change_cb) on_change_cb(addr, timer_day_2_change[day]);
+        notify(addr, timer_day_2_change[day],
+               day * TIMER_SLOTS_PER_DAY + slot);
 
         return OK;
     }
 
     Error ICACHE_FLASH_ATTR on_eeprom(uint8_t addr, RcvPacket &p) {
-        if (p.rest_size() < 2) {
-            ERR(PROTO_RESPONSE_TOO_SHORT);
-            return ERR_PROTO;
-        }
+        // G and S answer the same
+        cmd::Response<'G'> r;
+        if (!cmd::decode(p, r)) return too_short();
 
-        uint8_t eeaddr = p.pop();
-        uint8_t eeval  = p.pop();
+        uint8_t eeaddr = r[0];
+        uint8_t eeval  = r[1];
 
         HR20 *hr = model[addr];
         if (!hr) return ERR_MODEL;
 
         hr->last_contact = rd_time;
-        hr->eeprom[eeaddr].set_remote(eeval);
+        auto *cell = hr->eeprom.get(eeaddr);
+        if (cell) cell->set_remote(eeval);
 
         // callback to publish the changes. we use frequent here, no big deal
-        if (on_change_cb) on_change_cb(addr, CHANGE_EEPROM);
+        notify(addr, CHANGE_EEPROM, eeaddr);
 
         return OK;
     }
 
     Error ICACHE_FLASH_ATTR on_menu_lock(uint8_t addr, RcvPacket &p) {
-        if (p.rest_size() < 1) {
-            ERR(PROTO_RESPONSE_TOO_SHORT);
-            return ERR_PROTO;
-        }
+        cmd::Response<'L'> r;
+        if (!cmd::decode(p, r)) return too_short();
 
-        uint8_t menu_locked = p.pop();
+        uint8_t menu_locked = r[0];
 
         HR20 *hr = model[addr];
         if (!hr) return ERR_MODEL;
@@ -504,121 +582,127 @@ protected:
     }
 
     Error ICACHE_FLASH_ATTR on_reboot(uint8_t addr, RcvPacket &p) {
-        if (p.rest_size() < 2) {
-            ERR(PROTO_RESPONSE_TOO_SHORT);
-            return ERR_PROTO;
-        }
+        cmd::Response<'B'> r;
+        if (!cmd::decode(p, r)) return too_short();
 
         // fixed response. has to be 0x13, 0x24
-        uint8_t b13 = p.pop();
-        uint8_t b24 = p.pop();
-
-        if (b13 != 0x13 || b24 != 0x24)
+        if (r.u16(0) != 0x1324)
             return ERR_PROTO;
 
         return OK;
     }
 
     void ICACHE_FLASH_ATTR queue_updates_for(uint8_t addr, HR20 &hr) {
-        bool synced = true;
         bool was_synced = hr.synced;
 
-        // base values not yet read are not a reason for non-synced state
-        // the reason is that we'll get them for free after the client
-        // shows up
-        unsigned flags = 0;
+        // don't plan past the packets that are already waiting. User
+        // setpoints don't wait for the background work queued before them,
+        // their packet goes out first
+        uint8_t queued = sndQ.get_update_count(addr);
+        uint8_t exchanges = queued < PLAN_EXCHANGES
+                            ? PLAN_EXCHANGES - queued : 0;
+        if (!exchanges && hr.needs_basic_value_sync() &&
+            !sndQ.get_update_count(addr, PacketQ::PRIO_INTERACTIVE))
+            exchanges = 1;
+        plan.clear(exchanges, hr.packet_limit);
+        packet_limit = hr.packet_limit.limit;
+
+        // synced client. nothing to look for
+        if (hr.nothing_pending()) {
+            if (!was_synced) DBG("(OK %d)", addr);
+            hr.synced = true;
+            hr.exchanges_left = 0;
+            send_ack(addr);
+            update_bulk(addr, hr);
+            return;
+        }
 
         DBGI("(Q %d", (int)addr);
 
-        // wanted temperature
-        if (hr.temp_wanted.needs_write()) {
-            synced = false;
-            flags |= 1;
-            DBGI(" T");
-            send_set_temp(addr, hr.temp_wanted);
-        }
-
-        if (hr.auto_mode.needs_write()) {
-            synced = false;
-            flags |= 2;
-            DBGI(" A");
-            send_set_auto_mode(addr, hr.auto_mode);
-        }
-
-        if (hr.menu_locked.needs_write()) {
-            synced = false;
-            flags |= 4;
-            DBGI(" L");
-            send_set_menu_locked(addr, hr.menu_locked);
-        }
-
-        // only allow queueing N eeprom accesses at a time
-        uint8_t ee_ctr = MAX_QUEUE_EEPROM;
-
-        // read/write on eeprom?
-        for (unsigned ee_addr = 0; ee_addr < EEPROM_SIZE; ++ee_addr) {
-            auto &eeprom_slot = hr.eeprom[ee_addr];
-            if (eeprom_slot.needs_read()) {
-                synced = false;
-                flags |= 8;
-                DBGI(" RE");
-                send_get_eeprom(addr, ee_addr);
-                if (!(--ee_ctr)) break;
-            } else if (eeprom_slot.needs_write()) {
-                synced = false;
-                flags |= 8;
-                DBGI(" WE");
-                send_set_eeprom(addr, ee_addr, eeprom_slot);
-                if (!(--ee_ctr)) break;
+        // user visible setpoints first, then writes, background reads last
+        plan_write(hr.temp_wanted, 'A');
+        plan_write(hr.auto_mode, 'M');
+        plan_write(hr.menu_locked, 'L');
+
+        auto &ee = hr.eeprom;
+
+        for (uint32_t m = hr.eeprom_wr; m; m &= m - 1) {
+            uint8_t s = __builtin_ctz(m);
+            if (!ee.slot_used(s) || !ee.slot_cell(s).is_requested_set()) {
+                hr.eeprom_wr &= ~(1ul << s);
+                continue;
+            }
+            plan_write(ee.slot_cell(s), 'S', ee.slot_addr(s));
+        }
+
+        for (uint64_t m = hr.timers_wr; m; m &= m - 1) {
+            uint8_t i = __builtin_ctzll(m);
+            auto &timer = hr.timers[i / TIMER_SLOTS_PER_DAY][i % TIMER_SLOTS_PER_DAY];
+            if (!timer.is_requested_set()) {
+                hr.timers_wr &= ~(1ull << i);
+                continue;
+            }
+            plan_write(timer, 'W', timer_arg(i));
+        }
+
+        for (uint32_t m = hr.eeprom_rd; m; m &= m - 1) {
+            uint8_t s = __builtin_ctz(m);
+            if (!ee.slot_used(s) || !reading(ee.slot_cell(s))) {
+                hr.eeprom_rd &= ~(1ul << s);
+                continue;
             }
+            plan_read(ee.slot_cell(s), 'G', ee.slot_addr(s));
         }
 
-        // only read timers if we didn't handle eeprom ops.
-        // otherwise the client gets overhelmed
-        if (ee_ctr == MAX_QUEUE_EEPROM) {
-            // only allow queueing 8 timers to save time
-            uint8_t tmr_ctr = MAX_QUEUE_TIMERS;
-
-            // get timers if we don't have them, set them if change happened
-            for (uint8_t dow = 0; dow < 8; ++dow) {
-                for (uint8_t slot = 0; slot < TIMER_SLOTS_PER_DAY; ++slot) {
-                    auto &timer = hr.timers[dow][slot];
-                    if (timer.needs_read()) {
-                        flags |= 16;
-                        synced = hr.synced = false; // shortcut, we might return
-                        DBGI(" RT");
-                        send_get_timer(addr, dow, slot, timer);
-                        if (!(--tmr_ctr)) {
-                            DBG(")");
-                            return;
-                        }
-                    }
-                    if (timer.needs_write()) {
-                        flags |= 32;
-                        synced = hr.synced = false;
-                        DBGI(" WT");
-                        send_set_timer(addr, dow, slot, timer);
-                        if (!(--tmr_ctr)) {
-                            DBG(")");
-                            return;
-                        }
-                    }
+        // unverified timers wait for the checksum instead
+        if (!hr.timers_unverified) {
+            for (uint64_t m = hr.timers_rd; m; m &= m - 1) {
+                uint8_t i = __builtin_ctzll(m);
+                auto &timer = hr.timers[i / TIMER_SLOTS_PER_DAY][i % TIMER_SLOTS_PER_DAY];
+                if (!reading(timer)) {
+                    hr.timers_rd &= ~(1ull << i);
+                    continue;
                 }
+                plan_read(timer, 'R', timer_arg(i));
             }
         }
 
+        // emit the planned exchanges, each one in its own packet
+        for (uint8_t b = 0; b < plan.bins; ++b) {
+            fresh_packet = true;
+            packet_prio  = PacketQ::PRIO_BACKGROUND;
+
+            for (uint8_t i = 0; i < plan.count; ++i) {
+                const auto &cmd = plan.cmds[i];
+                if (cmd.bin == b && is_setpoint(cmd.code))
+                    packet_prio = PacketQ::PRIO_INTERACTIVE;
+            }
+
+            for (uint8_t i = 0; i < plan.count; ++i) {
+                const auto &cmd = plan.cmds[i];
+                if (cmd.bin != b) continue;
+                DBGI(" %c", cmd.code);
+                send_cmd(addr, hr, cmd);
+            }
+        }
+
+        fresh_packet = false;
+        packet_prio  = PacketQ::PRIO_BACKGROUND;
+        hr.exchanges_left = plan.exchanges_left();
+
         // close the debug statement
         DBG(")");
 
         // maybe we didn't need anything? In that case consider the client
         // synced. We will skip any of these in the force flags/addresses
+        bool synced = plan.empty();
         hr.synced = synced;
         if (synced && !was_synced) {
             // report the client is fully synced
             DBG("(OK %d)", addr);
         } else {
             if (!synced) {
-                DBG("(WAIT %d %d)", addr, flags);
+                DBG("(WAIT %d %d)", addr, hr.exchanges_left);
             }
         }
 
@@ -626,6 +710,139 @@ protected:
         if (synced) {
             send_ack(addr);
         }
+
+        update_bulk(addr, hr);
+    }
+
+    /** starts, advances and finishes the bulk session with the client.
+     * A client with a backlog of BULK_MIN_EXCHANGES or more gets forced in
+     * every sync, so it talks every second instead of twice a minute. The
+     * packets are the same planned ones, so SENT_PACKET_LEN still holds.
+     */
+    void ICACHE_FLASH_ATTR update_bulk(uint8_t addr, HR20 &hr) {
+        uint8_t left = hr.exchanges_left;
+
+        if (!hr.in_bulk()) {
+            if (hr.bulk_cooldown || left < BULK_MIN_EXCHANGES) return;
+            if (bulk_sessions >= BULK_MAX_SESSIONS) return;
+
+            DBG("(BULK %d %d)", addr, left);
+            EVENT_ARG(PROTO_BULK_START, addr);
+            hr.bulk_state  = BULK_ACTIVE;
+            hr.bulk_total  = left;
+            hr.bulk_errors = 0;
+            bulk_left[addr] = left;
+            ++bulk_sessions;
+            notify(addr, CHANGE_BULK);
+            return;
+        }
+
+        if (left == 0) {
+            DBG("(BULK OK %d)", addr);
+            EVENT_ARG(PROTO_BULK_DONE, addr);
+            hr.bulk_state = BULK_DONE;
+            --bulk_sessions;
+            notify(addr, CHANGE_BULK);
+            return;
+        }
+
+        // more work got requested meanwhile
+        if (left > hr.bulk_total) hr.bulk_total = left;
+
+        if (left != bulk_left[addr]) {
+            bulk_left[addr] = left;
+            notify(addr, CHANGE_BULK);
+        }
+    }
+
+    // counts a failure against the bulk session, ends it after too many
+    void ICACHE_FLASH_ATTR bulk_error(uint8_t addr, HR20 &hr) {
+        if (!hr.in_bulk()) return;
+        if (++hr.bulk_errors < BULK_MAX_ERRORS) return;
+
+        DBG("(BULK FAIL %d)", addr);
+        EVENT_ARG(PROTO_BULK_ABORT, addr);
+        hr.bulk_state    = BULK_ABORTED;
+        hr.bulk_cooldown = BULK_COOLDOWN_SYNCS;
+        --bulk_sessions;
+        notify(addr, CHANGE_BULK);
+    }
+
+    // commands of the user visible setpoints, queued as interactive
+    static bool is_setpoint(uint8_t code) {
+        return code == 'A' || code == 'M' || code == 'L';
+    }
+
+    // timer bit index to the dow << 4 | slot command argument
+    static uint8_t timer_arg(uint8_t i) {
+        return (i / TIMER_SLOTS_PER_DAY) << 4 | (i % TIMER_SLOTS_PER_DAY);
+    }
+
+    // value still has to be read (needs_read without the retry countdown)
+    template<typename ValT>
+    static bool ICACHE_FLASH_ATTR reading(const ValT &val) {
+        return !val.remote_valid() && !val.masked();
+    }
+
+    template<typename ValT>
+    void ICACHE_FLASH_ATTR plan_write(ValT &val, uint8_t code, uint8_t arg = 0) {
+        if (!val.needs_write()) return;
+        // didn't fit this time, make it due again in the next exchange
+        if (!plan.add(code, arg)) val.retry_next();
+    }
+
+    template<typename ValT>
+    void ICACHE_FLASH_ATTR plan_read(ValT &val, uint8_t code, uint8_t arg) {
+        if (!val.needs_read()) return;
+        if (!plan.add(code, arg)) val.retry_next();
+    }
+
+    void ICACHE_FLASH_ATTR send_cmd(uint8_t addr, HR20 &hr,
+                                    const ExchangePlanner::Cmd &cmd)
+    {
+        uint8_t dow  = cmd.arg >> 4;
+        uint8_t slot = cmd.arg & 0x0F;
+
+        switch (cmd.code) {
+        case 'A': send_set_temp(addr, hr.temp_wanted); break;
+        case 'M': send_set_auto_mode(addr, hr.auto_mode); break;
+        case 'L': send_set_menu_locked(addr, hr.menu_locked); break;
+        case 'S': send_set_eeprom(addr, cmd.arg, *hr.eeprom.find(cmd.arg)); break;
+        case 'G': send_get_eeprom(addr, cmd.arg); break;
+        case 'W': send_set_timer(addr, dow, slot, hr.timers[dow][slot]); break;
+        case 'R': send_get_timer(addr, dow, slot, hr.timers[dow][slot]); break;
+        }
+    }
+
+    // packet for a command of the given size. The first command of each
+    // planned exchange starts a new packet
+    SndPacket * ICACHE_FLASH_ATTR packet_for(uint8_t addr, uint8_t bytes) {
+        bool fresh = fresh_packet;
+        fresh_packet = false;
+        return sndQ.want_to_send_for(addr, bytes, rd_time, fresh,
+                                     packet_limit, packet_prio);
+    }
+
+    // queues command C with the arguments laid out as the command table says
+    template<char C, typename... Args>
+    void ICACHE_FLASH_ATTR send(uint8_t addr, Args... args) {
+        SndPacket *p = packet_for(addr, cmd::cmd_len(C));
+        if (!p) return;
+        cmd::encode<C>(*p, args...);
+    }
+
+    // the client's packet following ours tells if ours got through - the
+    // response comes right away, a status packet only with the next wakeup
+    void ICACHE_FLASH_ATTR packet_feedback(uint8_t addr, HR20 *hr,
+                                           bool verified, uint8_t resp)
+    {
+        PacketQ::Sent s;
+        if (!sndQ.take_sent(addr, s) || !hr) return;
+
+        if (verified && millis() - s.at < PACKET_REPLY_MS)
+            hr->packet_limit.on_answered(s.len, resp);
+        else
+            hr->packet_limit.on_lost();
     }
 
     void ICACHE_FLASH_ATTR send_ack(uint8_t addr) {
@@ -658,12 +875,8 @@ protected:
             temp_wanted.reset_requested();
         }
 
-        // 2 bytes [A][xx] xx is in half degrees
-        SndPacket *p = sndQ.want_to_send_for(addr, 2, rd_time);
-        if (!p) return;
-
-        p->push('A');
-        p->push(temp_wanted.get_requested());
+        // xx is in half degrees
+        send<'A'>(addr, temp_wanted.get_requested());
     }
 
     void ICACHE_FLASH_ATTR send_set_auto_mode(uint8_t addr,
@@ -672,11 +885,7 @@ protected:
 #ifdef VERBOSE
         DBG("   * AUTO %u", addr);
 #endif
-        SndPacket *p = sndQ.want_to_send_for(addr, 2, rd_time);
-        if (!p) return;
-
-        p->push('M');
-        p->push(auto_mode.get_requested() ? 1 : 0);
+        send<'M'>(addr, uint8_t(auto_mode.get_requested() ? 1 : 0));
     }
 
     void ICACHE_FLASH_ATTR send_set_menu_locked(uint8_t addr,
@@ -685,11 +894,7 @@ protected:
 #ifdef VERBOSE
         DBG("   * LOCK %u", addr);
 #endif
-        SndPacket *p = sndQ.want_to_send_for(addr, 2, rd_time);
-        if (!p) return;
-
-        p->push('L');
-        p->push(menu_locked.get_requested() ? 1 : 0);
+        send<'L'>(addr, uint8_t(menu_locked.get_requested() ? 1 : 0));
     }
 
     void ICACHE_FLASH_ATTR send_get_timer(uint8_t addr, uint8_t dow,
@@ -698,11 +903,7 @@ protected:
 #ifdef VERBOSE
         DBG("   * GET TIMER %u", addr);
 #endif
-        SndPacket *p = sndQ.want_to_send_for(addr, 2, rd_time);
-        if (!p) return;
-
-        p->push('R');
-        p->push(dow << 4 | slot);
+        send<'R'>(addr, uint8_t(dow << 4 | slot));
     }
 
     void ICACHE_FLASH_ATTR send_set_timer(uint8_t addr, uint8_t dow,
@@ -711,13 +912,7 @@ protected:
 #ifdef VERBOSE
         DBG("   * SET TIMER %u", addr);
 #endif
-        SndPacket *p = sndQ.want_to_send_for(addr, 4, rd_time);
-        if (!p) return;
-
-        p->push('W');
-        p->push(dow << 4 | slot);
-        p->push(timer.get_requested().raw() >> 8);
-        p->push(timer.get_requested().raw() && 0xFF);
+        send<'W'>(addr, uint8_t(dow << 4 | slot), timer.get_requested().raw());
     }
 
     void ICACHE_FLASH_ATTR send_set_eeprom(
@@ -726,12 +921,7 @@ protected:
 #ifdef VERBOSE
         DBG("   * EEPROM S %u", addr);
 #endif
-        SndPacket *p = sndQ.want_to_send_for(addr, 3, rd_time);
-        if (!p) return;
-
-        p->push('S');
-        p->push(ee_addr);
-        p->push(eeprom.get_requested());
+        send<'S'>(addr, ee_addr, eeprom.get_requested());
     }
 
     void ICACHE_FLASH_ATTR send_get_eeprom(
@@ -740,19 +930,17 @@ protected:
 #ifdef VERBOSE
         DBG("   * EEPROM G %u", addr);
 #endif
-        SndPacket *p = sndQ.want_to_send_for(addr, 3, rd_time);
-        if (!p) return;
-
-        p->push('G');
         // address is validly stored in remote, eventhough complete value is
         // invalidated
-        p->push(ee_addr);
+        send<'G'>(addr, ee_addr);
     }
 
 
     void ICACHE_FLASH_ATTR send_sync(time_t curtime) {
 #ifdef NTP_CLIENT
-        SndPacket *p = sndQ.want_to_send_for(PacketQ::SYNC_ADDR, 8, curtime);
+        // packet ages in the queue are kept in utc
+        SndPacket *p = sndQ.want_to_send_for(PacketQ::SYNC_ADDR, 8,
+                                             time.unixTime());
         if (!p) return;
 
         // TODO: force flags, if needed!
@@ -766,22 +954,33 @@ protected:
         // based on that knowledge, send flags or addresses
         ForceFlags ff;
 
-        // only fill force flags on :30
-        if (rtc.ss == 30) {
-            for (uint8_t a = 0; a < MAX_HR_ADDR; ++a) {
-                auto *hr = model[a];
-                if (!hr) continue;
+        time_t now = time.unixTime();
+
+        // fill force flags on :30, clients in bulk session get forced on :00
+        // as well
+        for (uint8_t a = 0; a < MAX_HR_ADDR; ++a) {
+            auto *hr = model[a];
+            if (!hr) continue;
+
+            if (hr->bulk_cooldown) --hr->bulk_cooldown;
+
+            // forced, yet silent for the whole half minute
+            if ((last_forced & (1ul << a)) && hr->last_contact < last_sync)
+                bulk_error(a, *hr);
+
+            if (rtc.ss != 30 && !hr->in_bulk() &&
+                !(force_next_mask & (1ul << a)))
+                continue;
 
 #ifdef VERBOSE
-                DBG("(FF %d %d %d)",
-                    a,
-                    hr->last_contact,
-                    ((!hr->synced) || hr->needs_basic_value_sync()) ? 1 : 0);
+            DBG("(FF %d %d %d)",
+                a,
+                hr->last_contact,
+                ((!hr->synced) || hr->needs_basic_value_sync()) ? 1 : 0);
 #endif
-                if (hr->last_contact == 0) continue;
-                if ((!hr->synced) || hr->needs_basic_value_sync()) {
-                    ff.push(a, hr->need_fat_comms);
-                }
+            if (hr->last_contact == 0) continue;
+            if ((!hr->synced) || hr->needs_basic_value_sync()) {
+                ff.push(a, hr->need_fat_comms);
             }
         }
 
@@ -789,6 +988,9 @@ protected:
         ff.write(p);
 
         last_force_count = ff.count();
+        last_forced      = ff.big;
+        last_sync        = now;
+        force_next_mask  = 0;
 #endif
     }
 
@@ -801,21 +1003,43 @@ protected:
     // encryption tools
     crypto::Crypto &crypto;
 
-    // callback that gets informed about changes
-    OnChangeCb on_change_cb;
+    // get informed about changes - the mqtt journal, the master's relay
+    ChangeObservers observers;
 
     // ref to packet queue responsible for packet retrieval for sending
     PacketQ &sndQ;
 
-    // last address we sent a packet to - limits to 1 packet for every client
-    // every minute
-    uint8_t last_addr = 0xFF;
+    // radio timing of the network, learns the reply times
+    ActivityModel &activity;
+
+    // bitmap of addresses already serviced in this second - limits to 1
+    // packet exchange for every client every second
+    uint32_t serviced = 0;
 
     /// count of forced addrs last time we iterated them in send_sync
     uint8_t last_force_count = 0;
+    /// and their bitmap
+    uint32_t last_forced = 0;
+    /// clients to be forced in the next sync, see force_next
+    uint32_t force_next_mask = 0;
+    /// time of the last sync sent
+    time_t last_sync = 0;
+    /// exchanges left last reported for clients in bulk session
+    uint8_t bulk_left[MAX_HR_ADDR] = {0};
+    /// count of clients in bulk session
+    uint8_t bulk_sessions = 0;
 
     // current read time
     time_t rd_time;
+
+    // plan of the exchanges queued by queue_updates_for
+    ExchangePlanner plan;
+    // next command pushed through packet_for starts a new packet
+    bool fresh_packet = false;
+    // class of the packets queue_updates_for is composing
+    PacketQ::Prio packet_prio = PacketQ::PRIO_BACKGROUND;
+    // packet limit of the client the commands are queued for
+    uint8_t packet_limit = SENT_PACKET_LEN;
 };
 
 
@@ -52,6 +52,22 @@ struct ShortQ {
 #endif
     }
 
+    // pushes n bytes at once, or nothing if they don't fit
+    bool push(const uint8_t *src, uint8_t n) {
+#ifndef RFM_POLL_MODE
+        noInterrupts();
+#endif
+        bool fits = _top + n <= LenT;
+        if (fits) {
+            memcpy(buf + _top, src, n);
+            _top += n;
+        }
+#ifndef RFM_POLL_MODE
+        interrupts();
+#endif
+        return fits;
+    }
+
     uint8_t pos() const {
         return _pos;
     }
@@ -71,6 +87,23 @@ struct ShortQ {
         return c;
     }
 
+    // pops n bytes at once, or nothing if there's less than that
+    bool take(uint8_t *dst, uint8_t n) {
+#ifndef RFM_POLL_MODE
+        noInterrupts();
+#endif
+        bool has = rest_size() >= n;
+        if (has) {
+            memcpy(dst, buf + _pos, n);
+            _pos += n;
+            if (_pos >= _top) clear();
+        }
+#ifndef RFM_POLL_MODE
+        interrupts();
+#endif
+        return has;
+    }
+
     uint8_t peek() const {
         if (_pos < _top)
             return buf[_pos];
@@ -114,4 +147,126 @@ struct ShortQ {
     uint8_t operator[](uint8_t idx) const { return buf[idx]; }
 };
 
+// byte FIFO like ShortQ, over storage owned by someone else - so queues of
+// one type can have differing capacities. Main loop only, no interrupt
+// masking
+struct SlotQ {
+    void attach(uint8_t *storage, uint8_t cap) {
+        buf  = storage;
+        _cap = cap;
+        clear();
+    }
+
+    bool push(uint8_t c) {
+        if (full()) return false;
+        buf[_top++] = c;
+        return true;
+    }
+
+    // pushes n bytes at once, or nothing if they don't fit
+    bool push(const uint8_t *src, uint8_t n) {
+        if (_top + n > _cap) return false;
+        memcpy(buf + _top, src, n);
+        _top += n;
+        return true;
+    }
+
+    uint8_t pop() {
+        uint8_t c = 0x0;
+
+        if (_pos < _top) c = buf[_pos++];
+        if (_pos >= _top) clear();
+
+        return c;
+    }
+
+    uint8_t peek() const {
+        if (_pos < _top)
+            return buf[_pos];
+
+        return 0x0;
+    }
+
+    bool empty() const { return _pos >= _top; }
+    bool full() const  { return _top >= _cap; }
+
+    // raw data access for packet storage
+    uint8_t *data() { return buf; }
+    const uint8_t *data() const { return buf; }
+    // size from the begining of the buffer
+    uint8_t size() const { return _top; }
+    uint8_t capacity() const { return _cap; }
+    uint8_t free_size() const { return _cap - _top; }
+
+    void clear() {
+        _top = 0;
+        _pos = 0;
+    }
+
+    uint8_t operator[](uint8_t idx) const { return buf[idx]; }
+
+protected:
+    uint8_t *buf = nullptr;
+    uint8_t _cap = 0;
+    uint8_t _pos = 0;
+    uint8_t _top = 0;
+};
+
+// lock-free single-producer/single-consumer byte ring buffer.
+// Producer only ever moves _head, consumer only ever moves _tail, so one of the
+// sides can live in an ISR without any interrupt masking on the other side.
+// Both indices run freely and wrap at 256, LenT has to be a power of 2 <= 128.
+// NOTE: Not using ICACHE_FLASH_ATTR here as this gets used from ISR too
+template<uint8_t LenT>
+struct RingQ {
+    static_assert(LenT && ((LenT & (LenT - 1)) == 0) && LenT <= 128,
+                  "RingQ length has to be a power of 2 not bigger than 128");
+
+    static constexpr const uint8_t MASK = LenT - 1;
+
+    // producer side
+    bool push(uint8_t c) {
+        uint8_t h = _head;
+        if (static_cast<uint8_t>(h - _tail) >= LenT) return false;
+        buf[h & MASK] = c;
+        // publish the byte only after it was written
+        _head = h + 1;
+        return true;
+    }
+
+    // consumer side. returns 0 if empty
+    uint8_t pop() {
+        uint8_t t = _tail;
+        if (t == _head) return 0x0;
+        uint8_t c = buf[t & MASK];
+        _tail = t + 1;
+        return c;
+    }
+
+    // consumer side. returns 0 if empty
+    uint8_t peek() const {
+        uint8_t t = _tail;
+        if (t == _head) return 0x0;
+        return buf[t & MASK];
+    }
+
+    // consumer side - drops everything that was pushed so far
+    void clear() {
+        _tail = _head;
+    }
+
+    bool empty() const { return _head == _tail; }
+    bool full() const  { return size() >= LenT; }
+
+    // count of bytes waiting in the ring
+    uint8_t size() const { return static_cast<uint8_t>(_head - _tail); }
+    uint8_t free_size() const { return LenT - size(); }
+
+protected:
+    uint8_t buf[LenT];
+    // volatile as these are handled from interrupt too
+    volatile uint8_t _head = 0;
+    volatile uint8_t _tail = 0;
+};
+
 } // namespace hr20
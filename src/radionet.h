@@ -0,0 +1,261 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+#pragma once
+
+#include "capture.h"
+#include "debug.h"
+#include "ntptime.h"
+#include "protocol.h"
+#include "rfm12b.h"
+#include "crypto.h"
+#include "packetqueue.h"
+#include "timing.h"
+
+static_assert(hr20::RFM_FRAME_MAX <= sizeof(hr20::RcvPacket::buf),
+              "received packet has to hold a whole frame");
+#ifdef MODEL_STORE
+#include "persist.h"
+#endif
+
+namespace hr20 {
+
+/// One radio with its own network of clients - the RFM12B, the packet
+/// queue, crypto RTC and protocol state, and the model of the clients. Runs
+/// the radio state machine: packet sending/retrieval and radio control.
+struct RadioNet {
+    ICACHE_FLASH_ATTR RadioNet(ntptime::NTPTime &tm, uint8_t net)
+        : net(net),
+          time(tm),
+          crypto{time},
+          radio{RFM_SS_PINS[net], RFM_NIRQ_PINS[net], RFM_FREQ_ADJUST[net]},
+          queue{crypto, activity, PACKET_DISCARD_AGE},
+          proto{model, time, crypto, queue, activity}
+    {}
+
+    RadioNet(const RadioNet &) = delete;
+
+    void ICACHE_FLASH_ATTR begin(const uint8_t *rfm_pass) {
+        crypto.begin(rfm_pass);
+#ifdef MODEL_STORE
+        // warm start - timers get verified by checksum instead of re-reading
+        store.begin();
+#endif
+        radio.begin();
+    }
+
+    bool ICACHE_FLASH_ATTR update(bool changed_time, time_t now) {
+        radio.update();
+
+        // Note: could use [[maybe_unused]] in C++17
+        // update the crypto rtc if needed
+        bool __attribute__((unused)) sec_pass = crypto.update(now);
+
+        // TODO: if it's 00 or 30, we send sync
+        if (sec_pass) {
+            DBGI("[%d:%d]\n", net, crypto.rtc.ss);
+            time_t curtime = time.localTime();
+            proto.update(curtime, time.isSynced(), changed_time, time.cur_slew);
+            expire_due = true;
+        }
+
+        // send data/receive data as appropriate
+        send();
+        receive();
+
+        // exchanges end with the radio going idle
+        bool idle = radio.is_idle();
+        if (idle && !radio_idle) activity.on_idle(time.getMillis());
+        radio_idle = idle;
+
+        // nothing on air, precompute this second's keystream so the
+        // RX->TX turnaround only has to XOR. Age out stale packets once
+        // per second, too
+        if (radio.is_idle()) {
+            crypto.prefetch();
+
+            if (expire_due || queue.expire_wanted) {
+                queue.expire(time.unixTime());
+                expire_due = false;
+            }
+        }
+
+        return sec_pass;
+    }
+
+    void ICACHE_FLASH_ATTR receive() {
+        int b = radio.recv();
+
+        // no data on input means we just ignore
+        if (b < 0) return;
+
+        // rest of an aborted frame, the next byte is a length byte again
+        if (skip) {
+            if (!--skip) wait_for_sync();
+            return;
+        }
+
+        if (length == 0) {
+            CAPTURE_BEGIN(net, 0, crypto.rtc);
+            CAPTURE_BYTE(net, b);
+
+            length = b & ~0x80;
+            if (length == 0) {
+                CAPTURE_END(net, Capture::ABORTED);
+                ERR(PROTO_EMPTY_PACKET);
+                abort_frame(0);
+                return;
+            } else if (length > RFM_FRAME_MAX) {
+                // the radio cuts the frame to RFM_FRAME_MAX
+                CAPTURE_END(net, Capture::ABORTED);
+                ERR(PROTO_PACKET_TOO_LONG);
+                abort_frame(RFM_FRAME_MAX - 1);
+                return;
+            } else {
+#ifdef VERBOSE
+                DBG(" * Start rcv. of %d bytes", length);
+#endif
+            }
+
+            // the length byte itself is not authenticated
+            rx.begin(b);
+            linkStats.on_rx_start(millis());
+            activity.on_rx_start(time.getMillis());
+        } else {
+            CAPTURE_BYTE(net, b);
+            // verify and decrypt on the fly
+            b = rx.feed(b);
+        }
+
+        if (!packet.push(b)) {
+            CAPTURE_END(net, Capture::ABORTED);
+            ERR(PROTO_PACKET_TOO_LONG);
+            abort_frame(length - 1);
+            return;
+        }
+
+        --length;
+
+        if (!length) {
+            DBG("(RCV %u)", packet.size());
+            CAPTURE_END(net, rx.verified() ? Capture::VERIFIED : 0);
+            // TODO: Close the RX sooner here
+            proto.receive(packet, rx);
+            wait_for_sync();
+        }
+    }
+
+    bool ICACHE_FLASH_ATTR send() {
+        // responses deferred while we were sending go out back to back
+        if (radio.is_idle()) queue.prepare_pending();
+
+        while (true) {
+            int b = queue.peek();
+
+            // no more data...
+            if (b < 0) return false;
+
+            // when sending, we are sure to discard any prior received data
+            length = 0;
+            skip   = 0;
+            packet.clear();
+
+            // come back after the radio gets free
+            if (!radio.send(b)) return true;
+
+            if (!CAPTURE_SENDING(net))
+                CAPTURE_BEGIN(net, Capture::TX, crypto.rtc);
+            CAPTURE_BYTE(net, b);
+
+            bool more = queue.pop();
+
+            // the radio starts as soon as the prologue was handed over, the
+            // payload gets encrypted and streamed while preamble is on air
+            if (queue.in_payload() || !more) radio.transmit();
+
+            if (!more) {
+                radio.end_packet();
+                CAPTURE_END(net, 0);
+                return false;
+            }
+        }
+    }
+
+    void ICACHE_FLASH_ATTR wait_for_sync() {
+        length = 0;
+        packet.clear();
+        radio.wait_for_sync();
+    }
+
+    /** drops the frame being received. The radio still delivers the bytes
+     * left of it, these get skipped before the radio is reset - otherwise
+     * the next of them would be read as the length byte of another frame
+     */
+    void ICACHE_FLASH_ATTR abort_frame(uint8_t left) {
+        length = 0;
+        packet.clear();
+        skip = left;
+        if (!skip) radio.wait_for_sync();
+    }
+
+    /** indicates the network has no time-sensitive work
+     * going on, so we can do some time consuming updates that could break
+     * radio comms.
+     */
+    bool ICACHE_FLASH_ATTR is_idle() {
+        // every second if we have realtime
+#ifndef NO_REALTIME
+        // outside of the exchanges the activity model expects, and the radio
+        // has to be idle, too
+        return radio.is_idle()
+               && !activity.busy(second(time.localTime()), time.getMillis(),
+                                 model.present, proto.forced());
+#endif
+        auto sec = second(time.localTime());
+        return (sec >= 50) && (sec <= 58) && radio.is_idle();
+    }
+
+    // index of the radio network
+    const uint8_t net;
+    // RTC with NTP synchronization
+    ntptime::NTPTime &time;
+    crypto::Crypto crypto;
+    RFM12B radio;
+    ActivityModel activity;
+    PacketQ queue;
+    Model model;
+    Protocol proto;
+#ifdef MODEL_STORE
+    ModelStore store{model, net};
+#endif
+
+    // received packet
+    RcvPacket packet;
+    int length = 0;
+    // bytes of an aborted frame yet to be dropped, see abort_frame
+    uint8_t skip = 0;
+    // packet queue age-out sweep is waiting for the radio to get idle
+    bool expire_due = false;
+    // radio idle as of the last update, to catch the ends of exchanges
+    bool radio_idle = false;
+    // authenticates/decrypts the received packet bytes as they arrive
+    crypto::RxStream rx{crypto};
+};
+
+} // namespace hr20
@@ -21,29 +21,31 @@
 #include "rfmdef.h"
 #include "debug.h"
 #include "error.h"
+#include "stats.h"
+#include "bench.h"
 
 namespace hr20 {
 
 // None, idle, rx, tx
 static const char *MODE = "NIRT";
 
-#ifndef RFM_POLL_MODE
-RFM12B *RFM12B::irq_instance = nullptr;
-#endif
-
-// scoped object setting the correct SPI parameters and selecting our radio
+// scoped object setting the correct SPI parameters for our radio. Kept for
+// a whole sequence of xfers, the radio is selected per xfer. With more radios
+// on the bus, the main loop's sequences keep the NIRQ handlers out - the
+// other radio's ISR would select its chip in the middle of our xfer
 struct SPIScope {
-    SPIScope(const SPISettings &s) {
+    SPIScope(const SPISettings &s, bool isr = false) : masked(!isr && RFM_RADIO_COUNT > 1) {
+        if (masked) ETS_GPIO_INTR_DISABLE();
         // this is the setting to use with our RFM12 client
         SPI.beginTransaction(s);
-        // pull SS pin low to select it, too
-        digitalWrite(RFM_SS_PIN, LOW);
     }
 
     ~SPIScope() {
-        digitalWrite(RFM_SS_PIN, HIGH);
         SPI.endTransaction();
+        if (masked) ETS_GPIO_INTR_ENABLE();
     }
+
+    const bool masked;
 };
 
 void RFM12B::begin() {
@@ -56,12 +58,14 @@ void RFM12B::begin() {
 
     SPI.begin();
 
-    // set GPIO2 to be our NSEL pin
-    pinMode(RFM_SS_PIN, OUTPUT);
-    digitalWrite(RFM_SS_PIN, HIGH);
+    // set up our NSEL pin
+    pinMode(ss_pin, OUTPUT);
+    digitalWrite(ss_pin, HIGH);
 
     // prepare the NIRQ pin
-    pinMode(RFM_NIRQ_PIN, INPUT_PULLUP);
+    pinMode(nirq_pin, INPUT_PULLUP);
+
+    SPIScope scope(spi_fifo_settings);
 
     // the rest of this ctor is just stock initialization as
     // copied from OpenHR20's rfm.c initialization routine
@@ -69,28 +73,26 @@ void RFM12B::begin() {
     read_status();
 
     // write some bogus data to fill the TX input while we set the radio up
-    spi16(RFM_TX_WRITE_CMD | 0xAA);
-    spi16(RFM_TX_WRITE_CMD | 0xAA);
+    xfer16(RFM_TX_WRITE_CMD | 0xAA);
+    xfer16(RFM_TX_WRITE_CMD | 0xAA);
 
-    spi16(
+    xfer16(
             RFM_CONFIG_EL                  |
             RFM_CONFIG_EF                  |
             RFM_CONFIG_Band(RFM_FREQ_MAIN) |
             RFM_CONFIG_X_12_0pf
     );
 
-    int8_t adjust = 0;
-
-    spi16(
+    xfer16(
             RFM_FREQUENCY            |
-            (RFM_FREQ_Band(RFM_FREQ_MAIN)(RFM_FREQ_DEC) + adjust)
+            (RFM_FREQ_Band(RFM_FREQ_MAIN)(RFM_FREQ_DEC) + freq_adjust)
     );
 
     // 4. Data Rate Command
-    spi16(RFM_SET_DATARATE(RFM_BAUD_RATE));
+    xfer16(RFM_SET_DATARATE(RFM_BAUD_RATE));
 
     // 5. Receiver Control Command
-    spi16(
+    xfer16(
             RFM_RX_CONTROL_P20_VDI  |   // 0x9400
             RFM_RX_CONTROL_VDI_FAST |
             RFM_RX_CONTROL_BW(RFM_BAUD_RATE) |
@@ -99,14 +101,14 @@ void RFM12B::begin() {
     );
 
     // 6. Data Filter Command
-    spi16(
+    xfer16(
             RFM_DATA_FILTER_AL      |
             RFM_DATA_FILTER_ML      |
             RFM_DATA_FILTER_DQD(3)
     );
 
     // 7. FIFO and Reset Mode Command
-    spi16(
+    xfer16(
             RFM_FIFO_IT(8) |
             RFM_FIFO_DR
     );
@@ -116,7 +118,7 @@ void RFM12B::begin() {
     // 9. Receiver FIFO Read
 
     // 10. AFC Command
-    spi16(
+    xfer16(
             RFM_AFC_AUTO_VDI        |
             RFM_AFC_RANGE_LIMIT_7_8 |
             RFM_AFC_EN              |
@@ -125,13 +127,13 @@ void RFM12B::begin() {
     );
 
     // 11. TX Configuration Control Command
-    spi16(
+    xfer16(
             RFM_TX_CONTROL_MOD(RFM_BAUD_RATE) |
             RFM_TX_CONTROL_POW_0
     );
 
     // 12. PLL Setting Command
-    spi16(
+    xfer16(
             RFM_PLL                 |
             RFM_PLL_uC_CLK_10       |
             RFM_PLL_DELAY_OFF       |
@@ -141,27 +143,22 @@ void RFM12B::begin() {
 
 #ifndef RFM_POLL_MODE
     // 13. Switch off, attach interrupt
-    spi16(RFM_POWER_MANAGEMENT_EX);
-
-    if (irq_instance != nullptr) {
-        ERR(RFM_ALREADY_INITIALIZED);
-    } else {
-        irq_instance = this;
-
-        // attach the interrupt
-        attachInterrupt(
-                digitalPinToInterrupt(RFM_NIRQ_PIN),
-                &RFM12B::rfm_interrupt_handler,
-                FALLING);
-
-        DBG("(RFM ISR SET)");
-
-        bool isr_low = digitalRead(RFM_NIRQ_PIN) == LOW;
-        if (isr_low) {
-            // WHY IS THE ISR ALREADY LOW IN SOME CASES? Initialization process screws us up?
-            auto st = spi16(RFM_STATUS_CMD);
-            DBG("(ISR SET ALREADY LOW! ST=%X)", st);
-        }
+    xfer16(RFM_POWER_MANAGEMENT_EX);
+
+    // attach the interrupt
+    attachInterruptArg(
+            digitalPinToInterrupt(nirq_pin),
+            &RFM12B::rfm_interrupt_handler,
+            this,
+            FALLING);
+
+    DBG("(RFM ISR SET %d)", nirq_pin);
+
+    bool isr_low = digitalRead(nirq_pin) == LOW;
+    if (isr_low) {
+        // WHY IS THE ISR ALREADY LOW IN SOME CASES? Initialization process screws us up?
+        auto st = xfer16(RFM_STATUS_CMD);
+        DBG("(ISR SET ALREADY LOW! ST=%X)", st);
     }
 #endif
 
@@ -177,7 +174,22 @@ static volatile uint16_t isr_ctr    = 0;
 // status and counters from isr
 static volatile uint16_t isr_txb = 0;
 static volatile uint16_t isr_rxb = 0;
-static volatile bool isr_underrun = false;
+
+void ICACHE_FLASH_ATTR RFM12B::wait_for_sync() {
+    SPIScope scope(spi_fifo_settings);
+    switch_to_idle();
+#ifdef RFM_POLL_MODE
+    // polled bytes are not framed, whatever is left came after the frame
+    in.clear();
+#endif
+}
+
+void ICACHE_FLASH_ATTR RFM12B::transmit() {
+    if (mode == TX) return;
+
+    SPIScope scope(spi_fifo_settings);
+    switch_to_tx();
+}
 
 void ICACHE_FLASH_ATTR RFM12B::update() {
 #ifdef DEBUG_RFM
@@ -185,13 +197,12 @@ void ICACHE_FLASH_ATTR RFM12B::update() {
 
     // interrupt(s) happened in the meantime
     if (ctr != isr_ctr) {
-        DBG("(ISR %u: %X TX %d RX %d O %d I %d/%d)",
+        DBG("(ISR %u: %X TX %d RX %d O %d I %d)",
             isr_ctr,
             isr_status,
             isr_txb,
             isr_rxb,
-            out.rest_size(),
-            in.rest_size(),
+            out.size(),
             in.size());
 
         isr_status = 0x0FFFF;
@@ -201,11 +212,18 @@ void ICACHE_FLASH_ATTR RFM12B::update() {
 
 #ifndef RFM_POLL_MODE
     // handle underrun reporting
-    if (isr_underrun) {
-        isr_underrun = false;
+    if (underrun) {
+        underrun = false;
+        ++linkStats.tx_underruns;
         ERR(RFM_TX_UNDERRUN); // TX underrun, otherwise we don't care
         return;
     }
+
+    if (rx_dropped) {
+        rx_dropped = false;
+        ++linkStats.rx_dropped;
+        ERR(RFM_RX_OVERFLOW);
+    }
 #endif
 
     // we need a polling routine called anyway, for situations
@@ -213,27 +231,27 @@ void ICACHE_FLASH_ATTR RFM12B::update() {
 
     // if there are data in the out queue, we switch to TX
     if (!out.empty() && (mode != TX)) {
+        SPIScope scope(spi_fifo_settings);
         switch_to_tx();
     }
 
 #ifdef RFM_POLL_MODE
+    SPIScope scope(spi_fifo_settings);
+
     if (mode == TX) {
-        // no more data in queue means we can switch to idle now
         if (out.empty()) {
-            // bogus data. just to be sure there's something in the buffers
-            // before switching to idle
-            spi16(RFM_TX_WRITE_CMD | 0xAA);
-            switch_to_idle();
-            return;
-        } else {
-            // any data to send? Check if we're done receiving first
-            if (send_byte(out.peek()))
-                out.pop();
+            // the rest of the packet is still being assembled
+            if (!tx_closed) return;
 
-            // switch to idle - wait for incoming data now
-            if (out.empty()) switch_to_idle();
+            // flush the tx register before switching to idle
+            if (send_byte(0xAA) && (++tail >= RFM_TX_TAIL)) switch_to_idle();
             return;
         }
+
+        if (send_byte(out.peek()))
+            out.pop();
+
+        return;
     } else {
         // don't overfill the input queue!
         if (in.full()) return;
@@ -247,14 +265,24 @@ void ICACHE_FLASH_ATTR RFM12B::update() {
 }
 
 uint16_t ICACHE_FLASH_ATTR RFM12B::read_status() {
-    return spi16(RFM_STATUS_CMD);
+    return xfer16(RFM_STATUS_CMD);
+}
+
+uint16_t ICACHE_RAM_ATTR RFM12B::read_status_fifo(int &fifo) {
+    BENCH_SCOPE(spi16);
+    select();
+    uint16_t st = SPI.transfer16(RFM_STATUS_CMD);
+    fifo = (st & RFM_STATUS_FFIT) ? SPI.transfer(0) : -1;
+    deselect();
+    return st;
 }
 
 int ICACHE_FLASH_ATTR RFM12B::recv_byte() {
     // can't receive in TX mode
     if (mode == TX) return -2;
 
-    auto st = read_status();
+    int b;
+    auto st = read_status_fifo(b);
 
     if (st & RFM_STATUS_RGUR) {
         // ERR(RFM_RX_OVERFLOW); // RX overflow
@@ -263,7 +291,7 @@ int ICACHE_FLASH_ATTR RFM12B::recv_byte() {
         // in time.
     }
 
-    if (st & RFM_STATUS_FFIT) {
+    if (b >= 0) {
         // forced RX as the radio woken up from IDLE for sure
 #ifdef DEBUG_RFM
         Mode last_mode = mode;
@@ -272,9 +300,8 @@ int ICACHE_FLASH_ATTR RFM12B::recv_byte() {
 #ifdef DEBUG_RFM
         if (last_mode != RX) { DBG("(R %c %c)", MODE[last_mode], MODE[mode]); }
 #endif
-        auto b = spi16(RFM_FIFO_READ);
         ++counter;
-        return ((uint16_t)b & 0x00FF);
+        return b;
     }
 
     return -1;
@@ -286,13 +313,14 @@ bool ICACHE_FLASH_ATTR RFM12B::send_byte(unsigned char c) {
     auto st = read_status();
 
     if (st & RFM_STATUS_RGUR) {
+        ++linkStats.tx_underruns;
         ERR(RFM_TX_UNDERRUN); // TX underrun
         out.clear();
         switch_to_idle();
     }
 
     if (st & RFM_STATUS_RGIT) {
-        spi16(RFM_TX_WRITE_CMD | ((c) & 0xFF));
+        xfer16(RFM_TX_WRITE_CMD | ((c) & 0xFF));
         ++counter;
         return true;
     }
@@ -310,7 +338,7 @@ void RFM12B::switch_to_rx() {
         DBG("(R %c %c)", MODE[last_mode], MODE[mode]);
 #endif
 
-        spi16(RFM_POWER_MANAGEMENT_DC  |
+        xfer16(RFM_POWER_MANAGEMENT_DC  |
               RFM_POWER_MANAGEMENT_ER  |
               RFM_POWER_MANAGEMENT_EBB |
               RFM_POWER_MANAGEMENT_ES  |
@@ -335,16 +363,17 @@ void RFM12B::switch_to_tx() {
         DBG("(R %c %c)", MODE[last_mode], MODE[mode]);
 #endif
         // bogus before switching
-        spi16(RFM_TX_WRITE_CMD | 0xAA);
-        spi16(RFM_TX_WRITE_CMD | 0xAA);
+        xfer16(RFM_TX_WRITE_CMD | 0xAA);
+        xfer16(RFM_TX_WRITE_CMD | 0xAA);
 
-        spi16(RFM_POWER_MANAGEMENT_DC |
+        xfer16(RFM_POWER_MANAGEMENT_DC |
               RFM_POWER_MANAGEMENT_ET |
               RFM_POWER_MANAGEMENT_ES |
               RFM_POWER_MANAGEMENT_EX);
 
         in.clear();
         counter = 0;
+        tail    = 0;
     }
 }
 
@@ -359,15 +388,15 @@ void RFM12B::switch_to_idle() {
         DBG("(R %c %c)", MODE[last_mode], MODE[mode]);
 #endif
 
-        spi16(RFM_POWER_MANAGEMENT_DC  |
+        xfer16(RFM_POWER_MANAGEMENT_DC  |
               RFM_POWER_MANAGEMENT_ER  |
               RFM_POWER_MANAGEMENT_EBB |
               RFM_POWER_MANAGEMENT_ES  |
               RFM_POWER_MANAGEMENT_EX);
 
         // (re)turn on FIFO to sync-word activation
-        spi16(RFM_FIFO_IT(8) | RFM_FIFO_DR);
-        spi16(RFM_FIFO_IT(8) | RFM_FIFO_FF | RFM_FIFO_DR);
+        xfer16(RFM_FIFO_IT(8) | RFM_FIFO_DR);
+        xfer16(RFM_FIFO_IT(8) | RFM_FIFO_FF | RFM_FIFO_DR);
 
 // Why is this here?!
 //        read_status();
@@ -377,68 +406,87 @@ void RFM12B::switch_to_idle() {
         counter = 0;
 
         out.clear();
+        tx_closed = false;
     }
 }
 
-uint16_t RFM12B::spi16(uint16_t reg) {
-    SPIScope scope(spi_settings);
+uint16_t ICACHE_RAM_ATTR RFM12B::xfer16(uint16_t reg) {
+    BENCH_SCOPE(spi16);
+    select();
     uint16_t res = SPI.transfer16(reg);
+    deselect();
     return res;
 }
 
 #ifndef RFM_POLL_MODE
 // NOTE: Not using ICACHE_RAM_ATTR as it seems to cause Exception 0
 // Just skipping the ICACHE_FLASH_ATTR is enough for this to work
-void ICACHE_RAM_ATTR RFM12B::rfm_interrupt_handler() {
-    if (irq_instance) irq_instance->on_interrupt();
+void ICACHE_RAM_ATTR RFM12B::rfm_interrupt_handler(void *arg) {
+    static_cast<RFM12B *>(arg)->on_interrupt();
 }
 
 void ICACHE_RAM_ATTR RFM12B::on_interrupt() {
-    // Interrupt handler
-    auto st = spi16(RFM_STATUS_CMD);
+    BENCH_SCOPE(isr);
+    // Interrupt handler. One transaction for the whole invocation, TX only
+    // writes so it can go with the faster clock
+    bool tx = mode == TX;
+    SPIScope scope(tx ? spi_settings : spi_fifo_settings, /*isr*/true);
+
+    // outside of TX, the byte comes with the status word (-1 means none)
+    int b = -1;
+    auto st = tx ? xfer16(RFM_STATUS_CMD) : read_status_fifo(b);
 
 #ifdef DEBUG_RFM
     isr_status = st;
     isr_ctr++;
 #endif
 
-    if (mode == TX) {
+    if (tx) {
         if (st & RFM_STATUS_RGUR) {
-            isr_underrun = true;
+            underrun = true;
+            // drop the rest of the packet if it wasn't queued whole yet
+            tx_aborted   = !tx_closed;
             switch_to_idle();
             return;
         }
 
         if (st & RFM_STATUS_RGIT) {
             // ready to send... what do we have?
-            if (out.empty()) {
-                // just send some dummy data
-                spi16(RFM_TX_WRITE_CMD | 0xAA);
-                // and switch to idle
-                switch_to_idle();
-            } else {
+            if (!out.empty()) {
                 auto c = out.pop();
-                spi16(RFM_TX_WRITE_CMD | (c & 0xFF));
+                xfer16(RFM_TX_WRITE_CMD | (c & 0xFF));
                 ++counter;
                 isr_txb++;
-
-                if (out.empty()) {
-                    // just send some dummy data to prevent possible underruns
-                    spi16(RFM_TX_WRITE_CMD | 0xAA);
+            } else if (tx_closed) {
+                // whole packet is in the radio. push the tail bytes to get
+                // the last real byte out of the tx register, then go idle
+                if (tail < RFM_TX_TAIL) {
+                    xfer16(RFM_TX_WRITE_CMD | 0xAA);
+                    ++tail;
+                } else {
                     switch_to_idle();
-                    return;
                 }
+            } else {
+                // the main loop did not keep up streaming the packet
+                underrun = true;
+                tx_aborted   = true;
+                switch_to_idle();
             }
         }
     } else {
-        if (st & RFM_STATUS_FFIT) {
-            // FIFO is 16 bit!
-            auto b = spi16(RFM_FIFO_READ);
-
+        if (b >= 0) {
             if (mode == IDLE) {
                 mode = RX; // if it were IDLE, it's not any more
+                // NOTE: in is not cleared here, only the consumer may do that.
+                // The main loop splits the stream to packets by length byte,
+                // so a frame goes to the ring whole or not at all
                 limit = b & 0x7F;
-                in.clear();
+                if (limit > RFM_FRAME_MAX) limit = RFM_FRAME_MAX;
+                if (limit > in.free_size()) {
+                    rx_dropped = true;
+                    switch_to_idle();
+                    return;
+                }
             }
 
             if (limit) {
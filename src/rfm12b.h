@@ -22,21 +22,66 @@
 #include <Arduino.h>
 #include <SPI.h>
 
+#include "config.h"
 #include "debug.h"
 #include "queue.h"
 
 namespace hr20 {
 
-// RFM is wired as SPI client, with GPIO2 being used as the select pin
-constexpr const uint8_t RFM_SS_PIN = 2;
-// GPIO5 is connected to NIRQ to push/pull bytes
-constexpr const uint8_t RFM_NIRQ_PIN = 5;
+// RFMs are wired as SPI clients sharing the bus, each with its own select
+// pin - GPIO2 for the first radio, GPIO15 for the second one (GPIO15 has to
+// stay pulled low for boot, the RFM's NSEL does not mind that)
+constexpr const uint8_t RFM_SS_PINS[] = {2, 15};
+// NIRQ of each radio, to push/pull bytes. GPIO0 has to be high at boot, the
+// NIRQ idles high
+constexpr const uint8_t RFM_NIRQ_PINS[] = {5, 0};
+// fine frequency adjustment of each radio, in the frequency register steps
+// (5kHz on the 868MHz band). The networks have to be on different channels,
+// the valves of the second one need the RFM_FREQ_FINE of 0.85
+constexpr const int16_t RFM_FREQ_ADJUST[] = {0, 100};
+
+static_assert(RFM_RADIO_COUNT <= sizeof(RFM_SS_PINS),
+              "RFM_SS_PINS has to list a select pin for every radio");
+static_assert(RFM_RADIO_COUNT <= sizeof(RFM_NIRQ_PINS),
+              "RFM_NIRQ_PINS has to list a NIRQ pin for every radio");
+static_assert(RFM_RADIO_COUNT <= sizeof(RFM_FREQ_ADJUST) / sizeof(RFM_FREQ_ADJUST[0]),
+              "RFM_FREQ_ADJUST has to list an adjustment for every radio");
+
+// NSEL is driven through the GPIO set/clear registers, GPIO16 has none
+constexpr bool rfm_ss_pins_valid(uint8_t i = 0) {
+    return i >= RFM_RADIO_COUNT || (RFM_SS_PINS[i] < 16 && rfm_ss_pins_valid(i + 1));
+}
+static_assert(rfm_ss_pins_valid(), "RFM_SS_PINS have to be GPIO0-15");
+
+// SPI clock for commands and TX writes. The ESP divides 80MHz, so this
+// should be 80MHz / N
+constexpr const uint32_t RFM_SPI_CLOCK = 10000000L;
+// SPI clock for anything that reads the RX FIFO - the radio needs it to be
+// below fxtal/4 (2.5MHz with the 10MHz crystal)
+constexpr const uint32_t RFM_SPI_FIFO_CLOCK = 2500000L;
+
+// TX/RX ring sizes. Packets are streamed through these, so TX can be
+// smaller than a whole packet
+constexpr const uint8_t RFM_TX_RING_LEN = 64;
+constexpr const uint8_t RFM_RX_RING_LEN = 128;
+
+// longest frame received, length byte included. Longer length bytes get cut
+// to this by both the ISR and the consumer, so they agree on frame boundaries
+constexpr const uint8_t RFM_FRAME_MAX = 80;
+
+static_assert(RFM_FRAME_MAX <= RFM_RX_RING_LEN,
+              "RX ring has to hold a whole frame");
+
+// bytes written after the last byte of the packet, so that the 16 bit TX
+// register gets shifted out whole before we turn the transmitter off
+constexpr const uint8_t RFM_TX_TAIL = 2;
 
 /*
  * A simple interface to RFM12B
  */
 struct RFM12B {
-    SPISettings spi_settings;
+    SPISettings spi_settings;      // commands, TX FIFO writes
+    SPISettings spi_fifo_settings; // RX FIFO reads
 
     enum Mode {
         NONE = 0,
@@ -47,19 +92,23 @@ struct RFM12B {
 
     volatile Mode mode;
 
-    RFM12B()
-        : spi_settings(2000000L, MSBFIRST, SPI_MODE0)
+    /// radio with its NSEL on ss_pin and NIRQ on nirq_pin, tuned
+    /// freq_adjust frequency steps off the RFM_FREQ_FINE
+    RFM12B(uint8_t ss_pin, uint8_t nirq_pin, int16_t freq_adjust = 0)
+        : spi_settings(RFM_SPI_CLOCK, MSBFIRST, SPI_MODE0)
+        , spi_fifo_settings(RFM_SPI_FIFO_CLOCK, MSBFIRST, SPI_MODE0)
         // default to NONE, so both TX and RX operations switch the accordingly
         , mode(NONE)
+        , ss_pin(ss_pin)
+        , nirq_pin(nirq_pin)
+        , freq_adjust(freq_adjust)
     {}
 
     void begin();
 
     /// call this to reset to receiver mode, sync-word activation
     /// (after packet was sent/received whole)
-    void wait_for_sync() {
-        switch_to_idle();
-    }
+    void wait_for_sync();
 
     /// -1 if no data is present, >= 0 received byte
     int recv() {
@@ -68,19 +117,37 @@ struct RFM12B {
         return in.pop();
     }
 
-    /// enqueues a character to be sent. returns false if fifo's full
-    /// @note FILL the whole buffer in one go, or at least enough
-    /// for the ISR based sending routine not to underrun. update() call
-    /// *will* switch to TX when IDLE and there are bytes to send.
+    /// enqueues a character to be sent. returns false if the ring is full or
+    /// the previous packet is still being flushed out of the radio.
+    /// @note The TX ring is drained by the ISR while being filled, so the
+    /// packet can be streamed in parts - the ISR only needs to be kept ahead
+    /// of. Call end_packet() after the last byte of the packet was queued.
     bool send(char c) {
-        if (out.full())
+        // underrun killed the packet, swallow the rest of it
+        if (tx_aborted)
+            return true;
+
+        if (tx_closed)
             return false;
 
-        out.push(c);
+        return out.push(c);
+    }
+
+    /// marks the end of the currently streamed packet. The ISR flushes the
+    /// radio's TX register after the last byte and switches to idle
+    void end_packet() {
+        if (tx_aborted) {
+            tx_aborted = false;
+            return;
+        }
 
-        return true;
+        tx_closed = true;
     }
 
+    /// switches to TX right away if there are bytes to be sent, without
+    /// waiting for the next update() call
+    void transmit();
+
     /// true if the output queue is empty
     bool sent() {
         return out.empty();
@@ -100,17 +167,36 @@ struct RFM12B {
 protected:
     bool init = false;
 
-    // TODO: Align this with PacketQ's SENT_PACKET_LEN
-    // we have to be able to hold the whole packet at once,
-    // as the naiive implementation of ShortQ does not allow for data appends
-    // while being emptied (would need a circular buffer for that)
-    ShortQ<84> out, in;
+    const uint8_t ss_pin;
+    const uint8_t nirq_pin;
+    const int16_t freq_adjust;
+
+    // out is filled by the main loop and drained by the ISR, in is the other
+    // way around. Neither of them has to hold a whole packet.
+    RingQ<RFM_TX_RING_LEN> out;
+    RingQ<RFM_RX_RING_LEN> in;
+    // true when the producer queued the last byte of the packet
+    volatile bool tx_closed = false;
+    // true when TX underrun cut the streamed packet short
+    volatile bool tx_aborted = false;
+    // set by the ISR on TX underrun, reported by update()
+    volatile bool underrun = false;
+    // set by the ISR when a frame was dropped for lack of room in the RX
+    // ring, reported by update()
+    volatile bool rx_dropped = false;
+    // count of flush bytes written after the packet's last byte
+    uint8_t tail = 0;
     uint8_t limit = 0; // read limit, decoded from the first byte
     uint8_t counter = 0; // envent counter - read/written bytes, reset on switch_*
 
     /// reads the status word
     uint16_t read_status();
 
+    /// reads the status word and, if FFIT is set, the received byte clocked
+    /// out right after it in the same select. Only valid outside of TX, where
+    /// the same bit means RGIT. fifo is set to -1 if there was no byte
+    uint16_t read_status_fifo(int &fifo);
+
     // receives single byte data from the radio, or -1 if none are available
     int recv_byte();
 
@@ -127,17 +213,19 @@ protected:
     void switch_to_idle();
 
     /// does the SPI xfer for 16 bits while selecting the rfm12b chip by pulling
-    /// down the RFM_SS_PIN
-    uint16_t spi16(uint16_t reg);
+    /// down the ss_pin. Only to be called within an SPIScope, which sets
+    /// up the transaction - so are all of the switch_* and *_byte calls
+    uint16_t xfer16(uint16_t reg);
+
+    void select()   { GPOC = 1 << ss_pin; }
+    void deselect() { GPOS = 1 << ss_pin; }
 
 #ifndef RFM_POLL_MODE
     // callback from interrupt that handles the TX/RX as needed
     void on_interrupt();
 
-    // TODO: make a singleton out of this class, since we're singleton on irq
-    // anyway
-    static RFM12B *irq_instance;
-    static void rfm_interrupt_handler();
+    // NIRQ handler, arg is the radio
+    static void rfm_interrupt_handler(void *arg);
 #endif
 };
 
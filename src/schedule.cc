@@ -0,0 +1,190 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+#include <jsmn.h>
+
+#include "schedule.h"
+#include "converters.h"
+#include "debug.h"
+
+namespace hr20 {
+namespace {
+
+// one token for the object, a key and an array per day, one per slot
+constexpr const unsigned TIMER_TABLE_TOKENS =
+    1 + TIMER_DAYS * (2 + TIMER_SLOTS_PER_DAY);
+
+struct TimerTable {
+    Timer slots[TIMER_DAYS][TIMER_SLOTS_PER_DAY];
+    uint64_t present = 0; // bit per day * TIMER_SLOTS_PER_DAY + slot
+
+    void set(uint8_t day, uint8_t slot, Timer t) {
+        slots[day][slot] = t;
+        present |= 1ull << (day * TIMER_SLOTS_PER_DAY + slot);
+    }
+};
+
+static_assert(TIMER_DAYS * TIMER_SLOTS_PER_DAY <= 64,
+              "TimerTable present mask is too small");
+
+bool ICACHE_FLASH_ATTR valid_timer(uint16_t time, uint8_t mode) {
+    return time < 24 * 60 && mode <= 0x0F;
+}
+
+// "HH:MM/M" - time of the slot and mode after the slash
+bool ICACHE_FLASH_ATTR parse_slot(const Str &val, Timer &tgt) {
+    int slash = val.indexOf('/');
+    if (slash <= 0) return false;
+
+    uint16_t time;
+    uint8_t mode;
+    if (!cvt::TimeHHMM::from_str(val.substring(0, slash), time)) return false;
+    if (!cvt::Simple::from_str(val.substring(slash + 1), mode)) return false;
+    if (!valid_timer(time, mode)) return false;
+
+    tgt = static_cast<uint16_t>(mode << 12 | time);
+    return true;
+}
+
+bool ICACHE_FLASH_ATTR parse_binary(const uint8_t *data, TimerTable &tbl) {
+    for (uint8_t day = 0; day < TIMER_DAYS; ++day) {
+        for (uint8_t slot = 0; slot < TIMER_SLOTS_PER_DAY; ++slot) {
+            uint16_t raw = data[0] | (data[1] << 8);
+            data += 2;
+
+            Timer t{raw};
+            if (!valid_timer(t.time(), t.mode())) {
+                ERR_ARG(MQTT_INVALID_TIMER_TABLE, day * TIMER_SLOTS_PER_DAY + slot);
+                return false;
+            }
+
+            tbl.set(day, slot, t);
+        }
+    }
+
+    return true;
+}
+
+bool ICACHE_FLASH_ATTR parse_json(const char *data, unsigned len,
+                                  TimerTable &tbl)
+{
+    jsmn_parser parser;
+    jsmntok_t tok[TIMER_TABLE_TOKENS];
+
+    jsmn_init(&parser);
+    int cnt = jsmn_parse(&parser, data, len, tok, TIMER_TABLE_TOKENS);
+
+    if (cnt < 1 || tok[0].type != JSMN_OBJECT) {
+        ERR_ARG(MQTT_INVALID_TIMER_TABLE, cnt);
+        return false;
+    }
+
+    int i = 1;
+    for (int k = 0; k < tok[0].size; ++k) {
+        // day key and its slot array
+        if (i + 1 >= cnt) break;
+
+        const auto &key = tok[i++];
+        const auto &arr = tok[i++];
+
+        uint8_t day;
+        Str day_s{data + key.start, unsigned(key.end - key.start)};
+
+        if (key.type != JSMN_STRING || !cvt::Simple::from_str(day_s, day) ||
+            day >= TIMER_DAYS || arr.type != JSMN_ARRAY ||
+            arr.size > TIMER_SLOTS_PER_DAY)
+        {
+            ERR_ARG(MQTT_INVALID_TIMER_TABLE, key.start);
+            return false;
+        }
+
+        for (int slot = 0; slot < arr.size; ++slot) {
+            if (i >= cnt) break;
+            const auto &st = tok[i++];
+
+            // null keeps the slot as it is
+            if (st.type == JSMN_PRIMITIVE && data[st.start] == 'n') continue;
+
+            Timer t;
+            Str val{data + st.start, unsigned(st.end - st.start)};
+            if (st.type != JSMN_STRING || !parse_slot(val, t)) {
+                ERR_ARG(MQTT_INVALID_TIMER_TABLE, st.start);
+                return false;
+            }
+
+            tbl.set(day, slot, t);
+        }
+    }
+
+    // ran out of tokens before the object ended
+    if (i != cnt) {
+        ERR_ARG(MQTT_INVALID_TIMER_TABLE, i);
+        return false;
+    }
+
+    return true;
+}
+
+} // namespace
+
+int ICACHE_FLASH_ATTR apply_timer_table(HR20 &hr, const char *data,
+                                        unsigned len, TimerTableFormat fmt)
+{
+    TimerTable tbl;
+
+    bool ok;
+    if (fmt == TIMER_TABLE_BINARY) {
+        if (len != TIMER_TABLE_BINARY_LEN) {
+            ERR_ARG(MQTT_INVALID_TIMER_TABLE, len);
+            return -1;
+        }
+        ok = parse_binary(reinterpret_cast<const uint8_t *>(data), tbl);
+    } else {
+        ok = parse_json(data, len, tbl);
+    }
+
+    if (!ok) return -1;
+
+    int changed = 0;
+    for (uint8_t day = 0; day < TIMER_DAYS; ++day) {
+        for (uint8_t slot = 0; slot < TIMER_SLOTS_PER_DAY; ++slot) {
+            if (!(tbl.present & (1ull << (day * TIMER_SLOTS_PER_DAY + slot))))
+                continue;
+
+            auto &tmr = hr.timers[day][slot];
+            const Timer &t = tbl.slots[day][slot];
+
+            // client already has it. drop a pending write to something else
+            if (tmr.remote_valid() && tmr.get_remote() == t) {
+                if (tmr.is_requested_set()) tmr.reset_requested();
+                continue;
+            }
+
+            // same write is already on its way
+            if (tmr.is_requested_set() && tmr.get_requested() == t) continue;
+
+            hr.request_timer(day, slot, t);
+            ++changed;
+        }
+    }
+
+    DBG("(TT %d)", changed);
+    return changed;
+}
+
+} // namespace hr20
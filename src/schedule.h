@@ -0,0 +1,57 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+#pragma once
+
+#include <Arduino.h>
+
+#include "config.h"
+#include "error.h"
+#include "model.h"
+
+namespace hr20 {
+
+// size of the binary timer table - 16 bit little endian raw timer per slot
+constexpr const unsigned TIMER_TABLE_BINARY_LEN =
+    TIMER_DAYS * TIMER_SLOTS_PER_DAY * sizeof(uint16_t);
+
+// payload format of a timer table upload, given by the transport (topic,
+// Content-Type) - a binary table may well start with '{'
+enum TimerTableFormat {
+    TIMER_TABLE_JSON = 0,
+    TIMER_TABLE_BINARY
+};
+
+/** Applies a whole-week timer table upload to a client.
+ *
+ * The payload is either the binary table (TIMER_TABLE_BINARY_LEN bytes, days
+ * in order, slots in order) or a compact json object keyed by day index with
+ * an array of "HH:MM/M" slot specifications per day, i.e.
+ * {"0":["6:00/2","22:00/1"],"7":[null,"7:30/2"]}. Days, slots and null
+ * entries not present in the json are left as they are.
+ *
+ * The upload is parsed whole before it is applied, so a malformed table
+ * changes nothing. Only slots that differ from the remote (or the already
+ * pending) value get a write requested.
+ *
+ * Returns count of slots that got a write requested, -1 on parse failure.
+ */
+int ICACHE_FLASH_ATTR apply_timer_table(HR20 &hr, const char *data,
+                                        unsigned len, TimerTableFormat fmt);
+
+} // namespace hr20
@@ -0,0 +1,176 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+#pragma once
+
+#include <Arduino.h>
+
+#include "config.h"
+#include "memstats.h"
+
+namespace hr20 {
+
+/** Cooperative main loop scheduler.
+ *
+ * Radio tasks run on every pass and again after every other task, so the
+ * radio gets serviced no matter what else is going on. The other tasks run
+ * when due (each has a period), in the order of priority and deadline, but
+ * only if their estimated run time still fits the time left of the pass
+ * (SCHED_SLICE_US). The estimate is the max. run time, decaying while the
+ * task waits for budget, so one slow run does not push it out for good. A
+ * task that got late by more than SCHED_STARVE_US runs regardless, so
+ * nothing starves.
+ */
+struct Scheduler {
+    using TaskFn = void (*)(void *ctx);
+    // optional task precondition, i.e. radio being idle
+    using GateFn = bool (*)(void *ctx);
+
+    enum Priority : uint8_t {
+        PRIO_RADIO = 0, // guaranteed service, every pass
+        PRIO_HIGH,
+        PRIO_LOW
+    };
+
+    struct Task {
+        const char *name = nullptr;
+        TaskFn fn   = nullptr;
+        GateFn gate = nullptr;
+        void *ctx   = nullptr;
+        uint8_t  prio      = PRIO_LOW;
+        uint32_t period_us = 0; // run interval, 0 means every pass
+        uint32_t deadline  = 0; // micros() the task wants to run by
+        uint32_t pass      = 0; // last pass the task ran in
+
+        // accounting
+        uint32_t runs     = 0;
+        uint32_t last_us  = 0; // duration of the last run
+        uint32_t worst_us = 0; // worst case run time observed
+        uint32_t est_us   = 0; // decaying max. run time, used for budgeting
+        uint16_t overruns = 0; // runs that went past the pass budget
+    };
+
+    // registers a task. returns false if there's no room left
+    bool ICACHE_FLASH_ATTR add(const char *name, Priority prio,
+                               uint32_t period_ms, TaskFn fn,
+                               void *ctx = nullptr, GateFn gate = nullptr)
+    {
+        if (count >= SCHED_MAX_TASKS) return false;
+
+        Task &t = tasks[count++];
+        t.name      = name;
+        t.fn        = fn;
+        t.gate      = gate;
+        t.ctx       = ctx;
+        t.prio      = prio;
+        t.period_us = period_ms * 1000;
+        t.deadline  = micros();
+#ifdef MEMSTATS
+        if (prio == PRIO_RADIO) memStats.radio_task = count - 1;
+#endif
+        return true;
+    }
+
+    // one pass of the main loop
+    void ICACHE_FLASH_ATTR run() {
+        ++pass;
+        uint32_t start = micros();
+
+        run_radio(start);
+
+        while (true) {
+            uint32_t now = micros();
+            Task *t = pick(now, now - start);
+            if (!t) break;
+
+            exec(*t, now, start);
+            t->deadline = now + t->period_us;
+
+            run_radio(start);
+        }
+    }
+
+    Task tasks[SCHED_MAX_TASKS];
+    uint8_t count = 0;
+
+protected:
+    void ICACHE_FLASH_ATTR run_radio(uint32_t start) {
+        for (uint8_t i = 0; i < count; ++i)
+            if (tasks[i].prio == PRIO_RADIO) exec(tasks[i], micros(), start);
+    }
+
+    // next due task that fits the rest of the budget
+    Task * ICACHE_FLASH_ATTR pick(uint32_t now, uint32_t used) {
+        Task *best = nullptr;
+
+        for (uint8_t i = 0; i < count; ++i) {
+            Task &t = tasks[i];
+            if (t.prio == PRIO_RADIO || t.pass == pass) continue;
+
+            int32_t late = static_cast<int32_t>(now - t.deadline);
+            if (late < 0) continue;
+
+            bool starving = static_cast<uint32_t>(late) > SCHED_STARVE_US;
+            if (!starving && used + t.est_us > SCHED_SLICE_US) {
+                // let the estimate decay while the task waits
+                t.est_us -= t.est_us / 8;
+                continue;
+            }
+
+            if (t.gate && !t.gate(t.ctx)) continue;
+
+            if (!best || t.prio < best->prio ||
+                (t.prio == best->prio &&
+                 static_cast<int32_t>(t.deadline - best->deadline) < 0))
+            {
+                best = &t;
+            }
+        }
+
+        return best;
+    }
+
+    void ICACHE_FLASH_ATTR exec(Task &t, uint32_t now, uint32_t start) {
+        t.pass = pass;
+#ifdef MEMSTATS
+        if (t.prio != PRIO_RADIO) {
+            auto mark = memStats.before_task();
+            t.fn(t.ctx);
+            memStats.after_task(&t - tasks, mark);
+        } else {
+            t.fn(t.ctx);
+        }
+#else
+        t.fn(t.ctx);
+#endif
+
+        uint32_t end = micros();
+        t.last_us = end - now;
+        if (t.last_us > t.worst_us) t.worst_us = t.last_us;
+        if (t.last_us > t.est_us) t.est_us = t.last_us;
+        if (end - start > SCHED_SLICE_US && t.overruns < 0xFFFF) ++t.overruns;
+        ++t.runs;
+    }
+
+    uint32_t pass = 0;
+};
+
+// global scheduler instance
+extern Scheduler scheduler;
+
+} // namespace hr20
@@ -0,0 +1,113 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+#pragma once
+
+#include <Arduino.h>
+
+#include "config.h"
+
+namespace hr20 {
+
+// fixed bucket width latency histogram. The last bucket collects everything
+// that did not fit the others
+struct LatencyHistogram {
+    ICACHE_FLASH_ATTR LatencyHistogram(uint16_t width) : width(width) {}
+
+    void ICACHE_FLASH_ATTR add(unsigned long ms) {
+        unsigned long b = ms / width;
+        if (b >= STATS_BUCKETS) b = STATS_BUCKETS - 1;
+        if (buckets[b] < 0xFFFF) ++buckets[b];
+    }
+
+    const uint16_t width; // bucket width in ms
+    uint16_t buckets[STATS_BUCKETS] = {};
+};
+
+/** Radio link statistics. Counters are bumped from the places the events
+ * happen (not from the ISR), so this is cheap enough to stay always on.
+ *
+ * Times are taken as millis() at the start of the sync packet, the start
+ * of the client packet reception, the processing of the client packet and
+ * the start of our answer to it.
+ */
+struct LinkStats {
+    struct Client {
+        uint16_t rx       = 0; // authenticated packets received
+        uint16_t bad_cmac = 0; // packets failing verification
+    };
+
+    // sync packet is being sent
+    void ICACHE_FLASH_ATTR on_sync(unsigned long now) {
+        ++syncs;
+        sync_ms = now;
+    }
+
+    // first byte of an incoming packet
+    void ICACHE_FLASH_ATTR on_rx_start(unsigned long now) {
+        rx_start_ms = now;
+    }
+
+    // packet from client addr was verified and is being processed
+    void ICACHE_FLASH_ATTR on_reply(uint8_t addr, unsigned long now) {
+        if (addr >= MAX_HR_ADDR) return;
+        ++clients[addr].rx;
+
+        // clients reply in their own second after the sync. Only the offset
+        // inside of that second is interesting for the timing windows
+        if (syncs) sync_to_reply.add((rx_start_ms - sync_ms) % 1000);
+
+        reply_addr = addr;
+        reply_ms   = now;
+    }
+
+    void ICACHE_FLASH_ATTR on_bad_cmac(uint8_t addr) {
+        if (addr >= MAX_HR_ADDR) return;
+        ++clients[addr].bad_cmac;
+    }
+
+    // our answer to client addr starts being sent
+    void ICACHE_FLASH_ATTR on_answer(uint8_t addr, unsigned long now) {
+        ++answers;
+
+        if (addr != reply_addr) return;
+        reply_to_answer.add(now - reply_ms);
+        reply_addr = 0;
+    }
+
+    Client clients[MAX_HR_ADDR];
+    uint16_t syncs        = 0;
+    uint16_t answers      = 0;
+    uint16_t tx_underruns = 0;
+    uint16_t rx_dropped   = 0; // frames that did not fit the RX ring
+    uint16_t queue_full   = 0;
+
+    LatencyHistogram sync_to_reply{STATS_SYNC_BUCKET_MS};
+    LatencyHistogram reply_to_answer{STATS_ANSWER_BUCKET_MS};
+
+private:
+    unsigned long sync_ms     = 0;
+    unsigned long rx_start_ms = 0;
+    unsigned long reply_ms    = 0;
+    uint8_t reply_addr = 0; // client waiting for an answer, 0 if none
+};
+
+// global link statistics instance
+extern LinkStats linkStats;
+
+} // namespace hr20
@@ -21,37 +21,87 @@
 
 namespace hr20 {
 
-#define LONG_INT_DIGITS 20
+namespace {
 
-StrMaker & StrMaker::operator += (long int i) {
-    char buf[LONG_INT_DIGITS];
+// "00" to "99", for conversions two digits a step
+const char DIGIT_PAIRS[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
 
-    bool neg = i < 0;
-    if (neg) i = -i;
+const uint32_t POW10[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+    1000000000
+};
 
-    uint8_t p;
+ICACHE_FLASH_ATTR uint8_t count_digits(uint32_t u) {
+    uint8_t n = 1;
+    while (n < 10 && u >= POW10[n]) ++n;
+    return n;
+}
 
-    // reverse temporary conversion
-    for (p = 0; p < LONG_INT_DIGITS; ++p) {
-        buf[p] = '0' + (i % 10);
-        i = i / 10;
-        if (!i) break;
+// writes exactly n digits of u, ending right before end
+ICACHE_FLASH_ATTR void write_digits(char *end, uint32_t u, uint8_t n) {
+    for (; n >= 2; n -= 2) {
+        const char *d = &DIGIT_PAIRS[(u % 100) * 2];
+        u /= 100;
+        *--end = d[1];
+        *--end = d[0];
     }
 
-    if (neg) {
-        if (full()) return *this;
-        *pos = '-';
-        ++pos;
-    }
+    if (n) *--end = '0' + u % 10;
+}
 
-    const char *b = &buf[p];
-    while (b > buf && *b == '0') --b;
-    for (;b > buf; --b) append_char(*b);
-    append_char(*b);
+} // namespace
+
+StrMaker & StrMaker::operator += (long int i) {
+    if (i < 0) {
+        append_char('-');
+        // works for LONG_MIN too
+        append_uint(0ul - (unsigned long)i);
+    } else {
+        append_uint(i);
+    }
 
     return *this;
 }
 
+ICACHE_FLASH_ATTR void StrMaker::append_uint(uint32_t u) {
+    uint8_t n = count_digits(u);
+    char *p = reserve(n);
+    if (p) write_digits(p + n, u, n);
+}
+
+ICACHE_FLASH_ATTR void StrMaker::append_fixed(long v, uint8_t decimals) {
+    if (v < 0) {
+        append_char('-');
+        v = -v;
+    }
+
+    uint32_t div   = POW10[decimals];
+    uint32_t whole = (uint32_t)v / div;
+    uint8_t  n     = count_digits(whole);
+
+    char *p = reserve(n + 1 + decimals);
+    if (!p) return;
+
+    write_digits(p + n, whole, n);
+    p[n] = '.';
+    write_digits(p + n + 1 + decimals, (uint32_t)v % div, decimals);
+}
+
+ICACHE_FLASH_ATTR void StrMaker::append_2digits(uint8_t v) {
+    char *p = reserve(2);
+    if (p) write_digits(p + 2, v % 100, 2);
+}
+
 ICACHE_FLASH_ATTR void StrMaker::append(float f, unsigned decimals) {
     // split to two integral parts, append both using integral append
     int pre = f;
@@ -211,10 +211,27 @@ protected:
 
 /// appendable string composition helper
 struct StrMaker {
+    /// receives the composed data of a streaming StrMaker
+    using Sink = void (*)(void *ctx, const char *data, unsigned len);
+
     ICACHE_FLASH_ATTR StrMaker(Buffer buf)
         : ptr(buf.ptr), capacity(buf.len), pos(ptr)
     {}
 
+    /// streaming variant - whenever the buffer fills up, its contents are
+    /// handed over to the sink and the buffer is reused. The output thus
+    /// is not limited by the buffer size. Call flush() when done.
+    ICACHE_FLASH_ATTR StrMaker(Buffer buf, Sink sink, void *ctx)
+        : ptr(buf.ptr), capacity(buf.len), pos(ptr), sink(sink), ctx(ctx)
+    {}
+
+    /// hands over the data composed so far to the sink
+    ICACHE_FLASH_ATTR void flush() {
+        if (!sink || !pos || pos == ptr) return;
+        sink(ctx, ptr, pos - ptr);
+        pos = ptr;
+    }
+
     ICACHE_FLASH_ATTR Str str() {
         if (invalid()) return {};
         // zero terminate the string to be compatible with C APIs
@@ -250,7 +267,8 @@ struct StrMaker {
     }
 
     ICACHE_FLASH_ATTR StrMaker & operator += (unsigned u) {
-        return this->operator+=((long int)u);
+        append_uint(u);
+        return *this;
     }
 
     // appends float with rounding to default num. of decimal places
@@ -261,6 +279,16 @@ struct StrMaker {
 
     void append(float f, unsigned decimals = 2);
 
+    /// appends the decimal digits of u, written straight to the buffer
+    void append_uint(uint32_t u);
+
+    /// appends fixed point v / 10^decimals with all of the decimals, i.e.
+    /// 2105 with 2 decimals is 21.05. decimals has to be 1-9
+    void append_fixed(long v, uint8_t decimals);
+
+    /// appends the two digits of 0-99, with the leading zero
+    void append_2digits(uint8_t v);
+
     inline bool invalid() const {
         return pos == nullptr;
     };
@@ -268,6 +296,10 @@ struct StrMaker {
     inline char *data() { return ptr; }
     inline const char *data() const { return ptr; }
     inline unsigned size() const  { return pos != nullptr ? pos - ptr : 0; }
+    // chars that still fit the buffer with the terminating zero
+    inline unsigned room() const {
+        return pos != nullptr && size() < capacity ? capacity - size() - 1 : 0;
+    }
 
 protected:
 
@@ -277,6 +309,25 @@ protected:
         ++pos;
     }
 
+    /// room for n chars right in the buffer. Moves past them and returns
+    /// their start, nullptr if they don't fit (non-streaming only, which
+    /// invalidates the string just like append_char does)
+    char *reserve(unsigned n) {
+        if (pos == nullptr) return nullptr;
+
+        if (pos + n > ptr + capacity) {
+            if (!sink || n > capacity) {
+                pos = nullptr;
+                return nullptr;
+            }
+            flush();
+        }
+
+        char *p = pos;
+        pos += n;
+        return p;
+    }
+
     bool terminate() {
         if (full()) return false;
         *pos = '\0';
@@ -288,6 +339,12 @@ protected:
             return true;
 
         if (pos >= ptr + capacity) {
+            // streaming - make room by sending what we have
+            if (sink) {
+                flush();
+                return false;
+            }
+
             pos = nullptr;
             return true;
         }
@@ -298,6 +355,8 @@ protected:
     char *ptr = nullptr;
     unsigned capacity = 0;
     char *pos = nullptr;
+    Sink sink = nullptr;
+    void *ctx = nullptr;
 };
 
 } // namespace hr20
@@ -0,0 +1,98 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+#ifdef SYSLOG
+
+#include "syslog.h"
+#include "error.h"
+#include "str.h"
+
+namespace hr20 {
+
+// facility local0, severities err and info
+static constexpr const uint8_t SYSLOG_PRI_ERR  = 16 * 8 + 3;
+static constexpr const uint8_t SYSLOG_PRI_INFO = 16 * 8 + 6;
+
+void SyslogExporter::update(time_t now) {
+    if (!config.syslog_server[0]) return;
+
+    exporter.start(now);
+
+    BufferHolder<SYSLOG_DATAGRAM_LEN> buf;
+    StrMaker sm{buf};
+
+    if (exporter.lost || exporter.dropped) {
+        sm += "lost ";
+        sm += (unsigned)exporter.lost;
+        sm += " dropped ";
+        sm += (unsigned)exporter.dropped;
+        sm += '\n';
+    }
+
+    bool error = false;
+    uint8_t count = 0;
+    Event ev;
+    while (count < EXPORT_BATCH_EVENTS && exporter.next(ev)) {
+        BufferHolder<SYSLOG_LINE_LEN> lb;
+        StrMaker line{lb};
+        line += (unsigned)ev.seq;
+        line += ' ';
+        line += (long)ev.time;
+        line += ' ';
+        line += ev.type == EventType::ERROR
+                    ? err_to_str(static_cast<ErrorCode>(ev.code))
+                    : event_to_str(static_cast<EventCode>(ev.code));
+        line += ' ';
+        line += (unsigned)ev.value;
+        line += '\n';
+
+        // the rest goes with the next datagram
+        auto l = line.str();
+        if (l.length() > sm.room()) {
+            exporter.unget(ev);
+            break;
+        }
+
+        ++count;
+        error |= ev.type == EventType::ERROR;
+        sm += l;
+    }
+
+    auto body = sm.str();
+    if (body.length() == 0) return;
+
+    // not committed - the same events get another try next time
+    if (!udp.beginPacket(config.syslog_server, SYSLOG_PORT)) return;
+
+    BufferHolder<16> hb;
+    StrMaker hdr{hb};
+    hdr += '<';
+    hdr += (unsigned)(error ? SYSLOG_PRI_ERR : SYSLOG_PRI_INFO);
+    hdr += ">hr20: ";
+    auto h = hdr.str();
+
+    udp.write(reinterpret_cast<const uint8_t *>(h.c_str()), h.length());
+    udp.write(reinterpret_cast<const uint8_t *>(body.c_str()), body.length());
+
+    if (udp.endPacket()) exporter.commit();
+}
+
+} // namespace hr20
+
+#endif
@@ -0,0 +1,47 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiUdp.h>
+
+#include "config.h"
+#include "eventexport.h"
+
+namespace hr20 {
+
+/** Ships the event log to a syslog server over UDP, each batch of events in
+ * one datagram. The datagram has the error severity if the batch has an
+ * error in it, informational otherwise, each event takes one line:
+ * "seq time NAME value". Enabled by the SYSLOG build flag.
+ */
+struct SyslogExporter {
+    SyslogExporter(Config &config) : config(config) {}
+
+    // sends the events logged since the last batch, if there are any
+    ICACHE_FLASH_ATTR void update(time_t now);
+
+protected:
+    Config &config;
+    WiFiUDP udp;
+    EventExporter exporter;
+};
+
+} // namespace hr20
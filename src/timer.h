@@ -39,23 +39,23 @@ struct Timer {
     }
 
     void set_hour(uint8_t shour) {
-        set(mode(), shour, min());
+        set(shour, min(), mode());
     }
 
     void set_min(uint8_t smin) {
-        set(mode(), hour(), smin);
+        set(hour(), smin, mode());
     }
 
     void set_mode(uint8_t smode) {
-        set(smode, hour(), min());
+        set(hour(), min(), smode);
     }
 
     void set_time(uint8_t shour, uint8_t smin) {
-        set(mode(), shour, smin);
+        set(shour, smin, mode());
     }
 
     void set_time(uint16_t time) {
-        set(mode(), time / 60, time % 60);
+        set(time / 60, time % 60, mode());
     }
 
     void set(uint8_t shour, uint8_t smin, uint8_t smode) {
@@ -0,0 +1,139 @@
+/*
+ * HR20 ESP Master
+ * ---------------
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http:*www.gnu.org/licenses
+ *
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#include "config.h"
+
+namespace hr20 {
+
+/** Learns when the radio is busy inside of each second, so that the work
+ * that could break radio comms (MQTT, web, NTP, flash writes) can use all of
+ * the quiet time, not just a fixed window.
+ *
+ * Client addr talks in the seconds addr and addr + 30 of every minute, our
+ * sync goes out at :00 and :30. For each of them, this tracks the envelope
+ * of the exchange in ms since the start of its second: from the first byte
+ * received (or the sync start) to the radio going idle after our answer.
+ * The envelope follows new samples right away and shrinks back by
+ * TIMING_DECAY_MS per exchange. The end can be past 1000, the exchange then
+ * spills into the next second. Every radio network has one of these.
+ */
+struct ActivityModel {
+    // slot of our sync packet, client slots are their addresses
+    static constexpr const uint8_t SYNC = 0;
+
+    // first byte of a packet came in, ms into the current second
+    void ICACHE_FLASH_ATTR on_rx_start(int ms) { rx_ms = ms; }
+
+    // the packet that started at on_rx_start was from client addr
+    void ICACHE_FLASH_ATTR on_reply(uint8_t addr) {
+        if (addr > SYNC && addr < MAX_HR_ADDR) start(addr, rx_ms);
+    }
+
+    // our sync starts being sent. That is right at the start of the second
+    void ICACHE_FLASH_ATTR on_sync() { start(SYNC, 0); }
+
+    // the radio went idle, ms into the current second. Extends the
+    // envelope of the exchange in progress, if there is one
+    void ICACHE_FLASH_ATTR on_idle(int ms) {
+        if (cur >= MAX_HR_ADDR) return;
+
+        // past the second the exchange started in
+        if (ms < cur_start) ms += 1000;
+
+        auto &s = slots[cur];
+        if (ms > s.end) s.end = ms;
+    }
+
+    /** true if radio traffic is to be expected in the given second at ms
+     * @param present bitmap of the client addresses we know of
+     * @param forced  bitmap of the forced clients, these talk in any second
+     */
+    ICACHE_FLASH_ATTR bool busy(uint8_t sec, int ms, uint32_t present,
+                                uint32_t forced) const
+    {
+        // the previous second spilling over, this one and the next one's
+        // early start
+        return busy_in(sec + 59, ms + 1000, present, forced)
+               || busy_in(sec, ms, present, forced)
+               || busy_in(sec + 1, ms - 1000, present, forced);
+    }
+
+protected:
+    struct Slot {
+        bool valid = false;
+        int16_t start = 0; // ms into the second
+        int16_t end   = 0; // ms into the second, might be past 1000
+    };
+
+    ICACHE_FLASH_ATTR void start(uint8_t slot, int ms) {
+        auto &s = slots[slot];
+
+        if (!s.valid) {
+            s.valid = true;
+            s.start = ms;
+            s.end   = ms;
+        } else {
+            s.start = std::min(s.start + TIMING_DECAY_MS, ms);
+            s.end   = std::max(s.end - TIMING_DECAY_MS, ms);
+            if (s.start > s.end) s.start = s.end;
+        }
+
+        cur       = slot;
+        cur_start = ms;
+    }
+
+    ICACHE_FLASH_ATTR bool busy_in(uint8_t sec, int ms, uint32_t present,
+                                   uint32_t forced) const
+    {
+        // ms is relative to the start of sec, its exchange can't be further
+        if (ms < -1000 || ms >= 2000) return false;
+
+        uint8_t slot = (sec % 60) % 30;
+        if (slot == SYNC) return overlaps(SYNC, ms);
+
+        if ((present & (1ul << slot)) && overlaps(slot, ms)) return true;
+
+        for (uint32_t m = forced & present; m; m &= m - 1)
+            if (overlaps(__builtin_ctz(m), ms)) return true;
+
+        return false;
+    }
+
+    ICACHE_FLASH_ATTR bool overlaps(uint8_t slot, int ms) const {
+        const auto &s = slots[slot];
+
+        // never seen - the whole second but the static window
+        if (!s.valid)
+            return ms >= 0 && ms < 1000
+                   && (ms < TIMING_IDLE_FROM || ms >= TIMING_IDLE_TO);
+
+        return ms >= s.start - TIMING_GUARD_MS && ms <= s.end + TIMING_GUARD_MS;
+    }
+
+    Slot slots[MAX_HR_ADDR];
+    int rx_ms = 0;
+    uint8_t cur = MAX_HR_ADDR; // slot of the exchange in progress
+    int cur_start = 0;
+};
+
+} // namespace hr20
@@ -119,7 +119,7 @@ struct Flags {
         return val >> CTR_POS;
     }
 
-    uint8_t set_counter(uint8_t value) {
+    void set_counter(uint8_t value) {
         val = (val & ((1 << CTR_POS) - 1)) | (value << CTR_POS);
     }
 
@@ -144,6 +144,52 @@ private:
     uint8_t val = 0;
 };
 
+/** Learned packet size limit of a client. Starts at the safe SENT_PACKET_LEN
+ * and steps up after a run of answered exchanges that came close to the
+ * limit, with our packet or the client's response. An exchange lost above
+ * the safe size steps back down and makes the next probe wait twice as long.
+ * The limit has the SENT_PACKET_LEN meaning - the payload is one byte less.
+ */
+struct PacketLimit {
+    // our packet of len bytes was answered with resp bytes
+    ICACHE_FLASH_ATTR void on_answered(uint8_t len, uint8_t resp) {
+        // small exchanges tell nothing about the limit
+        if (len + PACKET_LIMIT_STEP < limit &&
+            resp + PACKET_LIMIT_STEP < response_budget())
+            return;
+        if (++ok < (PACKET_LIMIT_PROBE_AFTER << backoff)) return;
+
+        ok = 0;
+        if (limit >= SENT_PACKET_MAX) return;
+
+        limit = limit + PACKET_LIMIT_STEP < SENT_PACKET_MAX
+                ? limit + PACKET_LIMIT_STEP : SENT_PACKET_MAX;
+        if (backoff) --backoff;
+        DBG("(MTU+ %d)", limit);
+    }
+
+    // our packet got no answer, or the answer did not verify
+    ICACHE_FLASH_ATTR void on_lost() {
+        ok = 0;
+        // exchanges of the safe size get lost too, that's just the radio
+        if (limit <= SENT_PACKET_LEN) return;
+
+        limit = limit > SENT_PACKET_LEN + PACKET_LIMIT_STEP
+                ? limit - PACKET_LIMIT_STEP : SENT_PACKET_LEN;
+        if (backoff < PACKET_LIMIT_MAX_BACKOFF) ++backoff;
+        DBG("(MTU- %d)", limit);
+    }
+
+    // response bytes our commands in one packet may trigger
+    uint8_t response_budget() const {
+        return PLAN_RESPONSE_BUDGET + (limit - SENT_PACKET_LEN);
+    }
+
+    uint8_t limit   = SENT_PACKET_LEN;
+    uint8_t ok      = 0; // answered exchanges since the last step
+    uint8_t backoff = 0;
+};
+
 /// Accumulates non-synced client addrs for sync force flags/addrs
 struct ForceFlags {
 
@@ -199,14 +245,60 @@ enum ChangeCategory {
     CHANGE_TIMER_6  = 128,
     CHANGE_TIMER_7  = 256,
     CHANGE_EEPROM   = 512,
+    CHANGE_BULK     = 1024, // bulk session started, progressed or ended
 };
 
 extern ChangeCategory timer_day_2_change[8];
 
+// change detail meaning the whole change category has to be visited.
+// otherwise the detail is timer slot (day*8+slot) or eeprom address
+constexpr const uint8_t CHANGE_DETAIL_ALL = 0xFF;
+
 ICACHE_FLASH_ATTR inline uint8_t change_get_timer_mask(uint16_t change) {
     return (change & CHANGE_TIMER_MASK) >> 1;
 }
 
+// change observer, gets called with the ctx it was registered with
+using OnChangeFn = void (*)(void *ctx, uint8_t addr, ChangeCategory cat,
+                            uint8_t detail);
+
+/** Fixed list of change observers - function pointer and context, no heap
+ * and no type erasure when notifying. All of them get called, in the order
+ * they were added.
+ */
+struct ChangeObservers {
+    // false if there is no free slot
+    bool ICACHE_FLASH_ATTR add(OnChangeFn fn, void *ctx) {
+        for (auto &o : slots) {
+            if (o.fn) continue;
+            o.fn  = fn;
+            o.ctx = ctx;
+            return true;
+        }
+
+        return false;
+    }
+
+    bool empty() const { return !slots[0].fn; }
+
+    void ICACHE_FLASH_ATTR notify(uint8_t addr, ChangeCategory cat,
+                                  uint8_t detail) const
+    {
+        for (const auto &o : slots) {
+            if (!o.fn) break;
+            o.fn(o.ctx, addr, cat, detail);
+        }
+    }
+
+protected:
+    struct Observer {
+        OnChangeFn fn = nullptr;
+        void *ctx     = nullptr;
+    };
+
+    Observer slots[MAX_CHANGE_CALLBACKS];
+};
+
 class StringBuffer : public String {
 public:
     StringBuffer(const void *cstr, unsigned int length) : String() {
@@ -20,6 +20,7 @@
 #pragma once
 
 #include "converters.h"
+#include "error.h"
 
 namespace hr20 {
 
@@ -60,6 +61,13 @@ struct CachedValue {
 
     T ICACHE_FLASH_ATTR get_remote() const { return remote; }
 
+    // makes a pending read/write due again on the next occasion
+    void ICACHE_FLASH_ATTR retry_next() { flags.reset_counter(); }
+
+    // sets the remote value without marking it valid - i.e. a value
+    // restored from flash that still has to be verified
+    void ICACHE_FLASH_ATTR restore_remote(T val) { remote = val; }
+
     ICACHE_FLASH_ATTR flag_accessor published() {
         return flags[PUBLISHED];
     }
@@ -96,6 +104,10 @@ struct CachedValue {
         return Converter::to_str(buf, remote);
     }
 
+    ICACHE_FLASH_ATTR void to_str(StrMaker &sm) const {
+        Converter::to_str(sm, remote);
+    }
+
 protected:
     flags_type flags;
     T remote;
@@ -172,6 +184,10 @@ struct SyncedValue : public CachedValue<T, CvT> {
         return Converter::to_str(buf, requested);
     }
 
+    ICACHE_FLASH_ATTR void req_to_str(StrMaker &sm) const {
+        Converter::to_str(sm, requested);
+    }
+
 private:
     T requested;
 };
@@ -22,6 +22,9 @@
 
 #include "webserver.h"
 #include "util.h"
+#include "bench.h"
+#include "capture.h"
+#include "memstats.h"
 
 namespace hr20 {
 
@@ -52,10 +55,37 @@ const char thingName[] = "hr20";
 const char wifiInitialApPassword[] = "accpass2019";
 
 // Note: if configuration changes, this has to be updated as well!
-#define CONFIG_VERSION "ver1"
+#ifdef SYSLOG
+#define CONFIG_VERSION "ver2s"
+#else
+#define CONFIG_VERSION "ver2"
+#endif
 
 // TODO: Include the logo in the html somehow optimally
 
+// StrMaker sink streaming the composed json to the web client
+static void send_chunk(void *ctx, const char *data, unsigned len) {
+    static_cast<WebServer *>(ctx)->sendContent_P(data, len);
+}
+
+// StrMaker sink writing to a /live subscriber
+static void send_live(void *ctx, const char *data, unsigned len) {
+    static_cast<WiFiClient *>(ctx)->write((const uint8_t *)data, len);
+}
+
+static const char BIN200[] PROGMEM =
+    "HTTP/1.0 200 OK\r\nContent-Type: application/octet-stream\r\n"
+    "Connection: close\r\n\r\n";
+
+// appends len lowest bytes of val, little endian
+static void put_le(StrMaker &s, uint32_t val, uint8_t len) {
+    for (; len; --len, val >>= 8) s += (char)(val & 0xFF);
+}
+
+static const char LIVE200[] PROGMEM =
+    "HTTP/1.0 200 OK\r\nContent-Type: text/event-stream\r\n"
+    "Cache-Control: no-cache\r\n\r\n";
+
 ICACHE_FLASH_ATTR Web::Web(Config &config, HR20Master &master)
     : config(config),
       server(80),
@@ -68,6 +98,10 @@ ICACHE_FLASH_ATTR Web::Web(Config &config, HR20Master &master)
       rfm_pass("RFM Password", "rfm_pass", config.rfm_pass_hex, 17),
       separator1(),
       ntp_server("NTP Server", "ntp_server", config.ntp_server, 40)
+#ifdef SYSLOG
+      ,
+      syslog_server("Syslog Server", "syslog_server", config.syslog_server, 40)
+#endif
 #ifdef MQTT
       ,
       separator2(),
@@ -82,7 +116,13 @@ ICACHE_FLASH_ATTR Web::Web(Config &config, HR20Master &master)
                 "min='1' max='65535' step='1'"),
       mqtt_user("MQTT User", "mqtt_user", config.mqtt_user, 20),
       mqtt_pass("MQTT Password", "mqtt_pass", config.mqtt_pass, 20),
-      mqtt_topic("MQTT Topic", "mqtt_topic", config.mqtt_topic_prefix, 40)
+      mqtt_topic("MQTT Topic", "mqtt_topic", config.mqtt_topic_prefix, 40),
+      mqtt_zones("MQTT Zones",
+                 "mqtt_zones",
+                 config.mqtt_zones,
+                 120,
+                 "text",
+                 "ground:1,2,3;first:4,5")
 #endif
 {
 }
@@ -94,6 +134,9 @@ ICACHE_FLASH_ATTR void Web::begin() {
     iotWebConf.addParameter(&rfm_pass);
     iotWebConf.addParameter(&separator1);
     iotWebConf.addParameter(&ntp_server);
+#ifdef SYSLOG
+    iotWebConf.addParameter(&syslog_server);
+#endif
 
 #ifdef MQTT
     iotWebConf.addParameter(&separator2);
@@ -102,6 +145,7 @@ ICACHE_FLASH_ATTR void Web::begin() {
     iotWebConf.addParameter(&mqtt_user);
     iotWebConf.addParameter(&mqtt_pass);
     iotWebConf.addParameter(&mqtt_topic);
+    iotWebConf.addParameter(&mqtt_zones);
 #endif
 
     // what is this?
@@ -113,8 +157,15 @@ ICACHE_FLASH_ATTR void Web::begin() {
     iotWebConf.init();
 
     server.on("/list", [&]   { handle_list(); } );
+    server.on("/timer", HTTP_POST, [&] { handle_timer_upload(); } );
     server.on("/timer", [&]  { handle_timer(); } );
     server.on("/events", [&] { handle_events(); } );
+    server.on("/stats", [&]  { handle_stats(); } );
+    server.on("/tasks", [&]  { handle_tasks(); } );
+    server.on("/live", [&]   { handle_live(); } );
+#ifdef CAPTURE
+    server.on("/capture", [&] { handle_capture(); } );
+#endif
 
     // iotWebConf handling
     server.on("/config", [&] { iotWebConf.handleConfig(); });
@@ -124,19 +175,56 @@ ICACHE_FLASH_ATTR void Web::begin() {
 
     server.onNotFound( [&] { iotWebConf.handleNotFound(); });
 
+    static const char *headers[] = {"If-None-Match", "Content-Type"};
+    server.collectHeaders(headers, 2);
+    etag_salt = ESP.random();
+
     server.begin();
+
+    master.add_callback(
+        [](void *ctx, uint8_t addr, ChangeCategory cat, uint8_t) {
+            static_cast<Web *>(ctx)->on_change(addr, cat);
+        },
+        this);
+}
+
+ICACHE_FLASH_ATTR bool Web::json_header(uint32_t gen) {
+    char etag[20];
+    snprintf(etag, sizeof(etag), "\"%08x%08x\"",
+             (unsigned)etag_salt, (unsigned)gen);
+
+    bool same = server.header("If-None-Match") == etag;
+
+    char hdr[128];
+    int len = snprintf(hdr, sizeof(hdr),
+                       "HTTP/1.0 %s\r\n%sETag: %s\r\nConnection: close\r\n\r\n",
+                       same ? "304 Not Modified" : "200 OK",
+                       same ? "" : "Content-Type: application/json\r\n",
+                       etag);
+    server.sendContent_P(hdr, len);
+    return !same;
 }
 
 ICACHE_FLASH_ATTR void Web::handle_list() {
-    // we need 32*140 for client list
-    static BufferHolder<LIST_MAX_SIZE> buf;
-    StrMaker result(buf);
+    // response changes with any of the clients
+    uint32_t gen = 0;
+    for (unsigned i = 0; i < hr20::MAX_CLIENT_ID; ++i) {
+        auto m = master.client(i);
+        if (!m || m->last_contact == 0) continue;
+        gen = gen * 31 + ((i << 16) | m->gen);
+    }
+
+    // header first, the json gets streamed right after as it's composed
+    if (!json_header(gen)) return;
+
+    BufferHolder<WEB_CHUNK_SIZE> buf;
+    StrMaker result(buf, send_chunk, &server);
     {
         json::Object main(result);
 
         // iterate all clients
-        for (unsigned i = 0; i < hr20::MAX_HR_ADDR; ++i) {
-            auto m = master.model[i];
+        for (unsigned i = 0; i < hr20::MAX_CLIENT_ID; ++i) {
+            auto m = master.client(i);
 
             if (!m) continue;
             if (m->last_contact == 0) continue;
@@ -150,17 +238,10 @@ ICACHE_FLASH_ATTR void Web::handle_list() {
     } // closes the curly brace
 
     result += "\r\n";
-
-    // compose a json list of all visible clients
-    // send header and content separately
-    server.sendContent_P(JSON200, JSON200_LEN);
-    server.sendContent_P(result.data(), result.size());
+    result.flush();
 }
 
 ICACHE_FLASH_ATTR void Web::handle_timer() {
-    // WE NEED 32*8*8 for timers
-    static BufferHolder<TIMER_MAX_SIZE> buf;
-    StrMaker result(buf);
     // did we get an argument?
     auto client = server.arg("client");
 
@@ -172,14 +253,19 @@ ICACHE_FLASH_ATTR void Web::handle_timer() {
     }
 
     // try to fetch the client
-    const auto &m = master.model[caddr];
+    const auto &m = master.client(caddr);
 
     if (!m || m->last_contact == 0) {
         server.send_P(404, "text/plain", "Invalid client");
         return;
     }
 
-    { // intentional brace to close the json before we send it
+    if (!json_header(((uint32_t)caddr << 16) | m->timers_gen)) return;
+
+    BufferHolder<WEB_CHUNK_SIZE> buf;
+    StrMaker result(buf, send_chunk, &server);
+
+    { // intentional brace to close the json before we flush it
         json::Object obj(result);
 
         // spew the whole timer table
@@ -190,50 +276,270 @@ ICACHE_FLASH_ATTR void Web::handle_timer() {
     }
 
     result += "\r\n";
+    result.flush();
+}
+
+ICACHE_FLASH_ATTR void Web::handle_timer_upload() {
+    int caddr = server.arg("client").toInt();
+    auto *m = master.client(caddr);
+
+    if (caddr == 0 || !m) {
+        server.send_P(404, "text/plain", "Invalid client");
+        return;
+    }
+
+    // the request body, a binary timer table if sent as octet-stream
+    const auto &body = server.arg("plain");
+    auto fmt = server.header("Content-Type") == "application/octet-stream"
+                   ? TIMER_TABLE_BINARY : TIMER_TABLE_JSON;
+    int changed = apply_timer_table(*m, body.c_str(), body.length(), fmt);
+
+    if (changed < 0) {
+        server.send_P(400, "text/plain", "Invalid timer table");
+        return;
+    }
+
+    if (changed) {
+        m->synced = false;
+        ++m->gen;
+        // picked up in the next sync, as MQTT uploads are
+        master.force_next(caddr);
+    }
 
+    server.send(200, "text/plain", String(changed));
+}
+
+ICACHE_FLASH_ATTR void Web::handle_stats() {
+    server.sendContent_P(JSON200, JSON200_LEN);
+
+    BufferHolder<WEB_CHUNK_SIZE> buf;
+    StrMaker result(buf, send_chunk, &server);
+
+    const Bench *b = nullptr;
+    const MemStats *m = nullptr;
+#ifdef BENCH
+    b = &bench;
+#endif
+#ifdef MEMSTATS
+    m = &memStats;
+#endif
+    json::append_link_stats(result, linkStats, b, m);
+
+    result += "\r\n";
+    result.flush();
+}
+
+ICACHE_FLASH_ATTR void Web::handle_tasks() {
     server.sendContent_P(JSON200, JSON200_LEN);
-    server.sendContent_P(result.data(), result.size());
+
+    BufferHolder<WEB_CHUNK_SIZE> buf;
+    StrMaker result(buf, send_chunk, &server);
+
+    json::append_tasks(result, scheduler);
+
+    result += "\r\n";
+    result.flush();
 }
 
+#ifdef CAPTURE
+// pcap link type of our records - LINKTYPE_USER0
+static constexpr const uint32_t PCAP_LINKTYPE = 147;
+// net, flags, rtc and dur_us in front of the frame bytes
+static constexpr const uint8_t PCAP_PSEUDO_LEN = 2 + sizeof(crypto::RTC) + 4;
+
+ICACHE_FLASH_ATTR void Web::handle_capture() {
+    BufferHolder<WEB_CHUNK_SIZE> buf;
+    StrMaker result(buf, send_chunk, &server);
+
+    server.sendContent_P(BIN200, sizeof(BIN200) - 1);
+
+    // pcap global header, microsecond timestamps
+    put_le(result, 0xA1B2C3D4, 4);
+    put_le(result, 2, 2);
+    put_le(result, 4, 2);
+    put_le(result, 0, 4); // GMT
+    put_le(result, 0, 4); // accuracy
+    put_le(result, PCAP_PSEUDO_LEN + CAPTURE_FRAME_LEN, 4);
+    put_le(result, PCAP_LINKTYPE, 4);
+
+    capture.walk([&](const Capture::Record &r) {
+        uint32_t len = PCAP_PSEUDO_LEN + r.len;
+        put_le(result, r.us / 1000000, 4);
+        put_le(result, r.us % 1000000, 4);
+        put_le(result, len, 4);
+        put_le(result, len, 4);
+
+        result += (char)r.net;
+        result += (char)r.flags;
+        const uint8_t *rtc = reinterpret_cast<const uint8_t *>(&r.rtc);
+        for (uint8_t i = 0; i < sizeof(r.rtc); ++i) result += (char)rtc[i];
+        put_le(result, r.dur_us, 4);
+
+        for (uint8_t i = 0; i < r.len; ++i) result += (char)r.data[i];
+    });
+
+    result.flush();
+}
+#endif
+
 ICACHE_FLASH_ATTR void Web::handle_events() {
-    static BufferHolder<EVENT_MAX_SIZE> buf;
-    StrMaker result(buf);
+    EventFilter filter;
+    if (server.hasArg("type")) filter.type = server.arg("type").toInt();
+    if (server.hasArg("code")) filter.code = server.arg("code").toInt();
+
+    // since=SEQ walks from the event after SEQ towards the newer ones.
+    // Otherwise we walk down from the newest event, or from before=SEQ
+    bool up = server.hasArg("since");
+    uint32_t from = eventLog.last_seq();
+    if (up) {
+        from = std::max<uint32_t>(eventLog.first_seq(),
+                                  server.arg("since").toInt() + 1);
+    } else if (server.hasArg("before")) {
+        uint32_t before = std::max(0L, server.arg("before").toInt());
+        from = std::min<uint32_t>(from, before ? before - 1 : 0);
+    }
 
+    // legacy paging, counts matching events from the start of the walk
     auto soffset = server.arg("offset");
-    unsigned offset   = std::max(0L, soffset.toInt());
-    unsigned counter  = MAX_JSON_EVENTS;
+    unsigned offset = std::max(0L, soffset.toInt());
+
+    BufferHolder<WEB_CHUNK_SIZE> buf;
+    StrMaker result(buf, send_chunk, &server);
+
+    // packed records of the whole matching log, see README
+    if (server.arg("format") == "bin") {
+        server.sendContent_P(BIN200, sizeof(BIN200) - 1);
+
+        eventLog.walk(from, up, filter, offset, EVENT_LOG_LEN,
+                      [&](const Event &ev) {
+                          put_le(result, ev.seq, 4);
+                          put_le(result, ev.time, 4);
+                          put_le(result, ev.value, 2);
+                          result += (char)ev.type;
+                          result += (char)ev.code;
+                      });
+
+        result.flush();
+        return;
+    }
+
+    server.sendContent_P(JSON200, JSON200_LEN);
     {
         json::Object main(result);
 
+        json::kv_raw(main, "first", (unsigned)eventLog.first_seq());
+        json::kv_raw(main, "last",  (unsigned)eventLog.last_seq());
+
         main.key("events");
         json::Array arr(main);
 
-        // iterate all clients
-        for (const auto &event : eventLog) {
-            if (offset != 0) {
-                --offset;
-                continue;
-            }
+        eventLog.walk(from, up, filter, offset, MAX_JSON_EVENTS,
+                      [&](const Event &ev) {
+                          // a comma is inserted unless this is first element
+                          arr.element();
+                          json::append_event(result, ev);
+                      });
+
+    } // closes the curly brace
+
+    result += "\r\n";
+    result.flush();
+}
+
+ICACHE_FLASH_ATTR void Web::handle_live() {
+    // free slot, or one with a connection that died
+    LiveClient *l = nullptr;
+    for (auto &c : live) {
+        if (c.conn.connected()) continue;
+        l = &c;
+        break;
+    }
 
-            if (!counter) break;
-            --counter;
+    if (!l) {
+        server.send_P(503, "text/plain", "Too many live clients");
+        return;
+    }
+
+    // the connection outlives this request, we keep streaming to it
+    l->conn = server.client();
+    l->conn.setNoDelay(true);
+    l->conn.write_P(LIVE200, sizeof(LIVE200) - 1);
+
+    // the stream starts with all the clients we know
+    l->attrs  = 0;
+    l->timers = 0;
+    memset(l->days, 0, sizeof(l->days));
+    for (uint8_t i = 0; i < MAX_CLIENT_ID; ++i) {
+        auto m = master.client(i);
+        if (m && m->last_contact) l->attrs |= 1ull << i;
+    }
+
+    l->last_write = millis();
+}
 
-            // skip empty events
-            if (event.time == 0) continue;
+ICACHE_FLASH_ATTR void Web::on_change(uint8_t addr, ChangeCategory cat) {
+    if (addr >= MAX_CLIENT_ID) return;
 
-            // a comma is inserted unless this is first element
-            arr.element();
+    uint8_t days = change_get_timer_mask(cat);
+    for (auto &l : live) {
+        if (!l.conn.connected()) continue;
 
-            // append value itself
-            json::append_event(result, event);
+        if (cat & CHANGE_FREQUENT) l.attrs |= 1ull << addr;
+
+        if (days) {
+            l.timers     |= 1ull << addr;
+            l.days[addr] |= days;
         }
+    }
+}
 
-    } // closes the curly brace
+ICACHE_FLASH_ATTR void Web::update_live() {
+    for (auto &l : live) {
+        if (!l.conn.connected()) continue;
+        // never block the loop on a slow subscriber, try on the next pass
+        if (l.conn.availableForWrite() < LIVE_FRAME_MAX) continue;
+        live_frame(l);
+    }
+}
 
-    result += "\r\n";
+ICACHE_FLASH_ATTR void Web::live_frame(LiveClient &l) {
+    BufferHolder<WEB_CHUNK_SIZE> buf;
+    StrMaker out(buf, send_live, &l.conn);
 
-    server.sendContent_P(JSON200, JSON200_LEN);
-    server.sendContent_P(result.data(), result.size());
+    if (l.attrs) {
+        unsigned addr = __builtin_ctzll(l.attrs);
+        l.attrs &= ~(1ull << addr);
+
+        auto m = master.client(addr);
+        if (!m) return;
+
+        out += "event: client\ndata: ";
+        {
+            json::Object obj(out);
+            obj.key(addr);
+            json::append_client_attr(out, *m);
+        }
+        out += "\n\n";
+    } else if (l.timers) {
+        unsigned addr = __builtin_ctzll(l.timers);
+        l.timers &= ~(1ull << addr);
+
+        out += "event: timer\ndata: ";
+        {
+            json::Object obj(out);
+            json::kv_raw(obj, addr, (unsigned)l.days[addr]);
+        }
+        out += "\n\n";
+        l.days[addr] = 0;
+    } else if (millis() - l.last_write >= LIVE_KEEPALIVE_MS) {
+        // comment line - ignored by EventSource, finds dead connections
+        out += ":\n\n";
+    } else {
+        return;
+    }
+
+    out.flush();
+    l.last_write = millis();
 }
 
 ICACHE_FLASH_ATTR void Web::handle_root() {
@@ -262,6 +568,7 @@ ICACHE_FLASH_ATTR void Web::handle_root() {
 ICACHE_FLASH_ATTR void Web::update() {
     iotWebConf.doLoop();
     server.handleClient();
+    update_live();
 }
 
 ICACHE_FLASH_ATTR bool Web::validate_config() {
@@ -287,6 +594,12 @@ ICACHE_FLASH_ATTR bool Web::validate_config() {
         mqtt_port.errorMessage = "MQTT Port expects a number!";
         valid = false;
     }
+
+    if (!Config::zones_valid(server.arg(mqtt_zones.getId()).c_str())) {
+        mqtt_zones.errorMessage =
+            "Zones are NAME:ID,ID;NAME:ID... with valve ids as in MQTT topics!";
+        valid = false;
+    }
 #endif
 
     // ....
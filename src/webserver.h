@@ -26,10 +26,12 @@
 #include "config.h"
 #include "master.h"
 #include "json.h"
+#include "schedule.h"
+#include "stats.h"
+#include "scheduler.h"
 
-#define LIST_MAX_SIZE (32*140)
-#define TIMER_MAX_SIZE (32*8*8)
-#define EVENT_MAX_SIZE (100*MAX_JSON_EVENTS)
+// json responses are composed in chunks of this size and streamed out
+#define WEB_CHUNK_SIZE 256
 
 namespace hr20 {
 
@@ -43,22 +45,61 @@ struct Web {
     void update();
 
 protected:
+    // subscriber connections, and their clients to be pushed. CHANGE_FREQUENT
+    // pushes client attributes, timer changes only the day mask
+    struct LiveClient {
+        WiFiClient conn;
+        uint64_t attrs  = 0;   // bitmap of client ids
+        uint64_t timers = 0;   // bitmap of client ids
+        uint8_t days[MAX_CLIENT_ID] = {}; // changed day mask per client
+        unsigned long last_write = 0;
+    };
+
     void handle_list();
     void handle_timer();
+    void handle_timer_upload();
     void handle_events();
+    void handle_stats();
+    void handle_tasks();
+    void handle_live();
+#ifdef CAPTURE
+    void handle_capture();
+#endif
     void handle_root();
     bool validate_config();
 
+    /** sends the header of a json response rendered from values of the given
+     * generation, with an ETag. Answers 304 instead if the request's
+     * If-None-Match had this tag - false means no body is to follow
+     */
+    bool json_header(uint32_t gen);
+
+    // == /live server-sent events ==
+    // marks the client to be pushed to every /live subscriber
+    void on_change(uint8_t addr, ChangeCategory cat);
+    // pushes at most one frame to each subscriber, drops dead connections
+    void update_live();
+    // writes the next pending frame (or keepalive) to the subscriber
+    void live_frame(LiveClient &l);
+
     Config &config;
     DNSServer dnsServer;
     WebServer server;
     IotWebConf iotWebConf;
     HR20Master &master;
 
+    LiveClient live[LIVE_MAX_CLIENTS];
+    // part of every ETag, tags of the previous boots don't match
+    uint32_t etag_salt = 0;
+
     IotWebConfParameter rfm_pass;
     IotWebConfSeparator separator1;
     IotWebConfParameter ntp_server;
 
+#ifdef SYSLOG
+    IotWebConfParameter syslog_server;
+#endif
+
 #ifdef MQTT
     IotWebConfSeparator separator2;
 
@@ -67,6 +108,7 @@ protected:
     IotWebConfParameter mqtt_user;
     IotWebConfParameter mqtt_pass;
     IotWebConfParameter mqtt_topic;
+    IotWebConfParameter mqtt_zones;
 #endif
 };
 